@@ -0,0 +1,395 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "analysis_tap.h"
+#include "thread_policy.h"
+#include "pcm_utils.h"
+
+#define TAP_FLOOR       1e-7f       /* -140 dB, spectrum bins never go below */
+
+AnalysisTap::AnalysisTap(uint32_t hz, uint32_t fftSize)
+    : hz(hz ? hz : TAP_DEFAULT_HZ)
+    , fftSize(TAP_DEFAULT_FFT)
+    , format(SND_PCM_FORMAT_UNKNOWN)
+    , channels(0)
+    , frameBytes(0)
+    , rate(0)
+    , ring(NULL)
+    , ringFrames(0)
+    , slack(0)
+    , written(0)
+    , running(false)
+    , stopping(false)
+    , analysed(0)
+    , raw(NULL)
+    , samples(NULL)
+    , history(NULL)
+    , historyPos(0)
+    , latest(0)
+{
+    uint32_t i, h, j, bits = 0;
+
+    if (fftSize >= 64 && fftSize <= TAP_MAX_FFT && (fftSize & (fftSize - 1)) == 0)
+        this->fftSize = fftSize;
+    fftSize = this->fftSize;
+    while ((1u << bits) < fftSize)
+        bits++;
+
+    window = (float *)malloc(fftSize * sizeof(float));
+    reversed = (uint32_t *)malloc(fftSize * sizeof(uint32_t));
+    re = (float *)malloc(fftSize * sizeof(float));
+    im = (float *)malloc(fftSize * sizeof(float));
+    twRe = (float *)malloc(fftSize * sizeof(float));
+    twIm = (float *)malloc(fftSize * sizeof(float));
+
+    for (i = 0; i < fftSize; i++)
+    {
+        window[i] = 0.5f - 0.5f * cosf(2 * M_PI * i / fftSize);
+        reversed[i] = 0;
+        for (j = 0; j < bits; j++)
+            if (i & (1u << j))
+                reversed[i] |= 1u << (bits - 1 - j);
+    }
+    for (h = 1; h < fftSize; h <<= 1)
+        for (j = 0; j < h; j++)
+        {
+            twRe[h + j] = cos(M_PI * j / h);
+            twIm[h + j] = -sin(M_PI * j / h);
+        }
+
+    memset(&work, 0, sizeof(work));
+    memset(slots, 0, sizeof(slots));
+    memset(versions, 0, sizeof(versions));
+}
+
+AnalysisTap::~AnalysisTap()
+{
+    stopThread();
+    free(ring);
+    free(raw);
+    free(samples);
+    free(history);
+    free(window);
+    free(reversed);
+    free(re);
+    free(im);
+    free(twRe);
+    free(twIm);
+}
+
+void AnalysisTap::stopThread()
+{
+    if (!running)
+        return;
+
+    __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+    running = false;
+    stopping = false;
+}
+
+int AnalysisTap::configure(snd_pcm_format_t format, uint16_t channels, uint32_t rate)
+{
+    uint64_t need;
+    size_t samplesMax;
+    float probe;
+
+    if (channels == 0 || rate == 0 || pcm_to_float(format, "\0\0\0\0\0\0\0\0", &probe, 1) < 0)
+    {
+        fprintf(stderr, "analysis: %s is not supported\n", snd_pcm_format_name(format));
+        return -1;
+    }
+
+    stopThread();
+
+    /* room for two analyses, whichever is longer, a quarter of it in flight */
+    need = rate / hz > fftSize ? rate / hz : fftSize;
+    ringFrames = 1;
+    while (ringFrames < 4 * need)
+        ringFrames <<= 1;
+    slack = ringFrames / 4;
+
+    this->format = format;
+    this->channels = channels;
+    this->rate = rate;
+    frameBytes = snd_pcm_format_physical_width(format) / 8 * channels;
+    samplesMax = (size_t)(ringFrames - slack) * channels;
+
+    free(ring);
+    free(raw);
+    free(samples);
+    free(history);
+    ring = (char *)malloc(ringFrames * frameBytes);
+    raw = (char *)malloc((ringFrames - slack) * frameBytes);
+    samples = (float *)malloc(samplesMax * sizeof(float));
+    history = (float *)calloc(fftSize, sizeof(float));
+    if (ring == NULL || raw == NULL || samples == NULL || history == NULL)
+    {
+        free(ring);
+        ring = NULL;
+        return -1;
+    }
+    written = 0;
+    analysed = 0;
+    historyPos = 0;
+
+    memset(&work, 0, sizeof(work));
+    work.rate = rate;
+    work.channels = channels < TAP_MAX_CHANNELS ? channels : TAP_MAX_CHANNELS;
+    work.bins = fftSize / 2;
+
+    if (ThreadPolicy::shared()->create(THREAD_DSP, &thread, analysisThreadFunc, this) != 0)
+        return -1;
+    running = true;
+
+    return 0;
+}
+
+/* in pieces of at most slack frames, so the reader knows how far a write in flight reaches */
+void AnalysisTap::push(const void *frames, size_t count)
+{
+    const char *p = (const char *)frames;
+    uint64_t w, at, n, first;
+
+    if (ring == NULL)
+        return;
+
+    w = written;
+    if (count > ringFrames - slack)
+    {
+        /* older than anything the analysis could still read */
+        w += count - (ringFrames - slack);
+        p += (count - (ringFrames - slack)) * frameBytes;
+        count = ringFrames - slack;
+    }
+
+    while (count > 0)
+    {
+        n = count < slack ? count : slack;
+        at = w & (ringFrames - 1);
+        first = ringFrames - at < n ? ringFrames - at : n;
+        memcpy(ring + at * frameBytes, p, first * frameBytes);
+        memcpy(ring, p + first * frameBytes, (n - first) * frameBytes);
+
+        w += n;
+        p += n * frameBytes;
+        count -= n;
+        __atomic_store_n(&written, w, __ATOMIC_RELEASE);
+    }
+}
+
+/* copies what came since the last call into raw, returns the frames still intact */
+size_t AnalysisTap::fetch()
+{
+    uint64_t to, now, at, first, lost, n;
+
+    to = __atomic_load_n(&written, __ATOMIC_ACQUIRE);
+    if (to > analysed + ringFrames - slack)
+    {
+        work.missed += to - (ringFrames - slack) - analysed;
+        analysed = to - (ringFrames - slack);
+    }
+    n = to - analysed;
+    at = analysed & (ringFrames - 1);
+    first = ringFrames - at < n ? ringFrames - at : n;
+    memcpy(raw, ring + at * frameBytes, first * frameBytes);
+    memcpy(raw + first * frameBytes, ring, (n - first) * frameBytes);
+
+    /* a push in flight since may have overwritten the oldest of them */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    now = __atomic_load_n(&written, __ATOMIC_RELAXED);
+    lost = now + slack > analysed + ringFrames ? now + slack - analysed - ringFrames : 0;
+    if (lost > n)
+        lost = n;
+    if (lost)
+    {
+        memmove(raw, raw + lost * frameBytes, (n - lost) * frameBytes);
+        work.missed += lost;
+        n -= lost;
+    }
+    analysed = to;
+
+    return n;
+}
+
+/*
+ * Peak and sum of squares. With 1, 2 or 4 channels every vector lane
+ * stays on one channel, so the interleaved samples go through SSE2 as
+ * they are and the lanes are folded at the end.
+ */
+void AnalysisTap::meter(const float *x, size_t frames, tap_snapshot_t *s)
+{
+    float pk[TAP_MAX_CHANNELS], sq[TAP_MAX_CHANNELS];
+    size_t n = frames * channels, i = 0;
+    int c;
+
+    for (c = 0; c < s->channels; c++)
+        pk[c] = sq[c] = 0;
+
+#ifdef __SSE2__
+    if (4 % channels == 0)
+    {
+        const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+        __m128 vpk = _mm_setzero_ps(), vsq = _mm_setzero_ps();
+        float lpk[4], lsq[4];
+
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 v = _mm_loadu_ps(x + i);
+            vpk = _mm_max_ps(vpk, _mm_and_ps(v, mask));
+            vsq = _mm_add_ps(vsq, _mm_mul_ps(v, v));
+        }
+        _mm_storeu_ps(lpk, vpk);
+        _mm_storeu_ps(lsq, vsq);
+        for (c = 0; c < 4; c++)
+        {
+            pk[c % channels] = fmaxf(pk[c % channels], lpk[c]);
+            sq[c % channels] += lsq[c];
+        }
+    }
+#endif
+    for (; i < n; i++)
+    {
+        c = i % channels;
+        if (c < s->channels)
+        {
+            pk[c] = fmaxf(pk[c], fabsf(x[i]));
+            sq[c] += x[i] * x[i];
+        }
+    }
+
+    for (c = 0; c < s->channels; c++)
+    {
+        s->peak[c] = frames ? 20 * log10f(pk[c]) : -HUGE_VALF;
+        s->rms[c] = frames ? 10 * log10f(sq[c] / frames) : -HUGE_VALF;
+    }
+}
+
+/* radix-2 on split real and imaginary parts, stages of four or more butterflies in SSE2 */
+void AnalysisTap::spectrum(tap_snapshot_t *s)
+{
+    const float scale = 4.0f / fftSize;     /* Hann sums to n / 2, both halves of a bin */
+    uint32_t i, h, k, j, n = fftSize;
+    float tr, ti, mag;
+
+    for (i = 0; i < n; i++)
+    {
+        re[reversed[i]] = window[i] * history[(historyPos + i) & (n - 1)];
+        im[reversed[i]] = 0;
+    }
+
+    for (h = 1; h < n; h <<= 1)
+        for (k = 0; k < n; k += 2 * h)
+        {
+            j = 0;
+#ifdef __SSE2__
+            for (; j + 4 <= h; j += 4)
+            {
+                float *ar = re + k + j, *ai = im + k + j;
+                float *br = ar + h, *bi = ai + h;
+                __m128 wr = _mm_loadu_ps(twRe + h + j), wi = _mm_loadu_ps(twIm + h + j);
+                __m128 xr = _mm_loadu_ps(br), xi = _mm_loadu_ps(bi);
+                __m128 vtr = _mm_sub_ps(_mm_mul_ps(xr, wr), _mm_mul_ps(xi, wi));
+                __m128 vti = _mm_add_ps(_mm_mul_ps(xr, wi), _mm_mul_ps(xi, wr));
+                __m128 yr = _mm_loadu_ps(ar), yi = _mm_loadu_ps(ai);
+                _mm_storeu_ps(br, _mm_sub_ps(yr, vtr));
+                _mm_storeu_ps(bi, _mm_sub_ps(yi, vti));
+                _mm_storeu_ps(ar, _mm_add_ps(yr, vtr));
+                _mm_storeu_ps(ai, _mm_add_ps(yi, vti));
+            }
+#endif
+            for (; j < h; j++)
+            {
+                uint32_t a = k + j, b = a + h;
+                tr = re[b] * twRe[h + j] - im[b] * twIm[h + j];
+                ti = re[b] * twIm[h + j] + im[b] * twRe[h + j];
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+
+    for (i = 0; i < n / 2; i++)
+    {
+        mag = sqrtf(re[i] * re[i] + im[i] * im[i]) * (i ? scale : scale / 2);
+        s->spectrum[i] = 20 * log10f(mag > TAP_FLOOR ? mag : TAP_FLOOR);
+    }
+}
+
+void AnalysisTap::publish()
+{
+    uint32_t slot = (latest + 1) & 1;
+
+    __atomic_store_n(&versions[slot], versions[slot] + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slots[slot], &work, sizeof(work));
+    __atomic_store_n(&versions[slot], versions[slot] + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&latest, slot, __ATOMIC_RELEASE);
+}
+
+int AnalysisTap::snapshot(tap_snapshot_t *snapshot)
+{
+    uint32_t slot, before, after;
+
+    /* only a reader that the analysis laps twice tries again */
+    do
+    {
+        slot = __atomic_load_n(&latest, __ATOMIC_ACQUIRE);
+        before = __atomic_load_n(&versions[slot], __ATOMIC_ACQUIRE);
+        memcpy(snapshot, &slots[slot], sizeof(*snapshot));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&versions[slot], __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+
+    return snapshot->sequence ? 0 : -1;
+}
+
+void *AnalysisTap::analysisThreadFunc(void *data)
+{
+    static_cast<AnalysisTap *>(data)->analysisTask();
+    return NULL;
+}
+
+void AnalysisTap::analysisTask()
+{
+    struct timespec next;
+    uint64_t period = 1000000000ULL / hz;
+    size_t frames, f;
+    float mean;
+    int c;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!__atomic_load_n(&stopping, __ATOMIC_RELAXED))
+    {
+        next.tv_nsec += period % 1000000000ULL;
+        next.tv_sec += period / 1000000000ULL + next.tv_nsec / 1000000000L;
+        next.tv_nsec %= 1000000000L;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        frames = fetch();
+        pcm_to_float(format, raw, samples, frames * channels);
+        meter(samples, frames, &work);
+
+        for (f = 0; f < frames; f++)
+        {
+            mean = 0;
+            for (c = 0; c < channels; c++)
+                mean += samples[f * channels + c];
+            history[historyPos] = mean / channels;
+            historyPos = (historyPos + 1) & (fftSize - 1);
+        }
+        if (frames)
+            spectrum(&work);
+
+        work.frame = analysed;
+        work.sequence++;
+        publish();
+    }
+}
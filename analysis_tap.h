@@ -0,0 +1,97 @@
+#ifndef _ANALYSIS_TAP_H_
+#define _ANALYSIS_TAP_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#define TAP_DEFAULT_HZ      30
+#define TAP_DEFAULT_FFT     2048
+#define TAP_MAX_FFT         8192
+#define TAP_MAX_CHANNELS    8           /* metered, the spectrum takes all of them */
+
+typedef struct {
+    uint64_t sequence;      /* analyses so far, 0 before the first */
+    uint64_t frame;         /* frames pushed up to the last one analysed */
+    uint64_t missed;        /* overwritten before the analysis got to them */
+    uint32_t rate;
+    uint16_t channels;      /* metered ones */
+    float    peak[TAP_MAX_CHANNELS];    /* dBFS over the frames since the previous analysis */
+    float    rms[TAP_MAX_CHANNELS];     /* dBFS, both -inf when no frames came */
+    uint32_t bins;          /* fftSize / 2, bin i is centred on i * rate / fftSize Hz */
+    float    spectrum[TAP_MAX_FFT / 2]; /* dBFS of the channel mean, Hann windowed */
+} tap_snapshot_t;
+
+/*
+ * Live meters and spectrum of a playing stream. push() copies the frames
+ * written to the device into a ring that overwrites its oldest frames and
+ * never waits; a thread of its own wakes hz times a second, converts what
+ * came since, computes peak and RMS per channel and the spectrum of the
+ * last fftSize frames, and publishes them. snapshot() copies the newest
+ * analysis out of two alternating slots, so readers wait on neither the
+ * player nor the analysis.
+ */
+class AnalysisTap
+{
+public:
+    /* fftSize - power of two, 64 .. TAP_MAX_FFT */
+    AnalysisTap(uint32_t hz = TAP_DEFAULT_HZ, uint32_t fftSize = TAP_DEFAULT_FFT);
+    virtual ~AnalysisTap();
+
+    /* the frames push() gets from now on, while nothing pushes */
+    int  configure(snd_pcm_format_t format, uint16_t channels, uint32_t rate);
+
+    /* the playing thread */
+    void push(const void *frames, size_t count);
+
+    /* any thread, -1 before the first analysis */
+    int  snapshot(tap_snapshot_t *snapshot);
+
+    static void *analysisThreadFunc(void *data);
+
+private:
+    void   stopThread();
+    void   analysisTask();
+    size_t fetch();
+    void   meter(const float *x, size_t frames, tap_snapshot_t *s);
+    void   spectrum(tap_snapshot_t *s);
+    void   publish();
+
+    uint32_t hz;
+    uint32_t fftSize;
+    snd_pcm_format_t format;
+    uint16_t channels;
+    uint16_t frameBytes;
+    uint32_t rate;
+
+    /* the ring, written by the playing thread */
+    char    *ring;
+    uint64_t ringFrames;        /* power of two */
+    uint64_t slack;             /* frames one push publishes at most */
+    uint64_t written;           /* frames ever pushed, release */
+
+    pthread_t thread;
+    bool     running;
+    bool     stopping;
+
+    /* the analysis thread's */
+    uint64_t analysed;          /* frames taken from the ring */
+    char    *raw;
+    float   *samples;
+    float   *history;           /* channel mean of the last fftSize frames, a ring */
+    uint32_t historyPos;
+    float   *window;
+    uint32_t *reversed;         /* bit reversal of the fft input */
+    float   *re;
+    float   *im;
+    float   *twRe;              /* stage of half size h at h .. 2h - 1 */
+    float   *twIm;
+    tap_snapshot_t work;
+
+    /* published, version odd while a slot is written */
+    tap_snapshot_t slots[2];
+    uint32_t versions[2];
+    uint32_t latest;
+};
+
+#endif
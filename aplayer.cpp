@@ -2,20 +2,29 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <time.h>
 #include "aplayer.h"
+#include "thread_policy.h"
+#include "trace.h"
 #include "wav_file.h"
 #include "pcm_utils.h"
 
 #define DEFAULT_FORMAT		SND_PCM_FORMAT_U8
 #define DEFAULT_SPEED 		8000
 
-#define DEFAULT_INTERLEAVED 1
 #define MAX_RING_BUF_LENGTH 300000 /* ring buffer length in us, microseconds */
+#define POWER_RING_BUF_LENGTH 2000000   /* in energy mode */
+#define POWER_TIMER_SLACK   50000000    /* ns, at most a quarter of a period */
 
 #define DEFAULT_CHUNK_COUNT 3       
+#define DEFAULT_QUEUED_BUFS 2       /* buffers read ahead per stream */
 #define SLEEP_TIME          20*1000000 /*nanoseconds*/
+#define MAX_FILE_LOOPS      8
+#define LOOP_RESIDENT_BYTES (16 * 1024 * 1024)  /* larger loop bodies are read again */
+#define STREAM_ENDLESS      UINT64_MAX          /* frames of a stream looping forever */
 
 #define DEBUG
 #ifdef DEBUG
@@ -32,17 +41,59 @@ do {                            \
 #define DBG(...)
 #endif
 
+static uint64_t monotonicUs()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint64_t monotonicMs()
+{
+    return monotonicUs() / 1000;
+}
+
 APlayer::APlayer(bool nonblock)
     : isPlaying(false)
-    , isReading(false)
     , fp(NULL)
-    , readingThID(0)
+    , index(NULL)
     , playingThID(0)
     , lock(NULL)
     , cond(NULL)
+    , opener(NULL)
+    , openerData(NULL)
     , handle(NULL)
     , log(NULL)
+    , mixBuffer(NULL)
+    , ditherMode(DITHER_TPDF)
+    , outBuffer(NULL)
+    , cur(NULL)
+    , next(NULL)
+    , fadeFrames(0)
+    , fadeStart(0)
+    , fadeCurve(FADE_EQUAL_POWER)
+    , fadeAtEnd(false)
+    , stretching(false)
+    , stretchOut(NULL)
+    , looping(false)
+    , readAhead(DEFAULT_QUEUED_BUFS)
+    , xrunCallback(NULL)
+    , xrunData(NULL)
+    , deviceName(NULL)
+    , capsCached(false)
+    , openUs(0)
+    , verifying(false)
+    , verifier(NULL)
+    , nextTap(NULL)
+    , tap(NULL)
+    , planar(false)
+    , nonInterleaved(false)
+    , powerSave(false)
+    , burstFrames(0)
+    , framesOut(0)
 {
+    memset(&power, 0, sizeof(power));
     openMode = 0;
     if (nonblock)
         openMode |= SND_PCM_NONBLOCK;
@@ -51,6 +102,12 @@ APlayer::APlayer(bool nonblock)
 
 APlayer::~APlayer()
 {
+    ThreadPolicy::freeLocal(mixBuffer);
+    ThreadPolicy::freeLocal(outBuffer);
+    ThreadPolicy::freeLocal(stretchOut);
+    free(deviceName);
+    delete verifier;
+
     if (lock)
     {
         pthread_mutex_destroy(lock);
@@ -64,29 +121,60 @@ APlayer::~APlayer()
     }
 }
 
+WavFile* APlayer::openFile(const char *filename)
+{
+    WavFile *wav;
+    wav_info_t info;
+    int ret;
+
+    if (!isWavFile(filename))
+        return NULL;
+
+    wav = new WavFile();
+    if (index && index->lookup(filename, &info))
+        ret = wav->open(filename, &info);
+    else
+        ret = wav->open(filename);
+    if (ret < 0)
+    {
+        DBG("Failed to open %s\n", filename);
+        delete wav;
+        return NULL;
+    }
+
+    return wav;
+}
+
 int APlayer::play(const char * filename, const char *device)
 {
     WavFile *wav;
+    uint64_t begin;
     int ret = -1;
     
     if (isRunning())
         stop();
 
-    if (isWavFile(filename))
+    wav = openFile(filename);
+    if (wav == NULL)
+        return -1;
+
+    begin = monotonicUs();
+    if (initHW(device) < 0)
     {
-        wav = new WavFile();
-        ret = wav->open(filename);
-        if (ret < 0)
-        {
-            DBG("Failed to open %s\n", filename);
-            return -1;
-        }
-        
-        if (initHW(device) < 0)
-            return -1;
+        delete wav;
+        return -1;
+    }
 
-        setParams(wav);
+    if (setParams(wav) < 0)
+    {
+        /* the device may have changed under the cached caps */
+        DeviceCaps::shared()->forget(deviceName);
+        delete wav;
+        uninitHW();
+        return -1;
     }
+    openUs = monotonicUs() - begin;
+    DBG("stream open %.2f ms, device caps %s\r\n", openUs / 1000.0, capsCached ? "cached" : "probed");
 
     if (lock == NULL)
     {
@@ -100,41 +188,129 @@ int APlayer::play(const char * filename, const char *device)
         pthread_cond_init(cond, NULL);
     }   
 
-    if (ret == 0)
+    memset(&power, 0, sizeof(power));
+    framesOut = 0;
+
+    cur = openStream(wav);
+    if (cur == NULL)
+    {
+        delete wav;
+        uninitHW();
+        return -1;
+    }
+
+    ret = useStream(cur);
+
+    delete verifier;
+    verifier = NULL;
+    if (ret == 0 && verifying)
     {
-        thread_param_t *param;
-        param = (thread_param_t *)malloc(sizeof(thread_param_t));
-        param->self = this;
-        param->data = wav;
-        ret = pthread_create(&readingThID, NULL, readingThreadFunc, (void *)param);
+        verifier = new BitVerifier();
+        if (verifier->start(filename, bitsPerFrame / 8) < 0)
+        {
+            DBG("can't verify %s\r\n", filename);
+            delete verifier;
+            verifier = NULL;
+        }
+    }
+
+    tap = NULL;
+    if (ret == 0 && nextTap)
+    {
+        if (nextTap->configure(format, channels, rate) == 0)
+            tap = nextTap;
+        else
+            DBG("no analysis of %s\r\n", filename);
     }
 
     if (ret == 0)
     {
-        ret = pthread_create(&playingThID, NULL, playingThreadFunc, (void *)this);
+        isPlaying = true;
+        ret = ThreadPolicy::shared()->create(THREAD_AUDIO, &playingThID, playingThreadFunc, (void *)this);
+    }
+
+    if (ret != 0)
+    {
+        closeStream(cur);
+        cur = NULL;
+        uninitHW();
     }
     
     return ret;
 }
 
+int APlayer::crossfade(const char *filename, uint32_t fadeMs, fade_curve_t curve, bool atEnd)
+{
+    WavFile *wav;
+    stream_t *s;
+    bool busy, playing;
+
+    if (!isRunning() || cur == NULL)
+        return play(filename);
+
+    pthread_mutex_lock(lock);
+    playing = isPlaying;
+    pthread_mutex_unlock(lock);
+    if (!playing)
+        return play(filename);
+
+    wav = openFile(filename);
+    if (wav == NULL)
+        return -1;
+
+    if ((uint32_t)wav->rate() != rate)
+    {
+        DBG("crossfade needs %u Hz, %s is %d Hz\r\n", rate, filename, wav->rate());
+        delete wav;
+        return -1;
+    }
+
+    pthread_mutex_lock(lock);
+    busy = (next != NULL);
+    pthread_mutex_unlock(lock);
+    if (busy)
+    {
+        DBG("a crossfade is already pending\r\n");
+        delete wav;
+        return -1;
+    }
+
+    s = openStream(wav);
+    if (s == NULL)
+    {
+        delete wav;
+        return -1;
+    }
+
+    pthread_mutex_lock(lock);
+    fadeFrames = (uint64_t)fadeMs * rate / 1000;
+    fadeCurve = curve;
+    fadeAtEnd = atEnd;
+    next = s;
+    pthread_mutex_unlock(lock);
+
+    return 0;
+}
+
 void APlayer::stop()
 {
     void *retval;
 
-    if (readingThID != 0 && playingThID != 0 && lock != NULL && cond != NULL)
+    if (playingThID != 0 && lock != NULL && cond != NULL)
     {
         pthread_mutex_lock(lock);
-        isReading = false;
         isPlaying = false;
 
-        pthread_cond_signal(cond);
+        pthread_cond_broadcast(cond);
         pthread_mutex_unlock(lock);
 
-        pthread_join(readingThID, &retval);
-        readingThID = 0;
         pthread_join(playingThID, &retval);
         playingThID = 0;
 
+        closeStream(cur);
+        closeStream(next);
+        cur = next = NULL;
+
         uninitHW();
     }
 
@@ -142,7 +318,35 @@ void APlayer::stop()
 
 bool APlayer::isRunning()
 {
-    return (readingThID != 0 || playingThID != 0);
+    return (playingThID != 0);
+}
+
+bool APlayer::isFinished()
+{
+    bool playing;
+
+    if (!isRunning())
+        return true;
+
+    pthread_mutex_lock(lock);
+    playing = isPlaying;
+    pthread_mutex_unlock(lock);
+
+    return !playing;
+}
+
+bool APlayer::isCrossfading()
+{
+    bool pending;
+
+    if (lock == NULL)
+        return false;
+
+    pthread_mutex_lock(lock);
+    pending = (next != NULL);
+    pthread_mutex_unlock(lock);
+
+    return pending;
 }
 
 void* APlayer::readingThreadFunc(void *args)
@@ -167,159 +371,672 @@ void* APlayer::playingThreadFunc(void *data)
     return player->playingTask();
 }
 
+APlayer::stream_t* APlayer::openStream(WavFile *wav)
+{
+    thread_param_t *param;
+    stream_t *s;
+
+    s = new stream_t();
+    s->wav = wav;
+    s->readingThID = 0;
+    s->isReading = true;
+    s->bufData = NULL;
+    s->bufPos = 0;
+    s->format = wav->pcmFormat();
+    s->channels = wav->channels();
+    s->frameBytes = wav->frameBytes();
+    s->chunkBytes = chunkSize * s->frameBytes;
+    s->frames = wav->frames();
+    s->played = 0;
+    s->scratch = (float *)malloc(chunkSize * s->channels * sizeof(float));
+    s->loopStart = s->loopEnd = 0;
+    s->loopCount = 0;
+    s->resident = NULL;
+
+    if (s->scratch == NULL || setupMixer(s, wav) < 0)
+    {
+        free(s->scratch);
+        delete s;
+        return NULL;
+    }
+
+    if (looping)
+        setupLoop(s, wav);
+
+    param = (thread_param_t *)malloc(sizeof(thread_param_t));
+    param->self = this;
+    param->data = s;
+    if (ThreadPolicy::shared()->create(THREAD_IO, &s->readingThID, readingThreadFunc, (void *)param) != 0)
+    {
+        free(param);
+        free(s->scratch);
+        free(s->resident);
+        delete s;
+        return NULL;
+    }
+
+    return s;
+}
+
+void APlayer::setupLoop(stream_t *s, WavFile *file)
+{
+    wav_loop_t loops[MAX_FILE_LOOPS];
+    uint64_t body;
+    int i, n;
+
+    n = file->loops(loops, MAX_FILE_LOOPS);
+    for (i = 0; i < n && loops[i].type != WAV_LOOP_FORWARD; i++)
+        ;
+    if (i == n || loops[i].playCount == 1)
+        return;
+
+    s->loopStart = loops[i].start * s->frameBytes;
+    s->loopEnd = (loops[i].end + 1) * s->frameBytes;
+    s->loopCount = loops[i].playCount;
+    body = s->loopEnd - s->loopStart;
+    if (s->loopCount == 0)
+        s->frames = STREAM_ENDLESS;
+    else
+        s->frames += (uint64_t)(s->loopCount - 1) * (body / s->frameBytes);
+
+    /* later passes come from memory, the file is only read once */
+    if (body <= LOOP_RESIDENT_BYTES)
+        s->resident = (char *)malloc(body);
+
+    DBG("looping frames %llu-%llu, %u plays (0 forever)%s\r\n", (unsigned long long)loops[i].start,
+        (unsigned long long)loops[i].end, s->loopCount, s->resident ? ", resident" : "");
+}
+
+void APlayer::closeStream(stream_t *s)
+{
+    buf_data_t *bufData;
+    void *retval;
+
+    if (s == NULL)
+        return;
+
+    pthread_mutex_lock(lock);
+    s->isReading = false;
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(lock);
+
+    if (s->readingThID != 0)
+        pthread_join(s->readingThID, &retval);
+
+    if (s->bufData)
+        s->bufList.push_front(s->bufData);
+    while (!s->bufList.empty())
+    {
+        bufData = s->bufList.front();
+        s->bufList.pop_front();    
+
+        if (!bufData->borrowed)
+            free(bufData->buffer);
+        free(bufData);        
+    }
+
+    free(s->scratch);
+    free(s->resident);
+    delete s;
+}
+
+/* make s the stream the playing loop works on */
+int APlayer::useStream(stream_t *s)
+{
+    fileFormat = s->format;
+    fileFrameBytes = s->frameBytes;
+    chunkBytes = s->chunkBytes;
+
+    if (!s->mixer.isIdentity())
+        DBG("remapping %u -> %u channels\r\n", s->channels, channels);
+    /* remapped frames, or a copy of the resident loop body for the in-place gain */
+    if (!s->mixer.isIdentity() || s->resident)
+    {
+        ThreadPolicy::freeLocal(mixBuffer);
+        mixBuffer = (char *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO,
+                                                               snd_pcm_format_size(fileFormat, chunkSize * channels));
+        if (mixBuffer == NULL)
+            return -1;
+    }
+
+    if (requant.setup(fileFormat, format, channels, ditherMode) < 0)
+        return -1;
+    if (!requant.isPassthrough())
+        DBG("dither: %s\r\n", Requantizer::modeName(requant.mode()));
+
+    if (planar && setupPlanes(s) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* file and mix planes of the direct path for s */
+int APlayer::setupPlanes(stream_t *s)
+{
+    if (filePlanes.setup(s->channels, chunkSize, snd_pcm_format_physical_width(fileFormat) / 8) < 0 ||
+        mixPlanes.setup(channels, chunkSize, snd_pcm_format_physical_width(fileFormat) / 8) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* the incoming stream has faded in completely, drop the outgoing one */
+void APlayer::switchStream()
+{
+    stream_t *old;
+
+    pthread_mutex_lock(lock);
+    old = cur;
+    cur = next;
+    next = NULL;
+    pthread_mutex_unlock(lock);
+
+    fader.stop();
+    closeStream(old);
+    if (useStream(cur) < 0)
+    {
+        pthread_mutex_lock(lock);
+        isPlaying = false;
+        pthread_mutex_unlock(lock);
+    }
+
+    DBG("crossfade done\r\n");
+}
+
 void* APlayer::readingTask(void *data)
 {   
     char *buffer;
     buf_data_t *bufData;
-    int bytes, requestBytes, bufSize, totalBytes;
+    ssize_t bytes;
+    size_t requestBytes, bufSize;
+    uint64_t readPos, endPos, from, to;
+    uint32_t plays = 1;
+    bool borrowed;
+    stream_t *s;
     WavFile *wav;
-    isReading = true;
 
     DBG("ReadingTask started.\r\n");
+    TRACE_THREAD("reader");
+    if (powerSave)
+        prctl(PR_SET_TIMERSLACK, POWER_TIMER_SLACK);
+
+    s = static_cast<stream_t *>(data);
+    wav = s->wav;
+    assert(wav->length() > 0);
+    readPos = 0;
 
-    wav = static_cast<WavFile *>(data);
-    if (wav)
+    pthread_mutex_lock(lock);
+    while (s->isReading && readPos < wav->length())
     {
-        totalBytes = wav->length();
-        assert(totalBytes > 0);
-        
-        pthread_mutex_lock(lock);
-        do 
+        /* a couple of buffers ahead is enough, the next stream waits here */
+        if (s->bufList.size() >= (size_t)readAhead)
         {
             pthread_cond_wait(cond, lock);
+            continue;
+        }
+        pthread_mutex_unlock(lock);
+
+        assert(s->chunkBytes > 0);
+        bufSize = DEFAULT_CHUNK_COUNT * s->chunkBytes;
+
+        /* buffers end at the loop seam so the body can be joined to itself */
+        endPos = wav->length();
+        if (readPos < s->loopEnd)
+            endPos = s->loopEnd;
+        if (endPos - readPos > bufSize)
+            requestBytes = bufSize;
+        else
+            requestBytes = endPos - readPos;
 
-            assert(chunkBytes > 0);
-            bufSize = DEFAULT_CHUNK_COUNT * chunkBytes;
+        borrowed = s->resident && plays > 1 && readPos >= s->loopStart && readPos < s->loopEnd;
+        if (borrowed)
+        {
+            buffer = s->resident + (readPos - s->loopStart);
+            bytes = requestBytes;
+        }
+        else
+        {
             buffer = (char *)malloc(bufSize);
-            if (totalBytes > bufSize)
-                requestBytes = bufSize;
-            else
-                requestBytes = totalBytes;
+            TRACE_BEGIN(read, requestBytes);
             bytes = wav->readData(buffer, requestBytes);
-        
-            if (bytes > 0)
-            {
-                bufData = (buf_data_t *)malloc(sizeof(buf_data_t));
-                bufData->buffer = buffer;
-                bufData->bufSize = bytes;
+            TRACE_END(read, bytes);
+
+            /* keep the first pass of the loop body */
+            from = readPos > s->loopStart ? readPos : s->loopStart;
+            to = readPos + (bytes > 0 ? bytes : 0);
+            if (to > s->loopEnd)
+                to = s->loopEnd;
+            if (s->resident && plays == 1 && from < to)
+                memcpy(s->resident + (from - s->loopStart), buffer + (from - readPos), to - from);
+        }
 
-                bufList.push_back(bufData);
+        pthread_mutex_lock(lock);
+        if (bytes > 0)
+        {
+            bufData = (buf_data_t *)malloc(sizeof(buf_data_t));
+            bufData->buffer = buffer;
+            bufData->bufSize = bytes;
+            bufData->borrowed = borrowed;
 
-                totalBytes -= bytes;
+            s->bufList.push_back(bufData);
+            pthread_cond_broadcast(cond);
+            TRACE_COUNTER(queued, s->bufList.size());
 
-                if (bytes < requestBytes)
-                    isReading = false; /* finished */
-            }
-            else
+            /* a short count is not the end: the rest comes with the next read */
+            readPos += bytes;
+
+            if (readPos == s->loopEnd && (s->loopCount == 0 || plays < s->loopCount))
             {
-                DBG("read error, break\r\n");
-                break; /* error */
+                /* round again, from memory or from the file */
+                plays++;
+                readPos = s->loopStart;
+                TRACE_INSTANT(loop, plays);
+                if (s->resident == NULL && wav->seek(s->loopStart / s->frameBytes) < 0)
+                    break;
             }
-                
         }
-        while(isReading && totalBytes > 0);
-        pthread_mutex_unlock(lock);
-
-        if (wav)
+        else
         {
-            wav->close();
-            delete wav;        
+            if (!borrowed)
+                free(buffer);
+            DBG("read error, break\r\n");
+            break; /* error */
         }
     }
 
-    isReading = false;
-    
+    s->isReading = false;
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(lock);
+
+    wav->close();
+    delete wav;
+    s->wav = NULL;
+    accountThread();
+
     DBG("ReadingTask stoped.\r\n");
 
     return NULL;
 }
 
+/*
+ * Up to maxFrames of s in its file format, points into the buffer being
+ * played which stays valid until the next call. 0 at the end of s.
+ */
+size_t APlayer::nextFrames(stream_t *s, char **data, size_t maxFrames)
+{
+    size_t frames;
+
+    pthread_mutex_lock(lock);
+    while (s->bufData == NULL || s->bufPos + s->frameBytes > s->bufData->bufSize)
+    {
+        if (s->bufData)
+        {
+            if (!s->bufData->borrowed)
+                free(s->bufData->buffer);
+            free(s->bufData);
+            s->bufData = NULL;
+        }
+
+        if (!s->bufList.empty())
+        {
+            s->bufData = s->bufList.front();
+            s->bufList.pop_front();
+            s->bufPos = 0;
+            pthread_cond_broadcast(cond);   /* ask to read more */
+            TRACE_COUNTER(queued, s->bufList.size());
+        }
+        else if (s->isReading && isPlaying)
+        {
+            /* the reader is late, a long wait here is heard as an underrun */
+            TRACE_BEGIN(starve, 0);
+            pthread_cond_wait(cond, lock);
+            TRACE_END(starve, 0);
+        }
+        else
+        {
+            pthread_mutex_unlock(lock);
+            return 0;
+        }
+    }
+
+    frames = (s->bufData->bufSize - s->bufPos) / s->frameBytes;
+    if (frames > maxFrames)
+        frames = maxFrames;
+    *data = s->bufData->buffer + s->bufPos;
+    s->bufPos += frames * s->frameBytes;
+    pthread_mutex_unlock(lock);
+
+    return frames;
+}
+
+/* file frames to float frames in the device layout, NULL data is silence */
+void APlayer::toFloat(stream_t *s, const char *data, float *dst, size_t frames)
+{
+    if (data == NULL || pcm_to_float(s->format, data, s->scratch, frames * s->channels) < 0)
+    {
+        memset(dst, 0, frames * channels * sizeof(float));
+        return;
+    }
+
+    s->mixer.process(s->scratch, dst, SND_PCM_FORMAT_FLOAT, frames);
+}
+
+/* exactly frames of s as float, padded with silence when s ends */
+void APlayer::pullFloat(stream_t *s, float *dst, size_t frames)
+{
+    char *data;
+    size_t n;
+
+    while (frames > 0)
+    {
+        n = nextFrames(s, &data, frames);
+        if (n == 0)
+        {
+            memset(dst, 0, frames * channels * sizeof(float));
+            break;
+        }
+
+        toFloat(s, data, dst, n);
+        s->played += n;
+        dst += n * channels;
+        frames -= n;
+    }
+}
+
+/*
+ * Float frames in the device layout to the device, through the time
+ * stretch when it is engaged and the equalizer. bus NULL only drains the stretch output.
+ */
+ssize_t APlayer::writeBus(float *bus, size_t frames)
+{
+    ssize_t size = 0;
+
+    if (!stretching)
+    {
+        eq.process(bus, frames);
+        gainStage.process(bus, SND_PCM_FORMAT_FLOAT, channels, frames);
+        busRequant.process(bus, outBuffer, frames);
+        return pcmWrite(outBuffer, frames);
+    }
+
+    if (bus)
+        stretch.put(bus, frames);
+    while (size >= 0 && (frames = stretch.get(stretchOut, chunkSize)) > 0)
+    {
+        eq.process(stretchOut, frames);
+        gainStage.process(stretchOut, SND_PCM_FORMAT_FLOAT, channels, frames);
+        busRequant.process(stretchOut, outBuffer, frames);
+        size = pcmWrite(outBuffer, frames);
+    }
+
+    return size;
+}
+
+/*
+ * Energy mode: with less than a period free, sleep until a whole burst
+ * is instead of being woken by the device every period. The thread's
+ * timer slack lets the kernel fold the wakeup into others. -1 once
+ * stop() was called.
+ */
+int APlayer::powerWait()
+{
+    snd_pcm_sframes_t avail;
+    struct timespec until;
+    uint64_t ns;
+    bool playing;
+
+    avail = snd_pcm_avail_update(handle);
+    if (avail < 0 || (snd_pcm_uframes_t)avail >= chunkSize ||
+        snd_pcm_state(handle) != SND_PCM_STATE_RUNNING)
+        return 0;   /* errors and the prefill are pcmWrite()'s */
+
+    ns = (uint64_t)(burstFrames - avail) * 1000000000ULL / rate;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += ns / 1000000000ULL;
+    until.tv_nsec += ns % 1000000000ULL;
+    if (until.tv_nsec >= 1000000000L)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    TRACE_BEGIN(sleep, avail);
+    pthread_mutex_lock(lock);
+    /* stop() cuts it short, buffers from the reader only wake it */
+    while (isPlaying && pthread_cond_timedwait(cond, lock, &until) != ETIMEDOUT)
+        ;
+    playing = isPlaying;
+    pthread_mutex_unlock(lock);
+    TRACE_END(sleep, 0);
+
+    return playing ? 0 : -1;
+}
+
+/*
+ * Energy mode: without period interrupts nothing ends a blocking drain,
+ * so drain nonblocking and sleep until the device has played it all.
+ */
+void APlayer::powerDrain()
+{
+    snd_pcm_sframes_t delay;
+
+    if (snd_pcm_drain(handle) != -EAGAIN)
+        return;     /* drained already, the handle was blocking */
+
+    /* the delay also moves the hardware pointer on, which ends the drain */
+    while (snd_pcm_state(handle) == SND_PCM_STATE_DRAINING &&
+           snd_pcm_delay(handle, &delay) == 0 && delay > 0)
+        usleep((uint64_t)delay * 1000000ULL / rate);
+
+    if (snd_pcm_state(handle) == SND_PCM_STATE_DRAINING)
+        snd_pcm_drop(handle);
+}
+
+/* cpu time and wakeups of the calling thread, into the stats of this play() */
+void APlayer::accountThread()
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_THREAD, &ru) < 0)
+        return;
+
+    pthread_mutex_lock(lock);
+    power.cpuSeconds += ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+                        ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    power.wakeups += ru.ru_nvcsw;
+    pthread_mutex_unlock(lock);
+}
+
+/*
+ * The direct path on planes: the file frames are split once, then
+ * remapped, scaled and requantized a channel at a time, and go to the
+ * device as planes, or joined again when it only takes interleaved ones.
+ */
+ssize_t APlayer::writePlanar(char *data, size_t count)
+{
+    PlanarBuffer *p = &filePlanes;
+
+    filePlanes.split(data, count);
+    if (!cur->mixer.isIdentity())
+    {
+        cur->mixer.processPlanar(filePlanes.planes(), mixPlanes.planes(), fileFormat, count);
+        p = &mixPlanes;
+    }
+
+    gainStage.processPlanar(p->planes(), fileFormat, channels, count);
+    if (!requant.isPassthrough())
+    {
+        /* the interleaved path's requantizer, the dither stays the same */
+        requant.processPlanar(p->planes(), outPlanes.planes(), count);
+        p = &outPlanes;
+    }
+
+    if (nonInterleaved)
+        return pcmWriteN(p->planes(), count);
+
+    p->join(outBuffer, count);
+    return pcmWrite(outBuffer, count);
+}
+
 void* APlayer::playingTask()
 {    
-    buf_data_t *bufData;
-    uint32_t count, bytes, size = 0, retry = 0;
+    stream_t *incoming;
+    size_t count, offset;
+    ssize_t size = 0;
+    char *data;
+    float *bus;
+    bool atEnd = false;
+    uint64_t begin = monotonicUs(), slack;
 
     DBG("PlayingTask started.\r\n");
-
-    pthread_mutex_lock(lock);
-    
-    isPlaying = true;
+    TRACE_THREAD("player");
+    if (powerSave)
+    {
+        /* late by up to a quarter period still leaves most of one queued */
+        slack = (uint64_t)chunkSize * 250000000ULL / rate;
+        prctl(PR_SET_TIMERSLACK, slack < POWER_TIMER_SLACK ? slack : POWER_TIMER_SLACK);
+    }
 
     while (isPlaying)
     {
-        if (!bufList.empty())
+        adaptLatency();
+        if (powerSave)
+            powerWait();
+        count = nextFrames(cur, &data, chunkSize);
+
+        pthread_mutex_lock(lock);
+        incoming = next;
+        pthread_mutex_unlock(lock);
+
+        if (incoming && !fader.isActive())
         {
-            bufData = bufList.front();
-            bufList.pop_front();
-            pthread_cond_signal(cond);
-            DBG("Ask to read more...\r\n");
-            pthread_mutex_unlock(lock);
+            /* first period since crossfade() */
+            fadeStart = cur->played;
+            if (fadeAtEnd && cur->frames != STREAM_ENDLESS && cur->frames > cur->played + fadeFrames)
+                fadeStart = cur->frames - fadeFrames;
+            fader.start(fadeFrames, fadeCurve);
+            /* what follows is a mix, the file alone was verified up to here */
+            if (verifier)
+                verifier->end(false);
+            DBG("crossfade %s, %llu frames from frame %llu\r\n", Crossfader::curveName(fadeCurve),
+                (unsigned long long)fadeFrames, (unsigned long long)fadeStart);
         }
-        else if (isReading)
-        {
-            pthread_mutex_unlock(lock);
-            pthread_cond_signal(cond);
-            DBG("sleep 10 millseconds\r\n");
-            usleep(10*1000);    // 10 ms
-            pthread_mutex_lock(lock);
-            continue;
-        }            
-        else if (size > 0)
+
+        if (!stretching && stretch.speed() != 1.0f)
         {
-            // we had played something, now reading thread had quited
-            break;  /* reading thread had exited */
+            /* from here on the output runs through the float bus */
+            stretch.reset();
+            stretching = true;
+            DBG("time stretch engaged\r\n");
         }
-        else 
+
+        if (fader.isActive())
         {
-            // isReading == false; wait reading thread startup
-            usleep(10*1000);
-            retry++;
-            if (retry <= 3)
+            if (count == 0)
+            {
+                /* outgoing stream ran out, finish against silence */
+                count = chunkSize;
+                data = NULL;
+            }
+
+            offset = (data && fadeStart > cur->played) ? fadeStart - cur->played : 0;
+            if (offset < count)
+            {
+                /* overlap: both streams in float on the mix bus */
+                toFloat(cur, data, fader.busA(), count);
+                memset(fader.busB(), 0, offset * channels * sizeof(float));
+                pullFloat(incoming, fader.busB() + offset * channels, count - offset);
+                bus = fader.mix(count, offset);
+                size = writeBus(bus, count);
+
+                if (data)
+                    cur->played += count;
+                if (fader.isDone())
+                    switchStream();
+                if (size < 0)
+                    break;
                 continue;
-            else
-                break;
+            }
         }
 
+        if (count == 0)
+        {
+            /* end of file */
+            atEnd = true;
+            if (stretching)
+            {
+                stretch.flush();
+                writeBus(NULL, 0);
+            }
+            break;
+        }
 
-        bytes = 0;
-        assert(bufData);
-        while ( bufData->bufSize > bytes && isPlaying)
+        if (stretching || !eq.isBypassed())
         {
-            if ((bufData->bufSize - bytes) >= chunkBytes)
-                count = chunkBytes * 8 / bitsPerFrame;
-            else
-                count = (bufData->bufSize - bytes) * 8 / bitsPerFrame;
-            
-            size = pcmWrite(bufData->buffer + bytes, count);
+            toFloat(cur, data, fader.busA(), count);
+            size = writeBus(fader.busA(), count);
+            cur->played += count;
+            if (size < 0)
+                break;
+            continue;
+        }
 
-            bytes += size * bitsPerFrame / 8;
+        if (planar)
+        {
+            size = writePlanar(data, count);
+            cur->played += count;
+            if (size < 0)
+                break;
+            continue;
         }
 
-        free(bufData->buffer);
-        free(bufData);
+        if (!cur->mixer.isIdentity())
+        {
+            cur->mixer.process(data, mixBuffer, fileFormat, count);
+            data = mixBuffer;
+        }
+        else if (cur->bufData->borrowed)
+        {
+            /* the loop body is played again and again, it is never scaled itself */
+            memcpy(mixBuffer, data, count * fileFrameBytes);
+            data = mixBuffer;
+        }
 
-        pthread_mutex_lock(lock);
-    }    
+        gainStage.process(data, fileFormat, channels, count);
+        if (!requant.isPassthrough())
+        {
+            requant.process(data, outBuffer, count);
+            data = outBuffer;
+        }
 
-    while (!bufList.empty())
-    {
-        bufData = bufList.front();
-        bufList.pop_front();    
+        size = pcmWrite(data, count);
+        cur->played += count;
+        if (size < 0)
+            break;
+    }    
 
-        free(bufData->buffer);
-        free(bufData);        
-    }
+    if (verifier)
+        verifier->end(atEnd);
 
+    pthread_mutex_lock(lock);
     isPlaying = false;
-    
     pthread_mutex_unlock(lock);
 
-	snd_pcm_nonblock(handle, 0);
-	snd_pcm_drain(handle);
+	if (powerSave)
+		powerDrain();
+	else
+	{
+		snd_pcm_nonblock(handle, 0);
+		snd_pcm_drain(handle);
 
-	// behavious copies from aplay, ALSA example
-	if (openMode & SND_PCM_NONBLOCK)
-    	snd_pcm_nonblock(handle, 1);
+		// behavious copies from aplay, ALSA example
+		if (openMode & SND_PCM_NONBLOCK)
+			snd_pcm_nonblock(handle, 1);
+	}
+
+    power.wallSeconds = (monotonicUs() - begin) / 1e6;
+    power.audioSeconds = (double)framesOut / rate;
+    accountThread();
 
     DBG("PlayingTask stoped.\r\n");
 
@@ -341,83 +1058,25 @@ const char* APlayer::getFileNameExt(const char *filename)
 
 bool APlayer::isWavFile(const char *filename)
 {
-    size_t length, i;
-    char *ext, str[4];
+    const char *ext;
 
-    ext = (char *)getFileNameExt(filename);
-    
-    length = strlen(ext);
-    if (length > sizeof(str))
-        length = sizeof(str);
+    ext = getFileNameExt(filename);
 
-    for (i = 0; i < length; i++)
-        str[i] = tolower(ext[i]);
-    
-    return (0 == strcmp("wav", str));
+    return ext && strcasecmp(ext, "wav") == 0;
 }
 
 snd_pcm_format_t APlayer::getPCMFormat(WavFile *file)
 {
-    snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
-
     assert(file != NULL);
-    switch(file->bits())
-    {
-    case 8:
-		format = SND_PCM_FORMAT_U8;
-		break;
-	case 16:
-		if (file->isBigEndian())
-			format = SND_PCM_FORMAT_S16_BE;
-		else
-			format = SND_PCM_FORMAT_S16_LE;
-		break;
-    case 24:
-		switch (TO_CPU_SHORT(file->bytes(), file->isBigEndian()) / file->channels()) 
-        {
-		case 3:
-			if (file->isBigEndian())
-				format = SND_PCM_FORMAT_S24_3BE;
-			else
-				format = SND_PCM_FORMAT_S24_3LE;
-			break;
-		case 4:
-			if (file->isBigEndian())
-				format = SND_PCM_FORMAT_S24_BE;
-			else
-				format = SND_PCM_FORMAT_S24_LE;
-			break;
-		default:
-			break;
-		}
-		break;    
-    case 32:
-        if (file->format() == WAV_FMT_PCM)
-        {
-			if (file->isBigEndian())
-				format = SND_PCM_FORMAT_S32_BE;
-			else
-				format = SND_PCM_FORMAT_S32_LE;
-		} 
-        else if (file->format() == WAV_FMT_IEEE_FLOAT)
-        {
-			if (file->isBigEndian())
-				format = SND_PCM_FORMAT_FLOAT_BE;
-			else
-				format = SND_PCM_FORMAT_FLOAT_LE;
-		}
-		break;
-    default:
-        break;        
-    }
 
-    return format;
+    return file->pcmFormat();
 }
 
 int APlayer::initHW(const char *device)
 {
     int err;
     snd_pcm_info_t *info;
+    snd_pcm_hw_params_t *params;
 
     snd_pcm_info_alloca(&info);
 	err = snd_output_stdio_attach(&log, stdout, 0);
@@ -425,7 +1084,10 @@ int APlayer::initHW(const char *device)
 
     if (device && strlen(device) > 0)
     {
-        err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, openMode);
+        if (opener)
+            err = opener(&handle, device, openMode, openerData);
+        else
+            err = snd_pcm_open(&handle, device, SND_PCM_STREAM_PLAYBACK, openMode);
         if (err < 0)
         {
             DBG("audio open error: %s\n", snd_strerror(err));
@@ -454,6 +1116,21 @@ int APlayer::initHW(const char *device)
 		}        
     }
 
+    free(deviceName);
+    deviceName = strdup(device);
+    capsCached = DeviceCaps::shared()->find(device, &caps);
+    if (!capsCached)
+    {
+        snd_pcm_hw_params_alloca(&params);
+        if (snd_pcm_hw_params_any(handle, params) < 0 ||
+            DeviceCaps::probe(handle, params, &caps) < 0)
+        {
+            DBG("Broken configuration for this PCM: no configurations available\r\n");
+            return -1;
+        }
+        DeviceCaps::shared()->store(device, &caps);
+    }
+
     return 0;
 }
 
@@ -463,7 +1140,7 @@ void APlayer::uninitHW()
 	handle = NULL;
 
 	snd_output_close(log);
-	snd_config_update_free_global();	
+	/* the global config stays loaded, the next open would parse it all again */
 }
 
 int APlayer::setParams(WavFile *file)
@@ -478,15 +1155,16 @@ int APlayer::setParams(WavFile *file)
 	snd_pcm_sw_params_t *swparams;
 	uint32_t rate, bufferTime, periodTime;
 	snd_pcm_uframes_t bufferSize, startThreshold, stopThreshold;
+	char formatNames[256];
 	
     assert(file != NULL);
     hwparams.channels = file->channels();
     hwparams.format = getPCMFormat(file);
     hwparams.rate = file->rate();
 
-    format = hwparams.format;
+    format = fileFormat = hwparams.format;
     channels = hwparams.channels;
-    bitsPerFrame = file->bits() * channels;
+    fileFrameBytes = file->frameBytes();
     bytesPerSample = file->bytes();
 
 	snd_pcm_hw_params_alloca(&params);
@@ -499,12 +1177,15 @@ int APlayer::setParams(WavFile *file)
 		return -1;
 	}
 
-    if (DEFAULT_INTERLEAVED)
-		err = snd_pcm_hw_params_set_access(handle, params,
-                SND_PCM_ACCESS_RW_INTERLEAVED);
-	else
+	/* planes go to the device as they are when it takes them */
+	err = -EINVAL;
+	if (planar)
 		err = snd_pcm_hw_params_set_access(handle, params,
 				SND_PCM_ACCESS_RW_NONINTERLEAVED);
+	nonInterleaved = (err == 0);
+	if (err < 0)
+		err = snd_pcm_hw_params_set_access(handle, params,
+				SND_PCM_ACCESS_RW_INTERLEAVED);
 
 	if (err < 0)
 	{
@@ -512,20 +1193,43 @@ int APlayer::setParams(WavFile *file)
 		return -1;
 	}
 
+	/* settled from the cached caps, the driver is asked only once */
+	if (!DeviceCaps::hasFormat(&caps, format))
+	{
+		/* convert to the best format the device has */
+		format = pickFormat();
+		if (format == SND_PCM_FORMAT_UNKNOWN)
+		{
+			DeviceCaps::formatNames(&caps, formatNames, sizeof(formatNames));
+			DBG("Sample format non available, the device has %s\r\n", formatNames);
+			return -1;
+		}
+		DBG("%s not available, converting to %s\r\n",
+		    snd_pcm_format_name(fileFormat), snd_pcm_format_name(format));
+	}
 	err = snd_pcm_hw_params_set_format(handle, params, format);
 	if (err < 0)
 	{
-		DBG("Sample format non available\r\n");
-		show_available_sample_formats(handle, params);
+		DBG("Sample format %s refused\r\n", snd_pcm_format_name(format));
 		return -1;
 	}
 
-	err = snd_pcm_hw_params_set_channels(handle, params, channels);
+	err = -EINVAL;
+	if (channels >= caps.channelsMin && channels <= caps.channelsMax)
+		err = snd_pcm_hw_params_set_channels(handle, params, channels);
 	if (err < 0)
 	{
-		DBG("Channels count non available");
-		return -1;
-	}	
+		/* the mixer folds or spreads the file layout onto what we get */
+		err = snd_pcm_hw_params_set_channels_near(handle, params, &hwparams.channels);
+		if (err < 0)
+		{
+			DBG("Channels count non available");
+			return -1;
+		}
+		DBG("%u channels not available, using %u\r\n", channels, hwparams.channels);
+		channels = hwparams.channels;
+	}
+	bitsPerFrame = snd_pcm_format_physical_width(format) * channels;
 
 	rate = hwparams.rate;
 	err = snd_pcm_hw_params_set_rate_near(handle, params, &hwparams.rate, 0);
@@ -544,11 +1248,13 @@ int APlayer::setParams(WavFile *file)
 	}
 
 	rate = hwparams.rate;
+	this->rate = rate;
+	gainStage.setRate(rate);
 
 	err = snd_pcm_hw_params_get_buffer_time_max(params, &bufferTime, 0); // us
 	assert(err >= 0);
-	if (bufferTime > MAX_RING_BUF_LENGTH)
-		bufferTime = MAX_RING_BUF_LENGTH;
+	if (bufferTime > (powerSave ? POWER_RING_BUF_LENGTH : MAX_RING_BUF_LENGTH))
+		bufferTime = powerSave ? POWER_RING_BUF_LENGTH : MAX_RING_BUF_LENGTH;
 
 	periodTime = bufferTime / 4;
 	assert(periodTime > 0);
@@ -562,6 +1268,16 @@ int APlayer::setParams(WavFile *file)
 
 	assert(err >= 0);	
 
+	/*
+	 * energy mode keeps time itself, an interrupt per period only wakes
+	 * the cpu. alsa-lib turns them off for a nonblocking handle only, its
+	 * writes are then paced by powerWait().
+	 */
+	if (powerSave && snd_pcm_nonblock(handle, 1) == 0 &&
+	    snd_pcm_hw_params_can_disable_period_wakeup(params) &&
+	    snd_pcm_hw_params_set_period_wakeup(handle, params, 0) == 0)
+		DBG("period wakeups off\r\n");
+
 	err = snd_pcm_hw_params(handle, params);
 	if (err < 0)
 	{
@@ -578,7 +1294,29 @@ int APlayer::setParams(WavFile *file)
 		        chunkSize, bufferSize);
 		return -1;
 	}
-	chunkBytes = chunkSize * file->bits() * file->channels() / 8;
+	chunkBytes = chunkSize * fileFrameBytes;
+
+	/* device side of the float mix bus used while crossfading */
+	if (fader.setup(channels, chunkSize) < 0 ||
+	    busRequant.setup(SND_PCM_FORMAT_FLOAT, format, channels, ditherMode) < 0)
+		return -1;
+	/* worked on by the playing thread, near its cpus */
+	ThreadPolicy::freeLocal(outBuffer);
+	outBuffer = (char *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO, chunkSize * bitsPerFrame / 8);
+	if (outBuffer == NULL)
+		return -1;
+	if (planar && outPlanes.setup(channels, chunkSize, snd_pcm_format_physical_width(format) / 8) < 0)
+		return -1;
+	if (planar)
+		DBG("planar, %s access\r\n", nonInterleaved ? "non-interleaved" : "interleaved");
+
+	ThreadPolicy::freeLocal(stretchOut);
+	stretchOut = (float *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO, chunkSize * channels * sizeof(float));
+	if (stretchOut == NULL || stretch.setup(channels, rate) < 0)
+		return -1;
+	if (eq.setup(channels, rate) < 0)
+		return -1;
+	stretching = false;
 
 	err = snd_pcm_sw_params_current(handle, swparams);
 	if (err < 0)
@@ -587,10 +1325,14 @@ int APlayer::setParams(WavFile *file)
 		return -1;
 	}
 
-	err = snd_pcm_sw_params_set_avail_min(handle, swparams, chunkSize);
+	/* all but a period of the buffer is refilled at once in energy mode */
+	burstFrames = powerSave ? bufferSize - chunkSize : chunkSize;
+	err = snd_pcm_sw_params_set_avail_min(handle, swparams, burstFrames);
 
-	/* round up to closest transfer boundary */
-	startThreshold = bufferSize;
+	/* start early, the xrun policy asks for more prefill when that fails */
+	xrunPolicy.setup(chunkSize, bufferSize, DEFAULT_QUEUED_BUFS);
+	readAhead = xrunPolicy.readAhead();
+	startThreshold = xrunPolicy.startThreshold();
     err = snd_pcm_sw_params_set_start_threshold(handle, swparams, startThreshold);
 	assert(err >= 0);
 	stopThreshold = bufferSize;
@@ -609,23 +1351,130 @@ int APlayer::setParams(WavFile *file)
     return 0;
 }
 
+/* ALSA channel map position to WAV_SPEAKER_* bit, 0 if it has none */
+static uint32_t chmapSpeaker(unsigned int pos)
+{
+    switch (pos & SND_CHMAP_POSITION_MASK)
+    {
+    case SND_CHMAP_MONO:
+    case SND_CHMAP_FC:  return WAV_SPEAKER_FRONT_CENTER;
+    case SND_CHMAP_FL:  return WAV_SPEAKER_FRONT_LEFT;
+    case SND_CHMAP_FR:  return WAV_SPEAKER_FRONT_RIGHT;
+    case SND_CHMAP_RL:  return WAV_SPEAKER_BACK_LEFT;
+    case SND_CHMAP_RR:  return WAV_SPEAKER_BACK_RIGHT;
+    case SND_CHMAP_LFE: return WAV_SPEAKER_LOW_FREQUENCY;
+    case SND_CHMAP_SL:  return WAV_SPEAKER_SIDE_LEFT;
+    case SND_CHMAP_SR:  return WAV_SPEAKER_SIDE_RIGHT;
+    case SND_CHMAP_RC:  return WAV_SPEAKER_BACK_CENTER;
+    case SND_CHMAP_FLC: return WAV_SPEAKER_FRONT_LEFT_OF_CENTER;
+    case SND_CHMAP_FRC: return WAV_SPEAKER_FRONT_RIGHT_OF_CENTER;
+    case SND_CHMAP_TC:  return WAV_SPEAKER_TOP_CENTER;
+    case SND_CHMAP_FLH:
+    case SND_CHMAP_TFL: return WAV_SPEAKER_TOP_FRONT_LEFT;
+    case SND_CHMAP_FCH:
+    case SND_CHMAP_TFC: return WAV_SPEAKER_TOP_FRONT_CENTER;
+    case SND_CHMAP_FRH:
+    case SND_CHMAP_TFR: return WAV_SPEAKER_TOP_FRONT_RIGHT;
+    case SND_CHMAP_TRL: return WAV_SPEAKER_TOP_BACK_LEFT;
+    case SND_CHMAP_TRC: return WAV_SPEAKER_TOP_BACK_CENTER;
+    case SND_CHMAP_TRR: return WAV_SPEAKER_TOP_BACK_RIGHT;
+    default:            return 0;
+    }
+}
+
+/*
+ * Speaker of every device channel. Drivers without a channel map get the
+ * ALSA default order, which differs from WAV order from 4 channels on.
+ */
+static void deviceSpeakers(snd_pcm_t *handle, int channels, uint32_t *pos)
+{
+    static const unsigned int alsaOrder[] = {
+        SND_CHMAP_FL, SND_CHMAP_FR, SND_CHMAP_RL, SND_CHMAP_RR,
+        SND_CHMAP_FC, SND_CHMAP_LFE, SND_CHMAP_SL, SND_CHMAP_SR
+    };
+    snd_pcm_chmap_t *map;
+    int c;
+
+    map = snd_pcm_get_chmap(handle);
+    if (map && (int)map->channels == channels)
+    {
+        for (c = 0; c < channels; c++)
+            pos[c] = chmapSpeaker(map->pos[c]);
+    }
+    else if (channels == 1)
+    {
+        pos[0] = WAV_SPEAKER_FRONT_CENTER;
+    }
+    else
+    {
+        for (c = 0; c < channels; c++)
+            pos[c] = c < 8 ? chmapSpeaker(alsaOrder[c]) : 0;
+    }
+    free(map);
+}
+
+/* highest resolution first, float after S32 as it holds only 24 bits */
+snd_pcm_format_t APlayer::pickFormat()
+{
+    static const snd_pcm_format_t formats[] = {
+        SND_PCM_FORMAT_S32, SND_PCM_FORMAT_FLOAT, SND_PCM_FORMAT_S24,
+        SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S16, SND_PCM_FORMAT_U8
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        if (DeviceCaps::hasFormat(&caps, formats[i]))
+            return formats[i];
+    }
+    return SND_PCM_FORMAT_UNKNOWN;
+}
+
+int APlayer::setupMixer(stream_t *s, WavFile *file)
+{
+    uint32_t inPos[MIXER_MAX_CHANNELS], outPos[MIXER_MAX_CHANNELS];
+    uint32_t mask;
+
+    if (file->channels() > MIXER_MAX_CHANNELS || channels > MIXER_MAX_CHANNELS)
+    {
+        /* nothing to remap, pass through as before if the counts match */
+        s->mixer.reset();
+        return file->channels() == channels ? 0 : -1;
+    }
+
+    mask = file->channelMask();
+    if (mask == 0)
+        mask = ChannelMixer::defaultMask(file->channels());
+    ChannelMixer::maskPositions(mask, file->channels(), inPos);
+    deviceSpeakers(handle, channels, outPos);
+
+    return s->mixer.setup(inPos, file->channels(), outPos, channels);
+}
+
 ssize_t APlayer::pcmWrite(char *data, size_t count)
 {
+	snd_pcm_sframes_t delay;
 	ssize_t r;
 	ssize_t result = 0;
 
-	if (count < chunkSize)
-    {
-		snd_pcm_format_set_silence(format, data + count * bitsPerFrame / 8, (chunkSize - count) * channels);
-		count = chunkSize;
+	if (nonInterleaved)
+	{
+		/* the device only takes planes */
+		outPlanes.split(data, count);
+		return pcmWriteN(outPlanes.planes(), count);
 	}
 
+	TRACE_BEGIN(write, count);
 	while (count > 0)
     {
 		r = snd_pcm_writei(handle, data, count);
 		if (r == -EAGAIN || (r >= 0 && (size_t)r < count))
         {
-			snd_pcm_wait(handle, 100);
+			/* no period interrupt may come to end snd_pcm_wait() */
+			if (!powerSave)
+				snd_pcm_wait(handle, 100);
+			else if (powerWait() < 0 && r <= 0)
+				break;
 		}
         else if (r == -EPIPE)
         {
@@ -638,21 +1487,92 @@ ssize_t APlayer::pcmWrite(char *data, size_t count)
         else if (r < 0)
         {
 			DBG("write error: %s", snd_strerror(r));
+			TRACE_END(write, r);
 			return -1;
 		}
 		if (r > 0)
         {
+			if (verifier)
+				verifier->feed(data, r);
+			if (tap)
+				tap->push(data, r);
 			result += r;
+			framesOut += r;
 			count -= r;
 			data += r * bitsPerFrame / 8;
 		}
 	}
+	TRACE_END(write, result);
+
+	/* what the device still has to play, only asked for while recording */
+	if (Tracer::recording && snd_pcm_delay(handle, &delay) == 0)
+		TRACE_COUNTER(delay, delay);
 	return result;
 }
 
+/* pcmWrite() for a non-interleaved device, one plane per channel */
+ssize_t APlayer::pcmWriteN(void **planes, size_t count)
+{
+	snd_pcm_sframes_t delay;
+	size_t width = snd_pcm_format_physical_width(format) / 8, done = 0;
+	void **at = (void **)alloca(channels * sizeof(void *));
+	ssize_t r;
+	int c;
+
+	TRACE_BEGIN(write, count);
+	while (done < count)
+    {
+		for (c = 0; c < channels; c++)
+			at[c] = (char *)planes[c] + done * width;
+		r = snd_pcm_writen(handle, at, count - done);
+		if (r == -EAGAIN || (r >= 0 && (size_t)r < count - done))
+        {
+			/* no period interrupt may come to end snd_pcm_wait() */
+			if (!powerSave)
+				snd_pcm_wait(handle, 100);
+			else if (powerWait() < 0 && r <= 0)
+				break;
+		}
+        else if (r == -EPIPE)
+        {
+			xrun();
+		}
+        else if (r == -ESTRPIPE)
+        {
+			suspend();
+		}
+        else if (r < 0)
+        {
+			DBG("write error: %s", snd_strerror(r));
+			TRACE_END(write, r);
+			return -1;
+		}
+		if (r > 0 && (verifier || tap))
+        {
+			/* they follow interleaved frames, joined only for them */
+			PlanarBuffer::interleave(at, outBuffer, channels, width, r);
+			if (verifier)
+				verifier->feed(outBuffer, r);
+			if (tap)
+				tap->push(outBuffer, r);
+		}
+		if (r > 0)
+		{
+			done += r;
+			framesOut += r;
+		}
+	}
+	TRACE_END(write, done);
+
+	if (Tracer::recording && snd_pcm_delay(handle, &delay) == 0)
+		TRACE_COUNTER(delay, delay);
+	return done;
+}
+
 void APlayer::xrun(void)
 {
 	snd_pcm_status_t *status;
+	uint64_t now;
 	int res;
 	
 	snd_pcm_status_alloca(&status);
@@ -664,6 +1584,16 @@ void APlayer::xrun(void)
 
 	if (snd_pcm_status_get_state(status) == SND_PCM_STATE_XRUN)
     {
+		now = monotonicMs();
+		TRACE_INSTANT(xrun, xrunPolicy.level());
+		xrunPolicy.underrun(now);
+		xrunEvent(XRUN_EVENT_UNDERRUN, now);
+		if (xrunPolicy.raise(now))
+		{
+			applyLatency();
+			xrunEvent(XRUN_EVENT_RAISE, now);
+		}
+
 		if ((res = snd_pcm_prepare(handle))<0)
         {
 			DBG("xrun: prepare error: %s\r\n", snd_strerror(res));
@@ -676,10 +1606,57 @@ void APlayer::xrun(void)
 	return;
 }
 
+/* steps back toward the latency target once underruns have stopped */
+void APlayer::adaptLatency()
+{
+    uint64_t now = monotonicMs();
+
+    if (xrunPolicy.tick(now))
+    {
+        applyLatency();
+        xrunEvent(XRUN_EVENT_DECAY, now);
+    }
+}
+
+/* start threshold and read-ahead of the current level */
+void APlayer::applyLatency()
+{
+    snd_pcm_sw_params_t *swparams;
+    int err;
+
+    snd_pcm_sw_params_alloca(&swparams);
+    err = snd_pcm_sw_params_current(handle, swparams);
+    if (err == 0)
+        err = snd_pcm_sw_params_set_start_threshold(handle, swparams, xrunPolicy.startThreshold());
+    if (err == 0)
+        err = snd_pcm_sw_params(handle, swparams);
+    if (err < 0)
+        DBG("unable to change the start threshold: %s\r\n", snd_strerror(err));
+
+    pthread_mutex_lock(lock);
+    readAhead = xrunPolicy.readAhead();
+    pthread_cond_broadcast(cond);
+    pthread_mutex_unlock(lock);
+}
+
+void APlayer::xrunEvent(xrun_event_type_t type, uint64_t now)
+{
+    xrun_event_t event;
+
+    xrunPolicy.event(type, now, &event);
+    TRACE_COUNTER(latency_level, event.level);
+    DBG("%s: level %d, start at %zu frames, %d buffers ahead, %u underruns recently\r\n",
+        XrunPolicy::eventName(type), event.level, event.startFrames, event.readAhead, event.recent);
+
+    if (xrunCallback)
+        xrunCallback(&event, xrunData);
+}
+
 void APlayer::suspend(void)
 {
 	int res;
 
+	TRACE_BEGIN(suspend, 0);
 	while ((res = snd_pcm_resume(handle)) == -EAGAIN)
 		sleep(1);	/* wait until suspend flag is released */
 
@@ -690,4 +1667,5 @@ void APlayer::suspend(void)
 			DBG("suspend: prepare error: %s\r\n", snd_strerror(res));
 		}
 	}
+	TRACE_END(suspend, res);
 }
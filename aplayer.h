@@ -9,6 +9,30 @@
 using namespace std;
 
 #include "wav_file.h"
+#include "wav_index.h"
+#include "gain_stage.h"
+#include "channel_mixer.h"
+#include "requantizer.h"
+#include "crossfade.h"
+#include "time_stretch.h"
+#include "biquad_chain.h"
+#include "xrun_policy.h"
+#include "device_caps.h"
+#include "bit_verifier.h"
+#include "analysis_tap.h"
+#include "planar.h"
+
+typedef void (*xrun_callback_t)(const xrun_event_t *event, void *data);
+/* what playback of one play() cost, its playing and reading threads together */
+typedef struct {
+    double   audioSeconds;      /* written to the device */
+    double   wallSeconds;
+    double   cpuSeconds;        /* user and system */
+    uint64_t wakeups;           /* the threads slept and were woken again */
+} power_stats_t;
+
+/* opens the playback device in place of snd_pcm_open(), same return value */
+typedef int (*pcm_opener_t)(snd_pcm_t **pcm, const char *device, int mode, void *data);
 
 class APlayer
 {
@@ -19,6 +43,106 @@ public:
     int play(const char *filename, const char *device="default");
     void stop();
     bool isRunning();
+    /* the last play() has run to its end, stop() still closes the device */
+    bool isFinished();
+
+    /*
+     * Fade from the playing file to filename without reopening the
+     * device. Starts right away, or so that the fade ends with the current
+     * file when atEnd is set. The file must have the device sample rate;
+     * channel layout and sample format may differ. Starts a plain play()
+     * when nothing is playing.
+     */
+    int crossfade(const char *filename, uint32_t fadeMs = 3000,
+                  fade_curve_t curve = FADE_EQUAL_POWER, bool atEnd = false);
+    /* a crossfade is waiting or running */
+    bool isCrossfading();
+
+    /* headers of indexed files are taken from index instead of parsed */
+    void setIndex(WavIndex *index) { this->index = index; }
+
+    /* safe to call from any thread while playing, linear gain, 1.0 is unity */
+    void  setGain(float gain, uint32_t rampMs = 20, gain_ramp_t ramp = GAIN_RAMP_LINEAR)
+    {
+        gainStage.setGain(gain, rampMs, ramp);
+    }
+    float gain() { return gainStage.gain(); }
+
+    /* tempo without pitch change, 0.5 .. 2.0, any thread, takes effect within 20 ms */
+    void  setSpeed(float speed) { stretch.setSpeed(speed); }
+    float speed() { return stretch.speed(); }
+
+    /*
+     * Equalizer sections in the device layout, any thread. index == number
+     * of sections appends; clearFilters() returns to the untouched path.
+     */
+    int  setFilter(int index, biquad_type_t type, float freq, float q, float gainDb = 0)
+        { return eq.setSection(index, type, freq, q, gainDb); }
+    void clearFilters() { eq.clear(); }
+
+    /*
+     * Play the first forward 'smpl' loop of the files opened from now on
+     * as often as the file asks, forever for a play count of 0. A file that
+     * loops forever fades out right away when crossfaded at its end.
+     */
+    void  setLoop(bool enable) { looping = enable; }
+
+    /* told about every underrun and latency change, on the playing thread */
+    void  setXrunCallback(xrun_callback_t callback, void *data = NULL)
+    {
+        xrunCallback = callback;
+        xrunData = data;
+    }
+    uint64_t underruns() { return xrunPolicy.total(); }
+
+    /* devices of later play() calls come from opener, NULL for ALSA */
+    void  setOpener(pcm_opener_t opener, void *data = NULL)
+    {
+        this->opener = opener;
+        openerData = data;
+    }
+
+    /* device open and setup of the last play(), in microseconds */
+    uint32_t openLatencyUs() { return openUs; }
+
+    /*
+     * Compare what is written to the device with the file's data chunk,
+     * from the next play() on. The result is there once playback has
+     * ended or stop() returned; -1 when nothing was verified.
+     */
+    void  setVerify(bool enable) { verifying = enable; }
+    int   verifyResult(verify_result_t *result)
+    {
+        return verifier ? verifier->finish(result) : -1;
+    }
+
+    /*
+     * Levels and spectrum of what is written to the device, from the next
+     * play() on; NULL for none. The tap stays the caller's and must outlive
+     * the playback it watches.
+     */
+    void  setTap(AnalysisTap *tap) { nextTap = tap; }
+
+    /*
+     * Split the file frames into one plane per channel and run the direct
+     * path on those, writing planes when the device takes them. Applies
+     * to the next play().
+     */
+    void  setPlanar(bool enable) { planar = enable; }
+
+    /*
+     * Fewer wakeups instead of low latency, from the next play() on: a
+     * buffer of up to two seconds, written nonblocking and refilled in
+     * bursts of several periods after a sleep with timer slack. Period
+     * interrupts are turned off where the device allows it. Gain and
+     * speed changes are heard a buffer later.
+     */
+    void  setPowerSave(bool enable) { powerSave = enable; }
+    /* of the last play() once its threads have ended, after stop() for sure */
+    void  powerStats(power_stats_t *stats) { *stats = power; }
+
+    /* used when the device has fewer bits than the file, applies to the next play() */
+    void  setDither(dither_mode_t mode) { ditherMode = mode; }
 
     static void* readingThreadFunc(void *data);
     static void* playingThreadFunc(void *data);
@@ -40,39 +164,127 @@ private:
     int    initHW(const char *device);
     void   uninitHW();
     int    setParams(WavFile *file);
+    snd_pcm_format_t pickFormat();
 
     /*
      * count - frame count actually
      */
     ssize_t pcmWrite(char *data, size_t count);
+    ssize_t pcmWriteN(void **planes, size_t count);
+    int     powerWait();
+    void    powerDrain();
+    void    accountThread();
     void    xrun(void);
     void    suspend(void);
+    void    adaptLatency();
+    void    applyLatency();
+    void    xrunEvent(xrun_event_type_t type, uint64_t now);
+
+    typedef struct {
+        char *buffer;
+        uint32_t bufSize;
+        bool borrowed;              /* points into the resident loop body */
+    } buf_data_t;
+
+    /* one file with its reading thread, two of them during a crossfade */
+    struct stream_t {
+        WavFile *wav;               /* owned by the reading thread */
+        pthread_t readingThID;
+        bool isReading;
+        list<buf_data_t *> bufList;
+        buf_data_t *bufData;        /* being played */
+        uint32_t bufPos;
+        snd_pcm_format_t format;
+        uint16_t channels;
+        uint16_t frameBytes;
+        size_t   chunkBytes;
+        uint64_t frames;
+        uint64_t played;
+        ChannelMixer mixer;         /* file layout to device layout */
+        float   *scratch;           /* one period in float, file channels */
+        uint64_t loopStart;         /* bytes into the data, loopEnd 0 without a loop */
+        uint64_t loopEnd;
+        uint32_t loopCount;         /* plays of the loop body, 0 forever */
+        char    *resident;          /* loop body kept after the first pass */
+    };
+
+    WavFile  *openFile(const char *filename);
+    stream_t *openStream(WavFile *wav);
+    void      closeStream(stream_t *s);
+    int       useStream(stream_t *s);
+    void      switchStream();
+    int       setupMixer(stream_t *s, WavFile *file);
+    void      setupLoop(stream_t *s, WavFile *file);
+    size_t    nextFrames(stream_t *s, char **data, size_t maxFrames);
+    void      toFloat(stream_t *s, const char *data, float *dst, size_t frames);
+    void      pullFloat(stream_t *s, float *dst, size_t frames);
+    ssize_t   writeBus(float *bus, size_t frames);
+    int       setupPlanes(stream_t *s);
+    ssize_t   writePlanar(char *data, size_t count);
 
     bool isPlaying;
-    bool isReading;
     FILE *fp;
-    pthread_t readingThID;
+    WavIndex *index;
     pthread_t playingThID;
    
     pthread_mutex_t *lock;
     pthread_cond_t  *cond;
    
     int openMode;    
+    pcm_opener_t opener;
+    void *openerData;
     snd_pcm_t *handle;
     snd_output_t *log;
     snd_pcm_uframes_t chunkSize;    /* unit is frame */
     size_t chunkBytes;    
+    uint32_t rate;
 
     /* for playing */
-    snd_pcm_format_t format;
-    uint16_t bitsPerFrame;
-    uint16_t channels;
+    snd_pcm_format_t format;    /* device format */
+    snd_pcm_format_t fileFormat;
+    uint16_t bitsPerFrame;      /* device frame */
+    uint16_t channels;          /* device channels */
     uint16_t bytesPerSample;
+    uint16_t fileFrameBytes;
+    char *mixBuffer;            /* one period, device channels in file format */
+    GainStage gainStage;
+    Requantizer requant;
+    dither_mode_t ditherMode;
+    char *outBuffer;            /* one period of device frames */
 
-    typedef struct {
-        char *buffer;
-        uint32_t bufSize;
-    } buf_data_t;
-    list<buf_data_t *> bufList;
+    stream_t *cur;
+    stream_t *next;             /* set by crossfade(), guarded by lock */
+    uint64_t fadeFrames;
+    uint64_t fadeStart;         /* frame of cur where the fade begins */
+    fade_curve_t fadeCurve;
+    bool fadeAtEnd;
+    Crossfader fader;
+    Requantizer busRequant;     /* float mix bus to device format */
+    TimeStretch stretch;
+    bool stretching;            /* engaged at the first speed change */
+    float *stretchOut;
+    BiquadChain eq;
+    bool looping;
+    XrunPolicy xrunPolicy;
+    int readAhead;              /* buffers queued per stream, guarded by lock */
+    xrun_callback_t xrunCallback;
+    void *xrunData;
+    char *deviceName;
+    device_caps_t caps;         /* of deviceName, probed once per process */
+    bool capsCached;
+    uint32_t openUs;
+    bool verifying;
+    BitVerifier *verifier;      /* of the last play() */
+    AnalysisTap *nextTap;
+    AnalysisTap *tap;           /* of the last play() */
+    bool planar;
+    bool nonInterleaved;        /* the device takes planes */
+    PlanarBuffer filePlanes;    /* one period, file channels in file format */
+    PlanarBuffer mixPlanes;     /* device channels in file format */
+    PlanarBuffer outPlanes;     /* device channels in device format */
+    bool powerSave;
+    snd_pcm_uframes_t burstFrames;  /* written at once in energy mode */
+    uint64_t framesOut;
+    power_stats_t power;
 };
 #endif
@@ -0,0 +1,385 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "requantizer.h"
+#include "time_stretch.h"
+#include "biquad_chain.h"
+#include "stream_hash.h"
+#include "analysis_tap.h"
+#include "channel_mixer.h"
+#include "gain_stage.h"
+#include "planar.h"
+#include "pcm_utils.h"
+
+#define BENCH_RATE      48000
+#define BENCH_FRAMES    4800        /* 100 ms per call */
+#define BENCH_SECONDS   0.3         /* CPU time spent per case */
+
+typedef struct {
+    const char *name;
+    const char *what;
+    void (*run)();
+} bench_t;
+
+double bench_cpu_time()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_report(const char *what, double seconds, size_t samples)
+{
+    double ns = seconds * 1e9 / samples;
+
+    printf("  %-36s %8.2f ns/sample  %7.4f%% of a core per channel\n",
+           what, ns, ns * BENCH_RATE / 1e7);
+}
+
+/* full scale 997 Hz sine in any format */
+static void *sineBuffer(snd_pcm_format_t format, int channels, size_t frames)
+{
+    float *tmp;
+    void *buf;
+    size_t f;
+    int c;
+
+    tmp = (float *)malloc(frames * channels * sizeof(float));
+    buf = malloc(snd_pcm_format_size(format, frames * channels));
+    for (f = 0; f < frames; f++)
+        for (c = 0; c < channels; c++)
+            tmp[f * channels + c] = 0.9f * sinf(2 * M_PI * 997 * f / BENCH_RATE + c);
+    pcm_from_float(format, tmp, buf, frames * channels);
+    free(tmp);
+
+    return buf;
+}
+
+static void benchDither()
+{
+    static const struct {
+        snd_pcm_format_t in;
+        snd_pcm_format_t out;
+    } cases[] = {
+        { SND_PCM_FORMAT_S32, SND_PCM_FORMAT_S16 },
+        { SND_PCM_FORMAT_FLOAT, SND_PCM_FORMAT_S16 },
+        { SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S16 },
+        { SND_PCM_FORMAT_FLOAT, SND_PCM_FORMAT_S24_3LE },
+    };
+    static const dither_mode_t modes[] = { DITHER_NONE, DITHER_TPDF, DITHER_SHAPED };
+    const int channels = 2;
+    Requantizer *requant;
+    void *in, *out;
+    double start, elapsed;
+    size_t i, m, samples;
+    char what[64];
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        in = sineBuffer(cases[i].in, channels, BENCH_FRAMES);
+        out = malloc(snd_pcm_format_size(cases[i].out, BENCH_FRAMES * channels));
+
+        for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+        {
+            requant = new Requantizer();
+            requant->setup(cases[i].in, cases[i].out, channels, modes[m]);
+
+            samples = 0;
+            start = bench_cpu_time();
+            do
+            {
+                requant->process(in, out, BENCH_FRAMES);
+                samples += BENCH_FRAMES * channels;
+                elapsed = bench_cpu_time() - start;
+            } while (elapsed < BENCH_SECONDS);
+
+            snprintf(what, sizeof(what), "%s -> %s %s",
+                     snd_pcm_format_name(cases[i].in), snd_pcm_format_name(cases[i].out),
+                     Requantizer::modeName(modes[m]));
+            bench_report(what, elapsed, samples);
+            delete requant;
+        }
+
+        free(in);
+        free(out);
+    }
+}
+
+static void benchStretch()
+{
+    static const float speeds[] = { 0.5f, 1.25f, 2.0f };
+    static const int layouts[] = { 2, 6 };
+    TimeStretch *stretch;
+    float *in, *out;
+    double start, elapsed;
+    size_t i, l, n, samples;
+    char what[64];
+
+    for (l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+    {
+        in = (float *)sineBuffer(SND_PCM_FORMAT_FLOAT, layouts[l], BENCH_FRAMES);
+        out = (float *)malloc(2 * BENCH_FRAMES * layouts[l] * sizeof(float));
+
+        for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]); i++)
+        {
+            stretch = new TimeStretch();
+            stretch->setup(layouts[l], BENCH_RATE);
+            stretch->setSpeed(speeds[i]);
+
+            /* per output sample, that is what the device consumes */
+            samples = 0;
+            start = bench_cpu_time();
+            do
+            {
+                stretch->put(in, BENCH_FRAMES);
+                while ((n = stretch->get(out, 2 * BENCH_FRAMES)) > 0)
+                    samples += n * layouts[l];
+                elapsed = bench_cpu_time() - start;
+            } while (elapsed < BENCH_SECONDS);
+
+            snprintf(what, sizeof(what), "%d channels at %.2fx", layouts[l], speeds[i]);
+            bench_report(what, elapsed, samples);
+            delete stretch;
+        }
+
+        free(in);
+        free(out);
+    }
+}
+
+static void benchEq()
+{
+    static const int layouts[] = { 1, 2, 6, 8 };
+    static const int sectionCounts[] = { 1, 5 };
+    BiquadChain *eq;
+    float *buf;
+    double start, elapsed;
+    size_t l, n, samples;
+    int s;
+    char what[64];
+
+    for (l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++)
+    {
+        buf = (float *)sineBuffer(SND_PCM_FORMAT_FLOAT, layouts[l], BENCH_FRAMES);
+
+        for (n = 0; n < sizeof(sectionCounts) / sizeof(sectionCounts[0]); n++)
+        {
+            eq = new BiquadChain();
+            eq->setup(layouts[l], BENCH_RATE);
+            eq->setSection(0, BIQUAD_HIGHPASS, 40, 0.707f, 0);
+            for (s = 1; s < sectionCounts[n]; s++)
+                eq->setSection(s, BIQUAD_PEAK, 62 << (2 * s), 1.4f, s & 1 ? 3 : -3);
+
+            samples = 0;
+            start = bench_cpu_time();
+            do
+            {
+                eq->process(buf, BENCH_FRAMES);
+                samples += BENCH_FRAMES * layouts[l];
+                elapsed = bench_cpu_time() - start;
+            } while (elapsed < BENCH_SECONDS);
+
+            snprintf(what, sizeof(what), "%d channels, %d sections", layouts[l], sectionCounts[n]);
+            bench_report(what, elapsed, samples);
+            delete eq;
+        }
+
+        free(buf);
+    }
+}
+
+/* the player's share of -V: every frame goes through two hashes */
+static void benchHash()
+{
+    static const snd_pcm_format_t formats[] = { SND_PCM_FORMAT_S16, SND_PCM_FORMAT_S24_3LE, SND_PCM_FORMAT_S32 };
+    const int channels = 2;
+    StreamHash block, whole;
+    void *buf;
+    double start, elapsed;
+    size_t i, bytes, samples;
+    char what[64];
+
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        buf = sineBuffer(formats[i], channels, BENCH_FRAMES);
+        bytes = snd_pcm_format_size(formats[i], BENCH_FRAMES * channels);
+
+        samples = 0;
+        start = bench_cpu_time();
+        do
+        {
+            block.update(buf, bytes);
+            whole.update(buf, bytes);
+            samples += BENCH_FRAMES * channels;
+            elapsed = bench_cpu_time() - start;
+        } while (elapsed < BENCH_SECONDS);
+
+        snprintf(what, sizeof(what), "%d bit samples", snd_pcm_format_physical_width(formats[i]));
+        bench_report(what, elapsed, samples);
+        free(buf);
+    }
+}
+
+/* the player's share of an analysis tap, the analysis itself runs elsewhere */
+static void benchTap()
+{
+    static const int channels[] = { 2, 8 };
+    AnalysisTap *tap;
+    void *buf;
+    double start, elapsed;
+    size_t i, samples;
+    char what[64];
+
+    for (i = 0; i < sizeof(channels) / sizeof(channels[0]); i++)
+    {
+        buf = sineBuffer(SND_PCM_FORMAT_S16, channels[i], BENCH_FRAMES);
+        tap = new AnalysisTap();
+        tap->configure(SND_PCM_FORMAT_S16, channels[i], BENCH_RATE);
+
+        samples = 0;
+        start = bench_cpu_time();
+        do
+        {
+            tap->push(buf, BENCH_FRAMES);
+            samples += BENCH_FRAMES * channels[i];
+            elapsed = bench_cpu_time() - start;
+        } while (elapsed < BENCH_SECONDS);
+
+        snprintf(what, sizeof(what), "push, %d channels", channels[i]);
+        bench_report(what, elapsed, samples);
+        delete tap;
+        free(buf);
+    }
+}
+
+/*
+ * The direct path of the player, 24 bits in S32 to a dithered S16 device
+ * through a crossfeed remap and a gain: on interleaved frames as it
+ * runs by default, and on planes, written as they are or joined again.
+ * Both ways must give the same samples, dither included.
+ */
+static void benchPlanar()
+{
+    static const int channels[] = { 2, 8, 32 };
+    static const char *modes[] = { "interleaved", "planar, planes out", "planar, joined" };
+    const snd_pcm_format_t in = SND_PCM_FORMAT_S32, out = SND_PCM_FORMAT_S16;
+    PlanarBuffer filePlanes, mixPlanes, outPlanes;
+    Requantizer requant, planeRequant;
+    ChannelMixer mixer;
+    GainStage gain;
+    float *matrix;
+    void *buf, *mixed, *dst, *joined;
+    double start, elapsed;
+    size_t i, samples;
+    int n, c, mode;
+    char what[64];
+
+    gain.setGain(0.5f, 0);
+    for (i = 0; i < sizeof(channels) / sizeof(channels[0]); i++)
+    {
+        n = channels[i];
+        matrix = (float *)calloc(n * n, sizeof(float));
+        for (c = 0; c < n; c++)
+        {
+            matrix[c * n + c] = 0.8f;
+            matrix[c * n + (c ^ 1) % n] += 0.2f;
+        }
+        mixer.setMatrix(matrix, n, n);
+        requant.setup(in, out, n, DITHER_TPDF);
+        planeRequant.setup(in, out, n, DITHER_TPDF);
+        filePlanes.setup(n, BENCH_FRAMES, 4);
+        mixPlanes.setup(n, BENCH_FRAMES, 4);
+        outPlanes.setup(n, BENCH_FRAMES, 2);
+        buf = sineBuffer(in, n, BENCH_FRAMES);
+        mixed = malloc(BENCH_FRAMES * n * 4);
+        dst = malloc(BENCH_FRAMES * n * 2);
+        joined = malloc(BENCH_FRAMES * n * 2);
+
+        requant.reseed(0);
+        planeRequant.reseed(0);
+        mixer.process(buf, mixed, in, BENCH_FRAMES);
+        gain.process(mixed, in, n, BENCH_FRAMES);
+        requant.process(mixed, dst, BENCH_FRAMES);
+        filePlanes.split(buf, BENCH_FRAMES);
+        mixer.processPlanar(filePlanes.planes(), mixPlanes.planes(), in, BENCH_FRAMES);
+        gain.processPlanar(mixPlanes.planes(), in, n, BENCH_FRAMES);
+        planeRequant.processPlanar(mixPlanes.planes(), outPlanes.planes(), BENCH_FRAMES);
+        outPlanes.join(joined, BENCH_FRAMES);
+        if (memcmp(dst, joined, BENCH_FRAMES * n * 2) != 0)
+            printf("  %d channels: planar output differs from interleaved\n", n);
+
+        for (mode = 0; mode < 3; mode++)
+        {
+            samples = 0;
+            start = bench_cpu_time();
+            do
+            {
+                if (mode == 0)
+                {
+                    mixer.process(buf, mixed, in, BENCH_FRAMES);
+                    gain.process(mixed, in, n, BENCH_FRAMES);
+                    requant.process(mixed, dst, BENCH_FRAMES);
+                }
+                else
+                {
+                    filePlanes.split(buf, BENCH_FRAMES);
+                    mixer.processPlanar(filePlanes.planes(), mixPlanes.planes(), in, BENCH_FRAMES);
+                    gain.processPlanar(mixPlanes.planes(), in, n, BENCH_FRAMES);
+                    planeRequant.processPlanar(mixPlanes.planes(), outPlanes.planes(), BENCH_FRAMES);
+                    if (mode == 2)
+                        outPlanes.join(dst, BENCH_FRAMES);
+                }
+                samples += BENCH_FRAMES * n;
+                elapsed = bench_cpu_time() - start;
+            } while (elapsed < BENCH_SECONDS);
+
+            snprintf(what, sizeof(what), "%d channels, %s", n, modes[mode]);
+            bench_report(what, elapsed, samples);
+        }
+
+        free(matrix);
+        free(buf);
+        free(mixed);
+        free(dst);
+        free(joined);
+    }
+}
+
+static const bench_t benches[] = {
+    { "dither", "requantization to a smaller device format", benchDither },
+    { "stretch", "pitch-preserving time stretch", benchStretch },
+    { "eq", "biquad equalizer chain", benchEq },
+    { "hash", "XXH64 of the frames written while verifying", benchHash },
+    { "tap", "frames handed to the analysis tap", benchTap },
+    { "planar", "direct path on interleaved frames and on planes", benchPlanar },
+};
+
+void bench_list()
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+        printf("  %-10s %s\n", benches[i].name, benches[i].what);
+}
+
+int bench_run(const char *name)
+{
+    size_t i;
+    int found = 0;
+
+    for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+    {
+        if (name && strcmp(name, benches[i].name) != 0)
+            continue;
+        printf("%s: %s\n", benches[i].name, benches[i].what);
+        benches[i].run();
+        found++;
+    }
+
+    return found ? 0 : -1;
+}
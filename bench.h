@@ -0,0 +1,22 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stddef.h>
+
+/*
+ * Micro benchmarks for the per-sample processing stages. Every result is
+ * reported as CPU time per sample and per channel, and as the share of
+ * one core a single channel costs at 48 kHz.
+ */
+
+/* name - run only this benchmark, NULL for all; returns -1 if unknown */
+int  bench_run(const char *name);
+void bench_list();
+
+/* thread CPU time in seconds */
+double bench_cpu_time();
+
+/* print one result line, samples counts every channel */
+void bench_report(const char *what, double seconds, size_t samples);
+
+#endif
@@ -0,0 +1,399 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "biquad_chain.h"
+
+#define SLOT_MASK   3
+#define SLOT_FRESH  4
+
+static const char *typeNames[BIQUAD_TYPES] = {
+    "peak", "lowshelf", "highshelf", "lowpass", "highpass", "bandpass", "notch",
+};
+
+BiquadChain::BiquadChain()
+    : sectionCount(0)
+    , rate(0)
+    , back(2)
+    , middle(1)
+    , front(0)
+    , channels(0)
+    , z1(NULL)
+    , z2(NULL)
+{
+    int i, s;
+
+    pthread_mutex_init(&ctlLock, NULL);
+
+    for (i = 0; i < 3; i++)
+    {
+        slots[i].count = 0;
+        for (s = 0; s < BIQUAD_MAX_SECTIONS; s++)
+            design(NULL, 0, &slots[i], s);
+    }
+}
+
+BiquadChain::~BiquadChain()
+{
+    free(z1);
+    free(z2);
+    pthread_mutex_destroy(&ctlLock);
+}
+
+const char *BiquadChain::typeName(biquad_type_t type)
+{
+    return type < BIQUAD_TYPES ? typeNames[type] : "unknown";
+}
+
+/* RBJ audio EQ cookbook, computed in double. NULL gives a pass-through section. */
+void BiquadChain::design(const section_t *s, uint32_t rate, biquad_coefs_t *c, int index)
+{
+    double A, w0, cw, alpha, sq, b0, b1, b2, a0, a1, a2, freq;
+
+    if (s == NULL)
+    {
+        c->b0[index] = 1.0f;
+        c->b1[index] = c->b2[index] = c->a1[index] = c->a2[index] = 0.0f;
+        return;
+    }
+
+    freq = s->freq < 0.49 * rate ? s->freq : 0.49 * rate;
+    A = pow(10, s->gainDb / 40);
+    w0 = 2 * M_PI * freq / rate;
+    cw = cos(w0);
+    alpha = sin(w0) / (2 * s->q);
+    sq = 2 * sqrt(A) * alpha;
+
+    switch (s->type)
+    {
+    case BIQUAD_LOWSHELF:
+        b0 = A * ((A + 1) - (A - 1) * cw + sq);
+        b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+        b2 = A * ((A + 1) - (A - 1) * cw - sq);
+        a0 = (A + 1) + (A - 1) * cw + sq;
+        a1 = -2 * ((A - 1) + (A + 1) * cw);
+        a2 = (A + 1) + (A - 1) * cw - sq;
+        break;
+    case BIQUAD_HIGHSHELF:
+        b0 = A * ((A + 1) + (A - 1) * cw + sq);
+        b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+        b2 = A * ((A + 1) + (A - 1) * cw - sq);
+        a0 = (A + 1) - (A - 1) * cw + sq;
+        a1 = 2 * ((A - 1) - (A + 1) * cw);
+        a2 = (A + 1) - (A - 1) * cw - sq;
+        break;
+    case BIQUAD_LOWPASS:
+        b0 = b2 = (1 - cw) / 2;
+        b1 = 1 - cw;
+        a0 = 1 + alpha;
+        a1 = -2 * cw;
+        a2 = 1 - alpha;
+        break;
+    case BIQUAD_HIGHPASS:
+        b0 = b2 = (1 + cw) / 2;
+        b1 = -(1 + cw);
+        a0 = 1 + alpha;
+        a1 = -2 * cw;
+        a2 = 1 - alpha;
+        break;
+    case BIQUAD_BANDPASS:
+        b0 = alpha;
+        b1 = 0;
+        b2 = -alpha;
+        a0 = 1 + alpha;
+        a1 = -2 * cw;
+        a2 = 1 - alpha;
+        break;
+    case BIQUAD_NOTCH:
+        b0 = b2 = 1;
+        b1 = -2 * cw;
+        a0 = 1 + alpha;
+        a1 = -2 * cw;
+        a2 = 1 - alpha;
+        break;
+    default:
+        b0 = 1 + alpha * A;
+        b1 = -2 * cw;
+        b2 = 1 - alpha * A;
+        a0 = 1 + alpha / A;
+        a1 = -2 * cw;
+        a2 = 1 - alpha / A;
+        break;
+    }
+
+    c->b0[index] = b0 / a0;
+    c->b1[index] = b1 / a0;
+    c->b2[index] = b2 / a0;
+    c->a1[index] = a1 / a0;
+    c->a2[index] = a2 / a0;
+}
+
+/* under ctlLock: redesign into the back slot and swap it with the middle one */
+void BiquadChain::publish()
+{
+    biquad_coefs_t *c = &slots[back];
+    int s;
+
+    if (rate == 0)
+        return;
+
+    c->count = sectionCount;
+    for (s = 0; s < BIQUAD_MAX_SECTIONS; s++)
+        design(s < sectionCount ? &sections[s] : NULL, rate, c, s);
+
+    back = __atomic_exchange_n(&middle, back | SLOT_FRESH, __ATOMIC_ACQ_REL) & SLOT_MASK;
+}
+
+int BiquadChain::setSection(int index, biquad_type_t type, float freq, float q, float gainDb)
+{
+    if (type >= BIQUAD_TYPES || !(freq > 0) || !(q > 0))
+        return -1;
+
+    pthread_mutex_lock(&ctlLock);
+    if (index < 0 || index > sectionCount || index >= BIQUAD_MAX_SECTIONS)
+    {
+        pthread_mutex_unlock(&ctlLock);
+        return -1;
+    }
+
+    sections[index].type = type;
+    sections[index].freq = freq;
+    sections[index].q = q;
+    sections[index].gainDb = gainDb;
+    if (index == sectionCount)
+        sectionCount++;
+    publish();
+    pthread_mutex_unlock(&ctlLock);
+
+    return 0;
+}
+
+void BiquadChain::setCount(int count)
+{
+    pthread_mutex_lock(&ctlLock);
+    if (count >= 0 && count < sectionCount)
+    {
+        sectionCount = count;
+        publish();
+    }
+    pthread_mutex_unlock(&ctlLock);
+}
+
+int BiquadChain::count()
+{
+    int count;
+
+    pthread_mutex_lock(&ctlLock);
+    count = sectionCount;
+    pthread_mutex_unlock(&ctlLock);
+
+    return count;
+}
+
+int BiquadChain::setup(int channels, uint32_t rate)
+{
+    free(z1);
+    free(z2);
+    z1 = (float *)calloc(BIQUAD_MAX_SECTIONS * channels, sizeof(float));
+    z2 = (float *)calloc(BIQUAD_MAX_SECTIONS * channels, sizeof(float));
+    if (!z1 || !z2)
+        return -1;
+    this->channels = channels;
+
+    pthread_mutex_lock(&ctlLock);
+    this->rate = rate;
+    publish();
+    pthread_mutex_unlock(&ctlLock);
+
+    return 0;
+}
+
+const biquad_coefs_t *BiquadChain::acquire()
+{
+    if (__atomic_load_n(&middle, __ATOMIC_ACQUIRE) & SLOT_FRESH)
+        front = __atomic_exchange_n(&middle, front, __ATOMIC_ACQ_REL) & SLOT_MASK;
+
+    return &slots[front];
+}
+
+bool BiquadChain::isBypassed()
+{
+    return acquire()->count == 0;
+}
+
+/* one channel, buf and state point at it, stride is the channel count */
+static void runScalar(const biquad_coefs_t *k, float *z1, float *z2, int stride,
+                      float *buf, size_t frames)
+{
+    float x, y, s1, s2;
+    float *p;
+    size_t f;
+    int s;
+
+    for (s = 0; s < k->count; s++)
+    {
+        s1 = z1[s * stride];
+        s2 = z2[s * stride];
+        for (f = 0, p = buf; f < frames; f++, p += stride)
+        {
+            x = *p;
+            y = k->b0[s] * x + s1;
+            s1 = k->b1[s] * x - k->a1[s] * y + s2;
+            s2 = k->b2[s] * x - k->a2[s] * y;
+            *p = y;
+        }
+        z1[s * stride] = s1;
+        z2[s * stride] = s2;
+    }
+}
+
+#ifdef __SSE2__
+template <int N> static inline __m128 lanesLoad(const float *p)
+{
+    return N == 4 ? _mm_loadu_ps(p) : _mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)p);
+}
+
+template <int N> static inline void lanesStore(float *p, __m128 v)
+{
+    if (N == 4)
+        _mm_storeu_ps(p, v);
+    else
+        _mm_storel_pi((__m64 *)p, v);
+}
+
+/* N neighbouring channels of interleaved frames in the lanes of one register */
+template <int N> static void runLanes(const biquad_coefs_t *k, float *z1, float *z2, int stride,
+                                      float *buf, size_t frames)
+{
+    __m128 x, y, s1, s2, b0, b1, b2, a1, a2;
+    float *p;
+    size_t f;
+    int s;
+
+    for (s = 0; s < k->count; s++)
+    {
+        b0 = _mm_set1_ps(k->b0[s]);
+        b1 = _mm_set1_ps(k->b1[s]);
+        b2 = _mm_set1_ps(k->b2[s]);
+        a1 = _mm_set1_ps(k->a1[s]);
+        a2 = _mm_set1_ps(k->a2[s]);
+        s1 = lanesLoad<N>(z1 + s * stride);
+        s2 = lanesLoad<N>(z2 + s * stride);
+        for (f = 0, p = buf; f < frames; f++, p += stride)
+        {
+            x = lanesLoad<N>(p);
+            y = _mm_add_ps(_mm_mul_ps(b0, x), s1);
+            s1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, x), _mm_mul_ps(a1, y)), s2);
+            s2 = _mm_sub_ps(_mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+            lanesStore<N>(p, y);
+        }
+        lanesStore<N>(z1 + s * stride, s1);
+        lanesStore<N>(z2 + s * stride, s2);
+    }
+}
+
+/*
+ * One channel through groups of four sections, lane k runs section k one
+ * sample behind lane k - 1. The first and last three steps of a buffer
+ * only commit the state of lanes that hold a real sample, so there is no
+ * added latency.
+ */
+static void runPipelined(const biquad_coefs_t *k, float *z1, float *z2, float *buf, size_t frames)
+{
+    __m128 in, y, n1, n2, s1, s2, b0, b1, b2, a1, a2, mask;
+    size_t step;
+    long lo, hi;
+    int g;
+
+    for (g = 0; g < k->count; g += 4)
+    {
+        b0 = _mm_loadu_ps(k->b0 + g);
+        b1 = _mm_loadu_ps(k->b1 + g);
+        b2 = _mm_loadu_ps(k->b2 + g);
+        a1 = _mm_loadu_ps(k->a1 + g);
+        a2 = _mm_loadu_ps(k->a2 + g);
+        s1 = _mm_loadu_ps(z1 + g);
+        s2 = _mm_loadu_ps(z2 + g);
+        y = _mm_setzero_ps();
+
+        for (step = 0; step < frames + 3; step++)
+        {
+            /* lane k takes what lane k - 1 produced last step */
+            in = _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(y), 4));
+            in = _mm_move_ss(in, _mm_set_ss(step < frames ? buf[step] : 0.0f));
+
+            y = _mm_add_ps(_mm_mul_ps(b0, in), s1);
+            n1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, in), _mm_mul_ps(a1, y)), s2);
+            n2 = _mm_sub_ps(_mm_mul_ps(b2, in), _mm_mul_ps(a2, y));
+
+            if (step >= 3 && step < frames)
+            {
+                s1 = n1;
+                s2 = n2;
+            }
+            else
+            {
+                lo = step >= frames ? (long)(step - frames) + 1 : 0;
+                hi = step < 3 ? (long)step : 3;
+                mask = _mm_castsi128_ps(_mm_set_epi32(lo <= 3 && 3 <= hi ? -1 : 0,
+                                                      lo <= 2 && 2 <= hi ? -1 : 0,
+                                                      lo <= 1 && 1 <= hi ? -1 : 0,
+                                                      lo <= 0 && 0 <= hi ? -1 : 0));
+                s1 = _mm_or_ps(_mm_and_ps(mask, n1), _mm_andnot_ps(mask, s1));
+                s2 = _mm_or_ps(_mm_and_ps(mask, n2), _mm_andnot_ps(mask, s2));
+            }
+
+            if (step >= 3)
+                _mm_store_ss(buf + step - 3, _mm_shuffle_ps(y, y, _MM_SHUFFLE(3, 3, 3, 3)));
+        }
+
+        _mm_storeu_ps(z1 + g, s1);
+        _mm_storeu_ps(z2 + g, s2);
+    }
+}
+#endif
+
+void BiquadChain::process(float *buf, size_t frames)
+{
+    const biquad_coefs_t *k = acquire();
+    size_t i, n;
+    int c = 0;
+
+    if (k->count == 0 || z1 == NULL || frames == 0)
+        return;
+
+#ifdef __SSE2__
+    /* flush to zero and denormals are zero while the recursion runs */
+    unsigned int csr = _mm_getcsr();
+    _mm_setcsr(csr | 0x8040);
+
+    if (channels == 1 && k->count > 1)
+    {
+        runPipelined(k, z1, z2, buf, frames);
+        c = 1;
+    }
+    for (; c + 4 <= channels; c += 4)
+        runLanes<4>(k, z1 + c, z2 + c, channels, buf + c, frames);
+    for (; c + 2 <= channels; c += 2)
+        runLanes<2>(k, z1 + c, z2 + c, channels, buf + c, frames);
+#endif
+    for (; c < channels; c++)
+        runScalar(k, z1 + c, z2 + c, channels, buf + c, frames);
+
+    /* a decaying tail must not leave the state in denormals where FTZ is missing */
+    n = k->count * channels;
+    for (i = 0; i < n; i++)
+    {
+        if (fabsf(z1[i]) < 1e-20f)
+            z1[i] = 0.0f;
+        if (fabsf(z2[i]) < 1e-20f)
+            z2[i] = 0.0f;
+    }
+
+#ifdef __SSE2__
+    _mm_setcsr(csr);
+#endif
+}
@@ -0,0 +1,89 @@
+#ifndef _BIQUAD_CHAIN_H_
+#define _BIQUAD_CHAIN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+#define BIQUAD_MAX_SECTIONS     16
+
+typedef enum {
+    BIQUAD_PEAK = 0,
+    BIQUAD_LOWSHELF,
+    BIQUAD_HIGHSHELF,
+    BIQUAD_LOWPASS,
+    BIQUAD_HIGHPASS,
+    BIQUAD_BANDPASS,
+    BIQUAD_NOTCH,
+    BIQUAD_TYPES
+} biquad_type_t;
+
+/* normalized by a0, laid out by section so four neighbours load as one vector */
+typedef struct {
+    int   count;
+    float b0[BIQUAD_MAX_SECTIONS];
+    float b1[BIQUAD_MAX_SECTIONS];
+    float b2[BIQUAD_MAX_SECTIONS];
+    float a1[BIQUAD_MAX_SECTIONS];
+    float a2[BIQUAD_MAX_SECTIONS];
+} biquad_coefs_t;
+
+/*
+ * Cascade of biquad sections (RBJ cookbook designs) on interleaved float
+ * frames, transposed direct form II. Control threads edit the sections
+ * and publish a new coefficient set through a triple buffer; process()
+ * picks the latest one up at the start of a buffer without taking a lock,
+ * filter state carries over so a change is glitch free for moderate moves.
+ * Channels are filtered four (or two) at a time with SSE, a single channel
+ * with several sections runs the sections as a pipeline instead.
+ */
+class BiquadChain
+{
+public:
+    BiquadChain();
+    virtual ~BiquadChain();
+
+    /* control thread side, index == count() appends */
+    int  setSection(int index, biquad_type_t type, float freq, float q, float gainDb);
+    void setCount(int count);
+    void clear() { setCount(0); }
+    int  count();
+
+    /* audio thread side, setup() also redesigns the sections for the rate */
+    int  setup(int channels, uint32_t rate);
+    void process(float *buf, size_t frames);
+    bool isBypassed();
+
+    static const char *typeName(biquad_type_t type);
+
+private:
+    typedef struct {
+        biquad_type_t type;
+        float freq;
+        float q;
+        float gainDb;
+    } section_t;
+
+    void publish();
+    const biquad_coefs_t *acquire();
+    static void design(const section_t *s, uint32_t rate, biquad_coefs_t *c, int index);
+
+    /* control side, under ctlLock */
+    pthread_mutex_t ctlLock;
+    section_t sections[BIQUAD_MAX_SECTIONS];
+    int      sectionCount;
+    uint32_t rate;
+    int      back;
+
+    /* slot index | FRESH, exchanged by both sides */
+    int      middle;
+
+    /* audio side */
+    biquad_coefs_t slots[3];
+    int      front;
+    int      channels;
+    float   *z1;            /* [section][channel] */
+    float   *z2;
+};
+
+#endif
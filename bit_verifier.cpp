@@ -0,0 +1,305 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bit_verifier.h"
+#include "wav_file.h"
+#include "thread_policy.h"
+
+#define VERIFY_POLL_MS      20      /* file side waiting for the output to catch up */
+
+BitVerifier::BitVerifier()
+    : fd(-1)
+    , dataOffset(0)
+    , fileFrames(0)
+    , frameBytes(0)
+    , fileFrameBytes(0)
+    , sameFrames(false)
+    , blocks(0)
+    , running(false)
+    , digests(NULL)
+    , kept(NULL)
+    , block(0)
+    , inBlock(0)
+    , fed(0)
+    , published(0)
+    , lastFrames(0)
+    , ended(false)
+    , complete(false)
+    , fileHash(0)
+    , mismatch(VERIFY_NONE)
+    , exact(false)
+{
+}
+
+BitVerifier::~BitVerifier()
+{
+    if (running)
+    {
+        end(false);
+        pthread_join(thread, NULL);
+    }
+    if (fd >= 0)
+        close(fd);
+    free(digests);
+    free(kept);
+}
+
+int BitVerifier::start(const char *filename, uint16_t frameBytes)
+{
+    wav_info_t info;
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    if (WavFile::probe(fd, &info) < 0 || info.blockAlign == 0)
+    {
+        fprintf(stderr, "%s: no WAV data to verify against\n", filename);
+        return -1;
+    }
+    posix_fadvise(fd, info.dataOffset, info.dataLength, POSIX_FADV_SEQUENTIAL);
+
+    dataOffset = info.dataOffset;
+    fileFrameBytes = info.blockAlign;
+    fileFrames = info.dataLength / info.blockAlign;
+    this->frameBytes = frameBytes;
+    /* a device that takes other frames can't be bit-perfect from the start */
+    sameFrames = (frameBytes == fileFrameBytes);
+    if (!sameFrames)
+        mismatch = 0;
+    blocks = (fileFrames + VERIFY_BLOCK_FRAMES - 1) / VERIFY_BLOCK_FRAMES;
+
+    digests = (uint64_t *)malloc((blocks + 1) * sizeof(uint64_t));
+    kept = (char *)malloc((size_t)VERIFY_KEPT_BLOCKS * VERIFY_BLOCK_FRAMES * frameBytes);
+    if (digests == NULL || kept == NULL)
+        return -1;
+
+    if (ThreadPolicy::shared()->create(THREAD_IO, &thread, checkingThreadFunc, this) != 0)
+        return -1;
+    running = true;
+
+    return 0;
+}
+
+void BitVerifier::publish()
+{
+    if (block < blocks)
+        digests[block] = blockHash.digest();
+    blockHash.reset();
+    inBlock = 0;
+    __atomic_store_n(&published, ++block, __ATOMIC_RELEASE);
+}
+
+void BitVerifier::feed(const void *frames, size_t count)
+{
+    const char *p = (const char *)frames;
+    size_t n;
+
+    if (ended)
+        return;
+
+    outputHash.update(p, count * frameBytes);
+    fed += count;
+
+    while (count > 0)
+    {
+        n = VERIFY_BLOCK_FRAMES - inBlock;
+        if (n > count)
+            n = count;
+
+        memcpy(kept + ((block % VERIFY_KEPT_BLOCKS) * VERIFY_BLOCK_FRAMES + inBlock) * frameBytes,
+               p, n * frameBytes);
+        blockHash.update(p, n * frameBytes);
+        inBlock += n;
+        p += n * frameBytes;
+        count -= n;
+
+        if (inBlock == VERIFY_BLOCK_FRAMES)
+            publish();
+    }
+}
+
+void BitVerifier::end(bool complete)
+{
+    if (ended)
+        return;
+
+    this->complete = complete;
+    if (inBlock)
+    {
+        lastFrames = inBlock;
+        publish();
+    }
+    __atomic_store_n(&ended, true, __ATOMIC_RELEASE);
+}
+
+int BitVerifier::finish(verify_result_t *result)
+{
+    if (!running && fd < 0)
+        return -1;
+
+    if (running)
+    {
+        pthread_join(thread, NULL);
+        running = false;
+    }
+
+    result->fileFrames = fileFrames;
+    result->frames = fed;
+    result->complete = complete;
+    result->mismatch = mismatch;
+    result->exact = exact;
+    result->fileHash = fileHash;
+    result->outputHash = outputHash.digest();
+
+    return 0;
+}
+
+void *BitVerifier::checkingThreadFunc(void *data)
+{
+    static_cast<BitVerifier *>(data)->checkingTask();
+    return NULL;
+}
+
+/* frames in output block, only the final one may be short */
+uint32_t BitVerifier::outputFrames(uint64_t block)
+{
+    if (lastFrames && block + 1 == __atomic_load_n(&published, __ATOMIC_ACQUIRE))
+        return lastFrames;
+    return VERIFY_BLOCK_FRAMES;
+}
+
+/* waits for end(), a short final block is published right before it */
+bool BitVerifier::endedComplete()
+{
+    while (!__atomic_load_n(&ended, __ATOMIC_ACQUIRE))
+        usleep(VERIFY_POLL_MS * 1000);
+
+    return complete;
+}
+
+bool BitVerifier::readBlock(uint64_t block, char *buf, uint32_t frames)
+{
+    uint64_t offset = dataOffset + block * VERIFY_BLOCK_FRAMES * fileFrameBytes;
+    size_t done = 0, bytes = (size_t)frames * fileFrameBytes;
+    ssize_t n;
+
+    while (done < bytes)
+    {
+        n = pread(fd, buf + done, bytes - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+
+    return true;
+}
+
+/*
+ * Frame by frame through a block whose digests differ, while the ring
+ * still has it. A short final block that matches as far as it goes only
+ * counts when the stream was meant to end there.
+ */
+void BitVerifier::locate(uint64_t block, const char *file, uint32_t count)
+{
+    uint64_t first = block * VERIFY_BLOCK_FRAMES;
+    uint32_t frames = outputFrames(block), f;
+    char *copy;
+
+    copy = (char *)malloc((size_t)VERIFY_BLOCK_FRAMES * frameBytes);
+    if (copy == NULL)
+    {
+        mismatch = first;
+        return;
+    }
+    memcpy(copy, kept + (block % VERIFY_KEPT_BLOCKS) * VERIFY_BLOCK_FRAMES * frameBytes,
+           (size_t)frames * frameBytes);
+
+    /* the player may have moved on and overwritten it meanwhile */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&published, __ATOMIC_ACQUIRE) >= block + VERIFY_KEPT_BLOCKS)
+    {
+        mismatch = first;
+        exact = false;
+        free(copy);
+        return;
+    }
+
+    for (f = 0; f < frames && f < count; f++)
+        if (memcmp(copy + (size_t)f * frameBytes, file + (size_t)f * frameBytes, frameBytes) != 0)
+            break;
+    if (f < frames && f < count)
+        mismatch = first + f;
+    else if (frames > count || (frames < count && endedComplete()))
+        mismatch = first + f;
+    exact = true;
+
+    free(copy);
+}
+
+void BitVerifier::checkingTask()
+{
+    StreamHash file;
+    uint64_t b, done;
+    uint32_t frames;
+    char *buf;
+
+    buf = (char *)malloc((size_t)VERIFY_BLOCK_FRAMES * fileFrameBytes);
+    if (buf == NULL)
+        return;
+
+    for (b = 0; b < blocks; b++)
+    {
+        frames = fileFrames - b * VERIFY_BLOCK_FRAMES < VERIFY_BLOCK_FRAMES ?
+                 fileFrames - b * VERIFY_BLOCK_FRAMES : VERIFY_BLOCK_FRAMES;
+        if (!readBlock(b, buf, frames))
+        {
+            fprintf(stderr, "verify: read error at frame %llu\n",
+                    (unsigned long long)(b * VERIFY_BLOCK_FRAMES));
+            break;
+        }
+        file.update(buf, (size_t)frames * fileFrameBytes);
+        if (mismatch != VERIFY_NONE)
+            continue;
+
+        /* the file side is faster, wait for the output to get this far */
+        while ((done = __atomic_load_n(&published, __ATOMIC_ACQUIRE)) <= b &&
+               !__atomic_load_n(&ended, __ATOMIC_ACQUIRE))
+            usleep(VERIFY_POLL_MS * 1000);
+        done = __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+
+        if (done <= b)
+        {
+            /* output stopped at a block boundary, so it has ended */
+            if (endedComplete())
+            {
+                mismatch = b * VERIFY_BLOCK_FRAMES;
+                exact = true;
+            }
+            continue;
+        }
+
+        if (digests[b] != StreamHash::hash(buf, (size_t)frames * fileFrameBytes))
+            locate(b, buf, frames);
+    }
+    free(buf);
+    fileHash = file.digest();
+
+    /* frames past the end of the file, loops for instance */
+    while (!__atomic_load_n(&ended, __ATOMIC_ACQUIRE))
+        usleep(VERIFY_POLL_MS * 1000);
+    if (mismatch == VERIFY_NONE && fed > fileFrames)
+    {
+        mismatch = fileFrames;
+        exact = true;
+    }
+}
@@ -0,0 +1,88 @@
+#ifndef _BIT_VERIFIER_H_
+#define _BIT_VERIFIER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "stream_hash.h"
+
+#define VERIFY_BLOCK_FRAMES 1024        /* frames per compared digest */
+#define VERIFY_KEPT_BLOCKS  64          /* recent output kept to find the frame in a bad block */
+#define VERIFY_NONE         UINT64_MAX
+
+typedef struct {
+    uint64_t fileFrames;
+    uint64_t frames;        /* handed to the device and compared */
+    bool     complete;      /* the stream played to its end, missing frames count */
+    uint64_t mismatch;      /* first frame that differs, VERIFY_NONE when none */
+    bool     exact;         /* otherwise only the block is known, mismatch is its first frame */
+    uint64_t fileHash;      /* XXH64 of the whole data chunk */
+    uint64_t outputHash;    /* XXH64 of the frames handed over */
+} verify_result_t;
+
+/*
+ * Proves that the frames handed to the device are the file's. The
+ * playing thread hashes what it writes, one digest per block, and keeps
+ * the last few blocks; a thread of its own reads the data chunk through
+ * a separate descriptor, hashes it the same way and compares block by
+ * block as playback goes. A differing block is searched frame by frame
+ * while the output is still kept. The player's cost is a copy and a hash,
+ * well below a percent of a core for any common format.
+ */
+class BitVerifier
+{
+public:
+    BitVerifier();
+    virtual ~BitVerifier();
+
+    /* frameBytes - size of the frames feed() gets, the device frame */
+    int  start(const char *filename, uint16_t frameBytes);
+
+    /* the playing thread */
+    void feed(const void *frames, size_t count);
+    /* no more frames; complete when the file was played to its end */
+    void end(bool complete);
+
+    /* any thread after end(), waits for the file side */
+    int  finish(verify_result_t *result);
+
+    static void *checkingThreadFunc(void *data);
+
+private:
+    void checkingTask();
+    void publish();
+    bool readBlock(uint64_t block, char *buf, uint32_t frames);
+    void locate(uint64_t block, const char *file, uint32_t count);
+    uint32_t outputFrames(uint64_t block);
+    bool     endedComplete();
+
+    int      fd;
+    uint64_t dataOffset;
+    uint64_t fileFrames;
+    uint16_t frameBytes;        /* of the output */
+    uint16_t fileFrameBytes;
+    bool     sameFrames;        /* device frames are file frames */
+    uint64_t blocks;            /* of the file */
+    pthread_t thread;
+    bool     running;
+
+    /* written by the playing thread */
+    StreamHash blockHash;
+    StreamHash outputHash;
+    uint64_t *digests;          /* per output block */
+    char     *kept;             /* VERIFY_KEPT_BLOCKS blocks of output, a ring */
+    uint64_t block;             /* being hashed */
+    uint32_t inBlock;           /* frames of the block being hashed */
+    uint64_t fed;
+    uint64_t published;         /* whole or final blocks, release */
+    uint32_t lastFrames;        /* of the final block when partial */
+    bool     ended;             /* release */
+    bool     complete;          /* read after ended only */
+
+    /* written by the checking thread */
+    uint64_t fileHash;
+    uint64_t mismatch;
+    bool     exact;
+};
+
+#endif
@@ -0,0 +1,446 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel_mixer.h"
+#include "wav_file.h"
+#include "pcm_utils.h"
+
+#define MIXER_BLOCK     256     /* frames converted to float at a time */
+#define M3DB            0.70710678f
+
+#define SPK(x)          WAV_SPEAKER_##x
+
+/*
+ * Where a speaker goes when the output does not have it, first target
+ * that exists wins. Two bits in one target mean a pair that gets the
+ * gain on both sides. Follows ITU-R BS.775 for the 5.1 to stereo case.
+ */
+typedef struct {
+    uint32_t from;
+    struct {
+        uint32_t to;
+        float    gain;
+    } target[4];
+} fold_rule_t;
+
+static const fold_rule_t foldRules[] = {
+    { SPK(FRONT_LEFT),          { { SPK(FRONT_CENTER), M3DB } } },
+    { SPK(FRONT_RIGHT),         { { SPK(FRONT_CENTER), M3DB } } },
+    { SPK(FRONT_CENTER),        { { SPK(FRONT_LEFT) | SPK(FRONT_RIGHT), M3DB } } },
+    { SPK(BACK_LEFT),           { { SPK(SIDE_LEFT), 1.0f }, { SPK(FRONT_LEFT), M3DB },
+                                  { SPK(FRONT_CENTER), M3DB } } },
+    { SPK(BACK_RIGHT),          { { SPK(SIDE_RIGHT), 1.0f }, { SPK(FRONT_RIGHT), M3DB },
+                                  { SPK(FRONT_CENTER), M3DB } } },
+    { SPK(FRONT_LEFT_OF_CENTER),  { { SPK(FRONT_LEFT), 1.0f }, { SPK(FRONT_CENTER), M3DB } } },
+    { SPK(FRONT_RIGHT_OF_CENTER), { { SPK(FRONT_RIGHT), 1.0f }, { SPK(FRONT_CENTER), M3DB } } },
+    { SPK(BACK_CENTER),         { { SPK(BACK_LEFT) | SPK(BACK_RIGHT), M3DB },
+                                  { SPK(SIDE_LEFT) | SPK(SIDE_RIGHT), M3DB },
+                                  { SPK(FRONT_LEFT) | SPK(FRONT_RIGHT), 0.5f },
+                                  { SPK(FRONT_CENTER), M3DB } } },
+    { SPK(SIDE_LEFT),           { { SPK(BACK_LEFT), 1.0f }, { SPK(FRONT_LEFT), M3DB },
+                                  { SPK(FRONT_CENTER), M3DB } } },
+    { SPK(SIDE_RIGHT),          { { SPK(BACK_RIGHT), 1.0f }, { SPK(FRONT_RIGHT), M3DB },
+                                  { SPK(FRONT_CENTER), M3DB } } },
+    { SPK(TOP_CENTER),          { { SPK(FRONT_CENTER), M3DB },
+                                  { SPK(FRONT_LEFT) | SPK(FRONT_RIGHT), 0.5f } } },
+    { SPK(TOP_FRONT_LEFT),      { { SPK(FRONT_LEFT), M3DB }, { SPK(FRONT_CENTER), 0.5f } } },
+    { SPK(TOP_FRONT_CENTER),    { { SPK(FRONT_CENTER), M3DB },
+                                  { SPK(FRONT_LEFT) | SPK(FRONT_RIGHT), 0.5f } } },
+    { SPK(TOP_FRONT_RIGHT),     { { SPK(FRONT_RIGHT), M3DB }, { SPK(FRONT_CENTER), 0.5f } } },
+    { SPK(TOP_BACK_LEFT),       { { SPK(BACK_LEFT), M3DB }, { SPK(SIDE_LEFT), M3DB },
+                                  { SPK(FRONT_LEFT), 0.5f }, { SPK(FRONT_CENTER), 0.5f } } },
+    { SPK(TOP_BACK_CENTER),     { { SPK(BACK_LEFT) | SPK(BACK_RIGHT), 0.5f },
+                                  { SPK(FRONT_LEFT) | SPK(FRONT_RIGHT), 0.5f },
+                                  { SPK(FRONT_CENTER), 0.5f } } },
+    { SPK(TOP_BACK_RIGHT),      { { SPK(BACK_RIGHT), M3DB }, { SPK(SIDE_RIGHT), M3DB },
+                                  { SPK(FRONT_RIGHT), 0.5f }, { SPK(FRONT_CENTER), 0.5f } } },
+    /* LOW_FREQUENCY has no rule and is dropped when the output lacks it */
+};
+
+static int findSpeaker(const uint32_t *pos, int channels, uint32_t bit)
+{
+    int c;
+
+    for (c = 0; c < channels; c++)
+        if (pos[c] == bit)
+            return c;
+    return -1;
+}
+
+/* add gain from input 'in' to every speaker in bits, only if all exist */
+static bool feed(float *row0, int nIn, int in, const uint32_t *outPos, int nOut,
+                 uint32_t bits, float gain)
+{
+    uint32_t bit;
+    int o;
+
+    for (bit = bits; bit; bit &= bit - 1)
+        if (findSpeaker(outPos, nOut, bit & -bit) < 0)
+            return false;
+
+    for (bit = bits; bit; bit &= bit - 1)
+    {
+        o = findSpeaker(outPos, nOut, bit & -bit);
+        row0[o * nIn + in] += gain;
+    }
+    return true;
+}
+
+/* channel counts known at compile time so the loops unroll and vectorize */
+template <int IN, int OUT>
+static void mixFixed(const float *__restrict matrix, const float *__restrict in,
+                     float *__restrict out, size_t frames, int, int)
+{
+    size_t f;
+    int i, o;
+
+    for (f = 0; f < frames; f++, in += IN, out += OUT)
+    {
+        for (o = 0; o < OUT; o++)
+        {
+            float acc = 0;
+            for (i = 0; i < IN; i++)
+                acc += matrix[o * IN + i] * in[i];
+            out[o] = acc;
+        }
+    }
+}
+
+static void mixAny(const float *__restrict matrix, const float *__restrict in,
+                   float *__restrict out, size_t frames, int nIn, int nOut)
+{
+    size_t f;
+    int i, o;
+
+    for (f = 0; f < frames; f++, in += nIn, out += nOut)
+    {
+        for (o = 0; o < nOut; o++)
+        {
+            const float *row = matrix + o * nIn;
+            float acc = 0;
+            for (i = 0; i < nIn; i++)
+                acc += row[i] * in[i];
+            out[o] = acc;
+        }
+    }
+}
+
+/* a row at a time over whole planes, each tap a contiguous multiply-add */
+static void mixPlanes(const float *matrix, float *const *in, float *const *out,
+                      size_t frames, int nIn, int nOut)
+{
+    size_t f;
+    int i, o;
+    bool first;
+
+    for (o = 0; o < nOut; o++)
+    {
+        float *__restrict y = out[o];
+
+        first = true;
+        for (i = 0; i < nIn; i++)
+        {
+            const float *__restrict x = in[i];
+            float m = matrix[o * nIn + i];
+
+            if (m == 0)
+                continue;
+            if (first)
+                for (f = 0; f < frames; f++)
+                    y[f] = m * x[f];
+            else
+                for (f = 0; f < frames; f++)
+                    y[f] += m * x[f];
+            first = false;
+        }
+        if (first)
+            memset(y, 0, frames * sizeof(float));
+    }
+}
+
+static const struct {
+    int in;
+    int out;
+    ChannelMixer::mix_func_t func;
+} mixKernels[] = {
+    { 2, 1, mixFixed<2, 1> },
+    { 4, 2, mixFixed<4, 2> },
+    { 6, 2, mixFixed<6, 2> },
+    { 8, 2, mixFixed<8, 2> },
+    { 8, 6, mixFixed<8, 6> },
+    { 6, 8, mixFixed<6, 8> },
+};
+
+ChannelMixer::ChannelMixer()
+    : nIn(0)
+    , nOut(0)
+    , matrix(NULL)
+    , identity(true)
+    , permutation(true)
+    , mix(mixAny)
+    , inScratch(NULL)
+    , outScratch(NULL)
+{
+}
+
+ChannelMixer::~ChannelMixer()
+{
+    free(matrix);
+    free(inScratch);
+    free(outScratch);
+}
+
+uint32_t ChannelMixer::defaultMask(int channels)
+{
+    switch (channels)
+    {
+    case 1: return SPK(FRONT_CENTER);
+    case 2: return 0x3;     /* L R */
+    case 3: return 0x7;     /* L R C */
+    case 4: return 0x33;    /* L R Bl Br */
+    case 5: return 0x37;    /* L R C Bl Br */
+    case 6: return 0x3f;    /* L R C LFE Bl Br */
+    case 7: return 0x13f;   /* L R C LFE Bl Br Bc */
+    case 8: return 0x63f;   /* L R C LFE Bl Br Sl Sr */
+    default: return 0;
+    }
+}
+
+void ChannelMixer::maskPositions(uint32_t mask, int channels, uint32_t *pos)
+{
+    int c;
+
+    for (c = 0; c < channels; c++)
+    {
+        pos[c] = mask & -mask;
+        mask &= mask - 1;
+    }
+}
+
+int ChannelMixer::allocate(int inChannels, int outChannels)
+{
+    if (inChannels < 1 || inChannels > MIXER_MAX_CHANNELS ||
+        outChannels < 1 || outChannels > MIXER_MAX_CHANNELS)
+    {
+        fprintf(stderr, "unsupported channel counts %d -> %d\n", inChannels, outChannels);
+        return -1;
+    }
+
+    free(matrix);
+    free(inScratch);
+    free(outScratch);
+    matrix = (float *)calloc(inChannels * outChannels, sizeof(float));
+    inScratch = (float *)malloc(MIXER_BLOCK * inChannels * sizeof(float));
+    outScratch = (float *)malloc(MIXER_BLOCK * outChannels * sizeof(float));
+    if (!matrix || !inScratch || !outScratch)
+    {
+        nIn = nOut = 0;
+        return -1;
+    }
+
+    nIn = inChannels;
+    nOut = outChannels;
+    return 0;
+}
+
+int ChannelMixer::setup(const uint32_t *inPos, int inChannels,
+                        const uint32_t *outPos, int outChannels, bool normalize)
+{
+    size_t r;
+    float sum, peak;
+    int i, o, t;
+
+    if (allocate(inChannels, outChannels) < 0)
+        return -1;
+
+    for (i = 0; i < nIn; i++)
+    {
+        uint32_t p = inPos[i];
+
+        if (p == 0)
+        {
+            /* no position, keep it on the same index */
+            if (i < nOut)
+                matrix[i * nIn + i] = 1.0f;
+            continue;
+        }
+
+        if (feed(matrix, nIn, i, outPos, nOut, p, 1.0f))
+            continue;
+
+        /* a mono source goes to both sides at full level */
+        if (nIn == 1 && p == SPK(FRONT_CENTER) &&
+            feed(matrix, nIn, i, outPos, nOut, SPK(FRONT_LEFT) | SPK(FRONT_RIGHT), 1.0f))
+            continue;
+
+        for (r = 0; r < sizeof(foldRules) / sizeof(foldRules[0]); r++)
+        {
+            if (foldRules[r].from != p)
+                continue;
+            for (t = 0; t < 4 && foldRules[r].target[t].to; t++)
+            {
+                if (feed(matrix, nIn, i, outPos, nOut, foldRules[r].target[t].to,
+                         foldRules[r].target[t].gain))
+                    break;
+            }
+            break;
+        }
+    }
+
+    if (normalize)
+    {
+        peak = 0;
+        for (o = 0; o < nOut; o++)
+        {
+            sum = 0;
+            for (i = 0; i < nIn; i++)
+                sum += fabsf(matrix[o * nIn + i]);
+            if (sum > peak)
+                peak = sum;
+        }
+        if (peak > 1.0f)
+            for (i = 0; i < nIn * nOut; i++)
+                matrix[i] /= peak;
+    }
+
+    analyze();
+    return 0;
+}
+
+int ChannelMixer::setMatrix(const float *coefs, int inChannels, int outChannels)
+{
+    if (allocate(inChannels, outChannels) < 0)
+        return -1;
+
+    memcpy(matrix, coefs, nIn * nOut * sizeof(float));
+    analyze();
+    return 0;
+}
+
+void ChannelMixer::analyze()
+{
+    size_t k;
+    int i, o;
+
+    identity = (nIn == nOut);
+    permutation = true;
+    for (o = 0; o < nOut; o++)
+    {
+        route[o] = -1;
+        for (i = 0; i < nIn; i++)
+        {
+            float m = matrix[o * nIn + i];
+
+            if (m != (o == i ? 1.0f : 0.0f))
+                identity = false;
+            if (m == 0)
+                continue;
+            if (m != 1.0f || route[o] >= 0)
+                permutation = false;
+            route[o] = i;
+        }
+    }
+
+    mix = mixAny;
+    for (k = 0; k < sizeof(mixKernels) / sizeof(mixKernels[0]); k++)
+        if (mixKernels[k].in == nIn && mixKernels[k].out == nOut)
+            mix = mixKernels[k].func;
+}
+
+int ChannelMixer::process(const void *in, void *out, snd_pcm_format_t format, size_t frames)
+{
+    const char *src = (const char *)in;
+    char *dst = (char *)out;
+    char silence[8];
+    size_t f, n, width;
+    int o;
+
+    if (identity)
+    {
+        if (in != out)
+            memcpy(out, in, snd_pcm_format_size(format, frames * nIn));
+        return 0;
+    }
+
+    if (permutation)
+    {
+        /* sample copies, bit exact for any format */
+        width = snd_pcm_format_physical_width(format) / 8;
+        snd_pcm_format_set_silence(format, silence, 1);
+        for (f = 0; f < frames; f++, src += nIn * width)
+        {
+            for (o = 0; o < nOut; o++, dst += width)
+            {
+                if (route[o] >= 0)
+                    memcpy(dst, src + route[o] * width, width);
+                else
+                    memcpy(dst, silence, width);
+            }
+        }
+        return 0;
+    }
+
+    if (format == SND_PCM_FORMAT_FLOAT)
+    {
+        mix(matrix, (const float *)in, (float *)out, frames, nIn, nOut);
+        return 0;
+    }
+
+    for (f = 0; f < frames; f += n)
+    {
+        n = frames - f < MIXER_BLOCK ? frames - f : MIXER_BLOCK;
+        if (pcm_to_float(format, src + snd_pcm_format_size(format, f * nIn), inScratch, n * nIn) < 0)
+            return -1;
+        mix(matrix, inScratch, outScratch, n, nIn, nOut);
+        pcm_from_float(format, outScratch, dst + snd_pcm_format_size(format, f * nOut), n * nOut);
+    }
+
+    return 0;
+}
+
+int ChannelMixer::processPlanar(void *const *in, void *const *out, snd_pcm_format_t format, size_t frames)
+{
+    float *inPlanes[MIXER_MAX_CHANNELS], *outPlanes[MIXER_MAX_CHANNELS];
+    size_t f, n, bytes = snd_pcm_format_size(format, frames);
+    int i, o;
+
+    if (identity || permutation)
+    {
+        /* whole planes copied, bit exact for any format */
+        for (o = 0; o < nOut; o++)
+        {
+            i = identity ? o : route[o];
+            if (i < 0)
+                snd_pcm_format_set_silence(format, out[o], frames);
+            else if (in[i] != out[o])
+                memcpy(out[o], in[i], bytes);
+        }
+        return 0;
+    }
+
+    if (format == SND_PCM_FORMAT_FLOAT)
+    {
+        mixPlanes(matrix, (float *const *)in, (float *const *)out, frames, nIn, nOut);
+        return 0;
+    }
+
+    for (i = 0; i < nIn; i++)
+        inPlanes[i] = inScratch + i * MIXER_BLOCK;
+    for (o = 0; o < nOut; o++)
+        outPlanes[o] = outScratch + o * MIXER_BLOCK;
+
+    for (f = 0; f < frames; f += n)
+    {
+        n = frames - f < MIXER_BLOCK ? frames - f : MIXER_BLOCK;
+        for (i = 0; i < nIn; i++)
+            if (pcm_to_float(format, (char *)in[i] + snd_pcm_format_size(format, f), inPlanes[i], n) < 0)
+                return -1;
+        mixPlanes(matrix, inPlanes, outPlanes, n, nIn, nOut);
+        for (o = 0; o < nOut; o++)
+            pcm_from_float(format, outPlanes[o], (char *)out[o] + snd_pcm_format_size(format, f), n);
+    }
+
+    return 0;
+}
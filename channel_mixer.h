@@ -0,0 +1,69 @@
+#ifndef _CHANNEL_MIXER_H_
+#define _CHANNEL_MIXER_H_
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+#define MIXER_MAX_CHANNELS  64
+
+/*
+ * Remaps, downmixes or upmixes interleaved frames between two speaker
+ * layouts. Speaker positions are WAV_SPEAKER_* bits, one per channel, 0
+ * for a channel without a known position. Setup builds an out x in gain
+ * matrix; a matrix that only moves channels around is applied as a plain
+ * copy so the samples stay bit exact, anything else is mixed in float.
+ */
+class ChannelMixer
+{
+public:
+    ChannelMixer();
+    virtual ~ChannelMixer();
+
+    /*
+     * normalize - scale the matrix down so that no output can exceed full
+     *             scale when every input it takes is at full scale
+     */
+    int  setup(const uint32_t *inPos, int inChannels,
+               const uint32_t *outPos, int outChannels, bool normalize = true);
+
+    /* custom out x in matrix, row major */
+    int  setMatrix(const float *matrix, int inChannels, int outChannels);
+
+    /* in and out have the same sample format, out holds frames * outChannels */
+    int  process(const void *in, void *out, snd_pcm_format_t format, size_t frames);
+
+    /* the same on planes, one per channel; the matrix skips its zeros here */
+    int  processPlanar(void *const *in, void *const *out, snd_pcm_format_t format, size_t frames);
+    /* back to pass through */
+    void reset() { identity = true; }
+
+    bool isIdentity() { return identity; }
+    int  inChannels() { return nIn; }
+    int  outChannels() { return nOut; }
+    float coef(int out, int in) { return matrix[out * nIn + in]; }
+
+    /* usual layout for a channel count when the file has no channel mask */
+    static uint32_t defaultMask(int channels);
+    /* one position per channel, channels past the mask get 0 */
+    static void maskPositions(uint32_t mask, int channels, uint32_t *pos);
+
+    typedef void (*mix_func_t)(const float *matrix, const float *in, float *out,
+                               size_t frames, int inChannels, int outChannels);
+
+private:
+    int  allocate(int inChannels, int outChannels);
+    void analyze();
+
+    int    nIn;
+    int    nOut;
+    float *matrix;
+    int    route[MIXER_MAX_CHANNELS];  /* input copied to each output, -1 silence */
+    bool   identity;
+    bool   permutation;
+    mix_func_t mix;
+
+    float *inScratch;
+    float *outScratch;
+};
+
+#endif
@@ -0,0 +1,355 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "clip_cache.h"
+#include "wav_file.h"
+#include "channel_mixer.h"
+
+static int64_t statTime(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+ClipCache::ClipCache(size_t limit)
+    : maxBytes(limit)
+    , usedBytes(0)
+    , hitCount(0)
+    , missCount(0)
+    , evictCount(0)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+ClipCache::~ClipCache()
+{
+    list<clip_t *>::iterator it;
+
+    /* clips still held by a voice are left to their release() */
+    pthread_mutex_lock(&lock);
+    for (it = clips.begin(); it != clips.end(); ++it)
+    {
+        (*it)->cached = false;
+        if ((*it)->refs == 0)
+            destroy(*it);
+    }
+    clips.clear();
+    pthread_mutex_unlock(&lock);
+
+    pthread_mutex_destroy(&lock);
+}
+
+ClipCache *ClipCache::shared()
+{
+    static ClipCache cache;
+
+    return &cache;
+}
+
+uint64_t ClipCache::hashPath(const char *path)
+{
+    uint64_t hash = 14695981039346656037ULL;    /* FNV-1a */
+
+    for (; *path; path++)
+    {
+        hash ^= (uint8_t)*path;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+void ClipCache::setLimit(size_t bytes)
+{
+    pthread_mutex_lock(&lock);
+    maxBytes = bytes;
+    trim();
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Reads the whole file through the channel mixer and the requantizer into
+ * an anonymous mapping that is made read-only before anyone sees it.
+ */
+clip_t *ClipCache::decode(const char *path, snd_pcm_format_t format, int channels, uint32_t rate,
+                          dither_mode_t dither)
+{
+    uint32_t inPos[MIXER_MAX_CHANNELS], outPos[MIXER_MAX_CHANNELS];
+    WavFile wav;
+    ChannelMixer mixer;
+    Requantizer requant;
+    clip_t *clip;
+    char *map, *buf = NULL, *mixBuf = NULL, *src;
+    size_t mapSize, fileFrameBytes, n;
+    uint64_t done;
+    ssize_t bytes;
+    uint32_t mask;
+
+    if (wav.open(path) < 0)
+        return NULL;
+
+    if ((uint32_t)wav.rate() != rate)
+    {
+        fprintf(stderr, "%s: need %u Hz, file has %d Hz\n", path, rate, wav.rate());
+        return NULL;
+    }
+    if (wav.frames() == 0)
+        return NULL;
+
+    if (wav.channels() > MIXER_MAX_CHANNELS || channels > MIXER_MAX_CHANNELS)
+    {
+        if (wav.channels() != channels)
+            return NULL;
+    }
+    else
+    {
+        mask = wav.channelMask();
+        if (mask == 0)
+            mask = ChannelMixer::defaultMask(wav.channels());
+        ChannelMixer::maskPositions(mask, wav.channels(), inPos);
+        ChannelMixer::maskPositions(ChannelMixer::defaultMask(channels), channels, outPos);
+        if (mixer.setup(inPos, wav.channels(), outPos, channels) < 0)
+            return NULL;
+    }
+
+    if (requant.setup(wav.pcmFormat(), format, channels, dither) < 0)
+        return NULL;
+
+    clip = (clip_t *)calloc(1, sizeof(clip_t));
+    clip->format = format;
+    clip->channels = channels;
+    clip->rate = rate;
+    clip->frames = wav.frames();
+    clip->frameBytes = snd_pcm_format_size(format, channels);
+    mapSize = clip->frames * clip->frameBytes;
+
+    fileFrameBytes = wav.frameBytes();
+    map = (char *)mmap(NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    buf = (char *)malloc(CLIP_DECODE_FRAMES * fileFrameBytes);
+    if (!mixer.isIdentity())
+        mixBuf = (char *)malloc(snd_pcm_format_size(wav.pcmFormat(), CLIP_DECODE_FRAMES * channels));
+    if (map == MAP_FAILED || buf == NULL || (!mixer.isIdentity() && mixBuf == NULL))
+        goto fail;
+    clip->data = map;
+    clip->mapSize = mapSize;
+
+    for (done = 0; done < clip->frames; done += n)
+    {
+        bytes = wav.readData(buf, CLIP_DECODE_FRAMES * fileFrameBytes);
+        if (bytes <= 0)
+            break;
+        n = bytes / fileFrameBytes;
+
+        src = buf;
+        if (!mixer.isIdentity())
+        {
+            mixer.process(buf, mixBuf, wav.pcmFormat(), n);
+            src = mixBuf;
+        }
+        if (requant.process(src, map + done * clip->frameBytes, n) < 0)
+            goto fail;
+    }
+    if (done < clip->frames)
+    {
+        fprintf(stderr, "%s: short read\n", path);
+        goto fail;
+    }
+
+    mprotect(map, mapSize, PROT_READ);
+    free(buf);
+    free(mixBuf);
+
+    return clip;
+
+fail:
+    if (map != MAP_FAILED)
+        munmap(map, mapSize);
+    free(buf);
+    free(mixBuf);
+    free(clip);
+
+    return NULL;
+}
+
+void ClipCache::destroy(clip_t *clip)
+{
+    munmap((void *)clip->data, clip->mapSize);
+    free(clip->path);
+    free(clip);
+}
+
+clip_t *ClipCache::find(uint64_t hash, const char *path, const struct stat *st,
+                        snd_pcm_format_t format, int channels, uint32_t rate)
+{
+    list<clip_t *>::iterator it, stale;
+    clip_t *clip;
+
+    for (it = clips.begin(); it != clips.end(); )
+    {
+        clip = *it;
+        if (clip->pathHash != hash || strcmp(clip->path, path) != 0)
+        {
+            ++it;
+            continue;
+        }
+
+        if (clip->mtime != statTime(st) || clip->fileSize != (uint64_t)st->st_size)
+        {
+            /* the file was replaced, voices finish the old sound */
+            stale = it++;
+            unlist(stale);
+            continue;
+        }
+
+        if (clip->format == format && clip->channels == channels && clip->rate == rate)
+        {
+            clips.splice(clips.begin(), clips, it);
+            return clip;
+        }
+        ++it;
+    }
+
+    return NULL;
+}
+
+void ClipCache::unlist(list<clip_t *>::iterator it)
+{
+    clip_t *clip = *it;
+
+    clips.erase(it);
+    clip->cached = false;
+    usedBytes -= clip->mapSize;
+    if (clip->refs == 0)
+        destroy(clip);
+}
+
+/* least recently used first, skipping what is being played */
+void ClipCache::trim()
+{
+    list<clip_t *>::iterator it;
+
+    it = clips.end();
+    while (usedBytes > maxBytes && it != clips.begin())
+    {
+        --it;
+        if ((*it)->refs > 0)
+            continue;
+
+        unlist(it++);
+        evictCount++;
+    }
+}
+
+const clip_t *ClipCache::acquire(const char *path, snd_pcm_format_t format, int channels,
+                                 uint32_t rate, dither_mode_t dither)
+{
+    struct stat st;
+    uint64_t hash;
+    clip_t *clip, *found;
+
+    if (stat(path, &st) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    hash = hashPath(path);
+
+    pthread_mutex_lock(&lock);
+    clip = find(hash, path, &st, format, channels, rate);
+    if (clip)
+    {
+        clip->refs++;
+        hitCount++;
+        pthread_mutex_unlock(&lock);
+        return clip;
+    }
+    pthread_mutex_unlock(&lock);
+
+    /* decoded without the lock, hits on other clips go on meanwhile */
+    clip = decode(path, format, channels, rate, dither);
+    if (clip == NULL)
+        return NULL;
+    clip->path = strdup(path);
+    clip->pathHash = hash;
+    clip->mtime = statTime(&st);
+    clip->fileSize = st.st_size;
+    clip->refs = 1;
+    clip->cached = true;
+
+    pthread_mutex_lock(&lock);
+    missCount++;
+    found = find(hash, path, &st, format, channels, rate);
+    if (found)
+    {
+        /* someone else decoded it first */
+        found->refs++;
+        pthread_mutex_unlock(&lock);
+        destroy(clip);
+        return found;
+    }
+    clips.push_front(clip);
+    usedBytes += clip->mapSize;
+    trim();
+    pthread_mutex_unlock(&lock);
+
+    return clip;
+}
+
+void ClipCache::release(const clip_t *clip)
+{
+    clip_t *c = (clip_t *)clip;
+
+    if (c == NULL)
+        return;
+
+    pthread_mutex_lock(&lock);
+    if (--c->refs == 0)
+    {
+        if (!c->cached)
+            destroy(c);
+        else
+            trim();
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void ClipCache::flush()
+{
+    list<clip_t *>::iterator it;
+
+    pthread_mutex_lock(&lock);
+    for (it = clips.begin(); it != clips.end(); )
+    {
+        if ((*it)->refs > 0)
+        {
+            ++it;
+            continue;
+        }
+        unlist(it++);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+size_t ClipCache::size()
+{
+    size_t bytes;
+
+    pthread_mutex_lock(&lock);
+    bytes = usedBytes;
+    pthread_mutex_unlock(&lock);
+
+    return bytes;
+}
+
+uint32_t ClipCache::count()
+{
+    uint32_t n;
+
+    pthread_mutex_lock(&lock);
+    n = clips.size();
+    pthread_mutex_unlock(&lock);
+
+    return n;
+}
@@ -0,0 +1,90 @@
+#ifndef _CLIP_CACHE_H_
+#define _CLIP_CACHE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <alsa/asoundlib.h>
+
+#include <list>
+using namespace std;
+
+#include "requantizer.h"
+
+#define CLIP_CACHE_LIMIT    (64 * 1024 * 1024)  /* default memory cap in bytes */
+#define CLIP_DECODE_FRAMES  4096
+
+/* one decoded file, read-only once published */
+typedef struct {
+    char    *path;
+    uint64_t pathHash;
+    int64_t  mtime;         /* nanoseconds */
+    uint64_t fileSize;
+    snd_pcm_format_t format;
+    int      channels;
+    uint32_t rate;
+    uint64_t frames;
+    size_t   frameBytes;
+    const char *data;       /* frames * frameBytes, mapped read-only */
+    size_t   mapSize;
+    uint32_t refs;          /* guarded by the cache lock */
+    bool     cached;        /* still listed, freed on the last release otherwise */
+} clip_t;
+
+/*
+ * Process-wide cache of short files decoded to a device format. Entries
+ * are keyed by path, mtime and size plus the target format, shared by
+ * every voice that plays them and dropped least recently used first once
+ * the cache holds more than its limit. Clips still being played are never
+ * freed under a voice; an evicted or replaced clip goes with its last
+ * release().
+ */
+class ClipCache
+{
+public:
+    ClipCache(size_t limit = CLIP_CACHE_LIMIT);
+    virtual ~ClipCache();
+
+    static ClipCache *shared();
+
+    void   setLimit(size_t bytes);
+    size_t limit() { return maxBytes; }
+
+    /*
+     * The clip of path converted to format and channels, decoded on a
+     * miss. The file must have the given rate. Every successful acquire()
+     * needs a release().
+     */
+    const clip_t *acquire(const char *path, snd_pcm_format_t format, int channels, uint32_t rate,
+                          dither_mode_t dither = DITHER_TPDF);
+    void   release(const clip_t *clip);
+    /* drop whatever no voice holds */
+    void   flush();
+
+    size_t   size();
+    uint32_t count();
+    uint32_t hits() { return __atomic_load_n(&hitCount, __ATOMIC_RELAXED); }
+    uint32_t misses() { return __atomic_load_n(&missCount, __ATOMIC_RELAXED); }
+    uint32_t evictions() { return __atomic_load_n(&evictCount, __ATOMIC_RELAXED); }
+
+private:
+    static uint64_t hashPath(const char *path);
+    static clip_t  *decode(const char *path, snd_pcm_format_t format, int channels, uint32_t rate,
+                           dither_mode_t dither);
+    static void     destroy(clip_t *clip);
+
+    clip_t *find(uint64_t hash, const char *path, const struct stat *st,
+                 snd_pcm_format_t format, int channels, uint32_t rate);
+    void    unlist(list<clip_t *>::iterator it);
+    void    trim();
+
+    list<clip_t *> clips;   /* most recently used first */
+    size_t   maxBytes;
+    size_t   usedBytes;
+    uint32_t hitCount;
+    uint32_t missCount;
+    uint32_t evictCount;
+    pthread_mutex_t lock;
+};
+
+#endif
@@ -0,0 +1,368 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clip_player.h"
+#include "thread_policy.h"
+#include "pcm_utils.h"
+
+ClipPlayer::ClipPlayer(ClipCache *cache)
+    : cache(cache ? cache : ClipCache::shared())
+    , handle(NULL)
+    , sampleFormat(SND_PCM_FORMAT_UNKNOWN)
+    , numChannels(0)
+    , sampleRate(0)
+    , period(0)
+    , frameBytes(0)
+    , ditherMode(DITHER_TPDF)
+    , maxVoices(16)
+    , maxPerClip(4)
+    , nextId(0)
+    , bus(NULL)
+    , scratch(NULL)
+    , out(NULL)
+    , mixThID(0)
+    , running(false)
+    , stealCount(0)
+    , xruns(0)
+    , worstLatency(0)
+{
+    memset(voices, 0, sizeof(voices));
+    pthread_mutex_init(&lock, NULL);
+}
+
+ClipPlayer::~ClipPlayer()
+{
+    close();
+    pthread_mutex_destroy(&lock);
+}
+
+void* ClipPlayer::mixThreadFunc(void *data)
+{
+    static_cast<ClipPlayer *>(data)->mixTask();
+
+    return NULL;
+}
+
+int ClipPlayer::openDevice(const char *device)
+{
+    unsigned int channels = numChannels, rate = sampleRate;
+    snd_pcm_uframes_t periodSize;
+
+    /* short periods and only a couple of them, latency over robustness */
+    if (pcm_open_playback(&handle, device, sampleFormat, &channels, &rate,
+                          CLIP_PERIOD_US, CLIP_PERIODS, &periodSize) < 0)
+        return -1;
+
+    numChannels = channels;
+    sampleRate = rate;
+    period = periodSize;
+
+    return 0;
+}
+
+int ClipPlayer::open(const char *device, snd_pcm_format_t format, int channels, uint32_t rate)
+{
+    if (handle)
+        return -1;
+
+    sampleFormat = format;
+    numChannels = channels;
+    sampleRate = rate;
+    if (openDevice(device) < 0)
+    {
+        close();
+        return -1;
+    }
+
+    frameBytes = snd_pcm_format_size(sampleFormat, numChannels);
+    bus = (float *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO, period * numChannels * sizeof(float));
+    scratch = (float *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO, period * numChannels * sizeof(float));
+    out = (char *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO, period * frameBytes);
+    if (bus == NULL || scratch == NULL || out == NULL ||
+        busRequant.setup(SND_PCM_FORMAT_FLOAT, sampleFormat, numChannels, ditherMode) < 0)
+    {
+        close();
+        return -1;
+    }
+
+    running = true;
+    if (ThreadPolicy::shared()->create(THREAD_AUDIO, &mixThID, mixThreadFunc, this) != 0)
+    {
+        mixThID = 0;
+        close();
+        return -1;
+    }
+
+    return 0;
+}
+
+void ClipPlayer::close()
+{
+    int v;
+
+    if (mixThID)
+    {
+        __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+        pthread_join(mixThID, NULL);
+        mixThID = 0;
+    }
+
+    if (handle)
+    {
+        snd_pcm_drop(handle);
+        snd_pcm_close(handle);
+        handle = NULL;
+    }
+
+    for (v = 0; v < CLIP_MAX_VOICES; v++)
+        freeVoice(&voices[v]);
+
+    ThreadPolicy::freeLocal(bus);
+    ThreadPolicy::freeLocal(scratch);
+    ThreadPolicy::freeLocal(out);
+    bus = scratch = NULL;
+    out = NULL;
+}
+
+void ClipPlayer::setVoices(int polyphony, int perClip)
+{
+    pthread_mutex_lock(&lock);
+    maxVoices = polyphony < 1 ? 1 : polyphony > CLIP_MAX_VOICES ? CLIP_MAX_VOICES : polyphony;
+    maxPerClip = perClip < 1 ? maxVoices : perClip;
+    pthread_mutex_unlock(&lock);
+}
+
+void ClipPlayer::freeVoice(clip_voice_t *v)
+{
+    if (v->clip)
+        cache->release(v->clip);
+    v->clip = NULL;
+}
+
+int ClipPlayer::preload(const char *filename)
+{
+    const clip_t *clip;
+
+    if (handle == NULL)
+        return -1;
+
+    clip = cache->acquire(filename, sampleFormat, numChannels, sampleRate, ditherMode);
+    if (clip == NULL)
+        return -1;
+    cache->release(clip);
+
+    return 0;
+}
+
+int ClipPlayer::trigger(const char *filename, float gain)
+{
+    const clip_t *clip, *old = NULL;
+    clip_voice_t *v, *slot = NULL, *oldest = NULL, *oldestSame = NULL;
+    int i, same = 0, id;
+
+    if (handle == NULL)
+        return -1;
+
+    /* a hit is a stat() and a list walk, a miss decodes here and not in the mixer */
+    clip = cache->acquire(filename, sampleFormat, numChannels, sampleRate, ditherMode);
+    if (clip == NULL)
+        return -1;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < maxVoices; i++)
+    {
+        v = &voices[i];
+        if (v->clip == NULL)
+        {
+            if (slot == NULL)
+                slot = v;
+            continue;
+        }
+        if (oldest == NULL || v->id < oldest->id)
+            oldest = v;
+        if (v->clip == clip)
+        {
+            same++;
+            if (oldestSame == NULL || v->id < oldestSame->id)
+                oldestSame = v;
+        }
+    }
+
+    if (same >= maxPerClip)
+        slot = oldestSame;
+    else if (slot == NULL)
+        slot = oldest;
+    if (slot->clip)
+    {
+        old = slot->clip;
+        stealCount++;
+    }
+
+    slot->clip = clip;
+    slot->pos = 0;
+    slot->gain = gain;
+    slot->stopping = false;
+    slot->started = false;
+    clock_gettime(CLOCK_MONOTONIC, &slot->triggered);
+    id = slot->id = ++nextId;
+    pthread_mutex_unlock(&lock);
+
+    if (old)
+        cache->release(old);
+
+    return id;
+}
+
+void ClipPlayer::stop(int voice)
+{
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < CLIP_MAX_VOICES; i++)
+        if (voices[i].clip && voices[i].id == voice)
+            voices[i].stopping = true;
+    pthread_mutex_unlock(&lock);
+}
+
+void ClipPlayer::stopAll()
+{
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < CLIP_MAX_VOICES; i++)
+        voices[i].stopping = true;
+    pthread_mutex_unlock(&lock);
+}
+
+int ClipPlayer::active()
+{
+    int i, n = 0;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < CLIP_MAX_VOICES; i++)
+        if (voices[i].clip)
+            n++;
+    pthread_mutex_unlock(&lock);
+
+    return n;
+}
+
+/* called as the first period of v goes to the device */
+void ClipPlayer::noteLatency(clip_voice_t *v)
+{
+    struct timespec now;
+    snd_pcm_sframes_t delay;
+    int64_t us;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - v->triggered.tv_sec) * 1000000LL + (now.tv_nsec - v->triggered.tv_nsec) / 1000;
+    if (snd_pcm_delay(handle, &delay) == 0 && delay > 0)
+        us += (int64_t)delay * 1000000 / sampleRate;
+
+    if (us > worstLatency)
+        __atomic_store_n(&worstLatency, (uint32_t)us, __ATOMIC_RELAXED);
+}
+
+/* one period of every voice into out */
+void ClipPlayer::mix()
+{
+    const clip_t *done[CLIP_MAX_VOICES];
+    clip_voice_t *v, *only = NULL;
+    size_t n, f, c;
+    float g, step;
+    int i, count = 0, finished = 0;
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < CLIP_MAX_VOICES; i++)
+    {
+        if (voices[i].clip)
+        {
+            only = &voices[i];
+            count++;
+        }
+    }
+
+    if (count == 0)
+    {
+        pthread_mutex_unlock(&lock);
+        snd_pcm_format_set_silence(sampleFormat, out, period * numChannels);
+        return;
+    }
+
+    if (count == 1 && only->gain == 1.0f && !only->stopping)
+    {
+        /* a single voice goes out exactly as decoded */
+        n = only->clip->frames - only->pos;
+        if (n > period)
+            n = period;
+        memcpy(out, only->clip->data + only->pos * frameBytes, n * frameBytes);
+        if (n < period)
+            snd_pcm_format_set_silence(sampleFormat, out + n * frameBytes, (period - n) * numChannels);
+    }
+    else
+    {
+        memset(bus, 0, period * numChannels * sizeof(float));
+        for (i = 0; i < CLIP_MAX_VOICES; i++)
+        {
+            v = &voices[i];
+            if (v->clip == NULL)
+                continue;
+
+            n = v->clip->frames - v->pos;
+            if (n > period)
+                n = period;
+            pcm_to_float(sampleFormat, v->clip->data + v->pos * frameBytes, scratch, n * numChannels);
+
+            g = v->gain;
+            step = v->stopping ? g / period : 0;
+            for (f = 0; f < n; f++, g -= step)
+                for (c = 0; c < (size_t)numChannels; c++)
+                    bus[f * numChannels + c] += scratch[f * numChannels + c] * g;
+        }
+        busRequant.process(bus, out, period);
+    }
+
+    for (i = 0; i < CLIP_MAX_VOICES; i++)
+    {
+        v = &voices[i];
+        if (v->clip == NULL)
+            continue;
+
+        if (!v->started)
+        {
+            noteLatency(v);
+            v->started = true;
+        }
+
+        v->pos += period;
+        if (v->pos >= v->clip->frames || v->stopping)
+        {
+            done[finished++] = v->clip;
+            v->clip = NULL;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < finished; i++)
+        cache->release(done[i]);
+}
+
+void ClipPlayer::mixTask()
+{
+    int err;
+
+    while (pcm_wait_room(handle, period, &running, &xruns) == 0)
+    {
+        mix();
+
+        err = pcm_write_recover(handle, out, period, &xruns);
+        if (err < 0)
+        {
+            fprintf(stderr, "clip write error: %s\n", snd_strerror(err));
+            break;
+        }
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef _CLIP_PLAYER_H_
+#define _CLIP_PLAYER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#include "clip_cache.h"
+#include "requantizer.h"
+
+#define CLIP_PERIOD_US      5000    /* mixing granularity, bounds trigger latency */
+#define CLIP_PERIODS        2       /* device buffer, in periods */
+#define CLIP_MAX_VOICES     64
+
+typedef struct {
+    const clip_t *clip;     /* NULL for a free slot */
+    uint64_t pos;           /* next frame */
+    float    gain;
+    int      id;
+    bool     stopping;      /* ramps out over the next period */
+    bool     started;
+    struct timespec triggered;
+} clip_voice_t;
+
+/*
+ * Plays short sounds from the clip cache on a device that stays open.
+ * The mixing thread fills one period at a time just before the device
+ * needs it, so a trigger is heard after at most one period of waiting plus
+ * the one period queued ahead of it. Voices past the polyphony, or past
+ * the limit for one clip, take over the oldest voice.
+ */
+class ClipPlayer
+{
+public:
+    /* cache - NULL for ClipCache::shared() */
+    ClipPlayer(ClipCache *cache = NULL);
+    virtual ~ClipPlayer();
+
+    int  open(const char *device = "default", snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE,
+              int channels = 2, uint32_t rate = 48000);
+    void close();
+    bool isOpen() { return handle != NULL; }
+
+    /* polyphony - voices at once, perClip - voices of the same clip at once */
+    void setVoices(int polyphony, int perClip);
+    void setDither(dither_mode_t mode) { ditherMode = mode; }
+
+    /* decode ahead of the first trigger */
+    int  preload(const char *filename);
+    /* voice id, or -1 when the file can't be played; any thread */
+    int  trigger(const char *filename, float gain = 1.0f);
+    void stop(int voice);
+    void stopAll();
+
+    int      active();
+    uint32_t stolen() { return __atomic_load_n(&stealCount, __ATOMIC_RELAXED); }
+    uint32_t underruns() { return __atomic_load_n(&xruns, __ATOMIC_RELAXED); }
+    /* longest trigger to first sample at the speaker seen so far */
+    uint32_t maxLatencyUs() { return __atomic_load_n(&worstLatency, __ATOMIC_RELAXED); }
+
+    snd_pcm_format_t format() { return sampleFormat; }
+    int      channels() { return numChannels; }
+    uint32_t rate() { return sampleRate; }
+    size_t   periodFrames() { return period; }
+
+private:
+    static void *mixThreadFunc(void *data);
+    void mixTask();
+
+    int  openDevice(const char *device);
+    void mix();
+    void noteLatency(clip_voice_t *v);
+    void freeVoice(clip_voice_t *v);
+
+    ClipCache *cache;
+    snd_pcm_t *handle;
+    snd_pcm_format_t sampleFormat;
+    int      numChannels;
+    uint32_t sampleRate;
+    size_t   period;
+    size_t   frameBytes;
+    dither_mode_t ditherMode;
+
+    clip_voice_t voices[CLIP_MAX_VOICES];
+    int      maxVoices;
+    int      maxPerClip;
+    int      nextId;
+    pthread_mutex_t lock;
+
+    float   *bus;
+    float   *scratch;
+    char    *out;
+    Requantizer busRequant;
+
+    pthread_t mixThID;
+    bool     running;
+    uint32_t stealCount;
+    uint32_t xruns;
+    uint32_t worstLatency;
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crossfade.h"
+
+Crossfader::Crossfader()
+    : channels(0)
+    , maxFrames(0)
+    , curve(FADE_EQUAL_POWER)
+    , length(0)
+    , pos(0)
+    , a(NULL)
+    , b(NULL)
+    , out(NULL)
+    , gainA(NULL)
+    , gainB(NULL)
+{
+}
+
+Crossfader::~Crossfader()
+{
+    free(a);
+    free(b);
+    free(out);
+    free(gainA);
+    free(gainB);
+}
+
+const char *Crossfader::curveName(fade_curve_t curve)
+{
+    switch (curve)
+    {
+    case FADE_LINEAR:   return "linear";
+    case FADE_S_CURVE:  return "s-curve";
+    default:            return "equal-power";
+    }
+}
+
+int Crossfader::setup(int channels, size_t maxFrames)
+{
+    free(a);
+    free(b);
+    free(out);
+    free(gainA);
+    free(gainB);
+    a = (float *)malloc(maxFrames * channels * sizeof(float));
+    b = (float *)malloc(maxFrames * channels * sizeof(float));
+    out = (float *)malloc(maxFrames * channels * sizeof(float));
+    gainA = (float *)malloc(maxFrames * sizeof(float));
+    gainB = (float *)malloc(maxFrames * sizeof(float));
+    if (!a || !b || !out || !gainA || !gainB)
+        return -1;
+
+    this->channels = channels;
+    this->maxFrames = maxFrames;
+    length = 0;
+    return 0;
+}
+
+void Crossfader::start(uint64_t frames, fade_curve_t curve)
+{
+    this->curve = curve;
+    length = frames > 0 ? frames : 1;
+    pos = 0;
+}
+
+/* envelope of both sides for the next frames, only touched during a fade */
+void Crossfader::gains(size_t frames, size_t offset)
+{
+    const float step = 1.0f / length;
+    size_t f;
+    float x;
+
+    for (f = 0; f < offset; f++)
+    {
+        gainA[f] = 1.0f;
+        gainB[f] = 0.0f;
+    }
+
+    for (; f < frames; f++)
+    {
+        x = (pos + f - offset) * step;
+        if (x >= 1.0f)
+        {
+            gainA[f] = 0.0f;
+            gainB[f] = 1.0f;
+            continue;
+        }
+
+        switch (curve)
+        {
+        case FADE_LINEAR:
+            gainB[f] = x;
+            gainA[f] = 1.0f - x;
+            break;
+        case FADE_S_CURVE:
+            gainB[f] = x * x * (3.0f - 2.0f * x);
+            gainA[f] = 1.0f - gainB[f];
+            break;
+        default:
+            gainB[f] = sinf(x * (float)M_PI_2);
+            gainA[f] = cosf(x * (float)M_PI_2);
+            break;
+        }
+    }
+}
+
+float *Crossfader::mix(size_t frames, size_t offset)
+{
+    const float *__restrict pa = a;
+    const float *__restrict pb = b;
+    float *__restrict po = out;
+    size_t f, i;
+    int c;
+
+    if (frames > maxFrames)
+        frames = maxFrames;
+    gains(frames, offset);
+
+    if (channels == 2)
+    {
+        for (f = 0, i = 0; f < frames; f++, i += 2)
+        {
+            po[i] = pa[i] * gainA[f] + pb[i] * gainB[f];
+            po[i + 1] = pa[i + 1] * gainA[f] + pb[i + 1] * gainB[f];
+        }
+    }
+    else
+    {
+        for (f = 0, i = 0; f < frames; f++, i += channels)
+            for (c = 0; c < channels; c++)
+                po[i + c] = pa[i + c] * gainA[f] + pb[i + c] * gainB[f];
+    }
+
+    if (frames > offset)
+        pos += frames - offset;
+
+    return out;
+}
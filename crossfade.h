@@ -0,0 +1,62 @@
+#ifndef _CROSSFADE_H_
+#define _CROSSFADE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+    FADE_LINEAR = 0,        /* constant sum of gains, dips 3 dB halfway for uncorrelated material */
+    FADE_EQUAL_POWER,       /* sin/cos, constant power */
+    FADE_S_CURVE,           /* smoothstep, gentle at both ends */
+} fade_curve_t;
+
+/*
+ * Mix bus of a transition between two streams. The caller fills busA()
+ * with the outgoing and busB() with the incoming stream, both as float
+ * frames in the device channel layout, and mix() blends them.
+ */
+class Crossfader
+{
+public:
+    Crossfader();
+    virtual ~Crossfader();
+
+    int  setup(int channels, size_t maxFrames);
+    void start(uint64_t frames, fade_curve_t curve);
+    void stop() { length = 0; }
+    /* jump into a running fade, for rendering pieces of it out of order */
+    void seek(uint64_t frame) { pos = frame; }
+
+    bool isActive() { return length > 0; }
+    bool isDone() { return pos >= length; }
+    uint64_t position() { return pos; }
+
+    float *busA() { return a; }
+    float *busB() { return b; }
+
+    /*
+     * A * fadeOut + B * fadeIn for frames, the first 'offset' frames are
+     * still before the fade and take A only. Advances the position and
+     * returns the mixed frames.
+     */
+    float *mix(size_t frames, size_t offset);
+
+    static const char *curveName(fade_curve_t curve);
+
+private:
+    void gains(size_t frames, size_t offset);
+
+    int      channels;
+    size_t   maxFrames;
+    fade_curve_t curve;
+    uint64_t length;
+    uint64_t pos;
+
+    float *a;
+    float *b;
+    float *out;
+    float *gainA;       /* per frame */
+    float *gainB;
+};
+
+#endif
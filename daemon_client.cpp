@@ -0,0 +1,342 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "daemon_client.h"
+
+DaemonClient::DaemonClient()
+    : sockFd(-1)
+    , outFormat(SND_PCM_FORMAT_UNKNOWN)
+    , outChannels(0)
+    , outRate(0)
+    , ringStream(-1)
+    , ring(NULL)
+    , data(NULL)
+    , mapSize(0)
+    , capacity(0)
+    , frameBytes(0)
+    , head(0)
+    , eventFd(-1)
+{
+}
+
+DaemonClient::~DaemonClient()
+{
+    close();
+}
+
+int DaemonClient::connect(const char *socketPath)
+{
+    struct sockaddr_un addr;
+    daemon_request_t req;
+    daemon_reply_t reply;
+
+    if (sockFd >= 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+
+    sockFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sockFd < 0 || ::connect(sockFd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", socketPath, strerror(errno));
+        close();
+        return -1;
+    }
+
+    /* any reply carries the output format */
+    memset(&req, 0, sizeof(req));
+    req.type = DAEMON_STATS;
+    req.stream = -1;
+    if (request(&req, &reply) < 0)
+    {
+        close();
+        return -1;
+    }
+
+    return 0;
+}
+
+void DaemonClient::close()
+{
+    closeStream();
+    if (sockFd >= 0)
+    {
+        ::close(sockFd);
+        sockFd = -1;
+    }
+}
+
+/* number of descriptors that came with the reply, -1 when the daemon is gone */
+int DaemonClient::request(daemon_request_t *req, daemon_reply_t *reply, int *fds, int count)
+{
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int received = 0, passed[2], i, n;
+    ssize_t r;
+
+    if (sockFd < 0 || send(sockFd, req, sizeof(*req), MSG_NOSIGNAL) != (ssize_t)sizeof(*req))
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = reply;
+    iov.iov_len = sizeof(*reply);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    do
+        r = recvmsg(sockFd, &msg, MSG_CMSG_CLOEXEC);
+    while (r < 0 && errno == EINTR);
+    if (r != (ssize_t)sizeof(*reply))
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        if (n > 2)
+            n = 2;
+        memcpy(passed, CMSG_DATA(cmsg), n * sizeof(int));
+        for (i = 0; i < n; i++)
+        {
+            /* nothing asked for is kept open */
+            if (received < count)
+                fds[received++] = passed[i];
+            else
+                ::close(passed[i]);
+        }
+    }
+
+    outFormat = reply->format;
+    outChannels = reply->channels;
+    outRate = reply->rate;
+
+    return received;
+}
+
+/*
+ * The ring arrives as a memfd; its header is believed only as far as
+ * it agrees with the size of the memfd.
+ */
+int DaemonClient::openStream(snd_pcm_format_t format, int channels, uint32_t rate, uint32_t ringMs)
+{
+    daemon_request_t req;
+    daemon_reply_t reply;
+    struct stat st;
+    int fds[2], n, i;
+    void *mem;
+
+    if (sockFd < 0 || ring)
+        return -1;
+
+    memset(&req, 0, sizeof(req));
+    req.type = DAEMON_OPEN_STREAM;
+    req.format = format;
+    req.channels = channels;
+    req.rate = rate;
+    req.ringMs = ringMs;
+    n = request(&req, &reply, fds, 2);
+    if (n < 0)
+        return -1;
+    if (reply.status < 0 || n != 2)
+    {
+        for (i = 0; i < n; i++)
+            ::close(fds[i]);
+        fprintf(stderr, "daemon refused the stream: %s\n", strerror(reply.status < 0 ? -reply.status : EPROTO));
+        return -1;
+    }
+
+    mem = MAP_FAILED;
+    if (fstat(fds[0], &st) == 0 && st.st_size > DAEMON_RING_HEADER)
+        mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    ::close(fds[0]);
+    if (mem == MAP_FAILED)
+    {
+        ::close(fds[1]);
+        return -1;
+    }
+
+    ring = (daemon_ring_t *)mem;
+    data = (char *)mem + DAEMON_RING_HEADER;
+    mapSize = st.st_size;
+    capacity = ring->capacity;
+    frameBytes = ring->frameBytes;
+    eventFd = fds[1];
+    head = 0;
+    if (ring->magic != DAEMON_RING_MAGIC || frameBytes == 0 ||
+        capacity % frameBytes || capacity != mapSize - DAEMON_RING_HEADER)
+    {
+        fprintf(stderr, "daemon sent a broken ring\n");
+        closeStream();
+        return -1;
+    }
+
+    return ringStream = reply.status;
+}
+
+void DaemonClient::closeStream()
+{
+    if (ring)
+        munmap(ring, mapSize);
+    if (eventFd >= 0)
+        ::close(eventFd);
+    ring = NULL;
+    data = NULL;
+    eventFd = -1;
+    ringStream = -1;
+}
+
+size_t DaemonClient::writable(void **ptr)
+{
+    uint64_t tail, space, pos;
+
+    if (ring == NULL)
+        return 0;
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    space = capacity - (head - tail);
+    pos = head % capacity;
+    if (space > capacity - pos)
+        space = capacity - pos;
+    *ptr = data + pos;
+
+    return space / frameBytes;
+}
+
+void DaemonClient::produce(size_t frames)
+{
+    struct timespec ts;
+
+    head += frames * frameBytes;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    daemon_ring_stamp(ring, head, ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+int DaemonClient::wait()
+{
+    uint64_t tail, count;
+
+    if (ring == NULL)
+        return -1;
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail)
+    {
+        if (__atomic_load_n(&ring->ended, __ATOMIC_ACQUIRE))
+            return -1;
+        if (read(eventFd, &count, sizeof(count)) < 0 && errno != EINTR)
+            return -1;
+    }
+
+    return 0;
+}
+
+ssize_t DaemonClient::write(const void *buf, size_t frames, bool block)
+{
+    const char *src = (const char *)buf;
+    size_t done = 0, n;
+    void *ptr;
+
+    if (ring == NULL || __atomic_load_n(&ring->ended, __ATOMIC_ACQUIRE))
+        return -1;
+
+    while (done < frames)
+    {
+        n = writable(&ptr);
+        if (n == 0)
+        {
+            if (!block || wait() < 0)
+                break;
+            continue;
+        }
+        if (n > frames - done)
+            n = frames - done;
+        memcpy(ptr, src + done * frameBytes, n * frameBytes);
+        produce(n);
+        done += n;
+    }
+
+    return done;
+}
+
+int DaemonClient::finish()
+{
+    uint64_t count;
+
+    if (ring == NULL)
+        return -1;
+
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&ring->ended, __ATOMIC_ACQUIRE))
+    {
+        if (read(eventFd, &count, sizeof(count)) < 0 && errno != EINTR)
+            return -1;
+    }
+
+    return 0;
+}
+
+int DaemonClient::playFile(const char *filename)
+{
+    daemon_request_t req;
+    daemon_reply_t reply;
+
+    memset(&req, 0, sizeof(req));
+    req.type = DAEMON_PLAY_FILE;
+    if (strlen(filename) >= sizeof(req.path))
+        return -1;
+    strcpy(req.path, filename);
+    if (request(&req, &reply) < 0)
+        return -1;
+    if (reply.status < 0)
+    {
+        fprintf(stderr, "%s: daemon can't play it: %s\n", filename, strerror(-reply.status));
+        return -1;
+    }
+
+    return reply.status;
+}
+
+int DaemonClient::stop(int stream)
+{
+    daemon_request_t req;
+    daemon_reply_t reply;
+
+    memset(&req, 0, sizeof(req));
+    req.type = DAEMON_STOP;
+    req.stream = stream;
+    if (request(&req, &reply) < 0 || reply.status < 0)
+        return -1;
+
+    return 0;
+}
+
+int DaemonClient::stats(int stream, daemon_stats_t *stats)
+{
+    daemon_request_t req;
+    daemon_reply_t reply;
+
+    memset(&req, 0, sizeof(req));
+    req.type = DAEMON_STATS;
+    req.stream = stream;
+    if (request(&req, &reply) < 0 || reply.status < 0)
+        return -1;
+    *stats = reply.stats;
+
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef _DAEMON_CLIENT_H_
+#define _DAEMON_CLIENT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <alsa/asoundlib.h>
+
+#include "daemon_protocol.h"
+
+/*
+ * Talks to a PlayDaemon. A stream opened here is a ring shared with the
+ * daemon: writable() hands out the free part of it so samples can be
+ * decoded or generated in place, produce() publishes them. write() is the
+ * copying shortcut on top of the two.
+ */
+class DaemonClient
+{
+public:
+    DaemonClient();
+    virtual ~DaemonClient();
+
+    int  connect(const char *socketPath = DAEMON_SOCKET);
+    void close();
+
+    /* stream id, or -1; rate has to be the daemon's */
+    int  openStream(snd_pcm_format_t format, int channels, uint32_t rate, uint32_t ringMs = 200);
+    /* contiguous free frames at *ptr, 0 when the ring is full */
+    size_t writable(void **ptr);
+    void produce(size_t frames);
+    /* sleeps until the daemon takes something, -1 once it ended the stream */
+    int  wait();
+    /* frames taken, -1 once the daemon ended the stream */
+    ssize_t write(const void *buf, size_t frames, bool block = true);
+    /* nothing more follows, wait until the daemon played the rest */
+    int  finish();
+    void closeStream();
+
+    /* the daemon reads and plays filename itself; stream id or -1 */
+    int  playFile(const char *filename);
+    int  stop(int stream);
+    int  stats(int stream, daemon_stats_t *stats);
+
+    int  streamId() { return ringStream; }
+    snd_pcm_format_t outputFormat() { return (snd_pcm_format_t)outFormat; }
+    int      outputChannels() { return outChannels; }
+    uint32_t outputRate() { return outRate; }
+
+private:
+    int  request(daemon_request_t *req, daemon_reply_t *reply, int *fds = NULL, int count = 0);
+
+    int      sockFd;
+    uint32_t outFormat;
+    uint32_t outChannels;
+    uint32_t outRate;
+
+    int      ringStream;
+    daemon_ring_t *ring;
+    char    *data;
+    size_t   mapSize;
+    uint64_t capacity;
+    uint32_t frameBytes;
+    uint64_t head;
+    int      eventFd;
+};
+
+#endif
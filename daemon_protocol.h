@@ -0,0 +1,100 @@
+#ifndef _DAEMON_PROTOCOL_H_
+#define _DAEMON_PROTOCOL_H_
+
+#include <stdint.h>
+
+#include "wav_file.h"
+
+/*
+ * Between PlayDaemon and DaemonClient. Requests and replies are single
+ * SOCK_SEQPACKET messages on a unix socket; the reply to OPEN_STREAM
+ * carries the memfd of the ring and an eventfd as SCM_RIGHTS. Samples
+ * never cross the socket: the client writes them into the ring and the
+ * daemon mixes them straight out of it.
+ */
+
+#define DAEMON_SOCKET       "/tmp/aplayer.sock"
+#define DAEMON_RING_MAGIC   COMPOSE('A', 'P', 'D', 'R')
+#define DAEMON_RING_HEADER  4096        /* samples start here in the memfd */
+#define DAEMON_MAX_PATH     1024
+
+typedef enum {
+    DAEMON_OPEN_STREAM = 1,     /* PCM through a shared ring */
+    DAEMON_PLAY_FILE,           /* the daemon reads path itself */
+    DAEMON_STOP,
+    DAEMON_STATS,
+} daemon_request_type_t;
+
+typedef struct {
+    uint32_t type;              /* DAEMON_* */
+    int32_t  stream;            /* STOP and STATS */
+    uint32_t format;            /* snd_pcm_format_t, OPEN_STREAM */
+    uint32_t channels;
+    uint32_t rate;              /* has to be the output rate */
+    uint32_t ringMs;
+    char     path[DAEMON_MAX_PATH];
+} daemon_request_t;
+
+typedef struct {
+    uint64_t frames;            /* mixed into the output so far */
+    uint64_t cpuNs;             /* daemon CPU time spent on the stream */
+    uint32_t underruns;         /* periods the ring could not fill */
+    uint32_t latencyUs;         /* latest write to output */
+    uint32_t maxLatencyUs;
+    uint32_t active;            /* 0 once played out or stopped */
+} daemon_stats_t;
+
+typedef struct {
+    int32_t  status;            /* stream id, or -errno */
+    uint32_t format;            /* of the output */
+    uint32_t channels;
+    uint32_t rate;
+    daemon_stats_t stats;
+} daemon_reply_t;
+
+/*
+ * Head of every ring memfd. Positions are byte counts that only grow;
+ * the data area is a whole number of frames, so no frame is ever split
+ * by the wrap.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t frameBytes;
+    uint64_t capacity;          /* data bytes */
+    uint64_t head;              /* written by the producer */
+    uint64_t tail;              /* written by the daemon */
+    uint32_t closed;            /* producer done, play out and end */
+    uint32_t ended;             /* set by the daemon, nothing more is taken */
+    uint32_t waiting;           /* producer sleeps on the eventfd */
+    uint32_t stampSeq;          /* seqlock, odd while the stamp changes */
+    uint64_t stampPos;          /* head after a write ... */
+    uint64_t stampNs;           /* ... and when it happened, CLOCK_MONOTONIC */
+} daemon_ring_t;
+
+/* producer side, after head moved to pos */
+static inline void daemon_ring_stamp(daemon_ring_t *ring, uint64_t pos, uint64_t ns)
+{
+    uint32_t seq = ring->stampSeq;
+
+    __atomic_store_n(&ring->stampSeq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&ring->stampPos, pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->stampNs, ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->stampSeq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* false when the producer was in the middle of a new stamp */
+static inline bool daemon_ring_read_stamp(const daemon_ring_t *ring, uint64_t *pos, uint64_t *ns)
+{
+    uint32_t seq = __atomic_load_n(&ring->stampSeq, __ATOMIC_ACQUIRE);
+
+    if (seq & 1)
+        return false;
+    *pos = __atomic_load_n(&ring->stampPos, __ATOMIC_RELAXED);
+    *ns = __atomic_load_n(&ring->stampNs, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&ring->stampSeq, __ATOMIC_RELAXED) == seq;
+}
+
+#endif
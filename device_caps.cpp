@@ -0,0 +1,130 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "device_caps.h"
+
+DeviceCaps::DeviceCaps()
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+DeviceCaps::~DeviceCaps()
+{
+    list<entry_t>::iterator it;
+
+    for (it = entries.begin(); it != entries.end(); ++it)
+        free(it->device);
+    pthread_mutex_destroy(&lock);
+}
+
+DeviceCaps *DeviceCaps::shared()
+{
+    static DeviceCaps caps;
+
+    return &caps;
+}
+
+bool DeviceCaps::find(const char *device, device_caps_t *caps)
+{
+    list<entry_t>::iterator it;
+    bool found = false;
+
+    pthread_mutex_lock(&lock);
+    for (it = entries.begin(); it != entries.end(); ++it)
+    {
+        if (strcmp(it->device, device) == 0)
+        {
+            *caps = it->caps;
+            found = true;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    return found;
+}
+
+void DeviceCaps::store(const char *device, const device_caps_t *caps)
+{
+    entry_t entry;
+
+    forget(device);
+
+    entry.device = strdup(device);
+    entry.caps = *caps;
+    pthread_mutex_lock(&lock);
+    entries.push_back(entry);
+    pthread_mutex_unlock(&lock);
+}
+
+void DeviceCaps::forget(const char *device)
+{
+    list<entry_t>::iterator it;
+
+    pthread_mutex_lock(&lock);
+    for (it = entries.begin(); it != entries.end(); ++it)
+    {
+        if (strcmp(it->device, device) == 0)
+        {
+            free(it->device);
+            entries.erase(it);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* limits a driver does not report are left wide open */
+int DeviceCaps::probe(snd_pcm_t *handle, snd_pcm_hw_params_t *params, device_caps_t *caps)
+{
+    int f;
+
+    memset(caps, 0, sizeof(*caps));
+    for (f = 0; f < DEVICE_CAPS_FORMATS && f <= SND_PCM_FORMAT_LAST; f++)
+    {
+        if (snd_pcm_hw_params_test_format(handle, params, (snd_pcm_format_t)f) == 0)
+            caps->formats |= 1ULL << f;
+    }
+    if (caps->formats == 0)
+        return -1;
+
+    if (snd_pcm_hw_params_get_channels_min(params, &caps->channelsMin) < 0)
+        caps->channelsMin = 1;
+    if (snd_pcm_hw_params_get_channels_max(params, &caps->channelsMax) < 0)
+        caps->channelsMax = UINT_MAX;
+    if (snd_pcm_hw_params_get_rate_min(params, &caps->rateMin, 0) < 0)
+        caps->rateMin = 0;
+    if (snd_pcm_hw_params_get_rate_max(params, &caps->rateMax, 0) < 0)
+        caps->rateMax = UINT_MAX;
+    if (snd_pcm_hw_params_get_buffer_time_min(params, &caps->bufferTimeMin, 0) < 0)
+        caps->bufferTimeMin = 0;
+    if (snd_pcm_hw_params_get_buffer_time_max(params, &caps->bufferTimeMax, 0) < 0)
+        caps->bufferTimeMax = UINT_MAX;
+    if (snd_pcm_hw_params_get_period_time_min(params, &caps->periodTimeMin, 0) < 0)
+        caps->periodTimeMin = 0;
+    if (snd_pcm_hw_params_get_period_time_max(params, &caps->periodTimeMax, 0) < 0)
+        caps->periodTimeMax = UINT_MAX;
+
+    return 0;
+}
+
+bool DeviceCaps::hasFormat(const device_caps_t *caps, snd_pcm_format_t format)
+{
+    return format >= 0 && format < DEVICE_CAPS_FORMATS && (caps->formats & (1ULL << format));
+}
+
+void DeviceCaps::formatNames(const device_caps_t *caps, char *buf, size_t size)
+{
+    size_t len = 0;
+    int f;
+
+    buf[0] = '\0';
+    for (f = 0; f < DEVICE_CAPS_FORMATS && len < size; f++)
+    {
+        if (caps->formats & (1ULL << f))
+            len += snprintf(buf + len, size - len, "%s%s", len ? " " : "",
+                            snd_pcm_format_name((snd_pcm_format_t)f));
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef _DEVICE_CAPS_H_
+#define _DEVICE_CAPS_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#include <list>
+using namespace std;
+
+#define DEVICE_CAPS_FORMATS     64      /* formats below this fit the mask */
+
+/* what one PCM device offers, from a fresh hw_params_any() space */
+typedef struct {
+    uint64_t formats;           /* bit per snd_pcm_format_t */
+    unsigned int channelsMin;
+    unsigned int channelsMax;
+    unsigned int rateMin;
+    unsigned int rateMax;
+    unsigned int bufferTimeMin; /* us */
+    unsigned int bufferTimeMax;
+    unsigned int periodTimeMin;
+    unsigned int periodTimeMax;
+} device_caps_t;
+
+/*
+ * Process-wide capabilities per device name, probed at the first open and
+ * used to settle format, channels and buffer sizes of later opens without
+ * asking the driver about every candidate again. An entry is dropped when
+ * the device refuses what it said it could do, so a replugged card is
+ * probed afresh.
+ */
+class DeviceCaps
+{
+public:
+    DeviceCaps();
+    virtual ~DeviceCaps();
+
+    static DeviceCaps *shared();
+
+    /* copies the cached caps of device, false when it was never probed */
+    bool find(const char *device, device_caps_t *caps);
+    void store(const char *device, const device_caps_t *caps);
+    void forget(const char *device);
+
+    static int  probe(snd_pcm_t *handle, snd_pcm_hw_params_t *params, device_caps_t *caps);
+    static bool hasFormat(const device_caps_t *caps, snd_pcm_format_t format);
+    /* space separated format names, for error messages */
+    static void formatNames(const device_caps_t *caps, char *buf, size_t size);
+
+private:
+    typedef struct {
+        char *device;
+        device_caps_t caps;
+    } entry_t;
+
+    list<entry_t> entries;
+    pthread_mutex_t lock;
+};
+
+#endif
@@ -0,0 +1,299 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "gain_stage.h"
+#include "pcm_utils.h"
+
+#define GAIN_FLOOR          0.0001f     /* -80 dB, where exponential ramps start and end */
+#define SCRATCH_SAMPLES     4096
+
+typedef union {
+    float f;
+    uint32_t u;
+} float_bits_t;
+
+static uint64_t packRequest(float gain, uint32_t rampMs, gain_ramp_t ramp)
+{
+    float_bits_t fb;
+
+    fb.f = gain;
+    return fb.u | ((uint64_t)(rampMs & 0x7fffffff) << 32) |
+           ((uint64_t)(ramp == GAIN_RAMP_EXPONENTIAL) << 63);
+}
+
+static inline int16_t clip16(float x)
+{
+    if (x >= 32767.0f)
+        return 32767;
+    if (x <= -32768.0f)
+        return -32768;
+    return (int16_t)lrintf(x);
+}
+
+static inline int32_t clipFixed(int64_t x, int64_t lo, int64_t hi)
+{
+    return (int32_t)(x < lo ? lo : (x > hi ? hi : x));
+}
+
+/* Q8.24: a 32-bit sample times any gain below 256 (+48 dB) fits in 64 bits */
+static inline int64_t toFixed(float g)
+{
+    return llrintf(g * 16777216.0f);
+}
+
+static void gainS16(int16_t *__restrict p, size_t samples, float g)
+{
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128 vg = _mm_set1_ps(g);
+    for (; i + 8 <= samples; i += 8)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo), vg));
+        hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi), vg));
+        _mm_storeu_si128((__m128i *)(p + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i < samples; i++)
+        p[i] = clip16(p[i] * g);
+}
+
+/* S32 and S24 in 32-bit containers, shift selects the container */
+static void gainS32(int32_t *__restrict p, size_t samples, float g, int shift)
+{
+    int64_t gq = toFixed(g);
+    int64_t hi = (1LL << (31 - shift)) - 1, lo = -(1LL << (31 - shift));
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+    {
+        int64_t x = (int32_t)((uint32_t)p[i] << shift) >> shift;
+        p[i] = clipFixed((x * gq + (1 << 23)) >> 24, lo, hi);
+    }
+}
+
+static void gainFloat(float *__restrict p, size_t samples, float g)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        p[i] *= g;
+}
+
+GainStage::GainStage()
+    : rate(48000)
+    , current(1.0f)
+    , target(1.0f)
+    , step(0)
+    , remaining(0)
+    , exponential(false)
+{
+    request = packRequest(1.0f, 0, GAIN_RAMP_LINEAR);
+    lastRequest = request;
+    scratch = (float *)malloc(SCRATCH_SAMPLES * sizeof(float));
+}
+
+GainStage::~GainStage()
+{
+    free(scratch);
+}
+
+void GainStage::setGain(float gain, uint32_t rampMs, gain_ramp_t ramp)
+{
+    if (!(gain >= 0))
+        gain = 0;   /* also catches NaN */
+    else if (gain > GAIN_MAX)
+        gain = GAIN_MAX;
+
+    __atomic_store_n(&request, packRequest(gain, rampMs, ramp), __ATOMIC_RELEASE);
+}
+
+float GainStage::gain()
+{
+    float_bits_t fb;
+
+    fb.u = (uint32_t)__atomic_load_n(&request, __ATOMIC_ACQUIRE);
+    return fb.f;
+}
+
+bool GainStage::isBypassed()
+{
+    return remaining == 0 && current == 1.0f &&
+           __atomic_load_n(&request, __ATOMIC_RELAXED) == lastRequest;
+}
+
+void GainStage::applyConstant(void *buf, snd_pcm_format_t format, size_t samples, float g)
+{
+    size_t i, n;
+
+    switch (format)
+    {
+    case SND_PCM_FORMAT_S16:
+        gainS16((int16_t *)buf, samples, g);
+        break;
+    case SND_PCM_FORMAT_S32:
+        gainS32((int32_t *)buf, samples, g, 0);
+        break;
+    case SND_PCM_FORMAT_S24:
+        gainS32((int32_t *)buf, samples, g, 8);
+        break;
+    case SND_PCM_FORMAT_FLOAT:
+        gainFloat((float *)buf, samples, g);
+        break;
+    default:
+        for (i = 0; i < samples && scratch; i += n)
+        {
+            char *p = (char *)buf + snd_pcm_format_size(format, i);
+            n = samples - i < SCRATCH_SAMPLES ? samples - i : SCRATCH_SAMPLES;
+            if (pcm_to_float(format, p, scratch, n) < 0)
+                break;
+            gainFloat(scratch, n, g);
+            pcm_from_float(format, scratch, p, n);
+        }
+        break;
+    }
+}
+
+void GainStage::applyRamp(void *buf, snd_pcm_format_t format, int channels, size_t frames,
+                          float g, float step, bool exponential)
+{
+    size_t f, done, n, width;
+    char *p;
+
+    width = snd_pcm_format_size(format, channels);
+
+    /* a frame at a time, every channel gets the same gain */
+    for (done = 0; done < frames; done += n)
+    {
+        n = frames - done;
+        if (n * channels > SCRATCH_SAMPLES)
+            n = SCRATCH_SAMPLES / channels;
+
+        p = (char *)buf + done * width;
+        if (format == SND_PCM_FORMAT_S16 || format == SND_PCM_FORMAT_S32 ||
+            format == SND_PCM_FORMAT_S24 || format == SND_PCM_FORMAT_FLOAT)
+        {
+            for (f = 0; f < n; f++)
+            {
+                float gf = exponential ? g : g + step * (done + f);
+                applyConstant(p + f * width, format, channels, gf);
+                if (exponential)
+                    g *= step;
+            }
+        }
+        else if (scratch && pcm_to_float(format, p, scratch, n * channels) == 0)
+        {
+            for (f = 0; f < n; f++)
+            {
+                float gf = exponential ? g : g + step * (done + f);
+                gainFloat(scratch + f * channels, channels, gf);
+                if (exponential)
+                    g *= step;
+            }
+            pcm_from_float(format, scratch, p, n * channels);
+        }
+    }
+}
+
+/* picks up a new request, starting its ramp */
+void GainStage::update()
+{
+    uint64_t req;
+    uint32_t rampFrames;
+    float_bits_t fb;
+
+    req = __atomic_load_n(&request, __ATOMIC_ACQUIRE);
+    if (req == lastRequest)
+        return;
+
+    lastRequest = req;
+    fb.u = (uint32_t)req;
+    target = fb.f;
+    exponential = (req >> 63) != 0;
+    rampFrames = (uint64_t)((req >> 32) & 0x7fffffff) * rate / 1000;
+
+    if (rampFrames == 0 || target == current)
+    {
+        current = target;
+        remaining = 0;
+    }
+    else if (exponential)
+    {
+        if (current < GAIN_FLOOR)
+            current = GAIN_FLOOR;
+        step = powf((target < GAIN_FLOOR ? GAIN_FLOOR : target) / current, 1.0f / rampFrames);
+        remaining = rampFrames;
+    }
+    else
+    {
+        step = (target - current) / rampFrames;
+        remaining = rampFrames;
+    }
+}
+
+/* n frames of the ramp are done */
+void GainStage::advance(size_t n)
+{
+    remaining -= n;
+
+    if (remaining == 0)
+        current = target;
+    else if (exponential)
+        current *= powf(step, n);
+    else
+        current += step * n;
+}
+
+void GainStage::process(void *buf, snd_pcm_format_t format, int channels, size_t frames)
+{
+    size_t n;
+
+    update();
+    if (remaining == 0)
+    {
+        if (current != 1.0f)
+            applyConstant(buf, format, frames * channels, current);
+        return;
+    }
+
+    n = frames < remaining ? frames : remaining;
+    applyRamp(buf, format, channels, n, current, step, exponential);
+    advance(n);
+
+    if (n < frames && current != 1.0f)
+        applyConstant((char *)buf + snd_pcm_format_size(format, n * channels), format,
+                      (frames - n) * channels, current);
+}
+
+void GainStage::processPlanar(void *const *planes, snd_pcm_format_t format, int channels, size_t frames)
+{
+    size_t n;
+    int c;
+
+    update();
+    if (remaining == 0)
+    {
+        if (current != 1.0f)
+            for (c = 0; c < channels; c++)
+                applyConstant(planes[c], format, frames, current);
+        return;
+    }
+
+    /* every plane gets the same stretch of the ramp */
+    n = frames < remaining ? frames : remaining;
+    for (c = 0; c < channels; c++)
+        applyRamp(planes[c], format, 1, n, current, step, exponential);
+    advance(n);
+
+    if (n < frames && current != 1.0f)
+        for (c = 0; c < channels; c++)
+            applyConstant((char *)planes[c] + snd_pcm_format_size(format, n), format,
+                          frames - n, current);
+}
@@ -0,0 +1,58 @@
+#ifndef _GAIN_STAGE_H_
+#define _GAIN_STAGE_H_
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+#define GAIN_MAX    125.89f     /* +42 dB, setGain() clamps to it */
+
+typedef enum {
+    GAIN_RAMP_LINEAR = 0,
+    GAIN_RAMP_EXPONENTIAL,      /* constant dB per frame */
+} gain_ramp_t;
+
+/*
+ * Per-stream volume. setGain() may be called from any thread, it only
+ * publishes the request with one atomic store; process() picks it up at
+ * the next buffer and ramps sample by sample to the new value. A stream
+ * that sits at exactly 1.0 is passed through untouched.
+ */
+class GainStage
+{
+public:
+    GainStage();
+    virtual ~GainStage();
+
+    /* control thread side, lock free */
+    void  setGain(float gain, uint32_t rampMs = 20, gain_ramp_t ramp = GAIN_RAMP_LINEAR);
+    float gain();
+
+    /* audio thread side */
+    void setRate(uint32_t rate) { this->rate = rate; }
+    void process(void *buf, snd_pcm_format_t format, int channels, size_t frames);
+    /* one plane per channel, the same gain on all of them */
+    void processPlanar(void *const *planes, snd_pcm_format_t format, int channels, size_t frames);
+    bool isBypassed();
+
+private:
+    void update();
+    void advance(size_t n);
+    void applyConstant(void *buf, snd_pcm_format_t format, size_t samples, float g);
+    void applyRamp(void *buf, snd_pcm_format_t format, int channels, size_t frames,
+                   float g, float step, bool exponential);
+
+    /* float bits | ramp ms << 32 | exponential << 63 */
+    uint64_t request;
+    uint64_t lastRequest;
+
+    uint32_t rate;
+    float    current;
+    float    target;
+    float    step;          /* added or multiplied per frame */
+    uint32_t remaining;     /* frames left in the ramp */
+    bool     exponential;
+
+    float   *scratch;       /* formats without a native kernel */
+};
+
+#endif
@@ -0,0 +1,548 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <vector>
+using namespace std;
+
+#include "loudness.h"
+#include "thread_policy.h"
+#include "pcm_utils.h"
+
+#define SEGMENT_STEPS       600     /* 100 ms gating steps per work item, 60 s */
+#define PREROLL_MS          500     /* K-weighting state settles long before */
+#define READ_FRAMES         16384
+
+#define MOMENTARY_STEPS     4       /* 400 ms */
+#define SHORT_TERM_STEPS    30      /* 3 s */
+#define ABSOLUTE_GATE       -70.0
+#define RELATIVE_GATE       -10.0
+#define LRA_RELATIVE_GATE   -20.0
+
+#define TP_PHASES           4
+#define TP_TAPS             12      /* per phase */
+
+typedef struct {
+    double b0, b1, b2, a1, a2;
+} biquad_coef_t;
+
+typedef struct {
+    double samplePeak;
+    double truePeak;
+    int err;
+} segment_t;
+
+typedef struct {
+    int fd;
+    wav_info_t info;
+    snd_pcm_format_t format;
+
+    uint32_t step;              /* frames per 100 ms */
+    uint64_t totalSteps;
+    uint64_t totalFrames;
+    uint32_t prerollFrames;
+
+    uint32_t numSegments;
+    uint32_t nextSegment;
+    segment_t *segments;
+    double *stepEnergy;         /* channel weighted sum of squares per step */
+
+    double *weights;            /* per channel */
+    biquad_coef_t shelf;
+    biquad_coef_t highpass;
+    float tpCoef[TP_PHASES][TP_TAPS];
+} job_t;
+
+static double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double toLUFS(double meanSquare)
+{
+    return meanSquare > 0 ? -0.691 + 10 * log10(meanSquare) : -HUGE_VAL;
+}
+
+static double toDB(double amplitude)
+{
+    return amplitude > 0 ? 20 * log10(amplitude) : -HUGE_VAL;
+}
+
+/* BS.1770 pre-filter and RLB weighting, re-derived for any sample rate */
+static void kWeightingCoef(uint32_t rate, biquad_coef_t *shelf, biquad_coef_t *highpass)
+{
+    double f0, G, Q, K, Vh, Vb, a0;
+
+    f0 = 1681.974450955533;
+    G = 3.999843853973347;
+    Q = 0.7071752369554196;
+    K = tan(M_PI * f0 / rate);
+    Vh = pow(10.0, G / 20.0);
+    Vb = pow(Vh, 0.4996667741545416);
+    a0 = 1.0 + K / Q + K * K;
+    shelf->b0 = (Vh + Vb * K / Q + K * K) / a0;
+    shelf->b1 = 2.0 * (K * K - Vh) / a0;
+    shelf->b2 = (Vh - Vb * K / Q + K * K) / a0;
+    shelf->a1 = 2.0 * (K * K - 1.0) / a0;
+    shelf->a2 = (1.0 - K / Q + K * K) / a0;
+
+    f0 = 38.13547087602444;
+    Q = 0.5003270373238773;
+    K = tan(M_PI * f0 / rate);
+    a0 = 1.0 + K / Q + K * K;
+    highpass->b0 = 1.0;
+    highpass->b1 = -2.0;
+    highpass->b2 = 1.0;
+    highpass->a1 = 2.0 * (K * K - 1.0) / a0;
+    highpass->a2 = (1.0 - K / Q + K * K) / a0;
+}
+
+/* windowed sinc interpolator, split into TP_PHASES polyphase branches */
+static void truePeakCoef(float coef[TP_PHASES][TP_TAPS])
+{
+    const int length = TP_PHASES * TP_TAPS;
+    double h[TP_PHASES * TP_TAPS], sum, x;
+    int i, p, k;
+
+    for (i = 0; i < length; i++)
+    {
+        x = (i - (length - 1) / 2.0) / TP_PHASES;
+        h[i] = (x == 0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        h[i] *= 0.5 - 0.5 * cos(2 * M_PI * (i + 1) / (length + 1));
+    }
+
+    for (p = 0; p < TP_PHASES; p++)
+    {
+        sum = 0;
+        for (k = 0; k < TP_TAPS; k++)
+            sum += h[p + k * TP_PHASES];
+        for (k = 0; k < TP_TAPS; k++)
+            coef[p][k] = h[p + k * TP_PHASES] / sum;
+    }
+}
+
+/* LFE is excluded, surrounds get +1.5 dB as in BS.1770 table 3 */
+static void channelWeights(const wav_info_t *info, double *weights)
+{
+    uint32_t bit, mask = info->channelMask;
+    int c;
+
+    for (c = 0; c < info->channels; c++)
+        weights[c] = 1.0;
+
+    if (mask == 0)
+    {
+        if (info->channels == 6)
+            mask = 0x3f;    /* L R C LFE Ls Rs */
+        else if (info->channels == 5)
+            mask = 0x37;    /* L R C Ls Rs */
+    }
+
+    for (c = 0, bit = 1; c < info->channels && bit; bit <<= 1)
+    {
+        if (!(mask & bit))
+            continue;
+        if (bit == WAV_SPEAKER_LOW_FREQUENCY)
+            weights[c] = 0.0;
+        else if (bit == WAV_SPEAKER_BACK_LEFT || bit == WAV_SPEAKER_BACK_RIGHT ||
+                 bit == WAV_SPEAKER_SIDE_LEFT || bit == WAV_SPEAKER_SIDE_RIGHT)
+            weights[c] = 1.41;
+        c++;
+    }
+}
+
+/*
+ * Both K-weighting stages, transposed direct form II. The inner loop runs
+ * across channels on separate state arrays so it vectorizes for
+ * multichannel material.
+ */
+static void kWeight(const biquad_coef_t *s1, const biquad_coef_t *s2,
+                    double *__restrict z, double *__restrict acc,
+                    const float *__restrict in, size_t frames, int channels)
+{
+    double *__restrict z1 = z;
+    double *__restrict z2 = z + channels;
+    double *__restrict z3 = z + 2 * channels;
+    double *__restrict z4 = z + 3 * channels;
+    double x, y, w;
+    size_t f;
+    int c;
+
+    for (f = 0; f < frames; f++, in += channels)
+    {
+        for (c = 0; c < channels; c++)
+        {
+            x = in[c];
+            y = s1->b0 * x + z1[c];
+            z1[c] = s1->b1 * x - s1->a1 * y + z2[c];
+            z2[c] = s1->b2 * x - s1->a2 * y;
+
+            w = y + z3[c];
+            z3[c] = -2.0 * y - s2->a1 * w + z4[c];
+            z4[c] = y - s2->a2 * w;
+
+            acc[c] += w * w;
+        }
+    }
+}
+
+static float samplePeak(const float *in, size_t samples)
+{
+    float peak = 0;
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        peak = fmaxf(peak, fabsf(in[i]));
+
+    return peak;
+}
+
+/* hist holds TP_TAPS - 1 samples of history followed by frames new ones */
+static float truePeak(const float coef[TP_PHASES][TP_TAPS], const float *hist, size_t frames)
+{
+    float peak = 0, y;
+    size_t j;
+    int p, k;
+
+    for (j = 0; j < frames; j++)
+    {
+        for (p = 0; p < TP_PHASES; p++)
+        {
+            y = 0;
+            for (k = 0; k < TP_TAPS; k++)
+                y += coef[p][k] * hist[j + TP_TAPS - 1 - k];
+            peak = fmaxf(peak, fabsf(y));
+        }
+    }
+
+    return peak;
+}
+
+static int readFrames(job_t *job, uint64_t frame, char *buf, size_t frames)
+{
+    size_t done = 0, bytes = frames * job->info.blockAlign;
+    off_t offset = job->info.dataOffset + frame * job->info.blockAlign;
+    ssize_t ret;
+
+    while (done < bytes)
+    {
+        ret = pread(job->fd, buf + done, bytes - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+
+    return 0;
+}
+
+static void analyzeSegment(job_t *job, uint32_t index)
+{
+    segment_t *seg = &job->segments[index];
+    int c, channels = job->info.channels;
+    uint64_t startStep, endStep, curStep, frameStart, frameEnd, pos;
+    uint32_t stepFill = 0;
+    size_t n, f, m, j;
+    double *z, *acc, energy;
+    float *buf, *hist;
+    char *raw;
+
+    startStep = (uint64_t)index * SEGMENT_STEPS;
+    endStep = min(job->totalSteps, startStep + SEGMENT_STEPS);
+    frameStart = startStep * job->step;
+    frameEnd = (index == job->numSegments - 1) ? job->totalFrames : endStep * job->step;
+
+    raw = (char *)malloc((size_t)READ_FRAMES * job->info.blockAlign);
+    buf = (float *)malloc((size_t)READ_FRAMES * channels * sizeof(float));
+    hist = (float *)calloc((size_t)channels * (TP_TAPS - 1 + READ_FRAMES), sizeof(float));
+    z = (double *)calloc(4 * channels, sizeof(double));
+    acc = (double *)calloc(channels, sizeof(double));
+
+    seg->samplePeak = 0;
+    seg->truePeak = 0;
+    seg->err = (raw && buf && hist && z && acc) ? 0 : -1;
+
+    curStep = startStep;
+    pos = frameStart - min<uint64_t>(frameStart, job->prerollFrames);
+    while (seg->err == 0 && pos < frameEnd)
+    {
+        n = min<uint64_t>(READ_FRAMES, frameEnd - pos);
+        if (readFrames(job, pos, raw, n) < 0 ||
+            pcm_to_float(job->format, raw, buf, n * channels) < 0)
+        {
+            seg->err = -1;
+            break;
+        }
+
+        /* pre-roll: only settle the filter and interpolator state */
+        f = 0;
+        if (pos < frameStart)
+        {
+            f = min<uint64_t>(n, frameStart - pos);
+            kWeight(&job->shelf, &job->highpass, z, acc, buf, f, channels);
+            memset(acc, 0, channels * sizeof(double));
+        }
+
+        seg->samplePeak = max<double>(seg->samplePeak, samplePeak(buf + f * channels, (n - f) * channels));
+
+        for (c = 0; c < channels; c++)
+        {
+            float *h = hist + c * (TP_TAPS - 1 + READ_FRAMES);
+            for (j = 0; j < n; j++)
+                h[TP_TAPS - 1 + j] = buf[j * channels + c];
+            seg->truePeak = max<double>(seg->truePeak, truePeak(job->tpCoef, h + f, n - f));
+            memmove(h, h + n, (TP_TAPS - 1) * sizeof(float));
+        }
+
+        while (f < n)
+        {
+            if (curStep >= endStep)
+                break;  /* partial last step is not gated */
+
+            m = min<size_t>(n - f, job->step - stepFill);
+            kWeight(&job->shelf, &job->highpass, z, acc, buf + f * channels, m, channels);
+            stepFill += m;
+            f += m;
+
+            if (stepFill == job->step)
+            {
+                energy = 0;
+                for (c = 0; c < channels; c++)
+                    energy += job->weights[c] * acc[c];
+                job->stepEnergy[curStep++] = energy;
+                memset(acc, 0, channels * sizeof(double));
+                stepFill = 0;
+            }
+        }
+
+        pos += n;
+    }
+
+    free(raw);
+    free(buf);
+    free(hist);
+    free(z);
+    free(acc);
+}
+
+static double percentile(vector<double> &sorted, double p)
+{
+    double idx = (sorted.size() - 1) * p;
+    size_t lo = (size_t)idx;
+
+    if (lo + 1 >= sorted.size())
+        return sorted[lo];
+
+    return sorted[lo] + (idx - lo) * (sorted[lo + 1] - sorted[lo]);
+}
+
+/* two-stage gating over the concatenated per-step energies */
+static void gate(const job_t *job, loudness_result_t *result)
+{
+    vector<double> momentary, shortTerm, lra;
+    double sum, gateLevel, blockFrames, l;
+    uint64_t i, k, count;
+
+    result->integrated = -HUGE_VAL;
+    result->range = 0;
+    result->maxMomentary = -HUGE_VAL;
+    result->maxShortTerm = -HUGE_VAL;
+
+    blockFrames = (double)MOMENTARY_STEPS * job->step;
+    for (i = 0; i + MOMENTARY_STEPS <= job->totalSteps; i++)
+    {
+        sum = 0;
+        for (k = 0; k < MOMENTARY_STEPS; k++)
+            sum += job->stepEnergy[i + k];
+        momentary.push_back(sum / blockFrames);
+        result->maxMomentary = max(result->maxMomentary, toLUFS(sum / blockFrames));
+    }
+
+    sum = 0;
+    count = 0;
+    for (i = 0; i < momentary.size(); i++)
+    {
+        if (toLUFS(momentary[i]) > ABSOLUTE_GATE)
+        {
+            sum += momentary[i];
+            count++;
+        }
+    }
+
+    if (count > 0)
+    {
+        gateLevel = toLUFS(sum / count) + RELATIVE_GATE;
+        sum = 0;
+        count = 0;
+        for (i = 0; i < momentary.size(); i++)
+        {
+            l = toLUFS(momentary[i]);
+            if (l > ABSOLUTE_GATE && l > gateLevel)
+            {
+                sum += momentary[i];
+                count++;
+            }
+        }
+        if (count > 0)
+            result->integrated = toLUFS(sum / count);
+    }
+
+    blockFrames = (double)SHORT_TERM_STEPS * job->step;
+    for (i = 0; i + SHORT_TERM_STEPS <= job->totalSteps; i++)
+    {
+        sum = 0;
+        for (k = 0; k < SHORT_TERM_STEPS; k++)
+            sum += job->stepEnergy[i + k];
+        shortTerm.push_back(sum / blockFrames);
+        result->maxShortTerm = max(result->maxShortTerm, toLUFS(sum / blockFrames));
+    }
+
+    sum = 0;
+    count = 0;
+    for (i = 0; i < shortTerm.size(); i++)
+    {
+        if (toLUFS(shortTerm[i]) > ABSOLUTE_GATE)
+        {
+            sum += shortTerm[i];
+            count++;
+        }
+    }
+
+    if (count > 0)
+    {
+        gateLevel = toLUFS(sum / count) + LRA_RELATIVE_GATE;
+        for (i = 0; i < shortTerm.size(); i++)
+        {
+            l = toLUFS(shortTerm[i]);
+            if (l > ABSOLUTE_GATE && l > gateLevel)
+                lra.push_back(l);
+        }
+        if (!lra.empty())
+        {
+            sort(lra.begin(), lra.end());
+            result->range = percentile(lra, 0.95) - percentile(lra, 0.10);
+        }
+    }
+}
+
+LoudnessAnalyzer::LoudnessAnalyzer(int threads)
+    : numThreads(threads)
+{
+    if (numThreads <= 0)
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads <= 0)
+        numThreads = 1;
+}
+
+LoudnessAnalyzer::~LoudnessAnalyzer()
+{
+}
+
+void* LoudnessAnalyzer::workerThreadFunc(void *data)
+{
+    job_t *job = (job_t *)data;
+    uint32_t index;
+
+    while ((index = __atomic_fetch_add(&job->nextSegment, 1, __ATOMIC_RELAXED)) < job->numSegments)
+        analyzeSegment(job, index);
+
+    return NULL;
+}
+
+int LoudnessAnalyzer::analyze(const char *filename, loudness_result_t *result)
+{
+    WavFile wav;
+    job_t *job;
+    pthread_t *threads;
+    double start, peak = 0, tp = 0;
+    int i, started = 0, ret = 0;
+    uint32_t s;
+
+    memset(result, 0, sizeof(*result));
+    start = now();
+
+    if (wav.open(filename) < 0)
+        return -1;
+
+    job = new job_t;
+    memset(job, 0, sizeof(*job));
+    job->info = *wav.header();
+    job->format = wav.pcmFormat();
+    wav.close();
+
+    job->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (job->fd < 0 || job->format == SND_PCM_FORMAT_UNKNOWN)
+    {
+        if (job->fd >= 0)
+            close(job->fd);
+        delete job;
+        return -1;
+    }
+
+    job->step = (job->info.rate + 5) / 10;
+    job->totalFrames = job->info.dataLength / job->info.blockAlign;
+    job->totalSteps = job->totalFrames / job->step;
+    job->prerollFrames = (uint64_t)job->info.rate * PREROLL_MS / 1000;
+    job->numSegments = (job->totalSteps + SEGMENT_STEPS - 1) / SEGMENT_STEPS;
+    if (job->numSegments == 0 && job->totalFrames > 0)
+        job->numSegments = 1;
+    job->segments = (segment_t *)calloc(job->numSegments + 1, sizeof(segment_t));
+    job->stepEnergy = (double *)calloc(job->totalSteps + 1, sizeof(double));
+
+    kWeightingCoef(job->info.rate, &job->shelf, &job->highpass);
+    truePeakCoef(job->tpCoef);
+    job->weights = (double *)calloc(job->info.channels, sizeof(double));
+    channelWeights(&job->info, job->weights);
+
+    threads = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
+    for (i = 0; i < numThreads && (uint32_t)i < job->numSegments; i++)
+    {
+        if (ThreadPolicy::shared()->create(THREAD_DSP, &threads[started], workerThreadFunc, job) == 0)
+            started++;
+    }
+
+    if (started == 0)
+        workerThreadFunc(job);
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (s = 0; s < job->numSegments; s++)
+    {
+        if (job->segments[s].err < 0)
+            ret = -1;
+        peak = max(peak, job->segments[s].samplePeak);
+        tp = max(tp, job->segments[s].truePeak);
+    }
+
+    if (ret == 0)
+    {
+        gate(job, result);
+        result->samplePeak = toDB(peak);
+        result->truePeak = toDB(max(tp, peak));
+        result->frames = job->totalFrames;
+        result->duration = (double)job->totalFrames / job->info.rate;
+    }
+
+    close(job->fd);
+    free(job->segments);
+    free(job->stepEnergy);
+    free(job->weights);
+    delete job;
+
+    result->elapsed = now() - start;
+
+    return ret;
+}
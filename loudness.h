@@ -0,0 +1,43 @@
+#ifndef _LOUDNESS_H_
+#define _LOUDNESS_H_
+
+#include <stdint.h>
+
+#include "wav_file.h"
+
+/* ITU-R BS.1770-4 / EBU R128 measurements of one file */
+typedef struct {
+    double integrated;      /* LUFS, -HUGE_VAL when everything is gated */
+    double range;           /* LRA in LU, EBU Tech 3342 */
+    double maxMomentary;    /* LUFS, 400 ms blocks */
+    double maxShortTerm;    /* LUFS, 3 s blocks */
+    double samplePeak;      /* dBFS */
+    double truePeak;        /* dBTP, 4x oversampled */
+    uint64_t frames;
+    double duration;        /* seconds of audio */
+    double elapsed;         /* seconds spent analysing */
+} loudness_result_t;
+
+/*
+ * Offline loudness and peak analysis. The data chunk is cut into
+ * segments of whole 100 ms gating steps that worker threads analyse in
+ * parallel; each segment replays a short pre-roll so the K-weighting
+ * filters reach the state a serial pass would have. Segment results are
+ * concatenated before gating, so the merge itself is exact.
+ */
+class LoudnessAnalyzer
+{
+public:
+    /* threads - 0 to use one worker per online CPU */
+    LoudnessAnalyzer(int threads = 0);
+    virtual ~LoudnessAnalyzer();
+
+    int analyze(const char *filename, loudness_result_t *result);
+
+    static void* workerThreadFunc(void *data);
+
+private:
+    int numThreads;
+};
+
+#endif
@@ -1,24 +1,467 @@
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <list>
 using namespace std;
 #include "wav_file.h"
+#include "wav_index.h"
+#include "wav_scanner.h"
+#include "loudness.h"
+#include "wav_overview.h"
 #include "aplayer.h"
+#include "bench.h"
+#include "stress.h"
+#include "recorder.h"
+#include "playlist_render.h"
+#include "clip_player.h"
+#include "play_daemon.h"
+#include "daemon_client.h"
+#include "thread_policy.h"
+#include "trace.h"
+
+static WavIndex *wavIndex = NULL;
+static volatile float gainDb = 0;     /* changed with +/- while playing */
+static volatile float speed = 1.0f;   /* changed with </> while playing */
+static dither_mode_t ditherMode = DITHER_TPDF;
+static uint32_t crossfadeMs = 0;
+static bool loopFiles;
+static bool verifyFiles;
+static uint32_t meterHz;
+static bool planarFiles;
+static bool powerSave;
+static bool powerReport;
+static char *filters[BIQUAD_MAX_SECTIONS];
+static int filterCount;
+static char **playlist;
+static int playlistCount;
+
+static int scan_dirs(char *dirs[], int count, const char *indexFile, int threads)
+{
+    WavScanner *scanner;
+    int index, ret = 0;
+
+    scanner = new WavScanner(wavIndex, threads);
+    for (index = 0; index < count; index++)
+    {
+        if (scanner->scan(dirs[index]) < 0)
+            ret = -1;
+    }
+
+    printf("%u scanned, %u unchanged, %u failed\n",
+           scanner->scanned(), scanner->unchanged(), scanner->failed());
+    delete scanner;
+
+    if (wavIndex->save(indexFile) < 0)
+        return -1;
+
+    printf("%u files in %s\n", wavIndex->count(), indexFile);
+
+    return ret;
+}
+
+static int analyze_files(char *files[], int count, int threads)
+{
+    LoudnessAnalyzer analyzer(threads);
+    loudness_result_t result;
+    int index, ret = 0;
+
+    for (index = 0; index < count; index++)
+    {
+        if (analyzer.analyze(files[index], &result) < 0)
+        {
+            printf("%s: analysis failed\n", files[index]);
+            ret = -1;
+            continue;
+        }
+
+        printf("%s: I %.1f LUFS, LRA %.1f LU, M max %.1f, S max %.1f, "
+               "peak %.2f dBFS, true peak %.2f dBTP, %.1fs in %.2fs (%.0fx)\n",
+               files[index], result.integrated, result.range,
+               result.maxMomentary, result.maxShortTerm,
+               result.samplePeak, result.truePeak,
+               result.duration, result.elapsed,
+               result.elapsed > 0 ? result.duration / result.elapsed : 0.0);
+    }
+
+    return ret;
+}
+
+static int overview_files(char *files[], int count, int threads)
+{
+    WavOverview overview;
+    char sidecar[PATH_MAX];
+    int index, level, ret = 0;
+
+    for (index = 0; index < count; index++)
+    {
+        snprintf(sidecar, sizeof(sidecar), "%s.wfm", files[index]);
+        if (WavOverview::update(files[index], sidecar, threads) < 0 ||
+            overview.open(sidecar) < 0)
+        {
+            printf("%s: overview failed\n", files[index]);
+            ret = -1;
+            continue;
+        }
+
+        printf("%s:", sidecar);
+        for (level = 0; level < overview.levels(); level++)
+            printf(" %llux%llu", (unsigned long long)overview.bins(level),
+                   (unsigned long long)overview.binFrames(level));
+        printf("\n");
+        overview.close();
+    }
+
+    return ret;
+}
+
+/* channels[:rate[:bits]] for -C, empty or left out fields stay as they were, -1 when malformed */
+static int parse_format(const char *spec, int *channels, uint32_t *rate, snd_pcm_format_t *format)
+{
+    unsigned long value[3] = { 0, 0, 0 };
+    bool given[3] = { false, false, false };
+    const char *p = spec;
+    char *end;
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        if (*p >= '0' && *p <= '9')
+        {
+            value[i] = strtoul(p, &end, 10);
+            given[i] = true;
+            p = end;
+        }
+        if (*p == '\0')
+            break;
+        if (*p != ':' || i == 2)
+            return -1;
+        p++;
+    }
+
+    if ((given[0] && (value[0] < 1 || value[0] > INT_MAX)) ||
+        (given[1] && (value[1] < 1 || value[1] > UINT32_MAX)) ||
+        (given[2] && value[2] != 16 && value[2] != 24 && value[2] != 32))
+        return -1;
+
+    if (given[0])
+        *channels = value[0];
+    if (given[1])
+        *rate = value[1];
+    if (given[2] && value[2] == 16)
+        *format = SND_PCM_FORMAT_S16_LE;
+    else if (given[2] && value[2] == 24)
+        *format = SND_PCM_FORMAT_S24_3LE;
+    else if (given[2] && value[2] == 32)
+        *format = SND_PCM_FORMAT_S32_LE;
+
+    return 0;
+}
+
+/* type:freq[:q[:dB]], e.g. highpass:80 or peak:3000:1.4:-4 */
+template <class T> static int add_filter(T *player, int index, const char *spec)
+{
+    char name[16];
+    float freq, q = 0.707f, db = 0;
+    int type;
+
+    if (sscanf(spec, "%15[a-z]:%f:%f:%f", name, &freq, &q, &db) < 2)
+        return -1;
+    for (type = 0; type < BIQUAD_TYPES; type++)
+        if (strcmp(name, BiquadChain::typeName((biquad_type_t)type)) == 0)
+            return player->setFilter(index, (biquad_type_t)type, freq, q, db);
+
+    return -1;
+}
+
+/* keys 1-9 trigger the files, one voice each press */
+static int trigger_clips(char *files[], int count, const char *voiceSpec, const char *formatSpec)
+{
+    ClipPlayer player;
+    ClipCache *cache = ClipCache::shared();
+    snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
+    int voices = 16, perClip = 4, channels = 2, index, ch;
+    uint32_t rate = 48000;
+
+    sscanf(voiceSpec, "%d:%d", &voices, &perClip);
+    if (formatSpec && parse_format(formatSpec, &channels, &rate, &format) < 0)
+    {
+        printf("Bad format %s\n", formatSpec);
+        return -1;
+    }
+
+    player.setVoices(voices, perClip);
+    player.setDither(ditherMode);
+    if (player.open("default", format, channels, rate) < 0)
+    {
+        printf("Failed to open the device\n");
+        return -1;
+    }
+
+    for (index = 0; index < count; index++)
+        if (player.preload(files[index]) < 0)
+            printf("Failed to load %s\n", files[index]);
+    printf("%u clips, %zu KiB cached, period %zu frames\n", cache->count(),
+           cache->size() / 1024, player.periodFrames());
+
+    do
+    {
+        printf("press 1-%d to trigger, Q to quit ...", count < 9 ? count : 9);
+        ch = getchar();
+        if (ch >= '1' && ch <= '9' && ch - '1' < count)
+            player.trigger(files[ch - '1'], powf(10, gainDb / 20));
+    } while (ch != 'q' && ch != 'Q' && ch != EOF);
+
+    player.close();
+    printf("%u hits, %u misses, %u evicted, %u voices stolen, %u underruns, worst latency %.1f ms\n",
+           cache->hits(), cache->misses(), cache->evictions(), player.stolen(),
+           player.underruns(), player.maxLatencyUs() / 1000.0);
+
+    return 0;
+}
+
+/* serves the socket until Q */
+static int run_daemon(const char *socketPath, const char *device, const char *formatSpec)
+{
+    PlayDaemon daemon;
+    snd_pcm_format_t format = SND_PCM_FORMAT_S16_LE;
+    int channels = 2, ch;
+    uint32_t rate = 48000;
+
+    if (formatSpec && parse_format(formatSpec, &channels, &rate, &format) < 0)
+    {
+        printf("Bad format %s\n", formatSpec);
+        return -1;
+    }
+    if (daemon.start(socketPath, device, format, channels, rate) < 0)
+    {
+        printf("Failed to start the daemon\n");
+        return -1;
+    }
+
+    printf("serving %s on %s, %d channels %u Hz %s\n", device, socketPath, daemon.channels(),
+           daemon.rate(), snd_pcm_format_name(daemon.format()));
+    do
+    {
+        printf("press Q to quit ...");
+        ch = getchar();
+    } while (ch != 'q' && ch != 'Q' && ch != EOF);
+
+    daemon.stop();
+
+    return 0;
+}
+
+static void print_stream(const char *name, int id, const daemon_stats_t *stats, uint32_t rate)
+{
+    printf("%s: stream %d, %.1f s, latency %.1f ms (max %.1f), %u underruns, daemon CPU %.2f ms\n",
+           name, id, (double)stats->frames / rate, stats->latencyUs / 1000.0,
+           stats->maxLatencyUs / 1000.0, stats->underruns, stats->cpuNs / 1e6);
+}
+
+/* shared - decode into the ring in place rather than asking the daemon to read the file */
+static int play_through_daemon(char *files[], int count, const char *socketPath, bool shared)
+{
+    DaemonClient client;
+    daemon_stats_t stats;
+    WavFile file;
+    int index, id, active, *ids;
+    size_t frames;
+    ssize_t bytes;
+    void *ptr;
+
+    if (client.connect(socketPath) < 0)
+        return -1;
+
+    if (shared)
+    {
+        for (index = 0; index < count; index++)
+        {
+            if (file.open(files[index]) < 0)
+            {
+                printf("Failed to open %s\n", files[index]);
+                continue;
+            }
+            id = client.openStream(file.pcmFormat(), file.channels(), file.rate());
+            if (id < 0)
+            {
+                file.close();
+                continue;
+            }
+
+            for (;;)
+            {
+                frames = client.writable(&ptr);
+                if (frames == 0)
+                {
+                    if (client.wait() < 0)
+                        break;
+                    continue;
+                }
+                bytes = file.readData((char *)ptr, frames * file.frameBytes());
+                if (bytes <= 0)
+                    break;
+                client.produce(bytes / file.frameBytes());
+            }
+            client.finish();
+            if (client.stats(id, &stats) == 0)
+                print_stream(files[index], id, &stats, client.outputRate());
+            client.closeStream();
+            file.close();
+        }
+        return 0;
+    }
+
+    ids = (int *)malloc(count * sizeof(int));
+    if (ids == NULL)
+        return -1;
+    for (index = 0; index < count; index++)
+        ids[index] = client.playFile(files[index]);
+
+    /* the daemon mixes them all at once */
+    do
+    {
+        usleep(200000);
+        active = 0;
+        for (index = 0; index < count; index++)
+            if (ids[index] >= 0 && client.stats(ids[index], &stats) == 0 && stats.active)
+                active++;
+    } while (active);
+
+    for (index = 0; index < count; index++)
+        if (ids[index] >= 0 && client.stats(ids[index], &stats) == 0)
+            print_stream(files[index], ids[index], &stats, client.outputRate());
+    free(ids);
+
+    return 0;
+}
+
+/* underruns and the latency changes they cause */
+static void print_xrun(const xrun_event_t *event, void *data)
+{
+    printf("%s: level %d, start after %zu frames, %d buffers read ahead, %u underruns in %d s, %llu in all\n",
+           XrunPolicy::eventName(event->type), event->level, event->startFrames, event->readAhead,
+           event->recent, XRUN_WINDOW_MS / 1000, (unsigned long long)event->total);
+}
+
+/* the verdict of -V on what reached the device */
+static void print_verify(const char *filename, APlayer *player)
+{
+    verify_result_t r;
+
+    if (player->verifyResult(&r) < 0)
+    {
+        printf("%s: not verified\n", filename);
+        return;
+    }
+
+    if (r.mismatch == VERIFY_NONE)
+        printf("%s: bit-perfect, %llu of %llu frames%s, xxh64 %016llx\n", filename,
+               (unsigned long long)r.frames, (unsigned long long)r.fileFrames,
+               r.complete ? "" : " compared", (unsigned long long)r.outputHash);
+    else
+        printf("%s: %s %llu differs, %llu of %llu frames written, xxh64 file %016llx device %016llx\n",
+               filename, r.exact ? "frame" : "block at frame", (unsigned long long)r.mismatch,
+               (unsigned long long)r.frames, (unsigned long long)r.fileFrames,
+               (unsigned long long)r.fileHash, (unsigned long long)r.outputHash);
+}
+
+/* -M: the newest analysis, peak/rms of every channel and the loudest bin */
+static void print_levels(const char *filename, AnalysisTap *tap, uint64_t *shown)
+{
+    tap_snapshot_t s;
+    uint32_t i, loudest = 1;
+    int c;
+
+    if (tap == NULL || tap->snapshot(&s) < 0 || s.sequence == *shown)
+        return;
+    *shown = s.sequence;
+
+    printf("%s: peak/rms", filename);
+    for (c = 0; c < s.channels; c++)
+        printf(" %.1f/%.1f", s.peak[c], s.rms[c]);
+    for (i = 2; i < s.bins; i++)
+        if (s.spectrum[i] > s.spectrum[loudest])
+            loudest = i;
+    printf(" dBFS, loudest %.0f Hz at %.1f dBFS\n", (double)loudest * s.rate / (2 * s.bins), s.spectrum[loudest]);
+}
+
+/* -W: what the playback cost, to set energy mode against the default */
+static void print_power(const char *filename, APlayer *player)
+{
+    power_stats_t p;
+
+    player->powerStats(&p);
+    if (p.wallSeconds <= 0 || p.audioSeconds <= 0)
+        return;
+
+    printf("%s: %.1f wakeups/s, %.2f s cpu per audio hour, %.1f s of audio in %.1f s\n", filename,
+           p.wakeups / p.wallSeconds, p.cpuSeconds * 3600 / p.audioSeconds, p.audioSeconds, p.wallSeconds);
+}
+
+static APlayer *new_player()
+{
+    APlayer *player;
+    int index;
+
+    player = new APlayer(false);
+    player->setIndex(wavIndex);
+    player->setDither(ditherMode);
+    player->setGain(powf(10, gainDb / 20), 0);
+    player->setSpeed(speed);
+    player->setLoop(loopFiles);
+    player->setVerify(verifyFiles);
+    player->setPlanar(planarFiles);
+    player->setPowerSave(powerSave);
+    player->setXrunCallback(print_xrun);
+    for (index = 0; index < filterCount; index++)
+        if (add_filter(player, index, filters[index]) < 0)
+            printf("Bad filter %s\n", filters[index]);
+
+    return player;
+}
+
+/* picks up +/- and </> from the console */
+static void follow_controls(APlayer *player, float *level)
+{
+    if (*level != gainDb)
+    {
+        *level = gainDb;
+        player->setGain(powf(10, *level / 20), 50, GAIN_RAMP_EXPONENTIAL);
+    }
+    if (player->speed() != speed)
+        player->setSpeed(speed);
+}
 
 static void *play_thread(void *data)
 {
     char *filename;
     APlayer *player;
+    AnalysisTap *tap = NULL;
+    uint64_t shown = 0;
+    float level;
 
     filename = (char *)data;
 
     if (strlen(filename) > 0)
     {
-        player = new APlayer(false);
+        player = new_player();
+        level = gainDb;
+        if (meterHz)
+        {
+            tap = new AnalysisTap(meterHz);
+            player->setTap(tap);
+        }
         if (player->play(filename) < 0)
         {
             printf("Failed to open file %s\n", filename);
+            delete player;
+            delete tap;
             return NULL;
         }
+        printf("%s: stream open %.2f ms\n", filename, player->openLatencyUs() / 1000.0);
 
         while (true)
         {
@@ -26,38 +469,393 @@ static void *play_thread(void *data)
 
             if (!player->isRunning())
                 break;
+
+            if ((verifyFiles || powerReport) && player->isFinished())
+            {
+                player->stop();
+                if (verifyFiles)
+                    print_verify(filename, player);
+                if (powerReport)
+                    print_power(filename, player);
+                break;
+            }
+
+            follow_controls(player, &level);
+            print_levels(filename, tap, &shown);
         }
 
         delete player;        
+        delete tap;
+    }
+
+    return NULL;
+}
+
+/* every file through one player, each one fading into the next */
+static void *playlist_thread(void *data)
+{
+    APlayer *player;
+    AnalysisTap *tap = NULL;
+    uint64_t shown = 0;
+    float level;
+    int index, ret;
+
+    player = new_player();
+    level = gainDb;
+    if (meterHz)
+    {
+        tap = new AnalysisTap(meterHz);
+        player->setTap(tap);
+    }
+
+    for (index = 0; index < playlistCount; index++)
+    {
+        if (index == 0)
+            ret = player->play(playlist[index]);
+        else
+            ret = player->crossfade(playlist[index], crossfadeMs, FADE_EQUAL_POWER, true);
+        if (ret < 0)
+        {
+            printf("Failed to open file %s\n", playlist[index]);
+            continue;
+        }
+
+        /* queued right away, the fade itself starts near the end */
+        do
+        {
+            usleep(50000); // 50 ms
+            follow_controls(player, &level);
+            print_levels("playlist", tap, &shown);
+        } while (player->isCrossfading());
+    }
+
+    while (player->isRunning())
+    {
+        usleep(50000);
+        follow_controls(player, &level);
+        print_levels("playlist", tap, &shown);
+        if (powerReport && player->isFinished())
+        {
+            player->stop();
+            print_power("playlist", player);
+        }
     }
 
+    delete player;
+    delete tap;
+
     return NULL;
 }
 
 int main(int argc, char *argv[])
 {
-    int index;
+    int index, opt, threads = 0;
+    const char *indexFile = NULL;
+    bool scan = false, analyze = false, waveform = false, bench = false, stress = false, direct = false;
+    const char *recordFile = NULL, *captureSource = "default", *renderFile = NULL, *formatSpec = NULL;
+    const char *voiceSpec = NULL, *daemonSocket = NULL, *clientSocket = NULL, *traceFile = NULL;
+    bool sharedRing = false, placed = false;
+    char placement[128];
+    snd_pcm_format_t captureFormat = SND_PCM_FORMAT_S16_LE, renderFormat = SND_PCM_FORMAT_UNKNOWN;
+    int captureChannels = 2, renderChannels = 0;
+    uint32_t captureRate = 48000, renderRate = 0;
+    Recorder *recorder = NULL;
+    PlaylistRenderer *renderer;
     pthread_t thID;
 
     char ch;
-    
-    if (argc < 2)
+
+    while ((opt = getopt(argc, argv, "i:sj:awg:d:BXx:t:e:r:c:C:Oo:k:lD:S:mP:T:VM:NEW")) != -1)
     {
-        printf("usage: %s [filename] \t- open WAV file\n", argv[0]);
+        switch (opt)
+        {
+        case 'i':
+            indexFile = optarg;
+            break;
+        case 's':
+            scan = true;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'a':
+            analyze = true;
+            break;
+        case 'w':
+            waveform = true;
+            break;
+        case 'g':
+            gainDb = atof(optarg);
+            break;
+        case 'd':
+            if (strcmp(optarg, "none") == 0)
+                ditherMode = DITHER_NONE;
+            else if (strcmp(optarg, "shaped") == 0)
+                ditherMode = DITHER_SHAPED;
+            else
+                ditherMode = DITHER_TPDF;
+            break;
+        case 'B':
+            bench = true;
+            break;
+        case 'X':
+            stress = true;
+            break;
+        case 'x':
+            crossfadeMs = atoi(optarg);
+            break;
+        case 't':
+            speed = atof(optarg);
+            break;
+        case 'e':
+            if (filterCount < BIQUAD_MAX_SECTIONS)
+                filters[filterCount++] = optarg;
+            break;
+        case 'r':
+            recordFile = optarg;
+            break;
+        case 'c':
+            captureSource = optarg;
+            break;
+        case 'C':
+            formatSpec = optarg;
+            break;
+        case 'O':
+            direct = true;
+            break;
+        case 'o':
+            renderFile = optarg;
+            break;
+        case 'k':
+            voiceSpec = optarg;
+            break;
+        case 'l':
+            loopFiles = true;
+            break;
+        case 'D':
+            daemonSocket = optarg;
+            break;
+        case 'S':
+            clientSocket = optarg;
+            break;
+        case 'm':
+            sharedRing = true;
+            break;
+        case 'P':
+            if (ThreadPolicy::shared()->parse(optarg) < 0)
+                printf("Bad placement %s\n", optarg);
+            else
+                placed = true;
+            break;
+        case 'T':
+            traceFile = optarg;
+            break;
+        case 'V':
+            verifyFiles = true;
+            break;
+        case 'E':
+            powerSave = true;
+            break;
+        case 'W':
+            powerReport = true;
+            break;
+        case 'N':
+            planarFiles = true;
+            break;
+        case 'M':
+            meterHz = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    if (bench)
+    {
+        if (optind >= argc)
+            return bench_run(NULL);
+        for (index = optind; index < argc; index++)
+        {
+            if (bench_run(argv[index]) < 0)
+            {
+                printf("unknown benchmark %s, one of:\n", argv[index]);
+                bench_list();
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if (stress)
+    {
+        index = stress_run(optind < argc ? argv[optind] : NULL);
+        if (index == STRESS_NO_FILE)
+            printf("Failed to create the test file\n");
+        else if (index == STRESS_UNKNOWN)
+        {
+            printf("unknown scenario %s, one of:\n", optind < argc ? argv[optind] : "");
+            stress_list();
+        }
+        return index;
+    }
+
+    if (placed)
+    {
+        for (index = 0; index < THREAD_CLASSES; index++)
+        {
+            ThreadPolicy::shared()->describe((thread_class_t)index, placement, sizeof(placement));
+            printf("%s threads: %s\n", ThreadPolicy::className((thread_class_t)index), placement);
+        }
+    }
+
+    if (daemonSocket)
+        return run_daemon(daemonSocket, optind < argc ? argv[optind] : "default", formatSpec) < 0 ? -1 : 0;
+
+    if ((optind >= argc && recordFile == NULL) || (scan && indexFile == NULL))
+    {
+        printf("usage: %s [-i index] [-g dB] [-t speed] [-d none|tpdf|shaped] [filename] \t- open WAV file, +/- change volume, </> speed\n", argv[0]);
+        printf("       %s -e type:freq[:q[:dB]] ... [filename] \t- equalize, type one of peak lowshelf highshelf lowpass highpass bandpass notch\n", argv[0]);
+        printf("       %s -l [filename ...] \t- loop the 'smpl' regions of the files\n", argv[0]);
+        printf("       %s -x ms [filename ...] \t- play files in turn, crossfading over ms\n", argv[0]);
+        printf("       %s -T trace.json [filename ...] \t- play and write a timeline of the pipeline for chrome://tracing\n", argv[0]);
+        printf("       %s -V [filename ...] \t- play and check that the device gets the file's samples unchanged\n", argv[0]);
+        printf("       %s -N [filename ...] \t- play with one buffer per channel, non-interleaved to devices that take it\n", argv[0]);
+        printf("       %s -E [-W] [filename ...] \t- play in energy mode, fewer wakeups for more latency; -W reports wakeups and cpu time\n", argv[0]);
+        printf("       %s -M hz [filename ...] \t- play and print levels and the loudest frequency hz times a second\n", argv[0]);
+        printf("       %s -r out.wav [-c device|file:in.wav|null] [-C channels[:rate[:bits]]] [-O] [filename ...] \t- record, playing the files meanwhile\n", argv[0]);
+        printf("       %s -o out.wav [-x ms] [-g dB] [-e ...] [-C channels[::bits]] [-j threads] [filename ...] \t- render the files to one file\n", argv[0]);
+        printf("       %s -k voices[:per clip] [-C channels[:rate[:bits]]] [filename ...] \t- trigger the files from memory with keys 1-9\n", argv[0]);
+        printf("       %s -D socket [-C channels[:rate[:bits]]] [device|null] \t- run the playback daemon\n", argv[0]);
+        printf("       %s -S socket [-m] [filename ...] \t- play the files through the daemon, -m writes them into a shared ring\n", argv[0]);
+        printf("       %s -i index -s [-j threads] [dir] \t- add WAV files below dir to index\n", argv[0]);
+        printf("       %s -a [-j threads] [filename] \t- measure loudness and true peak\n", argv[0]);
+        printf("       %s -w [-j threads] [filename] \t- build or refresh waveform overview\n", argv[0]);
+        printf("       %s -B [name] \t- run processing benchmarks\n", argv[0]);
+        printf("       %s -X [scenario] \t- play into a virtual device under injected faults and report underruns\n", argv[0]);
+        printf("       -P audio|io|dsp:cpus[:priority[:stack KiB]] \t- with any of the above, place a class of threads, e.g. audio:2-3:80\n");
         return -1;
     }
 
-    for (index = 0; index < (argc-1); index++)
+    if (indexFile)
+    {
+        wavIndex = new WavIndex();
+        if (wavIndex->load(indexFile) < 0 && !scan)
+            printf("No usable index %s, parsing headers\n", indexFile);
+    }
+
+    if (waveform)
+        return overview_files(argv + optind, argc - optind, threads) < 0 ? -1 : 0;
+
+    if (analyze)
+        return analyze_files(argv + optind, argc - optind, threads) < 0 ? -1 : 0;
+
+    if (scan)
+        return scan_dirs(argv + optind, argc - optind, indexFile, threads) < 0 ? -1 : 0;
+
+    if (clientSocket)
+        return play_through_daemon(argv + optind, argc - optind, clientSocket, sharedRing) < 0 ? -1 : 0;
+
+    if (voiceSpec)
+        return trigger_clips(argv + optind, argc - optind, voiceSpec, formatSpec) < 0 ? -1 : 0;
+
+    if (renderFile)
+    {
+        if (formatSpec && parse_format(formatSpec, &renderChannels, &renderRate, &renderFormat) < 0)
+        {
+            printf("Bad format %s\n", formatSpec);
+            return -1;
+        }
+        renderer = new PlaylistRenderer(threads);
+        renderer->setCrossfade(crossfadeMs);
+        renderer->setGain(powf(10, gainDb / 20));
+        renderer->setDither(ditherMode);
+        for (index = 0; index < filterCount; index++)
+            if (add_filter(renderer, index, filters[index]) < 0)
+                printf("Bad filter %s\n", filters[index]);
+
+        index = renderer->render(argv + optind, argc - optind, renderFile, renderFormat, renderChannels);
+        if (index == 0)
+            printf("rendered %s: %.1f s of audio in %.2f s, %.1fx real time\n", renderFile,
+                   (double)renderer->frames() / renderer->rate(), renderer->seconds(), renderer->speed());
+        delete renderer;
+        return index;
+    }
+
+    if (recordFile)
+    {
+        if (formatSpec && parse_format(formatSpec, &captureChannels, &captureRate, &captureFormat) < 0)
+        {
+            printf("Bad format %s\n", formatSpec);
+            return -1;
+        }
+        recorder = new Recorder();
+        if (recorder->start(captureSource, recordFile, captureFormat, captureChannels, captureRate, direct) < 0)
+        {
+            printf("Failed to record from %s\n", captureSource);
+            return -1;
+        }
+        printf("recording %s, %d channels %u Hz %s%s\n", recordFile, recorder->channels(),
+               recorder->rate(), snd_pcm_format_name(recorder->format()),
+               recorder->isDirect() ? ", O_DIRECT" : "");
+    }
+
+    if (traceFile)
+        Tracer::shared()->start();
+
+    if (crossfadeMs > 0 && optind < argc)
     {
-        pthread_create(&thID, NULL, play_thread, argv[index+1]);
+        playlist = argv + optind;
+        playlistCount = argc - optind;
+        pthread_create(&thID, NULL, playlist_thread, NULL);
         pthread_detach(thID);
     }
+    else
+    {
+        for (index = optind; index < argc; index++)
+        {
+            pthread_create(&thID, NULL, play_thread, argv[index]);
+            pthread_detach(thID);
+        }
+    }
 
     do 
     {
         printf("press Q key to quit ...");
         ch = getchar();
+        if (ch == '+' || ch == '-')
+        {
+            gainDb += ch == '+' ? 3 : -3;
+            printf("gain %+.1f dB\n", gainDb);
+        }
+        else if (ch == '<' || ch == '>')
+        {
+            speed += ch == '>' ? 0.1f : -0.1f;
+            if (speed < STRETCH_MIN_SPEED)
+                speed = STRETCH_MIN_SPEED;
+            else if (speed > STRETCH_MAX_SPEED)
+                speed = STRETCH_MAX_SPEED;
+            printf("speed %.2fx\n", speed);
+        }
     } while (ch != 'q' && ch != 'Q');
-    
+
+    if (traceFile)
+    {
+        Tracer::shared()->stop();
+        if (Tracer::shared()->save(traceFile) == 0)
+            printf("timeline in %s, %llu events dropped\n", traceFile,
+                   (unsigned long long)Tracer::shared()->dropped());
+    }
+
+    if (recorder)
+    {
+        index = recorder->stop();
+        printf("recorded %llu frames, %u overruns\n",
+               (unsigned long long)recorder->frames(), recorder->overruns());
+        delete recorder;
+        if (index < 0)
+            return -1;
+    }
+
     return 0;
 }
@@ -1,4 +1,9 @@
 #include <assert.h>
+#include <byteswap.h>
+#include <endian.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include "pcm_utils.h"
@@ -7,18 +12,6 @@
 #define MAX_COLUMNS 32
 
 
-void show_available_sample_formats(snd_pcm_t *handle, snd_pcm_hw_params_t* params)
-{
-	int format;
-
-	fprintf(stdout, "Available formats:\n");
-	for (format = 0; format <= SND_PCM_FORMAT_LAST; format++)
-	{
-		if (snd_pcm_hw_params_test_format(handle, params, (snd_pcm_format_t)format) == 0)
-			fprintf(stdout, "- %s\n", snd_pcm_format_name((snd_pcm_format_t)format));
-	}
-}
-
 int dump_memory(const unsigned char *buf, unsigned int size)
 {
     int             bytes, i;
@@ -74,3 +67,296 @@ int dump_memory(const unsigned char *buf, unsigned int size)
     return bytes;
 }
 
+
+int pcm_to_float(snd_pcm_format_t format, const void *src, float *dst, size_t samples)
+{
+    const uint8_t *p8 = (const uint8_t *)src;
+    const int16_t *p16 = (const int16_t *)src;
+    const int32_t *p32 = (const int32_t *)src;
+    const uint32_t *pu32 = (const uint32_t *)src;
+    size_t i;
+    int32_t v;
+    union { uint32_t u; float f; } fu;
+
+    switch (format)
+    {
+    case SND_PCM_FORMAT_U8:
+        for (i = 0; i < samples; i++)
+            dst[i] = ((int)p8[i] - 128) * (1.0f / 128);
+        break;
+    case SND_PCM_FORMAT_S16_LE:
+        for (i = 0; i < samples; i++)
+            dst[i] = (int16_t)le16toh(p16[i]) * (1.0f / 32768);
+        break;
+    case SND_PCM_FORMAT_S16_BE:
+        for (i = 0; i < samples; i++)
+            dst[i] = (int16_t)be16toh(p16[i]) * (1.0f / 32768);
+        break;
+    case SND_PCM_FORMAT_S24_3LE:
+        for (i = 0; i < samples; i++, p8 += 3)
+        {
+            v = (int32_t)((uint32_t)p8[0] << 8 | (uint32_t)p8[1] << 16 | (uint32_t)p8[2] << 24);
+            dst[i] = (v >> 8) * (1.0f / 8388608);
+        }
+        break;
+    case SND_PCM_FORMAT_S24_3BE:
+        for (i = 0; i < samples; i++, p8 += 3)
+        {
+            v = (int32_t)((uint32_t)p8[2] << 8 | (uint32_t)p8[1] << 16 | (uint32_t)p8[0] << 24);
+            dst[i] = (v >> 8) * (1.0f / 8388608);
+        }
+        break;
+    case SND_PCM_FORMAT_S24_LE:
+        /* low three bytes of a 32-bit container, sign extend */
+        for (i = 0; i < samples; i++)
+            dst[i] = ((int32_t)(le32toh(pu32[i]) << 8) >> 8) * (1.0f / 8388608);
+        break;
+    case SND_PCM_FORMAT_S24_BE:
+        for (i = 0; i < samples; i++)
+            dst[i] = ((int32_t)(be32toh(pu32[i]) << 8) >> 8) * (1.0f / 8388608);
+        break;
+    case SND_PCM_FORMAT_S32_LE:
+        for (i = 0; i < samples; i++)
+            dst[i] = (int32_t)le32toh(p32[i]) * (1.0f / 2147483648.0f);
+        break;
+    case SND_PCM_FORMAT_S32_BE:
+        for (i = 0; i < samples; i++)
+            dst[i] = (int32_t)be32toh(p32[i]) * (1.0f / 2147483648.0f);
+        break;
+    case SND_PCM_FORMAT_FLOAT_LE:
+        if (__BYTE_ORDER == __LITTLE_ENDIAN)
+        {
+            memcpy(dst, src, samples * sizeof(float));
+            break;
+        }
+        for (i = 0; i < samples; i++)
+        {
+            fu.u = le32toh(pu32[i]);
+            dst[i] = fu.f;
+        }
+        break;
+    case SND_PCM_FORMAT_FLOAT_BE:
+        for (i = 0; i < samples; i++)
+        {
+            fu.u = be32toh(pu32[i]);
+            dst[i] = fu.f;
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline int32_t clip_round(float v, float scale, int32_t lo, int32_t hi)
+{
+    float x = v * scale;
+
+    if (x >= (float)hi)
+        return hi;
+    if (x <= (float)lo)
+        return lo;
+    return (int32_t)lrintf(x);
+}
+
+int pcm_from_float(snd_pcm_format_t format, const float *src, void *dst, size_t samples)
+{
+    uint8_t *p8 = (uint8_t *)dst;
+    int16_t *p16 = (int16_t *)dst;
+    uint32_t *pu32 = (uint32_t *)dst;
+    size_t i;
+    int32_t v;
+    double d;
+    union { uint32_t u; float f; } fu;
+
+    switch (format)
+    {
+    case SND_PCM_FORMAT_U8:
+        for (i = 0; i < samples; i++)
+            p8[i] = clip_round(src[i], 128, -128, 127) + 128;
+        break;
+    case SND_PCM_FORMAT_S16_LE:
+        for (i = 0; i < samples; i++)
+            p16[i] = htole16((int16_t)clip_round(src[i], 32768, -32768, 32767));
+        break;
+    case SND_PCM_FORMAT_S16_BE:
+        for (i = 0; i < samples; i++)
+            p16[i] = htobe16((int16_t)clip_round(src[i], 32768, -32768, 32767));
+        break;
+    case SND_PCM_FORMAT_S24_3LE:
+        for (i = 0; i < samples; i++, p8 += 3)
+        {
+            v = clip_round(src[i], 8388608, -8388608, 8388607);
+            p8[0] = v;
+            p8[1] = v >> 8;
+            p8[2] = v >> 16;
+        }
+        break;
+    case SND_PCM_FORMAT_S24_3BE:
+        for (i = 0; i < samples; i++, p8 += 3)
+        {
+            v = clip_round(src[i], 8388608, -8388608, 8388607);
+            p8[2] = v;
+            p8[1] = v >> 8;
+            p8[0] = v >> 16;
+        }
+        break;
+    case SND_PCM_FORMAT_S24_LE:
+        for (i = 0; i < samples; i++)
+            pu32[i] = htole32((uint32_t)clip_round(src[i], 8388608, -8388608, 8388607));
+        break;
+    case SND_PCM_FORMAT_S24_BE:
+        for (i = 0; i < samples; i++)
+            pu32[i] = htobe32((uint32_t)clip_round(src[i], 8388608, -8388608, 8388607));
+        break;
+    case SND_PCM_FORMAT_S32_LE:
+    case SND_PCM_FORMAT_S32_BE:
+        /* float cannot represent INT32_MAX, clip in double */
+        for (i = 0; i < samples; i++)
+        {
+            d = src[i] * 2147483648.0;
+            if (d >= 2147483647.0)
+                v = INT32_MAX;
+            else if (d <= -2147483648.0)
+                v = INT32_MIN;
+            else
+                v = (int32_t)lrint(d);
+            pu32[i] = (format == SND_PCM_FORMAT_S32_LE) ? htole32((uint32_t)v) : htobe32((uint32_t)v);
+        }
+        break;
+    case SND_PCM_FORMAT_FLOAT_LE:
+        if (__BYTE_ORDER == __LITTLE_ENDIAN)
+        {
+            memcpy(dst, src, samples * sizeof(float));
+            break;
+        }
+        for (i = 0; i < samples; i++)
+        {
+            fu.f = src[i];
+            pu32[i] = htole32(fu.u);
+        }
+        break;
+    case SND_PCM_FORMAT_FLOAT_BE:
+        for (i = 0; i < samples; i++)
+        {
+            fu.f = src[i];
+            pu32[i] = htobe32(fu.u);
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    return 0;
+}
+
+int pcm_open_playback(snd_pcm_t **handle, const char *device, snd_pcm_format_t format,
+                      unsigned int *channels, unsigned int *rate,
+                      unsigned int period_us, unsigned int periods, snd_pcm_uframes_t *period)
+{
+    snd_pcm_hw_params_t *params;
+    snd_pcm_sw_params_t *swparams;
+    unsigned int period_time = period_us, buffer_time = period_us * periods;
+    snd_pcm_uframes_t buffer_size;
+    int err;
+
+    err = snd_pcm_open(handle, device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0)
+    {
+        fprintf(stderr, "audio open error: %s\n", snd_strerror(err));
+        *handle = NULL;
+        return -1;
+    }
+
+    snd_pcm_hw_params_alloca(&params);
+    snd_pcm_sw_params_alloca(&swparams);
+    if (snd_pcm_hw_params_any(*handle, params) < 0 ||
+        snd_pcm_hw_params_set_access(*handle, params, SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
+    {
+        fprintf(stderr, "%s: no interleaved playback\n", device);
+        goto fail;
+    }
+
+    if (snd_pcm_hw_params_set_format(*handle, params, format) < 0)
+    {
+        fprintf(stderr, "%s: can't play %s\n", device, snd_pcm_format_name(format));
+        goto fail;
+    }
+
+    if (snd_pcm_hw_params_set_channels_near(*handle, params, channels) < 0 ||
+        snd_pcm_hw_params_set_rate_near(*handle, params, rate, 0) < 0)
+    {
+        fprintf(stderr, "%s: no usable channel count or rate\n", device);
+        goto fail;
+    }
+
+    snd_pcm_hw_params_set_period_time_near(*handle, params, &period_time, 0);
+    snd_pcm_hw_params_set_buffer_time_near(*handle, params, &buffer_time, 0);
+
+    err = snd_pcm_hw_params(*handle, params);
+    if (err < 0)
+    {
+        fprintf(stderr, "%s: unable to install hw params: %s\n", device, snd_strerror(err));
+        goto fail;
+    }
+
+    snd_pcm_hw_params_get_period_size(params, period, 0);
+    snd_pcm_hw_params_get_buffer_size(params, &buffer_size);
+
+    if (snd_pcm_sw_params_current(*handle, swparams) < 0 ||
+        snd_pcm_sw_params_set_avail_min(*handle, swparams, *period) < 0 ||
+        snd_pcm_sw_params_set_start_threshold(*handle, swparams, buffer_size) < 0 ||
+        snd_pcm_sw_params(*handle, swparams) < 0)
+    {
+        fprintf(stderr, "%s: unable to install sw params\n", device);
+        goto fail;
+    }
+
+    return 0;
+
+fail:
+    snd_pcm_close(*handle);
+    *handle = NULL;
+    return -1;
+}
+
+int pcm_wait_room(snd_pcm_t *handle, snd_pcm_uframes_t frames, const bool *running, uint32_t *xruns)
+{
+    snd_pcm_sframes_t avail;
+
+    while (__atomic_load_n(running, __ATOMIC_ACQUIRE))
+    {
+        avail = snd_pcm_avail_update(handle);
+        if (avail < 0)
+        {
+            if (avail == -EPIPE && xruns)
+                __atomic_add_fetch(xruns, 1, __ATOMIC_RELAXED);
+            if (snd_pcm_recover(handle, avail, 1) < 0)
+                return -1;
+            continue;
+        }
+        if ((snd_pcm_uframes_t)avail >= frames)
+            return 0;
+
+        snd_pcm_wait(handle, 100);
+    }
+
+    return -1;
+}
+
+int pcm_write_recover(snd_pcm_t *handle, const void *buf, snd_pcm_uframes_t frames, uint32_t *xruns)
+{
+    snd_pcm_sframes_t r;
+
+    r = snd_pcm_writei(handle, buf, frames);
+    if (r >= 0)
+        return 0;
+
+    if (r == -EPIPE && xruns)
+        __atomic_add_fetch(xruns, 1, __ATOMIC_RELAXED);
+    if (snd_pcm_recover(handle, r, 1) < 0)
+        return (int)r;
+
+    return 0;
+}
@@ -1,16 +1,52 @@
 #ifndef _PCM_UTILS_H_
 #define _PCM_UTILS_H_
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <alsa/asoundlib.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void show_available_sample_formats(snd_pcm_t *handle, snd_pcm_hw_params_t* params);
-
 int dump_memory(const unsigned char *buf, unsigned int size);
 
+/*
+ * Convert interleaved samples of an integer or float PCM format to float
+ * in [-1.0, 1.0). Returns -1 for formats that are not supported.
+ */
+int pcm_to_float(snd_pcm_format_t format, const void *src, float *dst, size_t samples);
+
+/*
+ * Convert float samples back to an integer or float PCM format, integer
+ * targets are rounded and clipped. Returns -1 for unsupported formats.
+ */
+int pcm_from_float(snd_pcm_format_t format, const float *src, void *dst, size_t samples);
+
+/*
+ * Open device for interleaved playback of format, at the channel count and
+ * rate nearest to *channels and *rate, with periods of about period_us and
+ * periods of them in the buffer. It is woken every period and starts once
+ * the buffer is full. The values granted are written back, the period in
+ * frames to *period. Returns -1 with *handle NULL on failure.
+ */
+int pcm_open_playback(snd_pcm_t **handle, const char *device, snd_pcm_format_t format,
+                      unsigned int *channels, unsigned int *rate,
+                      unsigned int period_us, unsigned int periods, snd_pcm_uframes_t *period);
+
+/*
+ * Until the device has room for frames, recovering from underruns and
+ * suspends on the way. Returns -1 when it can't be recovered or once
+ * *running is cleared. Underruns are counted in *xruns unless it is NULL.
+ */
+int pcm_wait_room(snd_pcm_t *handle, snd_pcm_uframes_t frames, const bool *running, uint32_t *xruns);
+
+/*
+ * Write frames, recovering from underruns and suspends the same way.
+ * Returns 0, or the error that could not be recovered from.
+ */
+int pcm_write_recover(snd_pcm_t *handle, const void *buf, snd_pcm_uframes_t frames, uint32_t *xruns);
+
 
 #ifdef __cplusplus
 }
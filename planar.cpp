@@ -0,0 +1,314 @@
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "planar.h"
+#include "thread_policy.h"
+
+PlanarBuffer::PlanarBuffer()
+    : buf(NULL)
+    , bytes(0)
+    , ptrs(NULL)
+    , count(0)
+    , width(0)
+{
+}
+
+PlanarBuffer::~PlanarBuffer()
+{
+    ThreadPolicy::freeLocal(buf);
+    free(ptrs);
+}
+
+int PlanarBuffer::setup(int channels, size_t frames, size_t sampleBytes)
+{
+    size_t stride = (frames * sampleBytes + PLANAR_ALIGN - 1) & ~(size_t)(PLANAR_ALIGN - 1);
+    void **p;
+    int c;
+
+    if (channels < 1)
+        return -1;
+
+    if (stride * channels > bytes)
+    {
+        ThreadPolicy::freeLocal(buf);
+        /* filled and drained by the playing thread */
+        buf = (char *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO, stride * channels);
+        bytes = buf ? stride * channels : 0;
+        if (buf == NULL)
+            return -1;
+    }
+
+    p = (void **)realloc(ptrs, channels * sizeof(void *));
+    if (p == NULL)
+        return -1;
+    ptrs = p;
+    for (c = 0; c < channels; c++)
+        ptrs[c] = buf + c * stride;
+    count = channels;
+    width = sampleBytes;
+
+    return 0;
+}
+
+template <typename T>
+static void splitStrided(const T *__restrict in, void *const *planes, int channels, size_t frames)
+{
+    size_t f;
+    int c;
+
+    for (c = 0; c < channels; c++)
+    {
+        T *__restrict out = (T *)planes[c];
+        for (f = 0; f < frames; f++)
+            out[f] = in[f * channels + c];
+    }
+}
+
+template <typename T>
+static void joinStrided(void *const *planes, T *__restrict out, int channels, size_t frames)
+{
+    size_t f;
+    int c;
+
+    for (c = 0; c < channels; c++)
+    {
+        const T *__restrict in = (const T *)planes[c];
+        for (f = 0; f < frames; f++)
+            out[f * channels + c] = in[f];
+    }
+}
+
+/* S24_3LE and other odd widths, a byte copy per sample */
+static void splitBytes(const char *in, void *const *planes, int channels, size_t width, size_t frames)
+{
+    size_t f;
+    int c;
+
+    for (c = 0; c < channels; c++)
+        for (f = 0; f < frames; f++)
+            memcpy((char *)planes[c] + f * width, in + (f * channels + c) * width, width);
+}
+
+static void joinBytes(void *const *planes, char *out, int channels, size_t width, size_t frames)
+{
+    size_t f;
+    int c;
+
+    for (c = 0; c < channels; c++)
+        for (f = 0; f < frames; f++)
+            memcpy(out + (f * channels + c) * width, (const char *)planes[c] + f * width, width);
+}
+
+/* interleaved stereo S16 to two planes, eight frames at a time */
+static size_t split16x2(const int16_t *in, int16_t *l, int16_t *r, size_t frames)
+{
+    size_t f = 0;
+
+#ifdef __SSE2__
+    for (; f + 8 <= frames; f += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(in + 2 * f));
+        __m128i b = _mm_loadu_si128((const __m128i *)(in + 2 * f + 8));
+        /* the low half of each 32-bit pair is left, sign extended packs back exactly */
+        __m128i la = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+        __m128i lb = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+        _mm_storeu_si128((__m128i *)(l + f), _mm_packs_epi32(la, lb));
+        _mm_storeu_si128((__m128i *)(r + f), _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16)));
+    }
+#endif
+    return f;
+}
+
+static size_t join16x2(const int16_t *l, const int16_t *r, int16_t *out, size_t frames)
+{
+    size_t f = 0;
+
+#ifdef __SSE2__
+    for (; f + 8 <= frames; f += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(l + f));
+        __m128i b = _mm_loadu_si128((const __m128i *)(r + f));
+        _mm_storeu_si128((__m128i *)(out + 2 * f), _mm_unpacklo_epi16(a, b));
+        _mm_storeu_si128((__m128i *)(out + 2 * f + 8), _mm_unpackhi_epi16(a, b));
+    }
+#endif
+    return f;
+}
+
+/* 32-bit samples, S32, S24 and float alike: only bits are moved */
+static size_t split32x2(const float *in, float *l, float *r, size_t frames)
+{
+    size_t f = 0;
+
+#ifdef __SSE2__
+    for (; f + 4 <= frames; f += 4)
+    {
+        __m128 a = _mm_loadu_ps(in + 2 * f);
+        __m128 b = _mm_loadu_ps(in + 2 * f + 4);
+        _mm_storeu_ps(l + f, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+        _mm_storeu_ps(r + f, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+#endif
+    return f;
+}
+
+static size_t join32x2(const float *l, const float *r, float *out, size_t frames)
+{
+    size_t f = 0;
+
+#ifdef __SSE2__
+    for (; f + 4 <= frames; f += 4)
+    {
+        __m128 a = _mm_loadu_ps(l + f);
+        __m128 b = _mm_loadu_ps(r + f);
+        _mm_storeu_ps(out + 2 * f, _mm_unpacklo_ps(a, b));
+        _mm_storeu_ps(out + 2 * f + 4, _mm_unpackhi_ps(a, b));
+    }
+#endif
+    return f;
+}
+
+/* four channels of 32-bit samples, a 4x4 transpose per four frames, both ways */
+static size_t transpose32x4(float *const *a, float *const *b, size_t frames, bool toPlanes)
+{
+    size_t f = 0;
+
+#ifdef __SSE2__
+    const float *in = toPlanes ? a[0] : NULL;
+    float *out = toPlanes ? NULL : b[0];
+    __m128 r0, r1, r2, r3;
+
+    for (; f + 4 <= frames; f += 4)
+    {
+        if (toPlanes)
+        {
+            r0 = _mm_loadu_ps(in + 4 * f);
+            r1 = _mm_loadu_ps(in + 4 * f + 4);
+            r2 = _mm_loadu_ps(in + 4 * f + 8);
+            r3 = _mm_loadu_ps(in + 4 * f + 12);
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            _mm_storeu_ps(b[0] + f, r0);
+            _mm_storeu_ps(b[1] + f, r1);
+            _mm_storeu_ps(b[2] + f, r2);
+            _mm_storeu_ps(b[3] + f, r3);
+        }
+        else
+        {
+            r0 = _mm_loadu_ps(a[0] + f);
+            r1 = _mm_loadu_ps(a[1] + f);
+            r2 = _mm_loadu_ps(a[2] + f);
+            r3 = _mm_loadu_ps(a[3] + f);
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+            _mm_storeu_ps(out + 4 * f, r0);
+            _mm_storeu_ps(out + 4 * f + 4, r1);
+            _mm_storeu_ps(out + 4 * f + 8, r2);
+            _mm_storeu_ps(out + 4 * f + 12, r3);
+        }
+    }
+#endif
+    return f;
+}
+
+void PlanarBuffer::deinterleave(const void *in, void *const *planes, int channels,
+                                size_t sampleBytes, size_t frames)
+{
+    const char *src = (const char *)in;
+    void *rest[4];
+    float *quad[4];
+    size_t done = 0;
+    int c;
+
+    if (channels == 2 && sampleBytes == 2)
+        done = split16x2((const int16_t *)in, (int16_t *)planes[0], (int16_t *)planes[1], frames);
+    else if (channels == 2 && sampleBytes == 4)
+        done = split32x2((const float *)in, (float *)planes[0], (float *)planes[1], frames);
+    else if (channels == 4 && sampleBytes == 4)
+    {
+        quad[0] = (float *)in;
+        done = transpose32x4(quad, (float *const *)planes, frames, true);
+    }
+
+    /* what the vector loops left over, or all of it */
+    if (channels <= 4)
+    {
+        for (c = 0; c < channels; c++)
+            rest[c] = (char *)planes[c] + done * sampleBytes;
+        planes = rest;
+    }
+    else
+        done = 0;
+    src += done * channels * sampleBytes;
+    frames -= done;
+
+    switch (sampleBytes)
+    {
+    case 1:
+        splitStrided((const uint8_t *)src, planes, channels, frames);
+        break;
+    case 2:
+        splitStrided((const int16_t *)src, planes, channels, frames);
+        break;
+    case 4:
+        splitStrided((const int32_t *)src, planes, channels, frames);
+        break;
+    case 8:
+        splitStrided((const int64_t *)src, planes, channels, frames);
+        break;
+    default:
+        splitBytes(src, planes, channels, sampleBytes, frames);
+        break;
+    }
+}
+
+void PlanarBuffer::interleave(void *const *planes, void *out, int channels,
+                              size_t sampleBytes, size_t frames)
+{
+    char *dst = (char *)out;
+    void *rest[4];
+    float *quad[4];
+    size_t done = 0;
+    int c;
+
+    if (channels == 2 && sampleBytes == 2)
+        done = join16x2((const int16_t *)planes[0], (const int16_t *)planes[1], (int16_t *)out, frames);
+    else if (channels == 2 && sampleBytes == 4)
+        done = join32x2((const float *)planes[0], (const float *)planes[1], (float *)out, frames);
+    else if (channels == 4 && sampleBytes == 4)
+    {
+        quad[0] = (float *)out;
+        done = transpose32x4((float *const *)planes, quad, frames, false);
+    }
+
+    if (channels <= 4)
+    {
+        for (c = 0; c < channels; c++)
+            rest[c] = (char *)planes[c] + done * sampleBytes;
+        planes = rest;
+    }
+    else
+        done = 0;
+    dst += done * channels * sampleBytes;
+    frames -= done;
+
+    switch (sampleBytes)
+    {
+    case 1:
+        joinStrided(planes, (uint8_t *)dst, channels, frames);
+        break;
+    case 2:
+        joinStrided(planes, (int16_t *)dst, channels, frames);
+        break;
+    case 4:
+        joinStrided(planes, (int32_t *)dst, channels, frames);
+        break;
+    case 8:
+        joinStrided(planes, (int64_t *)dst, channels, frames);
+        break;
+    default:
+        joinBytes(planes, dst, channels, sampleBytes, frames);
+        break;
+    }
+}
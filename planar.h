@@ -0,0 +1,44 @@
+#ifndef _PLANAR_H_
+#define _PLANAR_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define PLANAR_ALIGN    64          /* every plane starts on a cache line */
+
+/*
+ * Samples kept per channel, each channel contiguous: a plane. The plane
+ * pointers are what snd_pcm_writen() takes. split() and join() convert
+ * from and to interleaved frames of any sample width, with SSE2 paths
+ * for the common stereo and quad layouts.
+ */
+class PlanarBuffer
+{
+public:
+    PlanarBuffer();
+    virtual ~PlanarBuffer();
+
+    /* reallocates only when it has to grow, the planes are then undefined */
+    int    setup(int channels, size_t frames, size_t sampleBytes);
+
+    void **planes() { return ptrs; }
+    char  *plane(int c) { return (char *)ptrs[c]; }
+    int    channels() { return count; }
+
+    void   split(const void *in, size_t frames) { deinterleave(in, ptrs, count, width, frames); }
+    void   join(void *out, size_t frames) { interleave(ptrs, out, count, width, frames); }
+
+    static void deinterleave(const void *in, void *const *planes, int channels,
+                             size_t sampleBytes, size_t frames);
+    static void interleave(void *const *planes, void *out, int channels,
+                           size_t sampleBytes, size_t frames);
+
+private:
+    char   *buf;
+    size_t  bytes;
+    void  **ptrs;
+    int     count;
+    size_t  width;
+};
+
+#endif
@@ -0,0 +1,845 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "play_daemon.h"
+#include "thread_policy.h"
+#include "pcm_utils.h"
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t thread_cpu_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+PlayDaemon::PlayDaemon()
+    : socketPath(NULL)
+    , listenFd(-1)
+    , clientCount(0)
+    , handle(NULL)
+    , sampleFormat(SND_PCM_FORMAT_UNKNOWN)
+    , numChannels(0)
+    , sampleRate(0)
+    , period(0)
+    , deadline(0)
+    , nextId(0)
+    , bus(NULL)
+    , scratch(NULL)
+    , mixed(NULL)
+    , out(NULL)
+    , controlThID(0)
+    , mixThID(0)
+    , running(false)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+PlayDaemon::~PlayDaemon()
+{
+    stop();
+    pthread_mutex_destroy(&lock);
+}
+
+void* PlayDaemon::controlThreadFunc(void *data)
+{
+    static_cast<PlayDaemon *>(data)->controlTask();
+
+    return NULL;
+}
+
+void* PlayDaemon::mixThreadFunc(void *data)
+{
+    static_cast<PlayDaemon *>(data)->mixTask();
+
+    return NULL;
+}
+
+void* PlayDaemon::readerThreadFunc(void *data)
+{
+    stream_t *s = static_cast<stream_t *>(data);
+
+    s->daemon->readerTask(s);
+
+    return NULL;
+}
+
+int PlayDaemon::openDevice(const char *device)
+{
+    unsigned int channels = numChannels, rate = sampleRate;
+    snd_pcm_uframes_t periodSize;
+
+    if (strcmp(device, "null") == 0)
+    {
+        period = (size_t)sampleRate * DAEMON_PERIOD_US / 1000000;
+        deadline = monotonic_ns();
+        return 0;
+    }
+
+    if (pcm_open_playback(&handle, device, sampleFormat, &channels, &rate,
+                          DAEMON_PERIOD_US, DAEMON_PERIODS, &periodSize) < 0)
+        return -1;
+
+    numChannels = channels;
+    sampleRate = rate;
+    period = periodSize;
+
+    return 0;
+}
+
+int PlayDaemon::start(const char *path, const char *device, snd_pcm_format_t format,
+                      int channels, uint32_t rate)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (listenFd >= 0)
+        return -1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    /* a socket somebody still answers on belongs to a running daemon */
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+        fprintf(stderr, "%s: daemon already running\n", path);
+        ::close(fd);
+        return -1;
+    }
+    if (fd >= 0)
+        ::close(fd);
+    unlink(path);
+
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listenFd < 0 ||
+        bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listenFd, DAEMON_MAX_CLIENTS) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        stop();
+        return -1;
+    }
+    socketPath = strdup(path);
+
+    sampleFormat = format;
+    numChannels = channels;
+    sampleRate = rate;
+    if (openDevice(device) < 0)
+    {
+        stop();
+        return -1;
+    }
+
+    bus = (float *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO, period * numChannels * sizeof(float));
+    scratch = (float *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO, period * MIXER_MAX_CHANNELS * sizeof(float));
+    mixed = (float *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO, period * numChannels * sizeof(float));
+    out = (char *)ThreadPolicy::shared()->allocLocal(THREAD_AUDIO, period * snd_pcm_format_size(sampleFormat, numChannels));
+    if (bus == NULL || scratch == NULL || mixed == NULL || out == NULL ||
+        busRequant.setup(SND_PCM_FORMAT_FLOAT, sampleFormat, numChannels, DITHER_TPDF) < 0)
+    {
+        stop();
+        return -1;
+    }
+
+    running = true;
+    if (ThreadPolicy::shared()->create(THREAD_AUDIO, &mixThID, mixThreadFunc, this) != 0)
+    {
+        mixThID = 0;
+        stop();
+        return -1;
+    }
+    if (ThreadPolicy::shared()->create(THREAD_IO, &controlThID, controlThreadFunc, this) != 0)
+    {
+        controlThID = 0;
+        stop();
+        return -1;
+    }
+
+    return 0;
+}
+
+void PlayDaemon::stop()
+{
+    list<stream_t *>::iterator it;
+    int i;
+
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    if (controlThID)
+    {
+        pthread_join(controlThID, NULL);
+        controlThID = 0;
+    }
+    if (mixThID)
+    {
+        pthread_join(mixThID, NULL);
+        mixThID = 0;
+    }
+
+    for (it = streams.begin(); it != streams.end(); ++it)
+        freeStream(*it);
+    streams.clear();
+
+    for (i = 0; i < clientCount; i++)
+        ::close(clientFds[i]);
+    clientCount = 0;
+
+    if (listenFd >= 0)
+    {
+        ::close(listenFd);
+        listenFd = -1;
+    }
+    if (socketPath)
+    {
+        unlink(socketPath);
+        free(socketPath);
+        socketPath = NULL;
+    }
+
+    if (handle)
+    {
+        snd_pcm_drop(handle);
+        snd_pcm_close(handle);
+        handle = NULL;
+    }
+
+    ThreadPolicy::freeLocal(bus);
+    ThreadPolicy::freeLocal(scratch);
+    ThreadPolicy::freeLocal(mixed);
+    ThreadPolicy::freeLocal(out);
+    bus = scratch = mixed = NULL;
+    out = NULL;
+}
+
+/*
+ * The data area is rounded up to whole periods of the stream's frames. A
+ * shared ring lives in a memfd that is sealed at its size, so the client
+ * can't shrink it under the daemon's mapping.
+ */
+PlayDaemon::stream_t *PlayDaemon::newStream(snd_pcm_format_t format, int channels, uint32_t mask,
+                                            uint32_t ringMs, bool shared)
+{
+    uint32_t inPos[MIXER_MAX_CHANNELS], outPos[MIXER_MAX_CHANNELS];
+    uint64_t frames;
+    stream_t *s;
+    void *mem;
+
+    s = new stream_t;
+    s->daemon = this;
+    s->id = 0;
+    s->client = -1;
+    s->ring = NULL;
+    s->memFd = -1;
+    s->eventFd = -1;
+    s->format = format;
+    s->channels = channels;
+    s->file = NULL;
+    s->readerThID = 0;
+    s->stopping = false;
+    s->ended = false;
+    s->endedAt = 0;
+    s->tail = 0;
+    memset(&s->stats, 0, sizeof(s->stats));
+
+    frames = (uint64_t)sampleRate * ringMs / 1000;
+    frames = (frames + period - 1) / period * period;
+    if (frames < 2 * period)
+        frames = 2 * period;
+    s->frameBytes = snd_pcm_format_size(format, channels);
+    s->capacity = frames * s->frameBytes;
+    s->mapSize = DAEMON_RING_HEADER + s->capacity;
+
+    if (shared)
+    {
+        s->memFd = memfd_create("aplayer-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (s->memFd < 0 || ftruncate(s->memFd, s->mapSize) < 0 ||
+            fcntl(s->memFd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+        {
+            freeStream(s);
+            return NULL;
+        }
+        mem = mmap(NULL, s->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, s->memFd, 0);
+    }
+    else
+        mem = mmap(NULL, s->mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+    {
+        freeStream(s);
+        return NULL;
+    }
+    s->ring = (daemon_ring_t *)mem;
+    s->data = (char *)mem + DAEMON_RING_HEADER;
+
+    s->eventFd = eventfd(0, EFD_CLOEXEC);
+    if (s->eventFd < 0)
+    {
+        freeStream(s);
+        return NULL;
+    }
+
+    ChannelMixer::maskPositions(mask ? mask : ChannelMixer::defaultMask(channels), channels, inPos);
+    ChannelMixer::maskPositions(ChannelMixer::defaultMask(numChannels), numChannels, outPos);
+    if (s->mixer.setup(inPos, channels, outPos, numChannels) < 0)
+    {
+        freeStream(s);
+        return NULL;
+    }
+
+    memset(s->ring, 0, sizeof(daemon_ring_t));
+    s->ring->frameBytes = s->frameBytes;
+    s->ring->capacity = s->capacity;
+    __atomic_store_n(&s->ring->magic, DAEMON_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return s;
+}
+
+void PlayDaemon::freeStream(stream_t *s)
+{
+    if (s->readerThID)
+    {
+        __atomic_store_n(&s->stopping, true, __ATOMIC_RELEASE);
+        wakeProducer(s);
+        pthread_join(s->readerThID, NULL);
+    }
+    if (s->file)
+        delete s->file;
+    if (s->ring)
+        munmap(s->ring, s->mapSize);
+    if (s->memFd >= 0)
+        ::close(s->memFd);
+    if (s->eventFd >= 0)
+        ::close(s->eventFd);
+    delete s;
+}
+
+PlayDaemon::stream_t *PlayDaemon::findStream(int id)
+{
+    list<stream_t *>::iterator it;
+
+    for (it = streams.begin(); it != streams.end(); ++it)
+        if ((*it)->id == id)
+            return *it;
+
+    return NULL;
+}
+
+void PlayDaemon::wakeProducer(stream_t *s)
+{
+    uint64_t one = 1;
+
+    if (write(s->eventFd, &one, sizeof(one)) < 0)
+        return;
+}
+
+/* with the lock held */
+void PlayDaemon::endStream(stream_t *s)
+{
+    s->ended = true;
+    s->endedAt = monotonic_ns() / 1000000;
+    __atomic_store_n(&s->ring->ended, 1, __ATOMIC_RELEASE);
+    wakeProducer(s);
+}
+
+/*
+ * Adds one period of s to the bus, with the lock held. Whatever the ring
+ * says is checked against the daemon's own copy of its geometry first: a
+ * client can scribble over the shared header but can't make the mixer
+ * read outside the mapping.
+ */
+bool PlayDaemon::mixStream(stream_t *s, uint64_t outNs)
+{
+    daemon_ring_t *ring = s->ring;
+    uint64_t cpu = thread_cpu_ns(), head, avail, frames, first, pos, stampPos, stampNs, played;
+    const float *src;
+    size_t i, samples;
+
+    if (s->stopping)
+    {
+        endStream(s);
+        return false;
+    }
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    avail = head - s->tail;
+    if (avail > s->capacity || avail % s->frameBytes)
+    {
+        fprintf(stderr, "stream %d: corrupt ring, dropped\n", s->id);
+        endStream(s);
+        return false;
+    }
+
+    frames = avail / s->frameBytes;
+    if (frames > period)
+        frames = period;
+    if (frames < period && !__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) && head > 0)
+        s->stats.underruns++;
+    if (frames == 0)
+    {
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) &&
+            head == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+            endStream(s);
+        s->stats.cpuNs += thread_cpu_ns() - cpu;
+        return false;
+    }
+
+    pos = s->tail % s->capacity;
+    first = (s->capacity - pos) / s->frameBytes;
+    if (first > frames)
+        first = frames;
+    pcm_to_float(s->format, s->data + pos, scratch, first * s->channels);
+    if (frames > first)
+        pcm_to_float(s->format, s->data, scratch + first * s->channels, (frames - first) * s->channels);
+
+    src = scratch;
+    if (!s->mixer.isIdentity())
+    {
+        s->mixer.process(scratch, mixed, SND_PCM_FORMAT_FLOAT, frames);
+        src = mixed;
+    }
+    samples = frames * numChannels;
+    for (i = 0; i < samples; i++)
+        bus[i] += src[i];
+
+    /* the stamped write is heard when its last frame leaves the output */
+    if (daemon_ring_read_stamp(ring, &stampPos, &stampNs) &&
+        stampPos > s->tail && stampPos <= s->tail + frames * s->frameBytes)
+    {
+        played = outNs + (stampPos - s->tail) / s->frameBytes * 1000000000ULL / sampleRate;
+        if (played > stampNs)
+        {
+            s->stats.latencyUs = (played - stampNs) / 1000;
+            if (s->stats.latencyUs > s->stats.maxLatencyUs)
+                s->stats.maxLatencyUs = s->stats.latencyUs;
+        }
+    }
+
+    s->tail += frames * s->frameBytes;
+    s->stats.frames += frames;
+    __atomic_store_n(&ring->tail, s->tail, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&ring->waiting, 0, __ATOMIC_SEQ_CST))
+        wakeProducer(s);
+
+    if (s->tail == head && __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE) &&
+        head == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        endStream(s);
+
+    s->stats.cpuNs += thread_cpu_ns() - cpu;
+
+    return true;
+}
+
+/* until the output takes a period, -1 when it is gone */
+int PlayDaemon::waitOutput()
+{
+    struct timespec ts;
+    uint64_t now;
+
+    if (handle == NULL)
+    {
+        /* a late wakeup is made up, a long stall starts over */
+        now = monotonic_ns();
+        deadline += (uint64_t)period * 1000000000ULL / sampleRate;
+        if (now > deadline + (uint64_t)DAEMON_PERIODS * DAEMON_PERIOD_US * 1000)
+            deadline = now;
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+        return __atomic_load_n(&running, __ATOMIC_ACQUIRE) ? 0 : -1;
+    }
+
+    return pcm_wait_room(handle, period, &running, NULL);
+}
+
+/* when the period mixed now starts to play */
+uint64_t PlayDaemon::outputTime()
+{
+    snd_pcm_sframes_t delay;
+    uint64_t now = monotonic_ns();
+
+    if (handle && snd_pcm_delay(handle, &delay) == 0 && delay > 0)
+        now += (uint64_t)delay * 1000000000ULL / sampleRate;
+
+    return now;
+}
+
+int PlayDaemon::writeOutput()
+{
+    int err;
+
+    if (handle == NULL)
+        return 0;
+
+    err = pcm_write_recover(handle, out, period, NULL);
+    if (err < 0)
+    {
+        fprintf(stderr, "daemon write error: %s\n", snd_strerror(err));
+        return -1;
+    }
+
+    return 0;
+}
+
+void PlayDaemon::mixTask()
+{
+    list<stream_t *>::iterator it;
+    uint64_t outNs;
+    int count;
+
+    while (waitOutput() == 0)
+    {
+        outNs = outputTime();
+        count = 0;
+        memset(bus, 0, period * numChannels * sizeof(float));
+
+        pthread_mutex_lock(&lock);
+        for (it = streams.begin(); it != streams.end(); ++it)
+            if (!(*it)->ended && mixStream(*it, outNs))
+                count++;
+        pthread_mutex_unlock(&lock);
+
+        if (count)
+            busRequant.process(bus, out, period);
+        else
+            snd_pcm_format_set_silence(sampleFormat, out, period * numChannels);
+
+        if (writeOutput() < 0)
+            break;
+    }
+}
+
+/* fills the ring of a file the daemon plays itself */
+void PlayDaemon::readerTask(stream_t *s)
+{
+    daemon_ring_t *ring = s->ring;
+    uint64_t cpu = thread_cpu_ns(), head = 0, tail, space, pos, now;
+    ssize_t bytes;
+
+    while (!__atomic_load_n(&s->stopping, __ATOMIC_ACQUIRE))
+    {
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        space = s->capacity - (head - tail);
+        if (space == 0)
+        {
+            uint64_t count;
+
+            __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail &&
+                !__atomic_load_n(&s->stopping, __ATOMIC_ACQUIRE) &&
+                read(s->eventFd, &count, sizeof(count)) < 0 && errno != EINTR)
+                break;
+            continue;
+        }
+
+        pos = head % s->capacity;
+        if (space > s->capacity - pos)
+            space = s->capacity - pos;
+        bytes = s->file->readData(s->data + pos, space);
+        if (bytes <= 0)
+            break;
+
+        head += bytes;
+        now = monotonic_ns();
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+        daemon_ring_stamp(ring, head, now);
+    }
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&lock);
+    s->stats.cpuNs += thread_cpu_ns() - cpu;
+    pthread_mutex_unlock(&lock);
+}
+
+int PlayDaemon::sendReply(int fd, daemon_reply_t *reply, int *fds, int count)
+{
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+
+    reply->format = sampleFormat;
+    reply->channels = numChannels;
+    reply->rate = sampleRate;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = reply;
+    iov.iov_len = sizeof(*reply);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (count)
+    {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    }
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(*reply) ? 0 : -1;
+}
+
+static bool stream_format_ok(uint32_t format, uint32_t channels)
+{
+    if ((int)format < 0 || format > SND_PCM_FORMAT_LAST ||
+        channels == 0 || channels > MIXER_MAX_CHANNELS)
+        return false;
+
+    return pcm_to_float((snd_pcm_format_t)format, NULL, NULL, 0) == 0;
+}
+
+void PlayDaemon::handleRequest(int fd)
+{
+    daemon_request_t req;
+    daemon_reply_t reply;
+    stream_t *s = NULL;
+    WavFile *file;
+    int fds[2];
+    ssize_t n;
+
+    n = recv(fd, &req, sizeof(req), MSG_DONTWAIT);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+    {
+        dropClient(fd);
+        return;
+    }
+    if (n < 0)
+        return;
+
+    memset(&reply, 0, sizeof(reply));
+    if (n != sizeof(req))
+    {
+        reply.status = -EINVAL;
+        sendReply(fd, &reply, NULL, 0);
+        return;
+    }
+
+    switch (req.type)
+    {
+    case DAEMON_OPEN_STREAM:
+        if (!stream_format_ok(req.format, req.channels) || req.rate != sampleRate)
+        {
+            reply.status = -EINVAL;
+            break;
+        }
+        if (req.ringMs == 0)
+            req.ringMs = 200;
+        req.ringMs = req.ringMs < 20 ? 20 : req.ringMs > 5000 ? 5000 : req.ringMs;
+
+        s = newStream((snd_pcm_format_t)req.format, req.channels, 0, req.ringMs, true);
+        if (s == NULL)
+        {
+            reply.status = -ENOMEM;
+            break;
+        }
+
+        s->client = fd;
+        pthread_mutex_lock(&lock);
+        s->id = reply.status = ++nextId;
+        pthread_mutex_unlock(&lock);
+
+        fds[0] = s->memFd;
+        fds[1] = s->eventFd;
+        if (sendReply(fd, &reply, fds, 2) < 0)
+        {
+            freeStream(s);
+            return;
+        }
+        ::close(s->memFd);
+        s->memFd = -1;
+
+        pthread_mutex_lock(&lock);
+        streams.push_back(s);
+        pthread_mutex_unlock(&lock);
+        return;
+
+    case DAEMON_PLAY_FILE:
+        req.path[DAEMON_MAX_PATH - 1] = '\0';
+        file = new WavFile();
+        if (file->open(req.path) < 0)
+        {
+            delete file;
+            reply.status = -ENOENT;
+            break;
+        }
+        if (!stream_format_ok(file->pcmFormat(), file->channels()) ||
+            (uint32_t)file->rate() != sampleRate)
+        {
+            fprintf(stderr, "%s: daemon plays only %u Hz\n", req.path, sampleRate);
+            delete file;
+            reply.status = -EINVAL;
+            break;
+        }
+
+        s = newStream(file->pcmFormat(), file->channels(), file->channelMask(), DAEMON_FILE_RING_MS, false);
+        if (s == NULL)
+        {
+            delete file;
+            reply.status = -ENOMEM;
+            break;
+        }
+        s->file = file;
+        if (ThreadPolicy::shared()->create(THREAD_IO, &s->readerThID, readerThreadFunc, s) != 0)
+        {
+            s->readerThID = 0;
+            freeStream(s);
+            reply.status = -EAGAIN;
+            break;
+        }
+
+        pthread_mutex_lock(&lock);
+        s->id = reply.status = ++nextId;
+        streams.push_back(s);
+        pthread_mutex_unlock(&lock);
+        break;
+
+    case DAEMON_STOP:
+        pthread_mutex_lock(&lock);
+        s = findStream(req.stream);
+        if (s)
+            __atomic_store_n(&s->stopping, true, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&lock);
+        reply.status = s ? 0 : -ENOENT;
+        break;
+
+    case DAEMON_STATS:
+        pthread_mutex_lock(&lock);
+        s = findStream(req.stream);
+        if (s)
+        {
+            reply.stats = s->stats;
+            reply.stats.active = !s->ended;
+        }
+        pthread_mutex_unlock(&lock);
+        reply.status = s ? 0 : -ENOENT;
+        break;
+
+    default:
+        reply.status = -EINVAL;
+        break;
+    }
+
+    sendReply(fd, &reply, NULL, 0);
+}
+
+/* streams on a ring of the client end with it, files it started play on */
+void PlayDaemon::dropClient(int fd)
+{
+    list<stream_t *>::iterator it;
+    int i;
+
+    pthread_mutex_lock(&lock);
+    for (it = streams.begin(); it != streams.end(); ++it)
+    {
+        if ((*it)->client == fd)
+        {
+            (*it)->client = -1;
+            __atomic_store_n(&(*it)->stopping, true, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (i = 0; i < clientCount; i++)
+    {
+        if (clientFds[i] == fd)
+        {
+            clientFds[i] = clientFds[--clientCount];
+            break;
+        }
+    }
+    ::close(fd);
+}
+
+void PlayDaemon::reap()
+{
+    list<stream_t *> done;
+    list<stream_t *>::iterator it;
+    uint64_t now = monotonic_ns() / 1000000;
+
+    pthread_mutex_lock(&lock);
+    for (it = streams.begin(); it != streams.end(); )
+    {
+        if ((*it)->ended && now - (*it)->endedAt >= DAEMON_LINGER_MS)
+        {
+            done.push_back(*it);
+            it = streams.erase(it);
+        }
+        else
+            ++it;
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (it = done.begin(); it != done.end(); ++it)
+        freeStream(*it);
+}
+
+void PlayDaemon::controlTask()
+{
+    struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+    int i, n, fd, count;
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE))
+    {
+        fds[0].fd = listenFd;
+        fds[0].events = POLLIN;
+        count = clientCount;
+        for (i = 0; i < count; i++)
+        {
+            fds[i + 1].fd = clientFds[i];
+            fds[i + 1].events = POLLIN;
+        }
+
+        n = poll(fds, count + 1, 100);
+        if (n < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "daemon poll: %s\n", strerror(errno));
+            break;
+        }
+
+        if (n > 0)
+        {
+            for (i = 1; i <= count; i++)
+            {
+                if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                    handleRequest(fds[i].fd);
+            }
+
+            if (fds[0].revents & POLLIN)
+            {
+                fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+                if (fd >= 0 && clientCount == DAEMON_MAX_CLIENTS)
+                    ::close(fd);
+                else if (fd >= 0)
+                    clientFds[clientCount++] = fd;
+            }
+        }
+
+        reap();
+    }
+}
@@ -0,0 +1,121 @@
+#ifndef _PLAY_DAEMON_H_
+#define _PLAY_DAEMON_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#include <list>
+using namespace std;
+
+#include "daemon_protocol.h"
+#include "channel_mixer.h"
+#include "requantizer.h"
+
+#define DAEMON_PERIOD_US    10000
+#define DAEMON_PERIODS      3           /* device buffer, in periods */
+#define DAEMON_MAX_CLIENTS  32
+#define DAEMON_FILE_RING_MS 500         /* read-ahead of a file the daemon plays */
+#define DAEMON_LINGER_MS    2000        /* stats of a finished stream stay this long */
+
+/*
+ * Owns one output and mixes every client into it. A control thread
+ * serves the unix socket, the mixing thread takes one period from every
+ * stream ring and writes the sum, and each file played on request gets a
+ * reader thread that fills a ring of its own. Clients sharing a ring with
+ * the daemon write samples into it directly; nothing is copied through
+ * the socket. The "null" device paces by the clock and drops the output,
+ * for measuring latency and CPU without hardware.
+ */
+class PlayDaemon
+{
+public:
+    PlayDaemon();
+    virtual ~PlayDaemon();
+
+    int  start(const char *socketPath, const char *device, snd_pcm_format_t format,
+               int channels, uint32_t rate);
+    void stop();
+    bool isRunning() { return __atomic_load_n(&running, __ATOMIC_ACQUIRE); }
+
+    snd_pcm_format_t format() { return sampleFormat; }
+    int      channels() { return numChannels; }
+    uint32_t rate() { return sampleRate; }
+
+private:
+    struct stream_t {
+        PlayDaemon *daemon;
+        int      id;
+        int      client;        /* socket owning a shared ring, -1 otherwise */
+        daemon_ring_t *ring;    /* shared, nothing in it is trusted */
+        char    *data;
+        size_t   mapSize;
+        uint64_t capacity;
+        uint32_t frameBytes;
+        uint64_t tail;
+        int      memFd;         /* handed to the client, then closed */
+        int      eventFd;       /* wakes the producer when room is made */
+        snd_pcm_format_t format;
+        int      channels;
+        ChannelMixer mixer;
+        WavFile *file;
+        pthread_t readerThID;
+        bool     stopping;
+        bool     ended;         /* no longer mixed */
+        uint64_t endedAt;       /* ms */
+        daemon_stats_t stats;
+    };
+
+    static void *controlThreadFunc(void *data);
+    static void *mixThreadFunc(void *data);
+    static void *readerThreadFunc(void *data);
+    void controlTask();
+    void mixTask();
+    void readerTask(stream_t *s);
+
+    int  openDevice(const char *device);
+    int  waitOutput();
+    int  writeOutput();
+    uint64_t outputTime();
+
+    stream_t *newStream(snd_pcm_format_t format, int channels, uint32_t mask,
+                        uint32_t ringMs, bool shared);
+    void freeStream(stream_t *s);
+    stream_t *findStream(int id);
+    bool mixStream(stream_t *s, uint64_t outNs);
+    void endStream(stream_t *s);
+    void wakeProducer(stream_t *s);
+
+    void handleRequest(int fd);
+    int  sendReply(int fd, daemon_reply_t *reply, int *fds, int count);
+    void dropClient(int fd);
+    void reap();
+
+    char    *socketPath;
+    int      listenFd;
+    int      clientFds[DAEMON_MAX_CLIENTS];
+    int      clientCount;
+
+    snd_pcm_t *handle;          /* NULL for the null sink */
+    snd_pcm_format_t sampleFormat;
+    int      numChannels;
+    uint32_t sampleRate;
+    size_t   period;
+    uint64_t deadline;          /* null sink, ns of the next period */
+
+    list<stream_t *> streams;
+    pthread_mutex_t lock;       /* streams and their stats */
+    int      nextId;
+
+    float   *bus;
+    float   *scratch;           /* one period of a stream in float */
+    float   *mixed;             /* ... in the output layout */
+    char    *out;
+    Requantizer busRequant;
+
+    pthread_t controlThID;
+    pthread_t mixThID;
+    bool     running;
+};
+
+#endif
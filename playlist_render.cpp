@@ -0,0 +1,537 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "playlist_render.h"
+#include "thread_policy.h"
+#include "channel_mixer.h"
+#include "gain_stage.h"
+#include "pcm_utils.h"
+
+static double monotonicSeconds()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* one track as seen by one worker */
+class RenderSource
+{
+public:
+    RenderSource() : pos(0) {}
+
+    WavFile      wav;
+    ChannelMixer mixer;     /* track layout to output layout */
+    Requantizer  requant;   /* track format to output format */
+    uint64_t     pos;       /* next frame readData() returns */
+};
+
+/* everything a worker needs to turn any output range into samples */
+class RenderWorker
+{
+public:
+    RenderWorker(PlaylistRenderer *owner);
+    virtual ~RenderWorker();
+
+    int  init();
+    int  renderSlice(uint32_t slice);
+
+private:
+    RenderSource *source(int k);
+    void  readRaw(int k, uint64_t pos, size_t frames);
+    void  readFloat(int k, uint64_t pos, float *dst, size_t frames);
+    int   findTrack(uint64_t frame);
+    int   renderRange(uint64_t from, uint64_t to, bool write);
+
+    PlaylistRenderer *r;
+    RenderSource **sources;
+    uint32_t   slice;
+
+    GainStage   gainStage;
+    BiquadChain eq;
+    Crossfader  fader;
+    Requantizer busRequant;     /* float bus to output format */
+
+    size_t outFrameBytes;
+    char  *raw;                 /* one block of any track */
+    float *scratch;             /* the same as float */
+    char  *mixed;               /* remapped, still in the track format */
+    char  *out;
+};
+
+RenderWorker::RenderWorker(PlaylistRenderer *owner)
+    : r(owner)
+    , sources(NULL)
+    , slice(0)
+    , outFrameBytes(0)
+    , raw(NULL)
+    , scratch(NULL)
+    , mixed(NULL)
+    , out(NULL)
+{
+}
+
+RenderWorker::~RenderWorker()
+{
+    int k;
+
+    if (sources)
+    {
+        for (k = 0; k < r->trackCount; k++)
+            delete sources[k];
+        free(sources);
+    }
+    free(raw);
+    free(scratch);
+    free(mixed);
+    free(out);
+}
+
+int RenderWorker::init()
+{
+    size_t frameBytes = 0, sampleBytes = 4, channels = r->outChannels;
+    int k;
+
+    for (k = 0; k < r->trackCount; k++)
+    {
+        const wav_info_t *info = &r->tracks[k].info;
+
+        if (info->blockAlign > frameBytes)
+            frameBytes = info->blockAlign;
+        if (info->channels > channels)
+            channels = info->channels;
+        if ((size_t)snd_pcm_format_physical_width(r->tracks[k].format) / 8 > sampleBytes)
+            sampleBytes = snd_pcm_format_physical_width(r->tracks[k].format) / 8;
+    }
+    outFrameBytes = snd_pcm_format_physical_width(r->outFormat) / 8 * r->outChannels;
+
+    sources = (RenderSource **)calloc(r->trackCount, sizeof(RenderSource *));
+    raw = (char *)malloc(RENDER_BLOCK_FRAMES * frameBytes);
+    scratch = (float *)malloc(RENDER_BLOCK_FRAMES * channels * sizeof(float));
+    mixed = (char *)malloc(RENDER_BLOCK_FRAMES * r->outChannels * sampleBytes);
+    out = (char *)malloc(RENDER_BLOCK_FRAMES * outFrameBytes);
+    if (!sources || !raw || !scratch || !mixed || !out)
+        return -1;
+
+    gainStage.setRate(r->sampleRate);
+    gainStage.setGain(r->gain, 0);
+    for (k = 0; k < r->filterCount; k++)
+        eq.setSection(k, r->filters[k].type, r->filters[k].freq, r->filters[k].q, r->filters[k].gainDb);
+
+    if (fader.setup(r->outChannels, RENDER_BLOCK_FRAMES) < 0 ||
+        busRequant.setup(SND_PCM_FORMAT_FLOAT, r->outFormat, r->outChannels, r->ditherMode) < 0 ||
+        eq.setup(r->outChannels, r->sampleRate) < 0)
+        return -1;
+
+    return 0;
+}
+
+RenderSource *RenderWorker::source(int k)
+{
+    const render_track_t *t = &r->tracks[k];
+    uint32_t inPos[MIXER_MAX_CHANNELS], outPos[MIXER_MAX_CHANNELS];
+    RenderSource *s;
+    uint32_t mask;
+
+    if (sources[k])
+        return sources[k];
+
+    s = new RenderSource();
+    if (s->wav.open(t->filename, &t->info) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", t->filename, strerror(errno));
+        delete s;
+        return NULL;
+    }
+
+    mask = t->info.channelMask ? t->info.channelMask : ChannelMixer::defaultMask(t->info.channels);
+    ChannelMixer::maskPositions(mask, t->info.channels, inPos);
+    ChannelMixer::maskPositions(r->outMask, r->outChannels, outPos);
+    if (s->mixer.setup(inPos, t->info.channels, outPos, r->outChannels) < 0 ||
+        s->requant.setup(t->format, r->outFormat, r->outChannels, r->ditherMode) < 0)
+    {
+        fprintf(stderr, "%s: can't convert to the output layout\n", t->filename);
+        delete s;
+        return NULL;
+    }
+    s->requant.reseed(slice + 1);
+
+    sources[k] = s;
+    return s;
+}
+
+/* frames of track k from pos into raw, silence past its end */
+void RenderWorker::readRaw(int k, uint64_t pos, size_t frames)
+{
+    RenderSource *s = sources[k];
+    size_t frameBytes = r->tracks[k].info.blockAlign;
+    ssize_t got = 0;
+
+    if (s->pos != pos)
+        s->wav.seek(pos);
+    got = s->wav.readData(raw, frames * frameBytes);
+    got = got > 0 ? got / frameBytes : 0;
+    if ((size_t)got < frames)
+        snd_pcm_format_set_silence(r->tracks[k].format, raw + got * frameBytes,
+                                   (frames - got) * r->tracks[k].info.channels);
+    s->pos = pos + got;
+}
+
+void RenderWorker::readFloat(int k, uint64_t pos, float *dst, size_t frames)
+{
+    readRaw(k, pos, frames);
+    if (pcm_to_float(r->tracks[k].format, raw, scratch, frames * r->tracks[k].info.channels) < 0)
+    {
+        memset(dst, 0, frames * r->outChannels * sizeof(float));
+        return;
+    }
+
+    sources[k]->mixer.process(scratch, dst, SND_PCM_FORMAT_FLOAT, frames);
+}
+
+/* the first track still playing at frame, ends only grow with the index */
+int RenderWorker::findTrack(uint64_t frame)
+{
+    int lo = 0, hi = r->trackCount - 1, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (r->tracks[mid].start + r->tracks[mid].frames > frame)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+/*
+ * Output frames from..to as the player would produce them: one track
+ * through its native path, or two on the float bus while they overlap.
+ * Without write only the equalizer state moves.
+ */
+int RenderWorker::renderRange(uint64_t from, uint64_t to, bool write)
+{
+    const render_track_t *t, *u;
+    bool overlap, useBus = !eq.isBypassed();
+    uint64_t p, end;
+    size_t n;
+    char *data;
+    float *bus;
+    int k;
+
+    for (p = from; p < to; p = end)
+    {
+        k = findTrack(p);
+        t = &r->tracks[k];
+        u = k + 1 < r->trackCount ? &r->tracks[k + 1] : NULL;
+
+        end = p + RENDER_BLOCK_FRAMES;
+        if (end > to)
+            end = to;
+        if (end > t->start + t->frames)
+            end = t->start + t->frames;
+        overlap = u && u->start <= p && u->frames > 0;
+        if (u && !overlap && end > u->start)
+            end = u->start;
+        n = end - p;
+
+        if (source(k) == NULL || (overlap && source(k + 1) == NULL))
+            return -1;
+
+        if (overlap)
+        {
+            readFloat(k, p - t->start, fader.busA(), n);
+            readFloat(k + 1, p - u->start, fader.busB(), n);
+            fader.start(u->fadeIn, r->fadeCurve);
+            fader.seek(p - u->start);
+            bus = fader.mix(n, 0);
+        }
+        else if (useBus || !write)
+        {
+            bus = fader.busA();
+            readFloat(k, p - t->start, bus, n);
+        }
+        else
+        {
+            /* the player's normal path, bit exact at unity gain */
+            readRaw(k, p - t->start, n);
+            data = raw;
+            if (!sources[k]->mixer.isIdentity())
+            {
+                sources[k]->mixer.process(raw, mixed, t->format, n);
+                data = mixed;
+            }
+            gainStage.process(data, t->format, r->outChannels, n);
+            if (!sources[k]->requant.isPassthrough())
+            {
+                sources[k]->requant.process(data, out, n);
+                data = out;
+            }
+            if (r->writer.writeAt(p * outFrameBytes, data, n * outFrameBytes) < 0)
+                return -1;
+            continue;
+        }
+
+        eq.process(bus, n);
+        if (!write)
+            continue;
+        gainStage.process(bus, SND_PCM_FORMAT_FLOAT, r->outChannels, n);
+        busRequant.process(bus, out, n);
+        if (r->writer.writeAt(p * outFrameBytes, out, n * outFrameBytes) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int RenderWorker::renderSlice(uint32_t slice)
+{
+    uint64_t from = (uint64_t)slice * r->sliceFrames;
+    uint64_t to = from + r->sliceFrames;
+    uint64_t preroll = 0;
+    int k, first;
+
+    if (to > r->totalFrames)
+        to = r->totalFrames;
+
+    if (!eq.isBypassed())
+    {
+        preroll = (uint64_t)r->sampleRate * RENDER_PREROLL_MS / 1000;
+        if (preroll > from)
+            preroll = from;
+        eq.setup(r->outChannels, r->sampleRate);
+    }
+
+    /* slices come in rising order, tracks before this one are done */
+    first = findTrack(from - preroll);
+    for (k = 0; k < first; k++)
+    {
+        delete sources[k];
+        sources[k] = NULL;
+    }
+
+    this->slice = slice;
+    busRequant.reseed(slice + 1);
+    for (k = first; k < r->trackCount; k++)
+        if (sources[k])
+            sources[k]->requant.reseed(slice + 1);
+
+    if (preroll > 0 && renderRange(from - preroll, from, false) < 0)
+        return -1;
+
+    return renderRange(from, to, true);
+}
+
+PlaylistRenderer::PlaylistRenderer(int threads)
+    : numThreads(threads)
+    , fadeMs(0)
+    , fadeCurve(FADE_EQUAL_POWER)
+    , gain(1.0f)
+    , ditherMode(DITHER_TPDF)
+    , filterCount(0)
+    , tracks(NULL)
+    , trackCount(0)
+    , outFormat(SND_PCM_FORMAT_UNKNOWN)
+    , outChannels(0)
+    , outMask(0)
+    , sampleRate(0)
+    , totalFrames(0)
+    , sliceFrames(0)
+    , sliceCount(0)
+    , nextSlice(0)
+    , failed(0)
+    , elapsed(0)
+{
+    if (numThreads <= 0)
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads <= 0)
+        numThreads = 1;
+}
+
+PlaylistRenderer::~PlaylistRenderer()
+{
+    free(tracks);
+}
+
+void PlaylistRenderer::setCrossfade(uint32_t ms, fade_curve_t curve)
+{
+    fadeMs = ms;
+    fadeCurve = curve;
+}
+
+int PlaylistRenderer::setFilter(int index, biquad_type_t type, float freq, float q, float gainDb)
+{
+    if (index < 0 || index > filterCount || index >= BIQUAD_MAX_SECTIONS)
+        return -1;
+
+    filters[index].type = type;
+    filters[index].freq = freq;
+    filters[index].q = q;
+    filters[index].gainDb = gainDb;
+    if (index == filterCount)
+        filterCount++;
+
+    return 0;
+}
+
+/* probe every file and place it on the output timeline */
+int PlaylistRenderer::layout(char *files[], int count)
+{
+    render_track_t *t;
+    WavFile wav;
+    uint64_t fade, overlap = 0;
+    int k;
+
+    free(tracks);
+    tracks = (render_track_t *)calloc(count, sizeof(render_track_t));
+    if (tracks == NULL)
+        return -1;
+    trackCount = count;
+
+    for (k = 0; k < count; k++)
+    {
+        t = &tracks[k];
+        t->filename = files[k];
+        if (wav.open(files[k]) < 0 || wav.pcmFormat() == SND_PCM_FORMAT_UNKNOWN)
+        {
+            fprintf(stderr, "%s: not a playable WAV file\n", files[k]);
+            wav.close();
+            return -1;
+        }
+        t->info = *wav.header();
+        t->format = wav.pcmFormat();
+        t->frames = wav.frames();
+        wav.close();
+
+        if (k == 0)
+        {
+            sampleRate = t->info.rate;
+            if (outFormat == SND_PCM_FORMAT_UNKNOWN)
+                outFormat = t->format;
+            if (outChannels == 0)
+            {
+                outChannels = t->info.channels;
+                outMask = t->info.channelMask;
+            }
+        }
+        else if (t->info.rate != sampleRate)
+        {
+            fprintf(stderr, "%s: %u Hz, the playlist is %u Hz\n", files[k], t->info.rate, sampleRate);
+            return -1;
+        }
+        if (t->info.channels > MIXER_MAX_CHANNELS && t->info.channels != outChannels)
+        {
+            fprintf(stderr, "%s: too many channels to remap\n", files[k]);
+            return -1;
+        }
+    }
+
+    if (outMask == 0 || (uint32_t)__builtin_popcount(outMask) < (uint32_t)outChannels)
+        outMask = ChannelMixer::defaultMask(outChannels);
+
+    /* a fade never starts before the previous one ended or outlasts the next track */
+    fade = (uint64_t)fadeMs * sampleRate / 1000;
+    for (k = 0; k < count; k++)
+    {
+        t = &tracks[k];
+        t->fadeIn = overlap;
+        t->start = k == 0 ? 0 : tracks[k - 1].start + tracks[k - 1].frames - overlap;
+
+        overlap = 0;
+        if (k + 1 < count)
+        {
+            overlap = fade;
+            if (overlap > t->frames - t->fadeIn)
+                overlap = t->frames - t->fadeIn;
+            if (overlap > tracks[k + 1].frames)
+                overlap = tracks[k + 1].frames;
+        }
+    }
+    totalFrames = count > 0 ? tracks[count - 1].start + tracks[count - 1].frames : 0;
+
+    return 0;
+}
+
+int PlaylistRenderer::render(char *files[], int count, const char *output,
+                             snd_pcm_format_t format, int channels)
+{
+    pthread_t *threads;
+    double start;
+    int i, n;
+
+    outFormat = format;
+    outChannels = channels;
+    outMask = 0;
+    totalFrames = 0;
+    elapsed = 0;
+    if (count < 1 || layout(files, count) < 0)
+        return -1;
+
+    if (writer.open(output, outFormat, outChannels, sampleRate, outMask) < 0)
+        return -1;
+
+    start = monotonicSeconds();
+    sliceFrames = (uint64_t)sampleRate * RENDER_SLICE_SECONDS;
+    sliceCount = (totalFrames + sliceFrames - 1) / sliceFrames;
+    nextSlice = 0;
+    failed = 0;
+
+    n = numThreads < (int)sliceCount ? numThreads : (int)sliceCount;
+    threads = (pthread_t *)malloc((n > 0 ? n : 1) * sizeof(pthread_t));
+    for (i = 0; i < n; i++)
+    {
+        if (ThreadPolicy::shared()->create(THREAD_DSP, &threads[i], workerThreadFunc, this) != 0)
+        {
+            failed = 1;
+            break;
+        }
+    }
+    n = i;
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    writer.setLength(totalFrames * (snd_pcm_format_physical_width(outFormat) / 8) * outChannels);
+    if (writer.close() < 0)
+        failed = 1;
+    elapsed = monotonicSeconds() - start;
+
+    return failed ? -1 : 0;
+}
+
+void PlaylistRenderer::workerTask()
+{
+    RenderWorker worker(this);
+    uint32_t slice;
+
+    if (worker.init() < 0)
+    {
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    while (!__atomic_load_n(&failed, __ATOMIC_RELAXED))
+    {
+        slice = __atomic_fetch_add(&nextSlice, 1, __ATOMIC_RELAXED);
+        if (slice >= sliceCount)
+            break;
+        if (worker.renderSlice(slice) < 0)
+        {
+            fprintf(stderr, "render failed at %u s\n", slice * RENDER_SLICE_SECONDS);
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void *PlaylistRenderer::workerThreadFunc(void *data)
+{
+    ((PlaylistRenderer *)data)->workerTask();
+    return NULL;
+}
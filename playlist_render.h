@@ -0,0 +1,103 @@
+#ifndef _PLAYLIST_RENDER_H_
+#define _PLAYLIST_RENDER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#include "wav_file.h"
+#include "wav_writer.h"
+#include "crossfade.h"
+#include "requantizer.h"
+#include "biquad_chain.h"
+
+#define RENDER_SLICE_SECONDS    10      /* output handed to a worker at a time */
+#define RENDER_BLOCK_FRAMES     4096
+#define RENDER_PREROLL_MS       500     /* settles the equalizer ahead of a slice */
+
+typedef struct {
+    const char *filename;
+    wav_info_t  info;
+    snd_pcm_format_t format;
+    uint64_t    frames;
+    uint64_t    start;          /* first output frame */
+    uint64_t    fadeIn;         /* frames shared with the previous track */
+} render_track_t;
+
+typedef struct {
+    biquad_type_t type;
+    float freq;
+    float q;
+    float gainDb;
+} render_filter_t;
+
+class RenderWorker;
+
+/*
+ * Renders a playlist to one WAV file the way APlayer plays it with
+ * crossfade(..., atEnd), only as fast as the disks and cores allow. Track
+ * positions follow from the lengths and the fade, so the output is cut
+ * into slices that a pool of workers reads, converts, mixes and writes
+ * independently. Every slice restarts the dither from its own seed and
+ * runs the equalizer in over the audio just before it, so the result does
+ * not depend on the number of threads. It matches live output exactly
+ * only where nothing is dithered, since the player's noise runs on from
+ * period to period.
+ */
+class PlaylistRenderer
+{
+public:
+    /* threads - 0 to use one worker per online CPU */
+    PlaylistRenderer(int threads = 0);
+    virtual ~PlaylistRenderer();
+
+    void setCrossfade(uint32_t ms, fade_curve_t curve = FADE_EQUAL_POWER);
+    void setGain(float gain) { this->gain = gain; }
+    void setDither(dither_mode_t mode) { ditherMode = mode; }
+    int  setFilter(int index, biquad_type_t type, float freq, float q, float gainDb = 0);
+
+    /*
+     * All files need the same rate. channels 0 and format UNKNOWN take
+     * those of the first file.
+     */
+    int  render(char *files[], int count, const char *output,
+                snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN, int channels = 0);
+
+    uint64_t frames() { return totalFrames; }
+    uint32_t rate() { return sampleRate; }
+    double   seconds() { return elapsed; }
+    /* audio time over wall clock time of the last render() */
+    double   speed() { return elapsed > 0 ? (double)totalFrames / sampleRate / elapsed : 0; }
+
+private:
+    friend class RenderWorker;
+
+    static void *workerThreadFunc(void *data);
+    void workerTask();
+    int  layout(char *files[], int count);
+
+    int      numThreads;
+    uint32_t fadeMs;
+    fade_curve_t fadeCurve;
+    float    gain;
+    dither_mode_t ditherMode;
+    render_filter_t filters[BIQUAD_MAX_SECTIONS];
+    int      filterCount;
+
+    render_track_t *tracks;
+    int      trackCount;
+    snd_pcm_format_t outFormat;
+    int      outChannels;
+    uint32_t outMask;
+    uint32_t sampleRate;
+    uint64_t totalFrames;
+    uint64_t sliceFrames;
+    uint32_t sliceCount;
+
+    WavWriter writer;
+    uint32_t nextSlice;     /* taken atomically by the workers */
+    int      failed;
+    double   elapsed;
+};
+
+#endif
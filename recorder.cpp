@@ -0,0 +1,445 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "recorder.h"
+#include "thread_policy.h"
+
+static uint64_t nowMs()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static size_t gcd(size_t a, size_t b)
+{
+    size_t t;
+
+    while (b)
+    {
+        t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+Recorder::Recorder()
+    : source(RECORD_SOURCE_NULL)
+    , handle(NULL)
+    , file(NULL)
+    , sampleFormat(SND_PCM_FORMAT_UNKNOWN)
+    , numChannels(0)
+    , sampleRate(0)
+    , frameBytes(0)
+    , periodFrames(0)
+    , paced(0)
+    , blockBytes(0)
+    , discard(NULL)
+    , wakeFd(-1)
+    , captureThID(0)
+    , writerThID(0)
+    , capturing(false)
+    , stopping(false)
+    , overflowing(false)
+    , captured(0)
+    , xruns(0)
+    , result(0)
+{
+}
+
+Recorder::~Recorder()
+{
+    stop();
+}
+
+int Recorder::openDevice(const char *device)
+{
+    snd_pcm_hw_params_t *params;
+    unsigned int channels = numChannels, rate = sampleRate, bufferTime, periodTime;
+    snd_pcm_uframes_t period;
+    int err;
+
+    err = snd_pcm_open(&handle, device, SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK);
+    if (err < 0)
+    {
+        fprintf(stderr, "capture open error: %s\n", snd_strerror(err));
+        handle = NULL;
+        return -1;
+    }
+
+    snd_pcm_hw_params_alloca(&params);
+    if (snd_pcm_hw_params_any(handle, params) < 0 ||
+        snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED) < 0)
+    {
+        fprintf(stderr, "%s: no interleaved capture\n", device);
+        return -1;
+    }
+
+    if (snd_pcm_hw_params_set_format(handle, params, sampleFormat) < 0)
+    {
+        fprintf(stderr, "%s: can't capture %s\n", device, snd_pcm_format_name(sampleFormat));
+        return -1;
+    }
+
+    if (snd_pcm_hw_params_set_channels_near(handle, params, &channels) < 0 ||
+        snd_pcm_hw_params_set_rate_near(handle, params, &rate, 0) < 0)
+    {
+        fprintf(stderr, "%s: no usable channel count or rate\n", device);
+        return -1;
+    }
+    numChannels = channels;
+    sampleRate = rate;
+
+    /* a long buffer so a slow wakeup does not overrun the device */
+    if (snd_pcm_hw_params_get_buffer_time_max(params, &bufferTime, 0) < 0 ||
+        bufferTime > RECORD_BUFFER_US)
+        bufferTime = RECORD_BUFFER_US;
+    periodTime = bufferTime / 4;
+    snd_pcm_hw_params_set_period_time_near(handle, params, &periodTime, 0);
+    snd_pcm_hw_params_set_buffer_time_near(handle, params, &bufferTime, 0);
+
+    err = snd_pcm_hw_params(handle, params);
+    if (err < 0)
+    {
+        fprintf(stderr, "%s: unable to install hw params: %s\n", device, snd_strerror(err));
+        return -1;
+    }
+
+    snd_pcm_hw_params_get_period_size(params, &period, 0);
+    periodFrames = period;
+
+    return 0;
+}
+
+int Recorder::start(const char *source, const char *filename, snd_pcm_format_t format,
+                    int channels, uint32_t rate, bool direct)
+{
+    uint32_t mask = 0;
+    size_t ringBytes;
+
+    if (captureThID)
+        return -1;
+
+    sampleFormat = format;
+    numChannels = channels;
+    sampleRate = rate;
+    periodFrames = 0;
+
+    if (strncmp(source, "file:", 5) == 0)
+    {
+        this->source = RECORD_SOURCE_FILE;
+        file = new WavFile();
+        if (file->open(source + 5) < 0)
+        {
+            fprintf(stderr, "%s: not a playable WAV file\n", source + 5);
+            release();
+            return -1;
+        }
+        sampleFormat = file->pcmFormat();
+        numChannels = file->channels();
+        sampleRate = file->rate();
+        mask = file->channelMask();
+    }
+    else if (strcmp(source, "null") == 0)
+    {
+        this->source = RECORD_SOURCE_NULL;
+    }
+    else
+    {
+        this->source = RECORD_SOURCE_ALSA;
+        if (openDevice(source) < 0)
+        {
+            release();
+            return -1;
+        }
+    }
+
+    if (numChannels < 1 || sampleRate == 0 || snd_pcm_format_physical_width(sampleFormat) <= 0)
+    {
+        release();
+        return -1;
+    }
+    frameBytes = snd_pcm_format_physical_width(sampleFormat) / 8 * numChannels;
+    if (periodFrames == 0)
+        periodFrames = sampleRate * RECORD_PERIOD_MS / 1000;
+
+    /*
+     * Whole frames and whole aligned blocks both meet the end of the ring
+     * exactly, so neither side ever gets a region cut short by the wrap.
+     */
+    blockBytes = frameBytes / gcd(frameBytes, WAV_WRITER_ALIGN) * WAV_WRITER_ALIGN;
+    blockBytes *= (RECORD_BLOCK_BYTES + blockBytes - 1) / blockBytes;
+    ringBytes = (uint64_t)sampleRate * frameBytes * RECORD_RING_MS / 1000;
+    ringBytes = (ringBytes + blockBytes - 1) / blockBytes * blockBytes;
+    if (ringBytes < 4 * blockBytes)
+        ringBytes = 4 * blockBytes;
+
+    discard = (char *)malloc(periodFrames * frameBytes);
+    wakeFd = eventfd(0, EFD_CLOEXEC);
+    if (discard == NULL || wakeFd < 0 || ring.setup(ringBytes, WAV_WRITER_ALIGN) < 0 ||
+        writer.open(filename, sampleFormat, numChannels, sampleRate, mask, direct) < 0)
+    {
+        release();
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &paceStart);
+    paced = 0;
+    captured = 0;
+    xruns = 0;
+    result = 0;
+    overflowing = false;
+    stopping = false;
+    capturing = true;
+
+    if (ThreadPolicy::shared()->create(THREAD_IO, &writerThID, writerThreadFunc, this) != 0)
+    {
+        writerThID = 0;
+        capturing = false;
+        writer.close();
+        release();
+        return -1;
+    }
+    if (ThreadPolicy::shared()->create(THREAD_AUDIO, &captureThID, captureThreadFunc, this) != 0)
+    {
+        captureThID = 0;
+        __atomic_store_n(&capturing, false, __ATOMIC_RELEASE);
+        wakeWriter();
+        pthread_join(writerThID, NULL);
+        writerThID = 0;
+        writer.close();
+        release();
+        return -1;
+    }
+
+    return 0;
+}
+
+int Recorder::stop()
+{
+    if (captureThID == 0)
+        return 0;
+
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_join(captureThID, NULL);
+    pthread_join(writerThID, NULL);
+    captureThID = writerThID = 0;
+
+    if (writer.close() < 0)
+        result = -1;
+    release();
+
+    return result;
+}
+
+void Recorder::release()
+{
+    if (handle)
+    {
+        snd_pcm_drop(handle);
+        snd_pcm_close(handle);
+        handle = NULL;
+    }
+    if (file)
+    {
+        file->close();
+        delete file;
+        file = NULL;
+    }
+    if (wakeFd >= 0)
+    {
+        ::close(wakeFd);
+        wakeFd = -1;
+    }
+    free(discard);
+    discard = NULL;
+}
+
+void Recorder::wakeWriter()
+{
+    uint64_t one = 1;
+    ssize_t ret;
+
+    ret = ::write(wakeFd, &one, sizeof(one));
+    (void)ret;
+}
+
+snd_pcm_sframes_t Recorder::readDevice(void *buf, size_t frames)
+{
+    snd_pcm_sframes_t r;
+
+    while (true)
+    {
+        r = snd_pcm_readi(handle, buf, frames);
+        if (r > 0)
+            return r;
+
+        if (r == -EAGAIN || r == 0)
+        {
+            if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+                return 0;
+            snd_pcm_wait(handle, 100);
+        }
+        else if (r == -EPIPE)
+        {
+            __atomic_add_fetch(&xruns, 1, __ATOMIC_RELAXED);
+            snd_pcm_prepare(handle);
+            snd_pcm_start(handle);
+        }
+        else if (r == -ESTRPIPE)
+        {
+            while ((r = snd_pcm_resume(handle)) == -EAGAIN)
+                sleep(1);
+            if (r < 0)
+                snd_pcm_prepare(handle);
+        }
+        else
+        {
+            fprintf(stderr, "capture error: %s\n", snd_strerror(r));
+            return -1;
+        }
+    }
+}
+
+/* frames read, 0 to check for stop again, -1 at the end of the source */
+snd_pcm_sframes_t Recorder::readSource(void *buf, size_t frames)
+{
+    struct timespec due;
+    uint64_t ns;
+    ssize_t bytes;
+
+    if (source == RECORD_SOURCE_ALSA)
+        return readDevice(buf, frames);
+
+    /* no clock of its own, hand out frames at the nominal rate */
+    ns = paced * 1000000000ULL / sampleRate;
+    due.tv_sec = paceStart.tv_sec + (paceStart.tv_nsec + ns) / 1000000000ULL;
+    due.tv_nsec = (paceStart.tv_nsec + ns) % 1000000000ULL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR)
+        ;
+
+    if (source == RECORD_SOURCE_NULL)
+    {
+        snd_pcm_format_set_silence(sampleFormat, buf, frames * numChannels);
+    }
+    else
+    {
+        bytes = file->readData((char *)buf, frames * frameBytes);
+        if (bytes <= 0)
+            return -1;
+        frames = bytes / frameBytes;
+    }
+
+    paced += frames;
+    return frames;
+}
+
+void Recorder::captureTask()
+{
+    snd_pcm_sframes_t r;
+    size_t room;
+    char *p;
+
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+    {
+        room = ring.writable(&p) / frameBytes;
+        if (room == 0)
+        {
+            /* the writer is behind: keep the device drained, lose this period */
+            if (!overflowing)
+                __atomic_add_fetch(&xruns, 1, __ATOMIC_RELAXED);
+            overflowing = true;
+            if (readSource(discard, periodFrames) < 0)
+                break;
+            continue;
+        }
+        overflowing = false;
+
+        r = readSource(p, room < periodFrames ? room : periodFrames);
+        if (r < 0)
+            break;
+        if (r == 0)
+            continue;
+
+        ring.produce(r * frameBytes);
+        __atomic_add_fetch(&captured, r, __ATOMIC_RELAXED);
+        if (ring.filled() >= blockBytes)
+            wakeWriter();
+    }
+
+    __atomic_store_n(&capturing, false, __ATOMIC_RELEASE);
+    wakeWriter();
+}
+
+void Recorder::writerTask()
+{
+    struct pollfd pfd;
+    uint64_t lastPatch = nowMs(), count;
+    bool live;
+    size_t n;
+    char *p;
+
+    pfd.fd = wakeFd;
+    pfd.events = POLLIN;
+
+    while (true)
+    {
+        live = __atomic_load_n(&capturing, __ATOMIC_ACQUIRE);
+
+        /* the tail sits on a block boundary, a whole block never wraps */
+        while (ring.filled() >= blockBytes)
+        {
+            ring.readable(&p);
+            if (writer.writeAligned(p, blockBytes) < 0)
+                goto fail;
+            ring.consume(blockBytes);
+        }
+
+        if (!live)
+            break;
+
+        if (nowMs() - lastPatch >= RECORD_PATCH_MS)
+        {
+            if (writer.updateHeader(true) < 0)
+                goto fail;
+            lastPatch = nowMs();
+        }
+
+        if (poll(&pfd, 1, RECORD_PATCH_MS) > 0 && (pfd.revents & POLLIN))
+        {
+            if (read(wakeFd, &count, sizeof(count)) < 0)
+                count = 0;
+        }
+    }
+
+    /* less than a block left once capture has ended */
+    n = ring.readable(&p);
+    if (n > 0 && writer.write(p, n) < 0)
+        goto fail;
+    ring.consume(n);
+    return;
+
+fail:
+    fprintf(stderr, "recording write error: %s\n", strerror(errno));
+    result = -1;
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+}
+
+void *Recorder::captureThreadFunc(void *arg)
+{
+    ((Recorder *)arg)->captureTask();
+    return NULL;
+}
+
+void *Recorder::writerThreadFunc(void *arg)
+{
+    ((Recorder *)arg)->writerTask();
+    return NULL;
+}
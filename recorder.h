@@ -0,0 +1,97 @@
+#ifndef _RECORDER_H_
+#define _RECORDER_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+
+#include "spsc_ring.h"
+#include "wav_file.h"
+#include "wav_writer.h"
+
+#define RECORD_RING_MS      2000            /* how far the writer may fall behind */
+#define RECORD_BLOCK_BYTES  (256 * 1024)    /* at least this much per write */
+#define RECORD_PATCH_MS     1000            /* header sizes refreshed on disk */
+#define RECORD_PERIOD_MS    10              /* pace of the file and null sources */
+#define RECORD_BUFFER_US    500000          /* device buffer, rides out a busy host */
+
+typedef enum {
+    RECORD_SOURCE_ALSA = 0,
+    RECORD_SOURCE_FILE,
+    RECORD_SOURCE_NULL,
+} record_source_t;
+
+/*
+ * Capture to a WAV file. The capture thread reads the device straight
+ * into a lock-free ring, the writer thread takes whole blocks out of it
+ * and writes them in place, with O_DIRECT on request. Neither side ever
+ * waits for the other: a full ring drops audio and counts an overrun
+ * rather than stalling the device. Runs next to an APlayer on the same
+ * or another card for full duplex.
+ */
+class Recorder
+{
+public:
+    Recorder();
+    virtual ~Recorder();
+
+    /*
+     * source - ALSA capture device, "file:name.wav" to replay a file at
+     *          real time, or "null" for silence. A file brings its own
+     *          format, channels and rate; a device gets the nearest it has.
+     */
+    int  start(const char *source, const char *filename, snd_pcm_format_t format,
+               int channels, uint32_t rate, bool direct = false);
+    /* finish the file, -1 when anything was lost to a write error */
+    int  stop();
+
+    bool isRecording() { return __atomic_load_n(&capturing, __ATOMIC_ACQUIRE); }
+    uint64_t frames() { return __atomic_load_n(&captured, __ATOMIC_RELAXED); }
+    uint32_t overruns() { return __atomic_load_n(&xruns, __ATOMIC_RELAXED); }
+    snd_pcm_format_t format() { return sampleFormat; }
+    int      channels() { return numChannels; }
+    uint32_t rate() { return sampleRate; }
+    bool     isDirect() { return writer.isDirect(); }
+
+private:
+    static void *captureThreadFunc(void *arg);
+    static void *writerThreadFunc(void *arg);
+    void captureTask();
+    void writerTask();
+
+    int  openDevice(const char *device);
+    snd_pcm_sframes_t readSource(void *buf, size_t frames);
+    snd_pcm_sframes_t readDevice(void *buf, size_t frames);
+    void wakeWriter();
+    void release();
+
+    record_source_t source;
+    snd_pcm_t *handle;
+    WavFile   *file;
+
+    snd_pcm_format_t sampleFormat;
+    int      numChannels;
+    uint32_t sampleRate;
+    size_t   frameBytes;
+    size_t   periodFrames;
+    struct timespec paceStart;
+    uint64_t paced;         /* frames handed out by a paced source */
+
+    SpscRing  ring;
+    size_t    blockBytes;   /* multiple of the frame size and WAV_WRITER_ALIGN */
+    WavWriter writer;
+    char     *discard;      /* device reads while the ring is full */
+    int       wakeFd;       /* eventfd, capture to writer */
+
+    pthread_t captureThID;
+    pthread_t writerThID;
+    bool      capturing;
+    bool      stopping;
+    bool      overflowing;
+    uint64_t  captured;
+    uint32_t  xruns;
+    int       result;
+};
+
+#endif
@@ -0,0 +1,286 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "requantizer.h"
+#include "pcm_utils.h"
+
+#define REQUANT_BLOCK   256     /* frames per pass */
+
+/* Lipshitz et al. minimally audible noise shaping, 5 taps */
+static const float shapeCoef[DITHER_SHAPE_TAPS] = {
+    2.033f, -2.165f, 1.959f, -1.590f, 0.6149f
+};
+
+static int effectiveBits(snd_pcm_format_t format)
+{
+    if (snd_pcm_format_float(format) == 1)
+        return 25;  /* float mantissa plus sign */
+    return snd_pcm_format_width(format);
+}
+
+Requantizer::Requantizer()
+    : inFormat(SND_PCM_FORMAT_UNKNOWN)
+    , outFormat(SND_PCM_FORMAT_UNKNOWN)
+    , channels(0)
+    , ditherMode(DITHER_NONE)
+    , scale(1)
+    , lo(-1)
+    , hi(1)
+    , error(NULL)
+    , scratch(NULL)
+    , noise(NULL)
+{
+    reseed(0);
+}
+
+Requantizer::~Requantizer()
+{
+    free(error);
+    free(scratch);
+    free(noise);
+}
+
+const char *Requantizer::modeName(dither_mode_t mode)
+{
+    switch (mode)
+    {
+    case DITHER_TPDF:   return "tpdf";
+    case DITHER_SHAPED: return "shaped";
+    default:            return "none";
+    }
+}
+
+void Requantizer::reseed(uint32_t seed)
+{
+    int k;
+
+    /* any non-zero seeds, different per lane */
+    for (k = 0; k < DITHER_LANES; k++)
+    {
+        rngA[k] = (0x9e3779b9U * (k + 1)) ^ (seed * 0x27d4eb2dU);
+        rngB[k] = (0x85ebca6bU * (k + 1) ^ 0x5bd1e995U) ^ (seed * 0x165667b1U);
+        if (rngA[k] == 0)
+            rngA[k] = 1;
+        if (rngB[k] == 0)
+            rngB[k] = 1;
+    }
+
+    if (error)
+        memset(error, 0, DITHER_SHAPE_TAPS * channels * sizeof(float));
+}
+
+int Requantizer::setup(snd_pcm_format_t in, snd_pcm_format_t out, int channels,
+                       dither_mode_t mode)
+{
+    int bits;
+
+    if (channels < 1)
+        return -1;
+
+    this->channels = channels;
+    inFormat = in;
+    outFormat = out;
+    if (in == out)
+    {
+        ditherMode = DITHER_NONE;
+        return 0;
+    }
+
+    /* dither only pays off when bits are dropped, and only down to 24 */
+    bits = effectiveBits(out);
+    if (snd_pcm_format_float(out) == 1 || bits > 24 || bits >= effectiveBits(in))
+        mode = DITHER_NONE;
+
+    ditherMode = mode;
+    scale = bits > 0 ? ldexpf(1.0f, bits - 1) : 1.0f;
+    lo = -scale;
+    hi = scale - 1;
+
+    free(error);
+    free(scratch);
+    free(noise);
+    error = (float *)calloc(DITHER_SHAPE_TAPS * channels, sizeof(float));
+    scratch = (float *)malloc(REQUANT_BLOCK * channels * sizeof(float));
+    /* rounded up to whole lanes */
+    noise = (float *)malloc((REQUANT_BLOCK * channels + DITHER_LANES) * sizeof(float));
+    if (!error || !scratch || !noise)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Sum of two uniform variables per sample, from DITHER_LANES xorshift32
+ * generators stepped side by side so the loop maps onto vector registers.
+ */
+void Requantizer::fillNoise(float *__restrict out, size_t samples)
+{
+    uint32_t a[DITHER_LANES], b[DITHER_LANES];
+    size_t i;
+    int k;
+
+    memcpy(a, rngA, sizeof(a));
+    memcpy(b, rngB, sizeof(b));
+
+    for (i = 0; i < samples; i += DITHER_LANES)
+    {
+        for (k = 0; k < DITHER_LANES; k++)
+        {
+            a[k] ^= a[k] << 13;
+            a[k] ^= a[k] >> 17;
+            a[k] ^= a[k] << 5;
+            b[k] ^= b[k] << 13;
+            b[k] ^= b[k] >> 17;
+            b[k] ^= b[k] << 5;
+            /* each term in [-0.5, 0.5) LSB */
+            out[i + k] = ((float)(int32_t)a[k] + (float)(int32_t)b[k]) * (1.0f / 4294967296.0f);
+        }
+    }
+
+    memcpy(rngA, a, sizeof(a));
+    memcpy(rngB, b, sizeof(b));
+}
+
+void Requantizer::quantize(float *__restrict buf, size_t frames)
+{
+    const float inv = 1.0f / scale;
+    size_t i, samples = frames * channels;
+    int c;
+
+    if (ditherMode == DITHER_NONE)
+        return;     /* pcm_from_float() rounds */
+
+    fillNoise(noise, samples);
+
+    if (ditherMode == DITHER_TPDF)
+    {
+        for (i = 0; i < samples; i++)
+            buf[i] = rintf(buf[i] * scale + noise[i]) * inv;
+        return;
+    }
+
+    for (c = 0; c < channels; c++)
+        shape(buf + c, channels, frames, c);
+}
+
+/* channel c of a block whose noise fillNoise() has made, interleaved */
+void Requantizer::quantizePlane(float *__restrict buf, size_t frames, int c)
+{
+    const float inv = 1.0f / scale;
+    size_t f;
+
+    if (ditherMode == DITHER_TPDF)
+    {
+        for (f = 0; f < frames; f++)
+            buf[f] = rintf(buf[f] * scale + noise[f * channels + c]) * inv;
+    }
+    else if (ditherMode == DITHER_SHAPED)
+        shape(buf, 1, frames, c);
+}
+
+/*
+ * Error feedback: w = x - sum(h[k] * e[n-k]), y = Q(w + d), e = y - w.
+ * The history is a shift register per tap, channel innermost. Channels
+ * are independent, so it runs one at a time on frames stride apart.
+ */
+void Requantizer::shape(float *__restrict buf, size_t stride, size_t frames, int c)
+{
+    const float inv = 1.0f / scale;
+    float *e1, *e2, *e3, *e4, *e5;
+    float v, q, e;
+    size_t f;
+
+    e1 = error + c;
+    e2 = e1 + channels;
+    e3 = e2 + channels;
+    e4 = e3 + channels;
+    e5 = e4 + channels;
+    for (f = 0; f < frames; f++)
+    {
+        v = buf[f * stride] * scale - (shapeCoef[0] * *e1 + shapeCoef[1] * *e2 +
+                                       shapeCoef[2] * *e3 + shapeCoef[3] * *e4 +
+                                       shapeCoef[4] * *e5);
+        q = rintf(v + noise[f * channels + c]);
+        if (q < lo)
+            q = lo;
+        else if (q > hi)
+            q = hi;
+
+        /* bounded so a clipped stretch can not make the loop run away */
+        e = q - v;
+        if (e > 2.0f)
+            e = 2.0f;
+        else if (e < -2.0f)
+            e = -2.0f;
+
+        *e5 = *e4;
+        *e4 = *e3;
+        *e3 = *e2;
+        *e2 = *e1;
+        *e1 = e;
+        buf[f * stride] = q * inv;
+    }
+}
+
+int Requantizer::process(const void *in, void *out, size_t frames)
+{
+    const char *src = (const char *)in;
+    char *dst = (char *)out;
+    size_t f, n;
+
+    if (inFormat == outFormat)
+    {
+        if (in != out)
+            memcpy(out, in, snd_pcm_format_size(inFormat, frames * channels));
+        return 0;
+    }
+
+    for (f = 0; f < frames; f += n)
+    {
+        n = frames - f < REQUANT_BLOCK ? frames - f : REQUANT_BLOCK;
+        if (pcm_to_float(inFormat, src + snd_pcm_format_size(inFormat, f * channels),
+                         scratch, n * channels) < 0)
+            return -1;
+        quantize(scratch, n);
+        if (pcm_from_float(outFormat, scratch, dst + snd_pcm_format_size(outFormat, f * channels),
+                           n * channels) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+int Requantizer::processPlanar(void *const *in, void *const *out, size_t frames)
+{
+    size_t f, n;
+    int c;
+
+    if (inFormat == outFormat)
+    {
+        for (c = 0; c < channels; c++)
+            if (in[c] != out[c])
+                memcpy(out[c], in[c], snd_pcm_format_size(inFormat, frames));
+        return 0;
+    }
+
+    /* blocks and noise as process() has them, each channel takes its samples */
+    for (f = 0; f < frames; f += n)
+    {
+        n = frames - f < REQUANT_BLOCK ? frames - f : REQUANT_BLOCK;
+        if (ditherMode != DITHER_NONE)
+            fillNoise(noise, n * channels);
+        for (c = 0; c < channels; c++)
+        {
+            if (pcm_to_float(inFormat, (const char *)in[c] + snd_pcm_format_size(inFormat, f),
+                             scratch, n) < 0)
+                return -1;
+            quantizePlane(scratch, n, c);
+            if (pcm_from_float(outFormat, scratch, (char *)out[c] + snd_pcm_format_size(outFormat, f), n) < 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+#ifndef _REQUANTIZER_H_
+#define _REQUANTIZER_H_
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+#define DITHER_LANES        8       /* independent generators, one vector wide */
+#define DITHER_SHAPE_TAPS   5
+
+typedef enum {
+    DITHER_NONE = 0,        /* round to nearest */
+    DITHER_TPDF,            /* triangular, 2 LSB peak to peak, flat spectrum */
+    DITHER_SHAPED,          /* TPDF plus error feedback, noise pushed above 15 kHz */
+} dither_mode_t;
+
+/*
+ * Converts interleaved frames from the file format to the device format.
+ * When the device has fewer bits than the source, the step down is
+ * dithered instead of being truncated.
+ */
+class Requantizer
+{
+public:
+    Requantizer();
+    virtual ~Requantizer();
+
+    int  setup(snd_pcm_format_t in, snd_pcm_format_t out, int channels,
+               dither_mode_t mode = DITHER_TPDF);
+    int  process(const void *in, void *out, size_t frames);
+    /* the same on one plane per channel, with the very noise process() adds */
+    int  processPlanar(void *const *in, void *const *out, size_t frames);
+    /* restart noise and error feedback, so pieces rendered apart repeat exactly */
+    void reseed(uint32_t seed);
+
+    bool isPassthrough() { return inFormat == outFormat; }
+    /* mode actually used, DITHER_NONE when no bits are lost */
+    dither_mode_t mode() { return ditherMode; }
+
+    static const char *modeName(dither_mode_t mode);
+
+private:
+    void fillNoise(float *noise, size_t samples);
+    void quantize(float *buf, size_t frames);
+    void quantizePlane(float *buf, size_t frames, int c);
+    void shape(float *buf, size_t stride, size_t frames, int c);
+
+    snd_pcm_format_t inFormat;
+    snd_pcm_format_t outFormat;
+    int   channels;
+    dither_mode_t ditherMode;
+    float scale;            /* full scale in output LSB */
+    float lo, hi;           /* output range in LSB */
+
+    uint32_t rngA[DITHER_LANES];
+    uint32_t rngB[DITHER_LANES];
+    float *error;           /* [DITHER_SHAPE_TAPS][channels], newest first */
+
+    float *scratch;
+    float *noise;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdlib.h>
+
+#include "spsc_ring.h"
+
+SpscRing::SpscRing()
+    : buf(NULL)
+    , size(0)
+    , head(0)
+    , tail(0)
+{
+}
+
+SpscRing::~SpscRing()
+{
+    free(buf);
+}
+
+int SpscRing::setup(size_t capacity, size_t align)
+{
+    free(buf);
+    buf = NULL;
+    size = 0;
+    head = tail = 0;
+
+    if (capacity == 0 || posix_memalign((void **)&buf, align, capacity) != 0)
+    {
+        buf = NULL;
+        return -1;
+    }
+    size = capacity;
+
+    return 0;
+}
+
+size_t SpscRing::writable(char **ptr)
+{
+    uint64_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    size_t offset = head % size;
+    size_t free = size - (size_t)(head - t);
+
+    *ptr = buf + offset;
+    return free < size - offset ? free : size - offset;
+}
+
+void SpscRing::produce(size_t bytes)
+{
+    __atomic_store_n(&head, head + bytes, __ATOMIC_RELEASE);
+}
+
+size_t SpscRing::readable(char **ptr)
+{
+    uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    size_t offset = tail % size;
+    size_t used = (size_t)(h - tail);
+
+    *ptr = buf + offset;
+    return used < size - offset ? used : size - offset;
+}
+
+void SpscRing::consume(size_t bytes)
+{
+    __atomic_store_n(&tail, tail + bytes, __ATOMIC_RELEASE);
+}
+
+size_t SpscRing::filled()
+{
+    uint64_t t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+
+    return (size_t)(h - t);
+}
@@ -0,0 +1,42 @@
+#ifndef _SPSC_RING_H_
+#define _SPSC_RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Single producer, single consumer byte ring without locks. Both sides
+ * work in place: writable()/readable() hand out the contiguous region at
+ * the head or tail, produce()/consume() publish what was done with it.
+ * The storage is page aligned so regions can go straight to O_DIRECT.
+ */
+class SpscRing
+{
+public:
+    SpscRing();
+    virtual ~SpscRing();
+
+    int    setup(size_t capacity, size_t align = 4096);
+    /* only while neither side is running */
+    void   reset() { head = tail = 0; }
+    size_t capacity() { return size; }
+
+    /* producer side */
+    size_t writable(char **ptr);
+    void   produce(size_t bytes);
+
+    /* consumer side */
+    size_t readable(char **ptr);
+    void   consume(size_t bytes);
+
+    /* either side, a snapshot */
+    size_t filled();
+
+private:
+    char    *buf;
+    size_t   size;
+    uint64_t head;          /* bytes ever produced, written by the producer */
+    uint64_t tail;          /* bytes ever consumed, written by the consumer */
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include <string.h>
+
+#include "stream_hash.h"
+
+#define PRIME1  0x9E3779B185EBCA87ULL
+#define PRIME2  0xC2B2AE3D27D4EB4FULL
+#define PRIME3  0x165667B19E3779F9ULL
+#define PRIME4  0x85EBCA77C2B2AE63ULL
+#define PRIME5  0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* little endian loads whatever the host, the digest is portable */
+static inline uint64_t read64(const uint8_t *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint32_t read32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME2;
+    acc = rotl(acc, 31);
+    return acc * PRIME1;
+}
+
+static inline uint64_t merge64(uint64_t h, uint64_t acc)
+{
+    h ^= round64(0, acc);
+    return h * PRIME1 + PRIME4;
+}
+
+void StreamHash::reset(uint64_t seed)
+{
+    this->seed = seed;
+    acc[0] = seed + PRIME1 + PRIME2;
+    acc[1] = seed + PRIME2;
+    acc[2] = seed;
+    acc[3] = seed - PRIME1;
+    total = 0;
+    tailBytes = 0;
+}
+
+void StreamHash::stripe(const uint8_t *p)
+{
+    acc[0] = round64(acc[0], read64(p));
+    acc[1] = round64(acc[1], read64(p + 8));
+    acc[2] = round64(acc[2], read64(p + 16));
+    acc[3] = round64(acc[3], read64(p + 24));
+}
+
+void StreamHash::update(const void *data, size_t bytes)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t n;
+
+    total += bytes;
+
+    if (tailBytes)
+    {
+        n = 32 - tailBytes;
+        if (n > bytes)
+            n = bytes;
+        memcpy(tail + tailBytes, p, n);
+        tailBytes += n;
+        p += n;
+        bytes -= n;
+        if (tailBytes < 32)
+            return;
+        stripe(tail);
+        tailBytes = 0;
+    }
+
+    for (; bytes >= 32; p += 32, bytes -= 32)
+        stripe(p);
+
+    memcpy(tail, p, bytes);
+    tailBytes = bytes;
+}
+
+uint64_t StreamHash::digest()
+{
+    const uint8_t *p = tail;
+    uint32_t left = tailBytes;
+    uint64_t h;
+
+    if (total >= 32)
+    {
+        h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+        h = merge64(h, acc[0]);
+        h = merge64(h, acc[1]);
+        h = merge64(h, acc[2]);
+        h = merge64(h, acc[3]);
+    }
+    else
+        h = seed + PRIME5;
+    h += total;
+
+    for (; left >= 8; p += 8, left -= 8)
+    {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * PRIME1 + PRIME4;
+    }
+    if (left >= 4)
+    {
+        h ^= (uint64_t)read32(p) * PRIME1;
+        h = rotl(h, 23) * PRIME2 + PRIME3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--)
+    {
+        h ^= *p * PRIME5;
+        h = rotl(h, 11) * PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+uint64_t StreamHash::hash(const void *data, size_t bytes, uint64_t seed)
+{
+    StreamHash h(seed);
+
+    h.update(data, bytes);
+    return h.digest();
+}
@@ -0,0 +1,34 @@
+#ifndef _STREAM_HASH_H_
+#define _STREAM_HASH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * XXH64 over data arriving in pieces of any size: the digest is the same
+ * as for one call with all of it, and the same as xxhsum -H64 prints for
+ * those bytes. Not cryptographic, about a byte per cycle or better.
+ */
+class StreamHash
+{
+public:
+    StreamHash(uint64_t seed = 0) { reset(seed); }
+
+    void     reset(uint64_t seed = 0);
+    void     update(const void *data, size_t bytes);
+    uint64_t digest();
+    uint64_t length() { return total; }
+
+    static uint64_t hash(const void *data, size_t bytes, uint64_t seed = 0);
+
+private:
+    void     stripe(const uint8_t *p);
+
+    uint64_t acc[4];
+    uint64_t seed;
+    uint64_t total;
+    uint8_t  tail[32];      /* bytes short of a whole stripe */
+    uint32_t tailBytes;
+};
+
+#endif
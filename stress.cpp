@@ -0,0 +1,332 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stress.h"
+#include "aplayer.h"
+#include "virtual_sink.h"
+#include "wav_writer.h"
+#include "thread_policy.h"
+#include "pcm_utils.h"
+
+#define STRESS_RATE         48000
+#define STRESS_CHANNELS     2
+#define STRESS_SECONDS      6
+#define STRESS_BUFFER_MS    100         /* of the virtual sink */
+#define STRESS_SEED         0x5eed1e55u
+#define STRESS_MAX_HOGS     64
+#define STRESS_MEMORY_HOGS  4
+
+typedef struct {
+    const char *name;
+    const char *what;
+    uint32_t readDelayMs;       /* every read sleeps up to this long */
+    uint32_t readStallMs;       /* and every readStallEvery-th this long */
+    uint32_t readStallEvery;
+    uint32_t shortReadBytes;    /* reads return at most this much, 0 for whole */
+    uint32_t jitterUs;          /* every device write is held up to this long */
+    uint32_t stallMs;           /* and every stallEvery-th this long */
+    uint32_t stallEvery;
+    int      cpuHogs;           /* spinning threads per cpu */
+    uint32_t memoryMiB;         /* streamed through by each of up to STRESS_MEMORY_HOGS threads */
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    { "clean", "no faults, the baseline",
+      0, 0, 0, 0, 0, 0, 0, 0, 0 },
+    { "slow-disk", "reads up to 30 ms late, a 400 ms stall every 16th",
+      30, 400, 16, 0, 0, 0, 0, 0, 0 },
+    { "short-reads", "reads split into pieces of up to 4 KiB",
+      0, 0, 0, 4096, 0, 0, 0, 0, 0 },
+    { "stalls", "the player held up 150 ms every 40th write",
+      0, 0, 0, 0, 0, 150, 40, 0, 0 },
+    { "jitter", "every write held up to 8 ms",
+      0, 0, 0, 0, 8000, 0, 0, 0, 0 },
+    { "cpu", "two spinning threads per cpu",
+      0, 0, 0, 0, 0, 0, 0, 2, 0 },
+    { "memory", "up to four threads streaming through 64 MiB each",
+      0, 0, 0, 0, 0, 0, 0, 0, 64 },
+    { "all", "slow and short reads, jitter, cpu and memory load together",
+      2, 200, 256, 4096, 4000, 0, 0, 1, 64 },
+};
+
+typedef struct {
+    const scenario_t *sc;
+    uint64_t reads;
+    bool     stop;
+} stress_state_t;
+
+/* the same number for the same seed and position, every run */
+static uint32_t fault_hash(uint32_t seed, uint64_t n)
+{
+    uint64_t x = n * 0x9e3779b97f4a7c15ULL + seed;
+
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+    return (uint32_t)(x ^ (x >> 31));
+}
+
+static size_t readFault(size_t bytes, void *data)
+{
+    stress_state_t *state = (stress_state_t *)data;
+    const scenario_t *sc = state->sc;
+    uint64_t n = __atomic_fetch_add(&state->reads, 1, __ATOMIC_RELAXED);
+    uint32_t h = fault_hash(STRESS_SEED, n);
+    uint32_t ms = 0;
+
+    if (sc->readStallEvery && n % sc->readStallEvery == sc->readStallEvery - 1)
+        ms = sc->readStallMs;
+    else if (sc->readDelayMs)
+        ms = h % (sc->readDelayMs + 1);
+    if (ms)
+        usleep(ms * 1000);
+
+    if (sc->shortReadBytes && bytes > 1)
+        bytes = 1 + (h >> 8) % (bytes < sc->shortReadBytes ? bytes : sc->shortReadBytes);
+
+    return bytes;
+}
+
+static uint32_t writeFault(uint64_t n, void *data)
+{
+    const scenario_t *sc = ((stress_state_t *)data)->sc;
+
+    if (sc->stallEvery && n % sc->stallEvery == sc->stallEvery - 1)
+        return sc->stallMs * 1000;
+    if (sc->jitterUs)
+        return fault_hash(STRESS_SEED ^ 1, n) % (sc->jitterUs + 1);
+
+    return 0;
+}
+
+static void *cpuHog(void *data)
+{
+    stress_state_t *state = (stress_state_t *)data;
+    volatile double x = 1;
+    int i;
+
+    while (!__atomic_load_n(&state->stop, __ATOMIC_RELAXED))
+        for (i = 0; i < 100000; i++)
+            x = x * 1.0000001 + 1e-9;
+
+    return NULL;
+}
+
+/* keeps evicting the caches and loading the memory bus */
+static void *memoryHog(void *data)
+{
+    stress_state_t *state = (stress_state_t *)data;
+    size_t bytes = (size_t)state->sc->memoryMiB << 20;
+    char *mem;
+
+    mem = (char *)malloc(bytes);
+    if (mem == NULL)
+        return NULL;
+    memset(mem, 1, bytes);
+
+    while (!__atomic_load_n(&state->stop, __ATOMIC_RELAXED))
+        memmove(mem, mem + bytes / 2, bytes / 2);
+
+    free(mem);
+
+    return NULL;
+}
+
+/* STRESS_SECONDS of 997 Hz sine, -6 dB */
+static int makeTestFile(char *filename, size_t size)
+{
+    const size_t frames = STRESS_RATE / 10;
+    WavWriter writer;
+    float *tmp;
+    int16_t *buf;
+    size_t f, n;
+    int fd, c, ret = 0;
+
+    snprintf(filename, size, "/tmp/aplayer-stress-XXXXXX.wav");
+    fd = mkstemps(filename, 4);
+    if (fd < 0)
+    {
+        perror(filename);
+        return -1;
+    }
+    close(fd);
+
+    if (writer.open(filename, SND_PCM_FORMAT_S16_LE, STRESS_CHANNELS, STRESS_RATE) < 0)
+    {
+        unlink(filename);
+        return -1;
+    }
+
+    tmp = (float *)malloc(frames * STRESS_CHANNELS * sizeof(float));
+    buf = (int16_t *)malloc(frames * STRESS_CHANNELS * sizeof(int16_t));
+    for (n = 0; n < STRESS_SECONDS * 10 && ret == 0; n++)
+    {
+        for (f = 0; f < frames; f++)
+            for (c = 0; c < STRESS_CHANNELS; c++)
+                tmp[f * STRESS_CHANNELS + c] = 0.5f * sinf(2 * M_PI * 997 * (n * frames + f) / STRESS_RATE);
+        pcm_from_float(SND_PCM_FORMAT_S16_LE, tmp, buf, frames * STRESS_CHANNELS);
+        ret = writer.write(buf, frames * STRESS_CHANNELS * sizeof(int16_t));
+    }
+    free(tmp);
+    free(buf);
+
+    if (writer.close() < 0 || ret < 0)
+    {
+        unlink(filename);
+        return -1;
+    }
+
+    return 0;
+}
+
+static int compareUs(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentileMs(const uint32_t *sorted, uint32_t count, int percent)
+{
+    if (count == 0)
+        return 0;
+
+    return sorted[(uint64_t)(count - 1) * percent / 100] / 1000.0;
+}
+
+static void report(VirtualSink *sink, APlayer *player, uint64_t fileFrames, double seconds)
+{
+    const uint32_t *recovery, *latency;
+    verify_result_t verify;
+    uint32_t *sorted;
+    uint32_t n, i, maxUs = 0;
+    uint64_t sumUs = 0;
+
+    printf("  %.2f s, %llu of %llu frames delivered, %u underruns",
+           seconds, (unsigned long long)sink->frames(), (unsigned long long)fileFrames, sink->xruns());
+
+    n = sink->recoveries(&recovery);
+    for (i = 0; i < n; i++)
+    {
+        sumUs += recovery[i];
+        if (recovery[i] > maxUs)
+            maxUs = recovery[i];
+    }
+    if (n)
+        printf(", recovery mean %.1f ms max %.1f ms", sumUs / 1000.0 / n, maxUs / 1000.0);
+    printf("\n");
+
+    n = sink->latencies(&latency);
+    sorted = (uint32_t *)malloc((n ? n : 1) * sizeof(uint32_t));
+    memcpy(sorted, latency, n * sizeof(uint32_t));
+    qsort(sorted, n, sizeof(uint32_t), compareUs);
+    printf("  latency p50 %.1f ms  p95 %.1f ms  p99 %.1f ms  min %.1f ms over %u writes\n",
+           percentileMs(sorted, n, 50), percentileMs(sorted, n, 95), percentileMs(sorted, n, 99),
+           percentileMs(sorted, n, 0), n);
+    free(sorted);
+
+    if (player->verifyResult(&verify) == 0)
+    {
+        if (verify.mismatch == VERIFY_NONE)
+            printf("  bit-perfect\n");
+        else
+            printf("  frame %llu differs from the file\n", (unsigned long long)verify.mismatch);
+    }
+}
+
+static int runScenario(const scenario_t *sc, const char *filename, uint64_t fileFrames)
+{
+    stress_state_t state;
+    pthread_t hogs[STRESS_MAX_HOGS];
+    VirtualSink *sink;
+    APlayer *player;
+    struct timespec begin, end;
+    int cpus, count = 0, i, ret;
+
+    memset(&state, 0, sizeof(state));
+    state.sc = sc;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1)
+        cpus = 1;
+    for (i = 0; i < cpus * sc->cpuHogs && count < STRESS_MAX_HOGS; i++)
+        if (ThreadPolicy::shared()->create(THREAD_DSP, &hogs[count], cpuHog, &state) == 0)
+            count++;
+    for (i = 0; sc->memoryMiB && i < cpus && i < STRESS_MEMORY_HOGS && count < STRESS_MAX_HOGS; i++)
+        if (ThreadPolicy::shared()->create(THREAD_DSP, &hogs[count], memoryHog, &state) == 0)
+            count++;
+
+    sink = new VirtualSink(SND_PCM_FORMAT_S16_LE, STRESS_CHANNELS, STRESS_RATE, STRESS_BUFFER_MS);
+    sink->setStall(writeFault, &state);
+    WavFile::setReadHook(readFault, &state);
+
+    player = new APlayer();
+    player->setOpener(VirtualSink::opener, sink);
+    player->setVerify(true);
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    ret = player->play(filename, "virtual");
+    if (ret == 0)
+    {
+        while (!player->isFinished())
+            usleep(20000);
+        player->stop();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    WavFile::setReadHook(NULL);
+    __atomic_store_n(&state.stop, true, __ATOMIC_RELAXED);
+    for (i = 0; i < count; i++)
+        pthread_join(hogs[i], NULL);
+
+    if (ret == 0)
+        report(sink, player, fileFrames, end.tv_sec - begin.tv_sec + (end.tv_nsec - begin.tv_nsec) / 1e9);
+    else
+        printf("  failed to play through the virtual sink\n");
+
+    delete player;
+    delete sink;
+
+    return ret;
+}
+
+void stress_list()
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        printf("  %-12s %s\n", scenarios[i].name, scenarios[i].what);
+}
+
+int stress_run(const char *name)
+{
+    char filename[64];
+    size_t i;
+    int found = 0, ret = 0;     /* scenarios that failed to run */
+
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+        if (name == NULL || strcmp(name, scenarios[i].name) == 0)
+            found++;
+    if (!found)
+        return STRESS_UNKNOWN;
+
+    if (makeTestFile(filename, sizeof(filename)) < 0)
+        return STRESS_NO_FILE;
+
+    for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++)
+    {
+        if (name && strcmp(name, scenarios[i].name) != 0)
+            continue;
+        printf("%s: %s\n", scenarios[i].name, scenarios[i].what);
+        fflush(stdout);
+        if (runScenario(&scenarios[i], filename, (uint64_t)STRESS_RATE * STRESS_SECONDS) < 0)
+            ret++;
+    }
+
+    unlink(filename);
+
+    return ret;
+}
@@ -0,0 +1,26 @@
+#ifndef _STRESS_H_
+#define _STRESS_H_
+
+/*
+ * Underrun resilience under injected faults. Every scenario plays a
+ * generated file through the whole APlayer pipeline into a VirtualSink
+ * while slowing down or splitting file reads, holding up device writes
+ * and loading the CPUs or memory, then reports the underruns, how long
+ * playback took to recover from them, the output latency and whether the
+ * device still got the file's samples unchanged. Faults are picked from
+ * a fixed seed by their position in the run, so every run of a scenario
+ * meets the same ones.
+ */
+
+#define STRESS_UNKNOWN      -1      /* no scenario of that name */
+#define STRESS_NO_FILE      -2      /* the test file could not be made */
+
+/*
+ * name - run only this scenario, NULL for all; returns STRESS_UNKNOWN or
+ * STRESS_NO_FILE, otherwise the number of scenarios that could not be
+ * played
+ */
+int  stress_run(const char *name);
+void stress_list();
+
+#endif
@@ -0,0 +1,347 @@
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "thread_policy.h"
+
+#define MPOL_PREFERRED_MODE     1       /* MPOL_PREFERRED of <linux/mempolicy.h> */
+#define LOCAL_HEADER            4096    /* mapping size, ahead of the memory handed out */
+
+ThreadPolicy::ThreadPolicy()
+{
+    int i;
+
+    for (i = 0; i < THREAD_CLASSES; i++)
+    {
+        CPU_ZERO(&classes[i].cpus);
+        classes[i].priority = 0;
+        classes[i].stackSize = 0;
+        classes[i].node = -1;
+        warned[i] = false;
+    }
+    pthread_mutex_init(&lock, NULL);
+}
+
+ThreadPolicy::~ThreadPolicy()
+{
+    pthread_mutex_destroy(&lock);
+}
+
+ThreadPolicy *ThreadPolicy::shared()
+{
+    static ThreadPolicy policy;
+
+    return &policy;
+}
+
+const char *ThreadPolicy::className(thread_class_t cls)
+{
+    switch (cls)
+    {
+    case THREAD_AUDIO:  return "audio";
+    case THREAD_IO:     return "io";
+    case THREAD_DSP:    return "dsp";
+    default:            return "unknown";
+    }
+}
+
+int ThreadPolicy::setCpus(thread_class_t cls, const char *cpus)
+{
+    cpu_set_t set;
+    const char *p = cpus;
+    char *end;
+    long first, last, cpu;
+
+    CPU_ZERO(&set);
+    while (p && *p)
+    {
+        first = last = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        if (*end == '-')
+        {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        if (last >= CPU_SETSIZE)
+            return -1;
+        for (cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, &set);
+
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    classes[cls].cpus = set;
+    updateNode(cls);
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+void ThreadPolicy::setPriority(thread_class_t cls, int priority)
+{
+    pthread_mutex_lock(&lock);
+    classes[cls].priority = priority < 0 ? 0 : priority > 99 ? 99 : priority;
+    warned[cls] = false;
+    pthread_mutex_unlock(&lock);
+}
+
+void ThreadPolicy::setStackSize(thread_class_t cls, size_t bytes)
+{
+    long page = sysconf(_SC_PAGESIZE);
+
+    if (bytes)
+    {
+        if (bytes < (size_t)PTHREAD_STACK_MIN)
+            bytes = PTHREAD_STACK_MIN;
+        bytes = (bytes + page - 1) / page * page;
+    }
+
+    pthread_mutex_lock(&lock);
+    classes[cls].stackSize = bytes;
+    pthread_mutex_unlock(&lock);
+}
+
+int ThreadPolicy::parse(const char *spec)
+{
+    const char *field[4];
+    size_t length[4];
+    char cpus[256];
+    long value[2] = { 0, 0 };      /* priority, stack KiB */
+    const char *p = spec;
+    char *end;
+    int n = 0, i, cls = -1;
+
+    /* class:cpus:priority:stack, any field but the class may be empty */
+    for (;;)
+    {
+        if (n == 4)
+            return -1;
+        field[n] = p;
+        length[n] = strcspn(p, ":");
+        p += length[n++];
+        if (*p == '\0')
+            break;
+        p++;
+    }
+
+    for (i = 0; i < THREAD_CLASSES; i++)
+    {
+        if (length[0] == strlen(className((thread_class_t)i)) &&
+            strncmp(field[0], className((thread_class_t)i), length[0]) == 0)
+            cls = i;
+    }
+    if (cls < 0)
+        return -1;
+
+    cpus[0] = '\0';
+    if (n > 1)
+    {
+        if (length[1] >= sizeof(cpus))
+            return -1;
+        memcpy(cpus, field[1], length[1]);
+        cpus[length[1]] = '\0';
+    }
+
+    for (i = 2; i < n; i++)
+    {
+        if (length[i] == 0)
+            continue;
+        if (field[i][0] < '0' || field[i][0] > '9')
+            return -1;
+        value[i - 2] = strtol(field[i], &end, 10);
+        if (end != field[i] + length[i] || value[i - 2] > INT_MAX / 1024)
+            return -1;
+    }
+
+    if (setCpus((thread_class_t)cls, cpus) < 0)
+        return -1;
+    setPriority((thread_class_t)cls, value[0]);
+    setStackSize((thread_class_t)cls, (size_t)value[1] * 1024);
+
+    return 0;
+}
+
+void ThreadPolicy::placement(thread_class_t cls, thread_placement_t *placement)
+{
+    pthread_mutex_lock(&lock);
+    *placement = classes[cls];
+    pthread_mutex_unlock(&lock);
+}
+
+/* -1 when the kernel has no NUMA information for cpu */
+int ThreadPolicy::nodeOf(int cpu)
+{
+    char path[64];
+    struct dirent *entry;
+    DIR *dir;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    dir = opendir(path);
+    if (dir == NULL)
+        return -1;
+
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+        {
+            node = atoi(entry->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+
+    return node;
+}
+
+/* with the lock held */
+void ThreadPolicy::updateNode(thread_class_t cls)
+{
+    int cpu, node, found = -1;
+
+    classes[cls].node = -1;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &classes[cls].cpus))
+            continue;
+
+        node = nodeOf(cpu);
+        if (node < 0 || (found >= 0 && node != found))
+            return;
+        found = node;
+    }
+    classes[cls].node = found;
+}
+
+int ThreadPolicy::create(thread_class_t cls, pthread_t *thread, void *(*func)(void *), void *arg)
+{
+    thread_placement_t p;
+    pthread_attr_t attr;
+    struct sched_param param;
+    int ret;
+
+    placement(cls, &p);
+    if (CPU_COUNT(&p.cpus) == 0 && p.priority == 0 && p.stackSize == 0)
+        return pthread_create(thread, NULL, func, arg);
+
+    pthread_attr_init(&attr);
+    if (p.stackSize)
+        pthread_attr_setstacksize(&attr, p.stackSize);
+    if (CPU_COUNT(&p.cpus))
+        pthread_attr_setaffinity_np(&attr, sizeof(p.cpus), &p.cpus);
+    if (p.priority)
+    {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = p.priority;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    }
+
+    ret = pthread_create(thread, &attr, func, arg);
+    if (ret == EPERM && p.priority)
+    {
+        pthread_mutex_lock(&lock);
+        if (!warned[cls])
+            fprintf(stderr, "%s threads: not allowed SCHED_FIFO %d, using the normal scheduler\n",
+                    className(cls), p.priority);
+        warned[cls] = true;
+        pthread_mutex_unlock(&lock);
+
+        pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+        ret = pthread_create(thread, &attr, func, arg);
+    }
+    pthread_attr_destroy(&attr);
+
+    return ret;
+}
+
+/*
+ * The node is a preference, not a binding: when it runs out of memory the
+ * kernel takes pages from elsewhere instead of failing. Pages are placed
+ * when first touched, by whichever thread that is.
+ */
+void *ThreadPolicy::allocLocal(thread_class_t cls, size_t bytes)
+{
+    unsigned long mask;
+    size_t total = LOCAL_HEADER + bytes;
+    int node;
+    char *mem;
+
+    mem = (char *)mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    pthread_mutex_lock(&lock);
+    node = classes[cls].node;
+    pthread_mutex_unlock(&lock);
+    if (node >= 0 && node < (int)(8 * sizeof(mask)))
+    {
+        mask = 1UL << node;
+        syscall(SYS_mbind, mem + LOCAL_HEADER, bytes, MPOL_PREFERRED_MODE, &mask, 8 * sizeof(mask), 0);
+    }
+
+    *(size_t *)mem = total;
+
+    return mem + LOCAL_HEADER;
+}
+
+void ThreadPolicy::freeLocal(void *ptr)
+{
+    char *mem;
+
+    if (ptr == NULL)
+        return;
+
+    mem = (char *)ptr - LOCAL_HEADER;
+    munmap(mem, *(size_t *)mem);
+}
+
+void ThreadPolicy::describe(thread_class_t cls, char *buf, size_t size)
+{
+    thread_placement_t p;
+    size_t len;
+    int cpu, first = -1;
+
+    placement(cls, &p);
+    len = snprintf(buf, size, "cpus ");
+    if (CPU_COUNT(&p.cpus) == 0)
+        len += snprintf(buf + len, len < size ? size - len : 0, "any");
+    for (cpu = 0; cpu <= CPU_SETSIZE; cpu++)
+    {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &p.cpus))
+        {
+            if (first < 0)
+                first = cpu;
+            continue;
+        }
+        if (first < 0)
+            continue;
+        if (len < size)
+            len += snprintf(buf + len, size - len, "%s%d", buf[len - 1] == ' ' ? "" : ",", first);
+        if (cpu - 1 > first && len < size)
+            len += snprintf(buf + len, size - len, "-%d", cpu - 1);
+        first = -1;
+    }
+    if (p.node >= 0 && len < size)
+        len += snprintf(buf + len, size - len, " (node %d)", p.node);
+    if (len < size)
+        len += snprintf(buf + len, size - len, p.priority ? ", FIFO %d" : ", normal", p.priority);
+    if (p.stackSize && len < size)
+        snprintf(buf + len, size - len, ", stack %zu KiB", p.stackSize / 1024);
+}
@@ -0,0 +1,69 @@
+#ifndef _THREAD_POLICY_H_
+#define _THREAD_POLICY_H_
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sched.h>
+
+typedef enum {
+    THREAD_AUDIO = 0,       /* feeds or drains a device */
+    THREAD_IO,              /* file reading and writing, sockets */
+    THREAD_DSP,             /* offline workers: render, analysis */
+    THREAD_CLASSES
+} thread_class_t;
+
+typedef struct {
+    cpu_set_t cpus;         /* empty for anywhere */
+    int      priority;      /* 1-99 for SCHED_FIFO, 0 for the normal scheduler */
+    size_t   stackSize;     /* 0 for the default */
+    int      node;          /* NUMA node all of cpus are on, -1 when none or several */
+} thread_placement_t;
+
+/*
+ * Where each class of thread runs. Every thread the library starts goes
+ * through create() with its class, so one setting covers all players,
+ * recorders and workers of the process. Changes apply to threads created
+ * afterwards. A priority the process may not use is dropped with a
+ * warning rather than failing the thread.
+ */
+class ThreadPolicy
+{
+public:
+    ThreadPolicy();
+    virtual ~ThreadPolicy();
+
+    static ThreadPolicy *shared();
+
+    /* cpus - list such as "0-3,8", NULL or "" for anywhere */
+    int  setCpus(thread_class_t cls, const char *cpus);
+    void setPriority(thread_class_t cls, int priority);
+    void setStackSize(thread_class_t cls, size_t bytes);
+    /* class:cpus[:priority[:stack KiB]], e.g. audio:2-3:80, empty fields for the defaults */
+    int  parse(const char *spec);
+
+    void placement(thread_class_t cls, thread_placement_t *placement);
+
+    /* pthread_create() with the class's placement, same return value */
+    int  create(thread_class_t cls, pthread_t *thread, void *(*func)(void *), void *arg);
+
+    /*
+     * Page aligned memory preferring the NUMA node of the class's cpus,
+     * for buffers its threads work on. Released with freeLocal().
+     */
+    void *allocLocal(thread_class_t cls, size_t bytes);
+    static void freeLocal(void *ptr);
+
+    static const char *className(thread_class_t cls);
+    /* "cpus 2-3, FIFO 80, stack 256 KiB" */
+    void describe(thread_class_t cls, char *buf, size_t size);
+
+private:
+    static int nodeOf(int cpu);
+    void updateNode(thread_class_t cls);
+
+    thread_placement_t classes[THREAD_CLASSES];
+    bool     warned[THREAD_CLASSES];
+    pthread_mutex_t lock;
+};
+
+#endif
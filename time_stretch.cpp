@@ -0,0 +1,298 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+#include "time_stretch.h"
+
+typedef union {
+    float f;
+    uint32_t u;
+} float_bits_t;
+
+/* the inner loop of the search, 8 products per step */
+static float dot(const float *__restrict a, const float *__restrict b, size_t n)
+{
+    float sum = 0;
+    size_t i = 0;
+
+#ifdef __SSE__
+    __m128 s0 = _mm_setzero_ps();
+    __m128 s1 = _mm_setzero_ps();
+    float t[4];
+
+    for (; i + 8 <= n; i += 8)
+    {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    _mm_storeu_ps(t, _mm_add_ps(s0, s1));
+    sum = t[0] + t[1] + t[2] + t[3];
+#endif
+    for (; i < n; i++)
+        sum += a[i] * b[i];
+
+    return sum;
+}
+
+TimeStretch::TimeStretch()
+    : channels(0)
+    , window(0)
+    , hop(0)
+    , tolerance(0)
+    , hann(NULL)
+    , acc(NULL)
+    , in(NULL)
+    , mono(NULL)
+    , inFrames(0)
+    , inCapacity(0)
+    , inBase(0)
+    , inPos(0)
+    , nextNatural(0)
+    , first(true)
+    , out(NULL)
+    , outFrames(0)
+    , outCapacity(0)
+{
+    setSpeed(1.0f);
+}
+
+TimeStretch::~TimeStretch()
+{
+    free(hann);
+    free(acc);
+    free(in);
+    free(mono);
+    free(out);
+}
+
+int TimeStretch::setup(int channels, uint32_t rate)
+{
+    size_t f;
+
+    this->channels = channels;
+    window = (rate / 50) & ~1U;     /* 20 ms */
+    if (window < 64)
+        window = 64;
+    hop = window / 2;
+    tolerance = rate / 200;         /* 5 ms */
+
+    free(hann);
+    free(acc);
+    hann = (float *)malloc(window * sizeof(float));
+    acc = (float *)malloc(window * channels * sizeof(float));
+    if (!hann || !acc)
+        return -1;
+
+    /* periodic Hann, shifted copies at half the length sum to one */
+    for (f = 0; f < window; f++)
+        hann[f] = 0.5f - 0.5f * cosf(2 * M_PI * f / window);
+
+    inFrames = outFrames = 0;
+    reserveInput(4 * window);
+    reserveOutput(4 * window);
+    if (!in || !mono || !out)
+        return -1;
+
+    reset();
+    return 0;
+}
+
+void TimeStretch::reset()
+{
+    inFrames = 0;
+    inBase = 0;
+    inPos = 0;
+    nextNatural = 0;
+    first = true;
+    outFrames = 0;
+    if (acc)
+        memset(acc, 0, window * channels * sizeof(float));
+}
+
+void TimeStretch::setSpeed(float speed)
+{
+    float_bits_t fb;
+
+    if (!(speed >= STRETCH_MIN_SPEED))
+        speed = STRETCH_MIN_SPEED;
+    else if (speed > STRETCH_MAX_SPEED)
+        speed = STRETCH_MAX_SPEED;
+
+    fb.f = speed;
+    __atomic_store_n(&speedBits, fb.u, __ATOMIC_RELAXED);
+}
+
+float TimeStretch::speed()
+{
+    float_bits_t fb;
+
+    fb.u = __atomic_load_n(&speedBits, __ATOMIC_RELAXED);
+    return fb.f;
+}
+
+void TimeStretch::reserveInput(size_t frames)
+{
+    if (frames <= inCapacity && in)
+        return;
+
+    if (frames < 2 * inCapacity)
+        frames = 2 * inCapacity;
+    in = (float *)realloc(in, frames * channels * sizeof(float));
+    mono = (float *)realloc(mono, frames * sizeof(float));
+    inCapacity = frames;
+}
+
+void TimeStretch::reserveOutput(size_t frames)
+{
+    if (frames <= outCapacity && out)
+        return;
+
+    if (frames < 2 * outCapacity)
+        frames = 2 * outCapacity;
+    out = (float *)realloc(out, frames * channels * sizeof(float));
+    outCapacity = frames;
+}
+
+void TimeStretch::put(const float *frames, size_t count)
+{
+    const float scale = 1.0f / channels;
+    float *m;
+    size_t f;
+    int c;
+
+    reserveInput(inFrames + count);
+    memcpy(in + inFrames * channels, frames, count * channels * sizeof(float));
+
+    m = mono + inFrames;
+    for (f = 0; f < count; f++, frames += channels)
+    {
+        float sum = 0;
+        for (c = 0; c < channels; c++)
+            sum += frames[c];
+        m[f] = sum * scale;
+    }
+    inFrames += count;
+
+    while (produce())
+        ;
+}
+
+void TimeStretch::flush()
+{
+    size_t n = window + tolerance;
+    float *zero;
+
+    zero = (float *)calloc(n * channels, sizeof(float));
+    if (zero)
+    {
+        put(zero, n);
+        free(zero);
+    }
+}
+
+size_t TimeStretch::get(float *frames, size_t count)
+{
+    if (count > outFrames)
+        count = outFrames;
+
+    memcpy(frames, out, count * channels * sizeof(float));
+    outFrames -= count;
+    memmove(out, out + count * channels, outFrames * channels * sizeof(float));
+
+    return count;
+}
+
+/*
+ * Start of the window within +-tolerance of nominal whose first half
+ * matches the continuation of the previous window best, normalized by the
+ * candidate energy so loud passages do not win by level alone.
+ */
+long TimeStretch::search(long nominal)
+{
+    const float *ref = mono + (nextNatural - inBase);
+    long lo, hi, c, best;
+    double energy, bestScore, score;
+    const float *m;
+    size_t i;
+
+    lo = nominal - tolerance;
+    if (lo < (long)inBase)
+        lo = inBase;
+    hi = nominal + tolerance;
+
+    m = mono + (lo - inBase);
+    energy = 0;
+    for (i = 0; i < hop; i++)
+        energy += m[i] * m[i];
+
+    /* the nominal position wins ties, speed 1.0 then copies the input */
+    best = nominal;
+    bestScore = -HUGE_VAL;
+    for (c = lo; c <= hi; c++, m++)
+    {
+        score = dot(ref, m, hop) / sqrt(energy + 1e-9);
+        if (score > bestScore * (1 + 1e-6) + 1e-12 || (c == nominal && score >= bestScore))
+        {
+            best = c;
+            bestScore = score;
+        }
+        energy += (double)m[hop] * m[hop] - (double)m[0] * m[0];
+    }
+
+    return best;
+}
+
+bool TimeStretch::produce()
+{
+    long nominal, pos, keep;
+    const float *src;
+    float *dst, w;
+    size_t f, drop;
+    int c;
+
+    nominal = (long)(inPos + 0.5);
+    if ((uint64_t)(nominal + window + (first ? 0 : tolerance)) > inBase + inFrames)
+        return false;
+
+    pos = first ? nominal : search(nominal);
+
+    /* overlap-add, the very first half is taken as is so engaging is seamless */
+    src = in + (pos - inBase) * channels;
+    dst = acc;
+    for (f = 0; f < window; f++, src += channels, dst += channels)
+    {
+        w = (first && f < hop) ? 1.0f : hann[f];
+        for (c = 0; c < channels; c++)
+            dst[c] += w * src[c];
+    }
+
+    reserveOutput(outFrames + hop);
+    memcpy(out + outFrames * channels, acc, hop * channels * sizeof(float));
+    outFrames += hop;
+    memmove(acc, acc + hop * channels, hop * channels * sizeof(float));
+    memset(acc + hop * channels, 0, hop * channels * sizeof(float));
+
+    nextNatural = pos + hop;
+    first = false;
+    inPos += hop * speed();
+
+    /* input before both the next search range and the continuation is done */
+    keep = (long)(inPos + 0.5) - tolerance;
+    if (keep > (long)nextNatural)
+        keep = nextNatural;
+    if (keep > (long)inBase)
+    {
+        drop = keep - inBase;
+        if (drop > inFrames)
+            drop = inFrames;
+        inFrames -= drop;
+        memmove(in, in + drop * channels, inFrames * channels * sizeof(float));
+        memmove(mono, mono + drop, inFrames * sizeof(float));
+        inBase += drop;
+    }
+
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef _TIME_STRETCH_H_
+#define _TIME_STRETCH_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STRETCH_MIN_SPEED   0.5f
+#define STRETCH_MAX_SPEED   2.0f
+
+/*
+ * WSOLA time stretch, changes tempo without changing pitch. Windows of
+ * 20 ms are overlap-added at a fixed synthesis hop while the analysis
+ * position advances by hop * speed; each window is shifted by up to 5 ms
+ * to where it best continues the previous one, found by cross-correlation
+ * of a mono mix. Works on interleaved float frames.
+ */
+class TimeStretch
+{
+public:
+    TimeStretch();
+    virtual ~TimeStretch();
+
+    int  setup(int channels, uint32_t rate);
+    /* drop buffered audio, e.g. on a new file */
+    void reset();
+
+    /* any thread, picked up at the next window, clamped to 0.5 .. 2.0 */
+    void  setSpeed(float speed);
+    float speed();
+
+    void   put(const float *frames, size_t count);
+    /* push the last buffered input out at the end of the material */
+    void   flush();
+    size_t available() { return outFrames; }
+    size_t get(float *frames, size_t count);
+
+private:
+    bool   produce();
+    long   search(long nominal);
+    void   reserveInput(size_t frames);
+    void   reserveOutput(size_t frames);
+
+    int      channels;
+    size_t   window;        /* N frames */
+    size_t   hop;           /* N / 2, synthesis hop and overlap */
+    long     tolerance;     /* search range either side */
+
+    uint32_t speedBits;     /* float, written atomically */
+
+    float   *hann;
+    float   *acc;           /* N frames being overlap-added */
+
+    float   *in;            /* buffered input, frame 0 is inBase */
+    float   *mono;
+    size_t   inFrames;
+    size_t   inCapacity;
+    uint64_t inBase;
+
+    double   inPos;         /* nominal start of the next window */
+    uint64_t nextNatural;   /* where the last window continues */
+    bool     first;
+
+    float   *out;
+    size_t   outFrames;
+    size_t   outCapacity;
+};
+
+#endif
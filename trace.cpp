@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+/* of a ring, the slot after the newest event may be being written */
+#define TRACE_EVENTS_KEPT   (TRACE_EVENTS_PER_THREAD - 1)
+
+bool Tracer::recording = false;
+__thread Tracer::thread_buf_t *Tracer::current = NULL;
+__thread const char *Tracer::threadName = NULL;
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+Tracer::Tracer()
+    : startNs(0)
+    , discarded(0)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_key_create(&key, threadExit);
+}
+
+Tracer::~Tracer()
+{
+    list<thread_buf_t *>::iterator it;
+
+    __atomic_store_n(&recording, false, __ATOMIC_RELEASE);
+    pthread_key_delete(key);
+    for (it = threads.begin(); it != threads.end(); ++it)
+        free(*it);
+    pthread_mutex_destroy(&lock);
+}
+
+Tracer *Tracer::shared()
+{
+    static Tracer tracer;
+
+    return &tracer;
+}
+
+void Tracer::start()
+{
+    list<thread_buf_t *>::iterator it;
+
+    __atomic_store_n(&recording, false, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&lock);
+    for (it = threads.begin(); it != threads.end(); ++it)
+        __atomic_store_n(&(*it)->written, 0, __ATOMIC_RELEASE);
+    discarded = 0;
+    startNs = monotonic_ns();
+    pthread_mutex_unlock(&lock);
+    __atomic_store_n(&recording, true, __ATOMIC_RELEASE);
+}
+
+void Tracer::stop()
+{
+    __atomic_store_n(&recording, false, __ATOMIC_RELEASE);
+}
+
+void Tracer::setThreadName(const char *name)
+{
+    threadName = name;
+    if (current)
+        current->name = name;
+}
+
+void Tracer::threadExit(void *data)
+{
+    __atomic_store_n(&((thread_buf_t *)data)->exited, true, __ATOMIC_RELEASE);
+}
+
+/* with the lock held, an exited thread's buffer or NULL */
+Tracer::thread_buf_t *Tracer::reuse()
+{
+    list<thread_buf_t *>::iterator it;
+    thread_buf_t *buf, *oldest = NULL;
+    uint64_t written, last, oldestNs = UINT64_MAX;
+
+    for (it = threads.begin(); it != threads.end(); ++it)
+    {
+        buf = *it;
+        if (!__atomic_load_n(&buf->exited, __ATOMIC_ACQUIRE))
+            continue;
+        written = buf->written;
+        if (written == 0)
+            return buf;     /* saved, or nothing since start() */
+
+        last = buf->events[(written - 1) % TRACE_EVENTS_PER_THREAD].ns;
+        if (last < oldestNs)
+        {
+            oldest = buf;
+            oldestNs = last;
+        }
+    }
+
+    if (oldest == NULL || threads.size() < TRACE_MAX_BUFFERS)
+        return NULL;
+
+    /* all of its events go unsaved */
+    discarded += oldest->written;
+
+    return oldest;
+}
+
+/* the buffer of the calling thread, found or made at its first event */
+Tracer::thread_buf_t *Tracer::local()
+{
+    thread_buf_t *buf;
+
+    if (current)
+        return current;
+
+    pthread_mutex_lock(&lock);
+    buf = reuse();
+    if (buf == NULL)
+    {
+        buf = (thread_buf_t *)malloc(sizeof(thread_buf_t));
+        if (buf == NULL)
+        {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        threads.push_back(buf);
+    }
+    buf->tid = syscall(SYS_gettid);
+    buf->name = threadName;
+    buf->exited = false;
+    __atomic_store_n(&buf->written, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&lock);
+
+    pthread_setspecific(key, buf);
+
+    return current = buf;
+}
+
+void Tracer::event(char phase, const char *name, int64_t arg)
+{
+    thread_buf_t *buf = local();
+    trace_event_t *e;
+    uint64_t n;
+
+    if (buf == NULL)
+        return;
+
+    n = buf->written;
+    e = &buf->events[n % TRACE_EVENTS_PER_THREAD];
+    e->ns = monotonic_ns();
+    e->name = name;
+    e->arg = arg;
+    e->phase = phase;
+    __atomic_store_n(&buf->written, n + 1, __ATOMIC_RELEASE);
+}
+
+/* overwritten in the rings, and lost with buffers handed on */
+uint64_t Tracer::dropped()
+{
+    list<thread_buf_t *>::iterator it;
+    uint64_t n, written;
+
+    pthread_mutex_lock(&lock);
+    n = discarded;
+    for (it = threads.begin(); it != threads.end(); ++it)
+    {
+        written = __atomic_load_n(&(*it)->written, __ATOMIC_ACQUIRE);
+        if (written > TRACE_EVENTS_KEPT)
+            n += written - TRACE_EVENTS_KEPT;
+    }
+    pthread_mutex_unlock(&lock);
+
+    return n;
+}
+
+/*
+ * Events from before start() are left out, and so are those a thread
+ * still recording may be overwriting. A span still open when the file
+ * is written has no end; the viewers close it at the end of the trace.
+ * Buffers of exited threads are free for new ones afterwards.
+ */
+int Tracer::save(const char *filename)
+{
+    list<thread_buf_t *>::iterator it;
+    trace_event_t e;
+    thread_buf_t *buf;
+    uint64_t i, begin, end;
+    int pid = getpid();
+    bool first = true;
+    FILE *fp;
+
+    fp = fopen(filename, "w");
+    if (fp == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    pthread_mutex_lock(&lock);
+    for (it = threads.begin(); it != threads.end(); ++it)
+    {
+        buf = *it;
+        end = __atomic_load_n(&buf->written, __ATOMIC_ACQUIRE);
+        if (end == 0)
+            continue;
+        begin = end > TRACE_EVENTS_KEPT ? end - TRACE_EVENTS_KEPT : 0;
+
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",\n", pid, buf->tid, buf->name ? buf->name : "thread");
+        first = false;
+
+        for (i = begin; i < end; i++)
+        {
+            e = buf->events[i % TRACE_EVENTS_PER_THREAD];
+            /* the slot is being written again once the ring has come round to it */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&buf->written, __ATOMIC_RELAXED) >= i + TRACE_EVENTS_PER_THREAD)
+                continue;
+            if (e.ns < startNs)
+                continue;
+
+            fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":%d,",
+                    e.name, e.phase, (e.ns - startNs) / 1000.0, pid, buf->tid);
+            if (e.phase == 'C')
+                fprintf(fp, "\"args\":{\"%s\":%lld}}", e.name, (long long)e.arg);
+            else if (e.phase == 'i')
+                fprintf(fp, "\"s\":\"t\",\"args\":{\"v\":%lld}}", (long long)e.arg);
+            else
+                fprintf(fp, "\"args\":{\"v\":%lld}}", (long long)e.arg);
+        }
+
+        if (__atomic_load_n(&buf->exited, __ATOMIC_ACQUIRE))
+        {
+            /* written out, free for the next new thread */
+            if (end > TRACE_EVENTS_KEPT)
+                discarded += end - TRACE_EVENTS_KEPT;
+            __atomic_store_n(&buf->written, 0, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp) != 0)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <list>
+using namespace std;
+
+/*
+ * Probes in the playback pipeline. Each one is a static USDT probe in
+ * provider "aplayer" when <sys/sdt.h> is around (a nop until perf or
+ * bpftrace attach to it), and an event for the built-in recorder while
+ * Tracer::shared()->start() is in effect. Disabled, a probe costs one
+ * load and a branch not taken. Names are plain identifiers; spans fire
+ * name_begin and name_end.
+ *
+ *   perf probe -x aplayer sdt_aplayer:write_begin
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_HAVE_SDT  1
+#endif
+#endif
+
+#ifdef TRACE_HAVE_SDT
+#define TRACE_SDT(name, arg)    DTRACE_PROBE1(aplayer, name, (int64_t)(arg))
+#else
+#define TRACE_SDT(name, arg)    do {} while (0)
+#endif
+
+#define TRACE_RECORD(phase, name, arg) \
+    do { \
+        if (__builtin_expect(__atomic_load_n(&Tracer::recording, __ATOMIC_RELAXED), 0)) \
+            Tracer::shared()->event(phase, name, (int64_t)(arg)); \
+    } while (0)
+
+#define TRACE_BEGIN(name, arg)      do { TRACE_SDT(name##_begin, arg); TRACE_RECORD('B', #name, arg); } while (0)
+#define TRACE_END(name, arg)        do { TRACE_SDT(name##_end, arg); TRACE_RECORD('E', #name, arg); } while (0)
+#define TRACE_INSTANT(name, arg)    do { TRACE_SDT(name, arg); TRACE_RECORD('i', #name, arg); } while (0)
+#define TRACE_COUNTER(name, value)  do { TRACE_SDT(name, value); TRACE_RECORD('C', #name, value); } while (0)
+/* names the calling thread in the timeline, a string literal */
+#define TRACE_THREAD(name)          Tracer::setThreadName(name)
+
+#define TRACE_EVENTS_PER_THREAD     16384   /* a ring, older events of a thread are overwritten */
+#define TRACE_MAX_BUFFERS           32      /* past that exited threads give theirs up unsaved */
+
+typedef struct {
+    uint64_t    ns;         /* CLOCK_MONOTONIC */
+    const char *name;       /* static */
+    int64_t     arg;
+    char        phase;      /* B E i C, as in the trace event format */
+} trace_event_t;
+
+/*
+ * Keeps the newest events of every thread in a ring of its own, so
+ * recording takes no lock after a thread's first event, and writes them
+ * out as Chrome trace-event JSON for chrome://tracing or Perfetto. The
+ * buffer of a thread that has exited goes to the next new thread once
+ * save() has written it, or before that when TRACE_MAX_BUFFERS are in
+ * use, taking the one whose events are oldest.
+ */
+class Tracer
+{
+public:
+    Tracer();
+    virtual ~Tracer();
+
+    static Tracer *shared();
+
+    /* drops what was recorded before */
+    void start();
+    void stop();
+    int  save(const char *filename);
+    uint64_t dropped();
+
+    void event(char phase, const char *name, int64_t arg);
+    static void setThreadName(const char *name);
+
+    static bool recording;
+
+private:
+    typedef struct {
+        int         tid;
+        const char *name;
+        uint64_t    written;    /* events ever recorded, release */
+        bool        exited;     /* the thread has, release */
+        trace_event_t events[TRACE_EVENTS_PER_THREAD];
+    } thread_buf_t;
+
+    thread_buf_t *local();
+    thread_buf_t *reuse();
+    static void threadExit(void *data);
+
+    static __thread thread_buf_t *current;
+    static __thread const char *threadName;
+
+    list<thread_buf_t *> threads;   /* kept after their thread exits */
+    pthread_mutex_t lock;
+    pthread_key_t key;              /* marks the buffer when its thread exits */
+    uint64_t startNs;
+    uint64_t discarded;             /* events of buffers handed on */
+};
+
+#endif
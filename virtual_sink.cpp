@@ -0,0 +1,297 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "virtual_sink.h"
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+VirtualSink::VirtualSink(snd_pcm_format_t format, int channels, uint32_t rate, uint32_t bufferMs)
+    : opened(false)
+    , timerFd(-1)
+    , format(format)
+    , channels(channels)
+    , rate(rate)
+    , bufferMs(bufferMs)
+    , stall(NULL)
+    , stallData(NULL)
+    , running(false)
+    , underrun(false)
+    , startNs(0)
+    , written(0)
+    , dryNs(0)
+    , transfers(0)
+    , total(0)
+    , xrunCount(0)
+    , recoveryCount(0)
+    , latencyCount(0)
+{
+    memset(&io, 0, sizeof(io));
+    memset(&callback, 0, sizeof(callback));
+    callback.start = cbStart;
+    callback.stop = cbStop;
+    callback.pointer = cbPointer;
+    callback.transfer = cbTransfer;
+    callback.close = cbClose;
+    callback.prepare = cbPrepare;
+    callback.poll_revents = cbPollRevents;
+    latencyUs = (uint32_t *)malloc(VSINK_MAX_WRITES * sizeof(uint32_t));
+}
+
+VirtualSink::~VirtualSink()
+{
+    if (timerFd >= 0)
+        close(timerFd);
+    free(latencyUs);
+}
+
+int VirtualSink::opener(snd_pcm_t **pcm, const char *device, int mode, void *data)
+{
+    (void)device;
+    return static_cast<VirtualSink *>(data)->open(pcm, mode);
+}
+
+int VirtualSink::open(snd_pcm_t **pcm, int mode)
+{
+    unsigned int access = SND_PCM_ACCESS_RW_INTERLEAVED;
+    unsigned int formats = format;
+    unsigned int frameBytes = snd_pcm_format_physical_width(format) / 8 * channels;
+    unsigned int bufferBytes = (uint64_t)rate * bufferMs / 1000 * frameBytes;
+    int err;
+
+    if (opened)
+        return -EBUSY;
+
+    if (timerFd < 0)
+    {
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (timerFd < 0)
+            return -errno;
+    }
+
+    memset(&io, 0, sizeof(io));
+    io.version = SND_PCM_IOPLUG_VERSION;
+    io.name = "aplayer virtual sink";
+    io.flags = SND_PCM_IOPLUG_FLAG_MONOTONIC;
+    io.poll_fd = timerFd;
+    io.poll_events = POLLIN;
+    io.mmap_rw = 0;
+    io.callback = &callback;
+    io.private_data = this;
+
+    err = snd_pcm_ioplug_create(&io, "virtual", SND_PCM_STREAM_PLAYBACK, mode);
+    if (err < 0)
+        return err;
+
+    /* the card has one configuration, periods of 1 ms up to half the buffer */
+    if ((err = snd_pcm_ioplug_set_param_list(&io, SND_PCM_IOPLUG_HW_ACCESS, 1, &access)) < 0 ||
+        (err = snd_pcm_ioplug_set_param_list(&io, SND_PCM_IOPLUG_HW_FORMAT, 1, &formats)) < 0 ||
+        (err = snd_pcm_ioplug_set_param_minmax(&io, SND_PCM_IOPLUG_HW_CHANNELS, channels, channels)) < 0 ||
+        (err = snd_pcm_ioplug_set_param_minmax(&io, SND_PCM_IOPLUG_HW_RATE, rate, rate)) < 0 ||
+        (err = snd_pcm_ioplug_set_param_minmax(&io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+                                               rate / 1000 * frameBytes, bufferBytes / 2)) < 0 ||
+        (err = snd_pcm_ioplug_set_param_minmax(&io, SND_PCM_IOPLUG_HW_PERIODS, 2, 64)) < 0 ||
+        (err = snd_pcm_ioplug_set_param_minmax(&io, SND_PCM_IOPLUG_HW_BUFFER_BYTES,
+                                               2 * rate / 1000 * frameBytes, bufferBytes)) < 0)
+    {
+        snd_pcm_ioplug_delete(&io);
+        return err;
+    }
+
+    opened = true;
+    running = false;
+    underrun = false;
+    dryNs = 0;
+    written = 0;
+    *pcm = io.pcm;
+
+    return 0;
+}
+
+void VirtualSink::setStall(vsink_stall_t stall, void *data)
+{
+    stallData = data;
+    this->stall = stall;
+}
+
+uint32_t VirtualSink::recoveries(const uint32_t **us)
+{
+    *us = recoveryUs;
+    return recoveryCount;
+}
+
+uint32_t VirtualSink::latencies(const uint32_t **us)
+{
+    *us = latencyUs;
+    return latencyCount;
+}
+
+void VirtualSink::reset()
+{
+    dryNs = 0;
+    transfers = 0;
+    total = 0;
+    xrunCount = 0;
+    recoveryCount = 0;
+    latencyCount = 0;
+}
+
+/* a wakeup every period while the clock runs, like a period interrupt */
+void VirtualSink::armTimer(bool run)
+{
+    struct itimerspec spec;
+    uint64_t periodNs = 0;
+
+    memset(&spec, 0, sizeof(spec));
+    if (run && io.period_size)
+    {
+        periodNs = io.period_size * 1000000000ULL / rate;
+        spec.it_value.tv_sec = spec.it_interval.tv_sec = periodNs / 1000000000ULL;
+        spec.it_value.tv_nsec = spec.it_interval.tv_nsec = periodNs % 1000000000ULL;
+    }
+    timerfd_settime(timerFd, 0, &spec, NULL);
+}
+
+/* frames the clock has consumed since the start */
+uint64_t VirtualSink::clockFrames()
+{
+    return (monotonic_ns() - startNs) * rate / 1000000000ULL;
+}
+
+int VirtualSink::cbStart(snd_pcm_ioplug_t *io)
+{
+    VirtualSink *self = static_cast<VirtualSink *>(io->private_data);
+
+    self->startNs = monotonic_ns();
+    if (self->dryNs)
+    {
+        if (self->recoveryCount < VSINK_MAX_XRUNS)
+            self->recoveryUs[self->recoveryCount++] = (self->startNs - self->dryNs) / 1000;
+        self->dryNs = 0;
+    }
+    self->running = true;
+    self->armTimer(true);
+
+    return 0;
+}
+
+int VirtualSink::cbStop(snd_pcm_ioplug_t *io)
+{
+    VirtualSink *self = static_cast<VirtualSink *>(io->private_data);
+
+    self->running = false;
+    self->armTimer(false);
+
+    return 0;
+}
+
+/*
+ * Past the last frame written the sink has run dry: an underrun, unless
+ * it is draining and simply done.
+ */
+snd_pcm_sframes_t VirtualSink::cbPointer(snd_pcm_ioplug_t *io)
+{
+    VirtualSink *self = static_cast<VirtualSink *>(io->private_data);
+    uint64_t consumed;
+
+    if (!self->running)
+        return self->underrun ? -EPIPE : 0;
+
+    consumed = self->clockFrames();
+    if (consumed >= self->written)
+    {
+        if (io->state == SND_PCM_STATE_DRAINING)
+            return self->written % io->buffer_size;
+
+        self->xrunCount++;
+        self->dryNs = self->startNs + self->written * 1000000000ULL / self->rate;
+        self->running = false;
+        self->underrun = true;
+        self->armTimer(false);
+        return -EPIPE;
+    }
+
+    return consumed % io->buffer_size;
+}
+
+snd_pcm_sframes_t VirtualSink::cbTransfer(snd_pcm_ioplug_t *io, const snd_pcm_channel_area_t *areas,
+                                          snd_pcm_uframes_t offset, snd_pcm_uframes_t size)
+{
+    VirtualSink *self = static_cast<VirtualSink *>(io->private_data);
+    uint64_t consumed;
+    uint32_t us;
+
+    /* nothing is kept, only counted */
+    (void)areas;
+    (void)offset;
+
+    if (self->stall)
+    {
+        us = self->stall(self->transfers, self->stallData);
+        if (us)
+            usleep(us);
+    }
+    self->transfers++;
+
+    if (self->running && self->latencyCount < VSINK_MAX_WRITES)
+    {
+        consumed = self->clockFrames();
+        us = consumed < self->written ? (self->written - consumed) * 1000000ULL / self->rate : 0;
+        self->latencyUs[self->latencyCount++] = us;
+    }
+
+    self->written += size;
+    self->total += size;
+
+    return size;
+}
+
+int VirtualSink::cbClose(snd_pcm_ioplug_t *io)
+{
+    VirtualSink *self = static_cast<VirtualSink *>(io->private_data);
+
+    self->armTimer(false);
+    self->running = false;
+    self->opened = false;
+
+    return 0;
+}
+
+int VirtualSink::cbPrepare(snd_pcm_ioplug_t *io)
+{
+    VirtualSink *self = static_cast<VirtualSink *>(io->private_data);
+
+    self->armTimer(false);
+    self->running = false;
+    self->underrun = false;
+    self->written = 0;
+
+    return 0;
+}
+
+int VirtualSink::cbPollRevents(snd_pcm_ioplug_t *io, struct pollfd *pfd, unsigned int nfds,
+                               unsigned short *revents)
+{
+    VirtualSink *self = static_cast<VirtualSink *>(io->private_data);
+    uint64_t expirations;
+
+    *revents = 0;
+    if (nfds > 0 && (pfd[0].revents & POLLIN))
+    {
+        if (read(self->timerFd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+            return -errno;
+        *revents = POLLOUT;
+    }
+
+    return 0;
+}
@@ -0,0 +1,88 @@
+#ifndef _VIRTUAL_SINK_H_
+#define _VIRTUAL_SINK_H_
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+#include <alsa/pcm_external.h>
+
+#define VSINK_MAX_XRUNS     1024        /* recovery times kept */
+#define VSINK_MAX_WRITES    65536       /* latency samples kept */
+
+/*
+ * Microseconds to hold up the nth transfer into the sink, as if the
+ * writing thread had been scheduled out right before it. For fault
+ * injection.
+ */
+typedef uint32_t (*vsink_stall_t)(uint64_t n, void *data);
+
+/*
+ * A playback device without hardware: an ALSA I/O plugin whose clock
+ * consumes frames at the nominal rate from the moment it is started,
+ * paced by CLOCK_MONOTONIC. It takes one fixed format, channel count and
+ * rate and at most bufferMs of buffer, and underruns exactly like a card
+ * when the clock catches up with the writer, so the whole of ALSA's and
+ * APlayer's xrun handling runs against it. One stream open at a time.
+ */
+class VirtualSink
+{
+public:
+    VirtualSink(snd_pcm_format_t format, int channels, uint32_t rate, uint32_t bufferMs);
+    virtual ~VirtualSink();
+
+    /* a pcm_opener_t for APlayer::setOpener(), data is the sink */
+    static int opener(snd_pcm_t **pcm, const char *device, int mode, void *data);
+    int  open(snd_pcm_t **pcm, int mode);
+
+    void setStall(vsink_stall_t stall, void *data = NULL);
+
+    /* frames handed to the sink over all streams */
+    uint64_t frames() { return total; }
+    uint32_t xruns() { return xrunCount; }
+    /* from the clock running dry to the next start, in microseconds */
+    uint32_t recoveries(const uint32_t **us);
+    /* audio queued ahead of each transfer, in microseconds */
+    uint32_t latencies(const uint32_t **us);
+    void     reset();
+
+private:
+    static int  cbStart(snd_pcm_ioplug_t *io);
+    static int  cbStop(snd_pcm_ioplug_t *io);
+    static snd_pcm_sframes_t cbPointer(snd_pcm_ioplug_t *io);
+    static snd_pcm_sframes_t cbTransfer(snd_pcm_ioplug_t *io, const snd_pcm_channel_area_t *areas,
+                                        snd_pcm_uframes_t offset, snd_pcm_uframes_t size);
+    static int  cbClose(snd_pcm_ioplug_t *io);
+    static int  cbPrepare(snd_pcm_ioplug_t *io);
+    static int  cbPollRevents(snd_pcm_ioplug_t *io, struct pollfd *pfd, unsigned int nfds,
+                              unsigned short *revents);
+
+    void     armTimer(bool run);
+    uint64_t clockFrames();
+
+    snd_pcm_ioplug_t io;
+    snd_pcm_ioplug_callback_t callback;
+    bool     opened;
+    int      timerFd;
+    snd_pcm_format_t format;
+    int      channels;
+    uint32_t rate;
+    uint32_t bufferMs;
+
+    vsink_stall_t stall;
+    void    *stallData;
+
+    bool     running;           /* clock started and not run dry */
+    bool     underrun;          /* run dry, until prepared again */
+    uint64_t startNs;
+    uint64_t written;           /* since the last prepare */
+    uint64_t dryNs;             /* when the clock ran dry, 0 once started again */
+    uint64_t transfers;
+    uint64_t total;
+
+    uint32_t xrunCount;
+    uint32_t recoveryCount;
+    uint32_t recoveryUs[VSINK_MAX_XRUNS];
+    uint32_t latencyCount;
+    uint32_t *latencyUs;
+};
+
+#endif
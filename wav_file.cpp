@@ -1,6 +1,9 @@
 #include <assert.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <alsa/asoundlib.h>
 #include "wav_file.h"
@@ -34,141 +37,427 @@ typedef struct {
 	uint32_t length;		/* samplecount */
 } wav_chnk_hdr_t;
 
+typedef struct {
+	uint32_t riff_size_low;
+	uint32_t riff_size_high;
+	uint32_t data_size_low;
+	uint32_t data_size_high;
+	uint32_t sample_count_low;
+	uint32_t sample_count_high;
+	uint32_t table_length;	/* entries in the chunk size table that follows */
+} wav_ds64_body_t;
 
-WavFile::WavFile()
-    : fp(NULL)
-    , bigEndian(false)
-    , fmtSize(0)
-    , fmtID(0)
-    , numChannels(0)
-    , sampleRate(0)
-    , bytesPerSec(0)
-    , blockAlign(0)
-    , bitsPerSample(0)
-    , bytesPerSample(0)
-    , numData(0)
+
+typedef struct {
+	uint32_t type;		/* chunk id */
+	uint32_t size_low;
+	uint32_t size_high;
+} wav_ds64_entry_t;
+
+typedef struct {
+	uint32_t manufacturer;
+	uint32_t product;
+	uint32_t sample_period;
+	uint32_t midi_unity_note;
+	uint32_t midi_pitch_fraction;
+	uint32_t smpte_format;
+	uint32_t smpte_offset;
+	uint32_t num_loops;
+	uint32_t sampler_data;
+} wav_smpl_body_t;
+
+typedef struct {
+	uint32_t cue_id;
+	uint32_t type;
+	uint32_t start;		/* frames */
+	uint32_t end;		/* last frame played */
+	uint32_t fraction;
+	uint32_t play_count;
+} wav_smpl_loop_t;
+
+typedef struct {
+	uint32_t id;
+	uint32_t position;
+	uint32_t chunk;		/* 'data' for plain files */
+	uint32_t chunk_start;
+	uint32_t block_start;
+	uint32_t sample_offset;	/* frames */
+} wav_cue_point_t;
+
+#define WAV_PROBE_SIZE      4096    /* covers the whole header of most files */
+#define WAV_MAX_DS64_TABLE  8
+
+typedef struct {
+    int fd;
+    uint64_t fileSize;
+    uint8_t cache[WAV_PROBE_SIZE];
+    size_t cached;
+} probe_ctx_t;
+
+/* copy from the first pread() when possible, else read at offset */
+static int probeRead(probe_ctx_t *ctx, uint64_t offset, void *buf, size_t bytes)
 {
+    ssize_t ret;
+    size_t done = 0;
+
+    if (offset + bytes <= ctx->cached)
+    {
+        memcpy(buf, ctx->cache + offset, bytes);
+        return 0;
+    }
+
+    while (done < bytes)
+    {
+        ret = pread(ctx->fd, (uint8_t *)buf + done, bytes - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+
+    return 0;
 }
 
-WavFile::~WavFile()
+static int probeFmt(probe_ctx_t *ctx, const wav_chunk_t *chunk, wav_info_t *info)
 {
-    close();
+    wav_fmt_ext_body fmt_ext_body;
+    wav_fmt_body_t *fmt_body = &fmt_ext_body.format;
+    bool be = info->bigEndian;
+
+    if (chunk->length < sizeof(wav_fmt_body_t))
+    {
+        fprintf(stderr, "unknown length of 'fmt ' chunk (read %u, should be %u at least)",
+		      (uint32_t)chunk->length, (uint32_t)sizeof(wav_fmt_body_t));
+        return -1;
+    }
+
+    memset(&fmt_ext_body, 0, sizeof(fmt_ext_body));
+    if (probeRead(ctx, chunk->offset, &fmt_ext_body,
+                  chunk->length < sizeof(fmt_ext_body) ? chunk->length : sizeof(fmt_ext_body)) < 0)
+        return -1;
+
+    info->format = TO_CPU_SHORT(fmt_body->format, be);
+    if (info->format == WAV_FMT_EXTENSIBLE)
+    {
+        if (chunk->length < sizeof(fmt_ext_body))
+        {
+            fprintf(stderr, "short 'fmt ' chunk for WAVE_FORMAT_EXTENSIBLE (%u bytes)\n",
+                    (uint32_t)chunk->length);
+            return -1;
+        }
+
+        info->format = TO_CPU_SHORT(fmt_ext_body.guid_format, be);
+        info->channelMask = TO_CPU_INT(fmt_ext_body.channel_mask, be);
+    }
+
+    info->channels = TO_CPU_SHORT(fmt_body->channels, be);
+    info->rate = TO_CPU_INT(fmt_body->sample_fq, be);
+    info->bytesPerSec = TO_CPU_INT(fmt_body->byte_p_sec, be);
+    info->blockAlign = TO_CPU_SHORT(fmt_body->byte_p_spl, be);
+    info->bits = TO_CPU_SHORT(fmt_body->bit_p_spl, be);
+
+    return 0;
 }
 
-int WavFile::open(const char *filename)
+int WavFile::probe(int fd, wav_info_t *info)
 {
+    probe_ctx_t ctx;
     wav_hdr_t hdr;
     wav_chnk_hdr_t chnk_hdr;
-    wav_fmt_body_t fmt_body;
-    wav_fmt_ext_body fmt_ext_body;
-
-    uint32_t chnk_type;
-    size_t bytes;
-    int length;
-
-    if (strlen(filename) <= 0)
+    wav_ds64_body_t ds64;
+    wav_ds64_entry_t table[WAV_MAX_DS64_TABLE];
+    wav_chunk_t chunk;
+    struct stat st;
+    uint64_t pos, dataSize = 0;
+    uint32_t i, tableLength = 0;
+    ssize_t ret;
+    bool haveFmt = false, haveData = false;
+
+    memset(info, 0, sizeof(*info));
+
+    if (fstat(fd, &st) < 0)
         return -1;
-        
-    fp = fopen(filename, "rb");
-    if (fp == NULL)
+
+    ctx.fd = fd;
+    ctx.fileSize = st.st_size;
+    do
+        ret = pread(fd, ctx.cache, sizeof(ctx.cache), 0);
+    while (ret < 0 && errno == EINTR);
+    if (ret < 0)
         return -1;
+    ctx.cached = ret;
 
     // read hdr
-    bytes = safeRead(&hdr, sizeof(hdr));
-    if (bytes < sizeof(hdr))
+    if (probeRead(&ctx, 0, &hdr, sizeof(hdr)) < 0)
         return -1;
 
-	if (hdr.magic == WAV_RIFF)
-		bigEndian = false;
-	else if (hdr.magic == WAV_RIFX)
-		bigEndian = true;
+    if (hdr.magic == WAV_RIFF)
+        info->bigEndian = false;
+    else if (hdr.magic == WAV_RIFX)
+        info->bigEndian = true;
+    else if (hdr.magic == WAV_RF64 || hdr.magic == WAV_BW64)
+        info->rf64 = true;    /* always little endian */
     else
         return -1;
 
     if (hdr.type != WAV_WAVE)
         return -1;
 
-    fprintf(stdout, "WAV Length %u.\n", (TO_CPU_INT(hdr.length, bigEndian) + 8));
-
-    //  read chunk hdr
-    while (true)
+    // walk every chunk, 'data' included, up to the end of file
+    for (pos = sizeof(hdr); pos + sizeof(chnk_hdr) <= ctx.fileSize; )
     {
-        bytes = safeRead(&chnk_hdr, sizeof(chnk_hdr));
-        if (bytes < sizeof(chnk_hdr))
+        if (probeRead(&ctx, pos, &chnk_hdr, sizeof(chnk_hdr)) < 0)
             return -1;
 
-        chnk_type = chnk_hdr.type;
-        fmtSize = TO_CPU_INT(chnk_hdr.length, bigEndian);
-        if (chnk_type == WAV_FMT)
-            break;
+        chunk.id = chnk_hdr.type;
+        chunk.reserved = 0;
+        chunk.offset = pos + sizeof(chnk_hdr);
+        chunk.length = TO_CPU_INT(chnk_hdr.length, info->bigEndian);
+
+        if (info->rf64 && chunk.length == WAV_SIZE_IN_DS64)
+        {
+            if (chunk.id == WAV_DATA)
+                chunk.length = dataSize;
+            for (i = 0; i < tableLength && i < WAV_MAX_DS64_TABLE; i++)
+            {
+                if (table[i].type == chunk.id)
+                    chunk.length = ((uint64_t)LE_INT(table[i].size_high) << 32) | LE_INT(table[i].size_low);
+            }
+        }
+
+        if (chunk.id == WAV_DS64 && info->rf64)
+        {
+            if (chunk.length < sizeof(ds64) || probeRead(&ctx, chunk.offset, &ds64, sizeof(ds64)) < 0)
+            {
+                fprintf(stderr, "invalid 'ds64' chunk\n");
+                return -1;
+            }
+
+            dataSize = ((uint64_t)LE_INT(ds64.data_size_high) << 32) | LE_INT(ds64.data_size_low);
+            tableLength = LE_INT(ds64.table_length);
+            if (tableLength > WAV_MAX_DS64_TABLE)
+                tableLength = WAV_MAX_DS64_TABLE;
+            if (tableLength > 0 &&
+                (chunk.length < sizeof(ds64) + tableLength * sizeof(table[0]) ||
+                 probeRead(&ctx, chunk.offset + sizeof(ds64), table, tableLength * sizeof(table[0])) < 0))
+                tableLength = 0;
+        }
+        else if (chunk.id == WAV_FMT)
+        {
+            if (probeFmt(&ctx, &chunk, info) < 0)
+                return -1;
+            haveFmt = true;
+        }
+        else if (chunk.id == WAV_DATA && !haveData)
+        {
+            /* a file still being recorded may have an unpatched size */
+            if (chunk.length == 0 || chunk.offset + chunk.length > ctx.fileSize)
+                chunk.length = ctx.fileSize - chunk.offset;
+
+            info->dataOffset = chunk.offset;
+            info->dataLength = chunk.length;
+            haveData = true;
+        }
+
+        if (info->numChunks < WAV_MAX_CHUNKS)
+            info->chunks[info->numChunks++] = chunk;
+
+        pos = chunk.offset + chunk.length + (chunk.length % 2);   /* chunks are word aligned */
     }
 
-    fmtSize += fmtSize % 2;
-    if (fmtSize < sizeof(wav_fmt_body_t))
+    if (!haveFmt)
     {
-        fprintf(stderr, "unknown length of 'fmt ' chunk (read %u, should be %u at least)",
-		      fmtSize, (uint32_t)sizeof(wav_fmt_body_t));
+        fprintf(stderr, "no 'fmt ' chunk found\n");
         return -1;
     }
 
-    bytes = safeRead(&fmt_body, sizeof(fmt_body));
-    if (bytes < sizeof(fmt_body))
+    if (!haveData)
+    {
+        fprintf(stderr, "no 'data' chunk found\n");
         return -1;
+    }
 
-    fmtID = TO_CPU_SHORT(fmt_body.format, bigEndian);
-    if (fmtID == WAV_FMT_EXTENSIBLE)
+    if (info->format != WAV_FMT_PCM && info->format != WAV_FMT_IEEE_FLOAT)
     {
-        fmt_ext_body.format = fmt_body;
-        bytes = safeRead(&fmt_ext_body.ext_size, sizeof(fmt_ext_body) - sizeof(wav_fmt_body_t));
-        if (bytes < sizeof(fmt_ext_body) - sizeof(wav_fmt_body_t))
-            return -1;
+        fprintf(stderr, "can't play WAVE-file format 0x%04x which is not PCM or FLOAT encoded", info->format);
+        return -1;
+    }
 
-        fmtID = TO_CPU_SHORT(fmt_ext_body.guid_format, bigEndian);
+    if (info->channels < 1)
+    {
+        fprintf(stderr, "can't play WAVE-files with %u tracks", info->channels);
+        return -1;
     }
 
-    if (fmtID != WAV_FMT_PCM && fmtID != WAV_FMT_IEEE_FLOAT)
+    if (info->blockAlign < info->channels || info->rate == 0 || info->bits == 0)
     {
-        fprintf(stderr, "can't play WAVE-file format 0x%04x which is not PCM or FLOAT encoded", fmtID);
+        fprintf(stderr, "invalid 'fmt ' chunk (%u bits, %u Hz)\n", info->bits, info->rate);
         return -1;
     }
 
-    numChannels = TO_CPU_SHORT(fmt_body.channels, bigEndian);
-    if (numChannels < 1)
+    return 0;
+}
+
+wav_read_hook_t WavFile::readHook = NULL;
+void *WavFile::readHookData = NULL;
+
+WavFile::WavFile()
+    : fp(NULL)
+    , bytesPerSample(0)
+    , dataRead(0)
+{
+    memset(&info, 0, sizeof(info));
+}
+
+WavFile::~WavFile()
+{
+    close();
+}
+
+int WavFile::open(const char *filename, const wav_info_t *hdr)
+{
+    if (strlen(filename) <= 0)
+        return -1;
+        
+    fp = fopen(filename, "rb");
+    if (fp == NULL)
+        return -1;
+
+    if (hdr)
+        info = *hdr;
+    else if (probe(fileno(fp), &info) < 0)
+        return -1;
+
+    bytesPerSample = info.blockAlign / info.channels;
+    dataRead = 0;
+
+    if (fseeko(fp, info.dataOffset, SEEK_SET) < 0)
+        return -1;
+
+    /* data is consumed strictly front to back */
+    posix_fadvise(fileno(fp), info.dataOffset, 0, POSIX_FADV_SEQUENTIAL);
+
+    return 0;
+}
+
+const wav_chunk_t *WavFile::findChunk(uint32_t id)
+{
+    int i;
+
+    for (i = 0; i < info.numChunks; i++)
     {
-        fprintf(stderr, "can't play WAVE-files with %u tracks", numChannels);
+        if (info.chunks[i].id == id)
+            return &info.chunks[i];
+    }
+
+    return NULL;
+}
+
+/* bytes at offset into the body of chunk, the file position stays */
+int WavFile::readChunk(const wav_chunk_t *chunk, uint64_t offset, void *buf, size_t bytes)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    if (fp == NULL || offset + bytes > chunk->length)
         return -1;
+
+    while (done < bytes)
+    {
+        ret = pread(fileno(fp), (uint8_t *)buf + done, bytes - done, chunk->offset + offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
     }
 
-    sampleRate = TO_CPU_SHORT(fmt_body.sample_fq, bigEndian);
-    bytesPerSec = TO_CPU_SHORT(fmt_body.byte_p_sec, bigEndian);
-    bitsPerSample = TO_CPU_SHORT(fmt_body.bit_p_spl, bigEndian);
-    bytesPerSample = bitsPerSample / 8;
-    blockAlign = bytesPerSample * numChannels;
+    return 0;
+}
 
-    while (true)
+int WavFile::loops(wav_loop_t *loops, int max)
+{
+    const wav_chunk_t *chunk;
+    wav_smpl_body_t smpl;
+    wav_smpl_loop_t loop;
+    uint32_t i, count;
+    bool be = info.bigEndian;
+    int n = 0;
+
+    chunk = findChunk(WAV_SMPL);
+    if (chunk == NULL || readChunk(chunk, 0, &smpl, sizeof(smpl)) < 0)
+        return 0;
+
+    count = TO_CPU_INT(smpl.num_loops, be);
+    for (i = 0; i < count && n < max; i++)
     {
-        bytes = safeRead(&chnk_hdr, sizeof(chnk_hdr));
-        length = TO_CPU_INT(chnk_hdr.length, bigEndian);
-        if (chnk_hdr.type == WAV_DATA)
-        {
-            numData = length;
+        if (readChunk(chunk, sizeof(smpl) + i * sizeof(loop), &loop, sizeof(loop)) < 0)
             break;
-        }
-        else if (length > 0)
-            fseek(fp, length, SEEK_CUR);
+
+        loops[n].id = TO_CPU_INT(loop.cue_id, be);
+        loops[n].type = TO_CPU_INT(loop.type, be);
+        loops[n].start = TO_CPU_INT(loop.start, be);
+        loops[n].end = TO_CPU_INT(loop.end, be);
+        loops[n].playCount = TO_CPU_INT(loop.play_count, be);
+
+        /* drop loops that reach past the data */
+        if (loops[n].start <= loops[n].end && loops[n].end < frames())
+            n++;
     }
 
-    return 0;
+    return n;
+}
+
+int WavFile::cues(wav_cue_t *cues, int max)
+{
+    const wav_chunk_t *chunk;
+    wav_cue_point_t point;
+    uint32_t i, count;
+    bool be = info.bigEndian;
+    int n = 0;
+
+    chunk = findChunk(WAV_CUE);
+    if (chunk == NULL || readChunk(chunk, 0, &count, sizeof(count)) < 0)
+        return 0;
+
+    count = TO_CPU_INT(count, be);
+    for (i = 0; i < count && n < max; i++)
+    {
+        if (readChunk(chunk, sizeof(count) + i * sizeof(point), &point, sizeof(point)) < 0)
+            break;
+
+        cues[n].id = TO_CPU_INT(point.id, be);
+        cues[n].frame = TO_CPU_INT(point.sample_offset, be);
+        n++;
+    }
+
+    return n;
+}
+
+void WavFile::setReadHook(wav_read_hook_t hook, void *data)
+{
+    readHookData = data;
+    readHook = hook;
 }
 
 size_t WavFile::safeRead(void *buffer, size_t bytes)
 {
-    size_t reads, offset = 0, total = bytes;
+    size_t reads, wanted, offset = 0, total = bytes;
+    bool shortened = false;
 
     assert(fp != NULL);
     while (total > 0)
     {
-        reads = fread((uint8_t *)buffer + offset, 1, total, fp);
+        wanted = total;
+        if (readHook && !shortened)
+        {
+            wanted = readHook(total, readHookData);
+            if (wanted == 0 || wanted > total)
+                wanted = total;
+            shortened = wanted < total;
+        }
+        reads = fread((uint8_t *)buffer + offset, 1, wanted, fp);
 
         offset += reads;
         total -= reads;
@@ -183,30 +472,116 @@ size_t WavFile::safeRead(void *buffer, size_t bytes)
             fprintf(stderr, "ferror(fp) = %d", ferror(fp));
             break;        
         }
+
+        /* a short read reaches the caller, cut at the next frame boundary */
+        if (shortened)
+            total = (info.blockAlign - offset % info.blockAlign) % info.blockAlign;
     }
 
     return offset;
 }
 
-int WavFile::readData(char *buf, int bufSize)
+ssize_t WavFile::readData(char *buf, size_t bufSize)
+{
+    size_t bytes;
+
+    if (bufSize > remaining())
+        bufSize = remaining();
+
+    if (bufSize % info.blockAlign)
+        bufSize = (bufSize / info.blockAlign) * info.blockAlign;
+
+    bytes = safeRead(buf, bufSize);
+    dataRead += bytes;
+
+    return bytes;
+}
+
+/* next readData() starts at frame, clamped to the end of the data */
+int WavFile::seek(uint64_t frame)
+{
+    uint64_t offset = frame * info.blockAlign;
+
+    if (offset > info.dataLength)
+        offset = info.dataLength;
+    if (fseeko(fp, info.dataOffset + offset, SEEK_SET) < 0)
+        return -1;
+
+    dataRead = offset;
+    return 0;
+}
+
+snd_pcm_format_t WavFile::pcmFormat()
 {
-    if (bufSize % blockAlign)
-        bufSize = (bufSize / blockAlign) * blockAlign;
+    snd_pcm_format_t format = SND_PCM_FORMAT_UNKNOWN;
+
+    switch(info.bits)
+    {
+    case 8:
+		format = SND_PCM_FORMAT_U8;
+		break;
+	case 16:
+		if (info.bigEndian)
+			format = SND_PCM_FORMAT_S16_BE;
+		else
+			format = SND_PCM_FORMAT_S16_LE;
+		break;
+    case 24:
+		switch (bytesPerSample)
+        {
+		case 3:
+			if (info.bigEndian)
+				format = SND_PCM_FORMAT_S24_3BE;
+			else
+				format = SND_PCM_FORMAT_S24_3LE;
+			break;
+		case 4:
+			if (info.bigEndian)
+				format = SND_PCM_FORMAT_S24_BE;
+			else
+				format = SND_PCM_FORMAT_S24_LE;
+			break;
+		default:
+			break;
+		}
+		break;    
+    case 32:
+        if (info.format == WAV_FMT_PCM)
+        {
+			if (info.bigEndian)
+				format = SND_PCM_FORMAT_S32_BE;
+			else
+				format = SND_PCM_FORMAT_S32_LE;
+		} 
+        else if (info.format == WAV_FMT_IEEE_FLOAT)
+        {
+			if (info.bigEndian)
+				format = SND_PCM_FORMAT_FLOAT_BE;
+			else
+				format = SND_PCM_FORMAT_FLOAT_LE;
+		}
+		break;
+    default:
+        break;        
+    }
 
-    return safeRead(buf, bufSize);
+    return format;
 }
 
 void WavFile::dumpInfo()
 {
-    fprintf(stdout, "Format:\t %u\r\n", fmtID);
-    fprintf(stdout, "Bits:\t %u\r\n", bitsPerSample);
-    fprintf(stdout, "Rate:\t %u Hz\r\n", sampleRate);
-    if (numChannels == 1)
+    fprintf(stdout, "Format:\t %u\r\n", info.format);
+    fprintf(stdout, "Bits:\t %u\r\n", info.bits);
+    fprintf(stdout, "Rate:\t %u Hz\r\n", info.rate);
+    if (info.channels == 1)
         fprintf(stdout, "Mono\r\n");
-    else if (numChannels == 2)
+    else if (info.channels == 2)
         fprintf(stdout, "Stereo\r\n");
 
-    fprintf(stdout, "%u seconds\r\n", numData/bytesPerSec);
+    if (info.rf64)
+        fprintf(stdout, "RF64\r\n");
+
+    fprintf(stdout, "%llu seconds\r\n", (unsigned long long)(frames() / info.rate));
 }
 
 void WavFile::close()
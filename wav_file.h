@@ -3,8 +3,10 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 #include <endian.h>
 #include <byteswap.h>
+#include <alsa/asoundlib.h>
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 #define COMPOSE_ID(a,b,c,d)	((a) | ((b)<<8) | ((c)<<16) | ((d)<<24))
@@ -31,9 +33,14 @@
 #define COMPOSE(a, b, c, d)		((a) | ((b)<<8) | ((c)<<16) | ((d)<<24))
 #define WAV_RIFF			COMPOSE('R', 'I', 'F', 'F')
 #define WAV_RIFX		    COMPOSE('R', 'I', 'F', 'X')
+#define WAV_RF64			COMPOSE('R', 'F', '6', '4')
+#define WAV_BW64			COMPOSE('B', 'W', '6', '4')
 #define WAV_WAVE			COMPOSE('W', 'A', 'V', 'E')
 #define WAV_FMT				COMPOSE('f', 'm', 't', ' ')
 #define WAV_DATA			COMPOSE('d', 'a', 't', 'a')
+#define WAV_DS64			COMPOSE('d', 's', '6', '4')
+#define WAV_SMPL			COMPOSE('s', 'm', 'p', 'l')
+#define WAV_CUE				COMPOSE('c', 'u', 'e', ' ')
 #define WAV_FORMAT_PCM			1	/* PCM WAVE file encoding */
 
 /* WAVE fmt block constants from Microsoft mmreg.h header */
@@ -42,6 +49,89 @@
 #define WAV_FMT_DOLBY_AC3_SPDIF 0x0092
 #define WAV_FMT_EXTENSIBLE      0xfffe
 
+/* RF64/BW64 store 0xFFFFFFFF in 32-bit size fields and keep the real
+ * value in the 'ds64' chunk */
+#define WAV_SIZE_IN_DS64        0xffffffffU
+
+
+/* WAVEFORMATEXTENSIBLE dwChannelMask bits, from Microsoft ksmedia.h */
+#define WAV_SPEAKER_FRONT_LEFT              0x00001
+#define WAV_SPEAKER_FRONT_RIGHT             0x00002
+#define WAV_SPEAKER_FRONT_CENTER            0x00004
+#define WAV_SPEAKER_LOW_FREQUENCY           0x00008
+#define WAV_SPEAKER_BACK_LEFT               0x00010
+#define WAV_SPEAKER_BACK_RIGHT              0x00020
+#define WAV_SPEAKER_FRONT_LEFT_OF_CENTER    0x00040
+#define WAV_SPEAKER_FRONT_RIGHT_OF_CENTER   0x00080
+#define WAV_SPEAKER_BACK_CENTER             0x00100
+#define WAV_SPEAKER_SIDE_LEFT               0x00200
+#define WAV_SPEAKER_SIDE_RIGHT              0x00400
+#define WAV_SPEAKER_TOP_CENTER              0x00800
+#define WAV_SPEAKER_TOP_FRONT_LEFT          0x01000
+#define WAV_SPEAKER_TOP_FRONT_CENTER        0x02000
+#define WAV_SPEAKER_TOP_FRONT_RIGHT         0x04000
+#define WAV_SPEAKER_TOP_BACK_LEFT           0x08000
+#define WAV_SPEAKER_TOP_BACK_CENTER         0x10000
+#define WAV_SPEAKER_TOP_BACK_RIGHT          0x20000
+
+#define WAV_MAX_CHUNKS          16
+
+/* location of one chunk body inside the file */
+typedef struct {
+	uint32_t id;		/* raw chunk id, compare with WAV_* */
+	uint32_t reserved;
+	uint64_t offset;	/* file offset of the chunk body */
+	uint64_t length;	/* body length in bytes, without pad byte */
+} wav_chunk_t;
+
+/* 'smpl' loop types */
+#define WAV_LOOP_FORWARD        0
+#define WAV_LOOP_PINGPONG       1
+#define WAV_LOOP_BACKWARD       2
+
+/* one 'smpl' loop, in frames; end is the last frame inside the loop */
+typedef struct {
+	uint32_t id;		/* cue point it belongs to */
+	uint32_t type;		/* WAV_LOOP_* */
+	uint64_t start;
+	uint64_t end;
+	uint32_t playCount;	/* times the loop plays, 0 forever */
+} wav_loop_t;
+
+/* one 'cue ' point */
+typedef struct {
+	uint32_t id;
+	uint64_t frame;
+} wav_cue_t;
+
+/*
+ * Everything learned from a WAV header. Plain old data with a fixed
+ * layout so it can be stored as is in an on-disk index (see WavIndex).
+ */
+typedef struct {
+	uint16_t format;	/* WAV_FMT_PCM or WAV_FMT_IEEE_FLOAT */
+	uint16_t channels;
+	uint32_t rate;
+	uint32_t bytesPerSec;
+	uint16_t blockAlign;
+	uint16_t bits;
+	uint32_t channelMask;	/* WAVEFORMATEXTENSIBLE speaker mask, 0 if absent */
+	uint8_t  bigEndian;
+	uint8_t  rf64;
+	uint16_t numChunks;
+	uint64_t dataOffset;
+	uint64_t dataLength;
+	wav_chunk_t chunks[WAV_MAX_CHUNKS];
+} wav_info_t;
+
+/*
+ * Called before every read of sample data with the bytes wanted; returns
+ * how many of them to ask the file for, at least one. Fewer than wanted
+ * makes readData() return a short count, rounded up to a whole frame.
+ * It may block to stand in for slow storage. For fault injection.
+ */
+typedef size_t (*wav_read_hook_t)(size_t bytes, void *data);
+
 
 class WavFile
 {
@@ -49,36 +139,57 @@ public:
     WavFile();
     virtual ~WavFile();
 
-    int open(const char *filename);
-	int readData(char *buf, int bufSize);
+    /*
+     * Parse the header of an already opened file with pread() only, the
+     * file position is left untouched. Every chunk offset is recorded.
+     */
+    static int probe(int fd, wav_info_t *info);
+
+    /*
+     * info - result of an earlier probe() of the same file, skips header
+     *        parsing when given
+     */
+    int open(const char *filename, const wav_info_t *info = NULL);
+	ssize_t readData(char *buf, size_t bufSize);
+	int seek(uint64_t frame);
 	void close();
 
-	int format() { return fmtID; }
-	int channels() { return numChannels; }
-	int rate() { return sampleRate; }
-	int bits() { return bitsPerSample; }
+	int format() { return info.format; }
+	int channels() { return info.channels; }
+	int rate() { return info.rate; }
+	int bits() { return info.bits; }
 	int bytes() { return bytesPerSample; }
-	bool isBigEndian() { return bigEndian; }
-	int length() { return numData; }
+	int frameBytes() { return info.blockAlign; }
+	uint32_t channelMask() { return info.channelMask; }
+	bool isBigEndian() { return info.bigEndian; }
+	bool isRF64() { return info.rf64; }
+	uint64_t length() { return info.dataLength; }
+	uint64_t frames() { return info.blockAlign ? info.dataLength / info.blockAlign : 0; }
+	uint64_t remaining() { return info.dataLength - dataRead; }
+	const wav_info_t *header() { return &info; }
+	snd_pcm_format_t pcmFormat();
+	const wav_chunk_t *findChunk(uint32_t id);
+	/* from the 'smpl' and 'cue ' chunks, up to max; the number found */
+	int loops(wav_loop_t *loops, int max);
+	int cues(wav_cue_t *cues, int max);
 
     void dumpInfo();
 
+    /* for every WavFile of the process, NULL to remove */
+    static void setReadHook(wav_read_hook_t hook, void *data = NULL);
+
 private:
     size_t safeRead(void *buffer, size_t bytes);
-    
+    int    readChunk(const wav_chunk_t *chunk, uint64_t offset, void *buf, size_t bytes);
+
     FILE *fp;
-	
-	bool bigEndian;
 
-	uint32_t fmtSize;
-	uint16_t fmtID;
-	uint16_t numChannels;
-	uint32_t sampleRate;
-	uint32_t bytesPerSec;
-	uint16_t blockAlign;//(bytes per sample)*(channels)
-	uint16_t bitsPerSample;
-	uint16_t bytesPerSample;
-	uint32_t numData;
+    static wav_read_hook_t readHook;
+    static void *readHookData;
+
+	wav_info_t info;
+	uint16_t bytesPerSample;    /* container size of one sample */
+	uint64_t dataRead;
 };
 
 #endif
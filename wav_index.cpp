@@ -0,0 +1,307 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include "wav_index.h"
+
+static int64_t statTime(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+WavIndex::WavIndex()
+    : map(NULL)
+    , mapSize(0)
+    , hdr(NULL)
+    , records(NULL)
+{
+    pthread_mutex_init(&lock, NULL);
+}
+
+WavIndex::~WavIndex()
+{
+    close();
+    pthread_mutex_destroy(&lock);
+}
+
+uint64_t WavIndex::hashPath(const char *path, size_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;    /* FNV-1a */
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)path[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+bool WavIndex::lessEntry(const entry_t &a, const entry_t &b)
+{
+    if (a.record.pathHash != b.record.pathHash)
+        return a.record.pathHash < b.record.pathHash;
+
+    return strcmp(a.path, b.path) < 0;
+}
+
+int WavIndex::load(const char *filename)
+{
+    struct stat st;
+    int fd;
+
+    close();
+
+    fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(wav_index_hdr_t))
+    {
+        ::close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        map = NULL;
+        return -1;
+    }
+    mapSize = st.st_size;
+
+    hdr = (const wav_index_hdr_t *)map;
+    if (hdr->magic != WAV_INDEX_MAGIC || hdr->version != WAV_INDEX_VERSION ||
+        hdr->recordSize != sizeof(wav_index_record_t) ||
+        sizeof(*hdr) + (uint64_t)hdr->count * sizeof(wav_index_record_t) > hdr->stringsOffset ||
+        hdr->stringsOffset + hdr->stringsSize > mapSize)
+    {
+        fprintf(stderr, "%s: not a valid WAV index\n", filename);
+        close();
+        return -1;
+    }
+
+    records = (const wav_index_record_t *)(hdr + 1);
+    madvise(map, mapSize, MADV_RANDOM);
+
+    return 0;
+}
+
+void WavIndex::close()
+{
+    size_t i;
+
+    if (map)
+    {
+        munmap(map, mapSize);
+        map = NULL;
+        mapSize = 0;
+        hdr = NULL;
+        records = NULL;
+    }
+
+    pthread_mutex_lock(&lock);
+    for (i = 0; i < entries.size(); i++)
+        free(entries[i].path);
+    entries.clear();
+    pthread_mutex_unlock(&lock);
+}
+
+const char *WavIndex::recordPath(const wav_index_record_t *record)
+{
+    return (const char *)map + hdr->stringsOffset + record->pathOffset;
+}
+
+const wav_index_record_t *WavIndex::findRecord(const char *path)
+{
+    size_t length = strlen(path);
+    uint64_t hash = hashPath(path, length);
+    uint32_t lo = 0, hi, mid;
+
+    if (records == NULL)
+        return NULL;
+
+    hi = hdr->count;
+    while (lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if (records[mid].pathHash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (; lo < hdr->count && records[lo].pathHash == hash; lo++)
+    {
+        if (records[lo].pathLength == length &&
+            records[lo].pathOffset + length <= hdr->stringsSize &&
+            memcmp(recordPath(&records[lo]), path, length) == 0)
+            return &records[lo];
+    }
+
+    return NULL;
+}
+
+bool WavIndex::find(const char *path, const struct stat *st, wav_info_t *info)
+{
+    const wav_index_record_t *record;
+
+    record = findRecord(path);
+    if (record == NULL)
+        return false;
+
+    if (record->mtime != statTime(st) || record->fileSize != (uint64_t)st->st_size)
+        return false;
+
+    if (info)
+        *info = record->info;
+
+    return true;
+}
+
+bool WavIndex::lookup(const char *filename, wav_info_t *info)
+{
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (records == NULL)
+        return false;
+
+    if (realpath(filename, path) == NULL || stat(path, &st) < 0)
+        return false;
+
+    return find(path, &st, info);
+}
+
+int WavIndex::add(const char *path, const struct stat *st, const wav_info_t *info)
+{
+    entry_t entry;
+
+    entry.path = strdup(path);
+    if (entry.path == NULL)
+        return -1;
+    entry.fromMap = false;
+
+    memset(&entry.record, 0, sizeof(entry.record));
+    entry.record.pathLength = strlen(path);
+    entry.record.pathHash = hashPath(path, entry.record.pathLength);
+    entry.record.mtime = statTime(st);
+    entry.record.fileSize = st->st_size;
+    entry.record.info = *info;
+
+    pthread_mutex_lock(&lock);
+    entries.push_back(entry);
+    pthread_mutex_unlock(&lock);
+
+    return 0;
+}
+
+uint32_t WavIndex::count()
+{
+    return hdr ? hdr->count : 0;
+}
+
+int WavIndex::save(const char *filename)
+{
+    vector<entry_t> merged;
+    wav_index_hdr_t newHdr;
+    wav_index_record_t record;
+    char tmpname[PATH_MAX];
+    entry_t entry;
+    uint64_t offset;
+    uint32_t i;
+    size_t j;
+    FILE *out;
+    int ret = 0;
+
+    pthread_mutex_lock(&lock);
+
+    /* new entries first, stable_sort keeps them ahead of stale ones */
+    merged = entries;
+    for (i = 0; records && i < hdr->count; i++)
+    {
+        if (records[i].pathOffset + records[i].pathLength > hdr->stringsSize)
+            continue;
+        entry.path = strndup(recordPath(&records[i]), records[i].pathLength);
+        entry.fromMap = true;
+        entry.record = records[i];
+        merged.push_back(entry);
+    }
+
+    stable_sort(merged.begin(), merged.end(), lessEntry);
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+    out = fopen(tmpname, "wb");
+    if (out == NULL)
+        ret = -1;
+
+    if (ret == 0)
+    {
+        memset(&newHdr, 0, sizeof(newHdr));
+        newHdr.magic = WAV_INDEX_MAGIC;
+        newHdr.version = WAV_INDEX_VERSION;
+        newHdr.recordSize = sizeof(wav_index_record_t);
+        fwrite(&newHdr, sizeof(newHdr), 1, out);
+
+        offset = 0;
+        for (j = 0; j < merged.size(); j++)
+        {
+            if (j > 0 && lessEntry(merged[j - 1], merged[j]) == false)
+                continue;   /* same path, older entry */
+
+            record = merged[j].record;
+            record.pathOffset = offset;
+            fwrite(&record, sizeof(record), 1, out);
+
+            offset += record.pathLength;
+            newHdr.count++;
+        }
+
+        newHdr.stringsOffset = sizeof(newHdr) + (uint64_t)newHdr.count * sizeof(record);
+        newHdr.stringsSize = offset;
+        for (j = 0; j < merged.size(); j++)
+        {
+            if (j > 0 && lessEntry(merged[j - 1], merged[j]) == false)
+                continue;
+            fwrite(merged[j].path, 1, merged[j].record.pathLength, out);
+        }
+
+        rewind(out);
+        fwrite(&newHdr, sizeof(newHdr), 1, out);
+
+        if (fflush(out) != 0 || ferror(out) || fsync(fileno(out)) < 0)
+            ret = -1;
+        fclose(out);
+    }
+
+    if (ret == 0 && rename(tmpname, filename) < 0)
+        ret = -1;
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "failed to write index %s: %s\n", filename, strerror(errno));
+        unlink(tmpname);
+    }
+
+    for (j = 0; j < merged.size(); j++)
+    {
+        if (merged[j].fromMap)
+            free(merged[j].path);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    if (ret == 0)
+        ret = load(filename);
+
+    return ret;
+}
@@ -0,0 +1,87 @@
+#ifndef _WAV_INDEX_H_
+#define _WAV_INDEX_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <vector>
+using namespace std;
+
+#include "wav_file.h"
+
+#define WAV_INDEX_MAGIC     COMPOSE('A', 'W', 'I', 'X')
+#define WAV_INDEX_VERSION   1
+
+/*
+ * On-disk layout, native endian, mmap()ed as is:
+ *   wav_index_hdr_t
+ *   wav_index_record_t[count]  sorted by (pathHash, path)
+ *   path strings, not NUL terminated
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t recordSize;    /* sizeof(wav_index_record_t), guards layout changes */
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t stringsOffset;
+    uint64_t stringsSize;
+} wav_index_hdr_t;
+
+typedef struct {
+    uint64_t pathHash;
+    uint64_t pathOffset;    /* relative to stringsOffset */
+    uint32_t pathLength;
+    uint32_t reserved;
+    int64_t  mtime;         /* nanoseconds */
+    uint64_t fileSize;
+    wav_info_t info;
+} wav_index_record_t;
+
+/*
+ * Persistent WAV header cache keyed by path + mtime + size. Lookups go
+ * to the read-only mapping, add() collects new entries until save().
+ */
+class WavIndex
+{
+public:
+    WavIndex();
+    virtual ~WavIndex();
+
+    int  load(const char *filename);
+    int  save(const char *filename);
+    void close();
+
+    /* thread safe */
+    int  add(const char *path, const struct stat *st, const wav_info_t *info);
+
+    /* true if path is indexed and unchanged since */
+    bool find(const char *path, const struct stat *st, wav_info_t *info);
+    bool lookup(const char *filename, wav_info_t *info);
+
+    uint32_t count();
+
+private:
+    typedef struct {
+        char *path;
+        bool  fromMap;  /* copied out of the old mapping by save() */
+        wav_index_record_t record;
+    } entry_t;
+
+    static uint64_t hashPath(const char *path, size_t length);
+    static bool     lessEntry(const entry_t &a, const entry_t &b);
+
+    const wav_index_record_t *findRecord(const char *path);
+    const char *recordPath(const wav_index_record_t *record);
+
+    void   *map;
+    size_t  mapSize;
+    const wav_index_hdr_t    *hdr;
+    const wav_index_record_t *records;
+
+    vector<entry_t> entries;
+    pthread_mutex_t lock;
+};
+
+#endif
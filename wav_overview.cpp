@@ -0,0 +1,550 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <vector>
+using namespace std;
+
+#include "wav_overview.h"
+#include "thread_policy.h"
+#include "pcm_utils.h"
+
+#define WORK_BINS   1024    /* level 0 bins per work item */
+
+typedef vector<wav_overview_bin_t> level_data_t;
+
+typedef struct {
+    int fd;
+    wav_info_t info;
+    snd_pcm_format_t format;
+    uint64_t firstBin;
+    uint64_t lastBin;
+    uint64_t nextBin;
+    wav_overview_bin_t *out;    /* level 0, indexed from bin 0 */
+    int err;
+} job_t;
+
+static int readAll(int fd, void *buf, size_t bytes, off_t offset)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < bytes)
+    {
+        ret = pread(fd, (char *)buf + done, bytes - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+
+    return 0;
+}
+
+static int writeAll(int fd, const void *buf, size_t bytes, off_t offset)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < bytes)
+    {
+        ret = pwrite(fd, (const char *)buf + done, bytes - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+
+    return 0;
+}
+
+#ifdef __SSE2__
+/*
+ * One bin of 1, 2 or 4 channels: the interleaved samples are taken four at a
+ * time, lane k always holding channel k % channels, and the lanes are folded
+ * per channel at the end. The sample is the first operand of min/max so a NaN
+ * sample is skipped, as fminf()/fmaxf() do.
+ */
+static void reduceLanes(const float *in, int channels,
+                        float *mn, float *mx, float *sq)
+{
+    float lo[4], hi[4], acc[4];
+    __m128 x = _mm_loadu_ps(in);
+    __m128 vlo = x, vhi = x, vsq = _mm_setzero_ps();
+    size_t i;
+    int c, k;
+
+    for (i = 0; i < WAV_OVERVIEW_BASE_BIN * (size_t)channels; i += 4)
+    {
+        x = _mm_loadu_ps(in + i);
+        vlo = _mm_min_ps(x, vlo);
+        vhi = _mm_max_ps(x, vhi);
+        vsq = _mm_add_ps(vsq, _mm_mul_ps(x, x));
+    }
+    _mm_storeu_ps(lo, vlo);
+    _mm_storeu_ps(hi, vhi);
+    _mm_storeu_ps(acc, vsq);
+
+    for (c = 0; c < channels; c++)
+    {
+        mn[c] = lo[c];
+        mx[c] = hi[c];
+        sq[c] = acc[c];
+        for (k = c + channels; k < 4; k += channels)
+        {
+            mn[c] = fminf(mn[c], lo[k]);
+            mx[c] = fmaxf(mx[c], hi[k]);
+            sq[c] += acc[k];
+        }
+    }
+}
+#endif
+
+/*
+ * Level 0 reduction. Mono, stereo and quad bins go through the SSE2 kernel
+ * above; other layouts run channel-innermost on separate accumulators.
+ */
+static void reduceFrames(const float *__restrict in, int channels, size_t bins,
+                         wav_overview_bin_t *__restrict out,
+                         float *__restrict mn, float *__restrict mx, float *__restrict sq)
+{
+    size_t b, f;
+    int c;
+
+    for (b = 0; b < bins; b++)
+    {
+#ifdef __SSE2__
+        if (4 % channels == 0)
+            reduceLanes(in, channels, mn, mx, sq);
+        else
+#endif
+        {
+            for (c = 0; c < channels; c++)
+            {
+                mn[c] = in[c];
+                mx[c] = in[c];
+                sq[c] = 0;
+            }
+            for (f = 0; f < WAV_OVERVIEW_BASE_BIN; f++)
+            {
+                const float *x = in + f * channels;
+                for (c = 0; c < channels; c++)
+                {
+                    mn[c] = fminf(mn[c], x[c]);
+                    mx[c] = fmaxf(mx[c], x[c]);
+                    sq[c] += x[c] * x[c];
+                }
+            }
+        }
+
+        for (c = 0; c < channels; c++)
+        {
+            out[c].min = mn[c];
+            out[c].max = mx[c];
+            out[c].meanSquare = sq[c] / WAV_OVERVIEW_BASE_BIN;
+        }
+
+        in += WAV_OVERVIEW_BASE_BIN * channels;
+        out += channels;
+    }
+}
+
+/* parent bin from WAV_OVERVIEW_FACTOR complete children */
+static void reduceBins(const wav_overview_bin_t *in, int channels, wav_overview_bin_t *out)
+{
+    int c, k;
+
+    for (c = 0; c < channels; c++)
+    {
+        out[c] = in[c];
+        for (k = 1; k < WAV_OVERVIEW_FACTOR; k++)
+        {
+            out[c].min = fminf(out[c].min, in[k * channels + c].min);
+            out[c].max = fmaxf(out[c].max, in[k * channels + c].max);
+            out[c].meanSquare += in[k * channels + c].meanSquare;
+        }
+        out[c].meanSquare /= WAV_OVERVIEW_FACTOR;
+    }
+}
+
+void* WavOverview::workerThreadFunc(void *data)
+{
+    job_t *job = (job_t *)data;
+    int channels = job->info.channels;
+    size_t frames = (size_t)WORK_BINS * WAV_OVERVIEW_BASE_BIN;
+    uint64_t bin, n;
+    char *raw;
+    float *buf, *scratch;
+
+    raw = (char *)malloc(frames * job->info.blockAlign);
+    buf = (float *)malloc(frames * channels * sizeof(float));
+    scratch = (float *)malloc(3 * channels * sizeof(float));
+    if (raw == NULL || buf == NULL || scratch == NULL)
+        job->err = -1;
+
+    while (job->err == 0)
+    {
+        bin = __atomic_fetch_add(&job->nextBin, WORK_BINS, __ATOMIC_RELAXED);
+        if (bin >= job->lastBin)
+            break;
+
+        n = job->lastBin - bin;
+        if (n > WORK_BINS)
+            n = WORK_BINS;
+
+        if (readAll(job->fd, raw, n * WAV_OVERVIEW_BASE_BIN * job->info.blockAlign,
+                    job->info.dataOffset + bin * WAV_OVERVIEW_BASE_BIN * job->info.blockAlign) < 0 ||
+            pcm_to_float(job->format, raw, buf, n * WAV_OVERVIEW_BASE_BIN * channels) < 0)
+        {
+            job->err = -1;
+            break;
+        }
+
+        reduceFrames(buf, channels, n, job->out + bin * channels,
+                     scratch, scratch + channels, scratch + 2 * channels);
+    }
+
+    free(raw);
+    free(buf);
+    free(scratch);
+
+    return NULL;
+}
+
+/* number of levels that have at least two bins for bins0 level 0 bins */
+static uint32_t levelCount(uint64_t bins0)
+{
+    uint32_t n = 1;
+
+    while (n < WAV_OVERVIEW_MAX_LEVELS && bins0 >= 2 * WAV_OVERVIEW_FACTOR)
+    {
+        bins0 /= WAV_OVERVIEW_FACTOR;
+        n++;
+    }
+
+    return n;
+}
+
+static int loadOld(int fd, const wav_info_t *info,
+                   wav_overview_hdr_t *hdr, level_data_t *levels)
+{
+    uint32_t k;
+
+    if (readAll(fd, hdr, sizeof(*hdr), 0) < 0)
+        return -1;
+
+    if (hdr->magic != WAV_OVERVIEW_MAGIC || hdr->version != WAV_OVERVIEW_VERSION ||
+        hdr->channels != info->channels || hdr->rate != info->rate ||
+        hdr->dataOffset != info->dataOffset || hdr->numLevels > WAV_OVERVIEW_MAX_LEVELS ||
+        hdr->frames > info->dataLength / info->blockAlign)
+        return -1;
+
+    for (k = 0; k < hdr->numLevels; k++)
+    {
+        levels[k].resize(hdr->levels[k].bins * hdr->channels);
+        if (hdr->levels[k].bins > 0 &&
+            readAll(fd, &levels[k][0], levels[k].size() * sizeof(wav_overview_bin_t),
+                    hdr->levels[k].offset) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static int writeLayout(const char *sidecar, wav_overview_hdr_t *hdr, level_data_t *levels)
+{
+    char tmpname[PATH_MAX];
+    uint64_t offset, capacity;
+    uint32_t k;
+    int fd, ret = 0;
+
+    /* reserve twice the current size so a growing source appends in place */
+    offset = sizeof(*hdr);
+    capacity = 2 * hdr->levels[0].bins + 64;
+    for (k = 0; k < hdr->numLevels; k++)
+    {
+        hdr->levels[k].offset = offset;
+        hdr->levels[k].capacity = capacity;
+        offset += capacity * hdr->channels * sizeof(wav_overview_bin_t);
+        capacity = capacity / WAV_OVERVIEW_FACTOR + 1;
+    }
+
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", sidecar);
+    fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return -1;
+
+    if (ftruncate(fd, offset) < 0)
+        ret = -1;
+
+    for (k = 0; ret == 0 && k < hdr->numLevels; k++)
+    {
+        if (!levels[k].empty() &&
+            writeAll(fd, &levels[k][0], levels[k].size() * sizeof(wav_overview_bin_t),
+                     hdr->levels[k].offset) < 0)
+            ret = -1;
+    }
+
+    if (ret == 0 && (writeAll(fd, hdr, sizeof(*hdr), 0) < 0 || fdatasync(fd) < 0))
+        ret = -1;
+
+    close(fd);
+
+    if (ret == 0 && rename(tmpname, sidecar) < 0)
+        ret = -1;
+    if (ret < 0)
+        unlink(tmpname);
+
+    return ret;
+}
+
+int WavOverview::update(const char *filename, const char *sidecar, int threads)
+{
+    level_data_t levels[WAV_OVERVIEW_MAX_LEVELS];
+    wav_overview_hdr_t hdr, old;
+    WavFile wav;
+    job_t job;
+    pthread_t *ids;
+    uint64_t bins, i, start;
+    uint32_t k, numLevels;
+    bool inPlace;
+    int fd, n, started = 0, channels;
+    int ret = 0;
+
+    if (wav.open(filename) < 0)
+        return -1;
+
+    memset(&job, 0, sizeof(job));
+    job.info = *wav.header();
+    job.format = wav.pcmFormat();
+    wav.close();
+    channels = job.info.channels;
+
+    memset(&old, 0, sizeof(old));
+    fd = ::open(sidecar, O_RDWR | O_CLOEXEC);
+    if (fd >= 0 && loadOld(fd, &job.info, &old, levels) < 0)
+    {
+        memset(&old, 0, sizeof(old));
+        for (k = 0; k < WAV_OVERVIEW_MAX_LEVELS; k++)
+            levels[k].clear();
+    }
+
+    hdr = old;
+    hdr.magic = WAV_OVERVIEW_MAGIC;
+    hdr.version = WAV_OVERVIEW_VERSION;
+    hdr.channels = channels;
+    hdr.rate = job.info.rate;
+    hdr.dataOffset = job.info.dataOffset;
+
+    bins = job.info.dataLength / job.info.blockAlign / WAV_OVERVIEW_BASE_BIN;
+    if (old.magic && bins == old.levels[0].bins)
+    {
+        ::close(fd);
+        return 0;   /* nothing new */
+    }
+
+    /* level 0, only the bins the source gained */
+    job.fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (job.fd < 0)
+    {
+        if (fd >= 0)
+            ::close(fd);
+        return -1;
+    }
+
+    levels[0].resize(bins * channels);
+    job.firstBin = old.levels[0].bins;
+    job.lastBin = bins;
+    job.nextBin = job.firstBin;
+    job.out = levels[0].empty() ? NULL : &levels[0][0];
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    n = (job.lastBin - job.firstBin + WORK_BINS - 1) / WORK_BINS;
+    if (threads > n)
+        threads = n;
+
+    ids = (pthread_t *)malloc((threads > 0 ? threads : 1) * sizeof(pthread_t));
+    for (n = 0; n < threads; n++)
+    {
+        if (ThreadPolicy::shared()->create(THREAD_DSP, &ids[started], workerThreadFunc, &job) == 0)
+            started++;
+    }
+    if (started == 0)
+        workerThreadFunc(&job);
+    for (n = 0; n < started; n++)
+        pthread_join(ids[n], NULL);
+    free(ids);
+    ::close(job.fd);
+
+    if (job.err < 0)
+    {
+        if (fd >= 0)
+            ::close(fd);
+        return -1;
+    }
+
+    /*
+     * upper levels from their children; levels a relayout would reserve
+     * for growth are computed too even if they are still empty
+     */
+    numLevels = levelCount(2 * bins + 64);
+    if (numLevels < old.numLevels)
+        numLevels = old.numLevels;
+    hdr.levels[0].bins = bins;
+    hdr.levels[0].binFrames = WAV_OVERVIEW_BASE_BIN;
+    for (k = 1; k < numLevels; k++)
+    {
+        hdr.levels[k].bins = hdr.levels[k - 1].bins / WAV_OVERVIEW_FACTOR;
+        hdr.levels[k].binFrames = hdr.levels[k - 1].binFrames * WAV_OVERVIEW_FACTOR;
+        start = (k < old.numLevels) ? old.levels[k].bins : 0;
+        levels[k].resize(hdr.levels[k].bins * channels);
+        for (i = start; i < hdr.levels[k].bins; i++)
+            reduceBins(&levels[k - 1][i * WAV_OVERVIEW_FACTOR * channels], channels,
+                       &levels[k][i * channels]);
+    }
+    hdr.frames = bins * WAV_OVERVIEW_BASE_BIN;
+
+    inPlace = (fd >= 0 && old.magic != 0 && levelCount(bins) <= old.numLevels);
+    for (k = 0; inPlace && k < old.numLevels; k++)
+        inPlace = (hdr.levels[k].bins <= old.levels[k].capacity);
+
+    if (inPlace)
+    {
+        /* append the new bins, then publish them with the header */
+        for (k = 0; ret == 0 && k < old.numLevels; k++)
+        {
+            start = old.levels[k].bins;
+            if (hdr.levels[k].bins > start &&
+                writeAll(fd, &levels[k][start * channels],
+                         (hdr.levels[k].bins - start) * channels * sizeof(wav_overview_bin_t),
+                         hdr.levels[k].offset + start * channels * sizeof(wav_overview_bin_t)) < 0)
+                ret = -1;
+        }
+
+        if (ret == 0 && fdatasync(fd) < 0)
+            ret = -1;
+        if (ret == 0 && writeAll(fd, &hdr, sizeof(hdr), 0) < 0)
+            ret = -1;
+    }
+    else
+    {
+        hdr.numLevels = numLevels;
+        ret = writeLayout(sidecar, &hdr, levels);
+    }
+
+    if (fd >= 0)
+        ::close(fd);
+
+    return ret;
+}
+
+WavOverview::WavOverview()
+    : map(NULL)
+    , mapSize(0)
+    , hdr(NULL)
+{
+}
+
+WavOverview::~WavOverview()
+{
+    close();
+}
+
+int WavOverview::open(const char *sidecar)
+{
+    struct stat st;
+    uint32_t k;
+    int fd;
+
+    close();
+
+    fd = ::open(sidecar, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(wav_overview_hdr_t))
+    {
+        ::close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        map = NULL;
+        return -1;
+    }
+    mapSize = st.st_size;
+    hdr = (const wav_overview_hdr_t *)map;
+
+    if (hdr->magic != WAV_OVERVIEW_MAGIC || hdr->version != WAV_OVERVIEW_VERSION ||
+        hdr->numLevels == 0 || hdr->numLevels > WAV_OVERVIEW_MAX_LEVELS)
+    {
+        close();
+        return -1;
+    }
+
+    for (k = 0; k < hdr->numLevels; k++)
+    {
+        if (hdr->levels[k].offset + hdr->levels[k].capacity * hdr->channels *
+            sizeof(wav_overview_bin_t) > mapSize)
+        {
+            close();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void WavOverview::close()
+{
+    if (map)
+    {
+        munmap(map, mapSize);
+        map = NULL;
+        mapSize = 0;
+        hdr = NULL;
+    }
+}
+
+int WavOverview::levelFor(uint64_t framesPerPixel)
+{
+    int k;
+
+    for (k = levels() - 1; k > 0; k--)
+    {
+        if (hdr->levels[k].binFrames <= framesPerPixel)
+            return k;
+    }
+
+    return 0;
+}
+
+const wav_overview_bin_t *WavOverview::bin(int level, uint64_t index)
+{
+    const wav_overview_level_t *l;
+
+    if (hdr == NULL || level < 0 || level >= (int)hdr->numLevels)
+        return NULL;
+
+    l = &hdr->levels[level];
+    if (index >= __atomic_load_n(&l->bins, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return (const wav_overview_bin_t *)((const char *)map + l->offset) + index * hdr->channels;
+}
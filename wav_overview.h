@@ -0,0 +1,84 @@
+#ifndef _WAV_OVERVIEW_H_
+#define _WAV_OVERVIEW_H_
+
+#include <stdint.h>
+
+#include "wav_file.h"
+
+#define WAV_OVERVIEW_MAGIC      COMPOSE('A', 'W', 'O', 'V')
+#define WAV_OVERVIEW_VERSION    1
+#define WAV_OVERVIEW_MAX_LEVELS 16
+#define WAV_OVERVIEW_BASE_BIN   256     /* frames per level 0 bin */
+#define WAV_OVERVIEW_FACTOR     4       /* bins merged per level */
+
+/* one channel of one bin */
+typedef struct {
+    float min;
+    float max;
+    float meanSquare;
+} wav_overview_bin_t;
+
+typedef struct {
+    uint64_t offset;        /* file offset of bin 0 */
+    uint64_t capacity;      /* bins reserved, the file can grow in place */
+    uint64_t bins;          /* complete bins written */
+    uint64_t binFrames;
+} wav_overview_level_t;
+
+/*
+ * Sidecar layout, native endian, mmap()ed as is:
+ *   wav_overview_hdr_t
+ *   per level: wav_overview_bin_t[capacity][channels]
+ * Only complete bins are stored, a refresh appends the bins the source
+ * gained since and rewrites the header last.
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t channels;
+    uint32_t rate;
+    uint32_t numLevels;
+    uint64_t dataOffset;    /* identifies the source layout */
+    uint64_t frames;        /* source frames covered by level 0 */
+    wav_overview_level_t levels[WAV_OVERVIEW_MAX_LEVELS];
+} wav_overview_hdr_t;
+
+/*
+ * Min/max/RMS pyramid of a WAV file for waveform drawing at any zoom.
+ */
+class WavOverview
+{
+public:
+    WavOverview();
+    virtual ~WavOverview();
+
+    /*
+     * Create the sidecar or append what the source gained since the last
+     * call, e.g. while it is still being recorded.
+     * threads - 0 to use one worker per online CPU
+     */
+    static int update(const char *filename, const char *sidecar, int threads = 0);
+
+    int  open(const char *sidecar);
+    void close();
+
+    int      channels() { return hdr ? hdr->channels : 0; }
+    int      levels() { return hdr ? hdr->numLevels : 0; }
+    uint64_t bins(int level) { return hdr->levels[level].bins; }
+    uint64_t binFrames(int level) { return hdr->levels[level].binFrames; }
+
+    /* coarsest level that still has at least one bin per pixel */
+    int levelFor(uint64_t framesPerPixel);
+
+    /* channels() consecutive entries, NULL past the last complete bin */
+    const wav_overview_bin_t *bin(int level, uint64_t index);
+
+    static void* workerThreadFunc(void *data);
+
+private:
+    void   *map;
+    size_t  mapSize;
+    const wav_overview_hdr_t *hdr;
+};
+
+#endif
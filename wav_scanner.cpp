@@ -0,0 +1,209 @@
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "wav_scanner.h"
+#include "thread_policy.h"
+
+static bool hasWavExt(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+
+    return ext && strcasecmp(ext, ".wav") == 0;
+}
+
+WavScanner::WavScanner(WavIndex *index, int threads)
+    : index(index)
+    , numThreads(threads)
+    , busyWorkers(0)
+    , numScanned(0)
+    , numUnchanged(0)
+    , numFailed(0)
+{
+    if (numThreads <= 0)
+        numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (numThreads <= 0)
+        numThreads = 1;
+
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+WavScanner::~WavScanner()
+{
+    pthread_mutex_destroy(&lock);
+    pthread_cond_destroy(&cond);
+}
+
+int WavScanner::scan(const char *root)
+{
+    char path[PATH_MAX];
+    pthread_t *threads;
+    int i, started = 0;
+
+    if (realpath(root, path) == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", root, strerror(errno));
+        return -1;
+    }
+
+    dirList.push_back(strdup(path));
+
+    threads = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
+    for (i = 0; i < numThreads; i++)
+    {
+        if (ThreadPolicy::shared()->create(THREAD_IO, &threads[started], workerThreadFunc, (void *)this) == 0)
+            started++;
+    }
+
+    if (started == 0)
+        workerTask();
+
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+
+    return 0;
+}
+
+void* WavScanner::workerThreadFunc(void *data)
+{
+    WavScanner *scanner = static_cast<WavScanner *>(data);
+
+    return scanner->workerTask();
+}
+
+void* WavScanner::workerTask()
+{
+    char *dir;
+
+    pthread_mutex_lock(&lock);
+    while (true)
+    {
+        while (dirList.empty() && busyWorkers > 0)
+            pthread_cond_wait(&cond, &lock);
+
+        if (dirList.empty())
+            break;  /* nothing queued and nobody can queue more */
+
+        dir = dirList.front();
+        dirList.pop_front();
+        busyWorkers++;
+        pthread_mutex_unlock(&lock);
+
+        scanDir(dir);
+
+        pthread_mutex_lock(&lock);
+        busyWorkers--;
+        if (busyWorkers == 0 && dirList.empty())
+            pthread_cond_broadcast(&cond);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+void WavScanner::pushDir(char *dir)
+{
+    pthread_mutex_lock(&lock);
+    dirList.push_back(dir);
+    pthread_cond_signal(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+void WavScanner::scanDir(char *dir)
+{
+    char path[PATH_MAX], target[PATH_MAX];
+    struct dirent *entry;
+    struct stat st;
+    bool isDir, isReg, isLink;
+    DIR *dp;
+
+    dp = opendir(dir);
+    if (dp == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        free(dir);
+        return;
+    }
+
+    while ((entry = readdir(dp)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;   /* ".", ".." and hidden files */
+
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path))
+            continue;
+
+        isDir = (entry->d_type == DT_DIR);
+        isReg = (entry->d_type == DT_REG);
+        isLink = (entry->d_type == DT_LNK);
+        if (entry->d_type == DT_UNKNOWN)
+        {
+            if (lstat(path, &st) < 0)
+                continue;
+            isDir = S_ISDIR(st.st_mode);
+            isReg = S_ISREG(st.st_mode);
+            isLink = S_ISLNK(st.st_mode);
+        }
+        if (isLink)
+        {
+            /* linked files go in under the realpath() that WavIndex::lookup() resolves to */
+            if (stat(path, &st) < 0 || !S_ISREG(st.st_mode) || realpath(path, target) == NULL)
+                continue;
+            isReg = true;
+            strcpy(path, target);
+        }
+
+        if (isDir)
+            pushDir(strdup(path));
+        else if (isReg && hasWavExt(entry->d_name))
+            scanFile(path);
+    }
+
+    closedir(dp);
+    free(dir);
+}
+
+void WavScanner::scanFile(const char *path)
+{
+    wav_info_t info;
+    struct stat st;
+    int fd;
+
+    /* unchanged files cost one stat() */
+    if (stat(path, &st) == 0 && index->find(path, &st, NULL))
+    {
+        __atomic_add_fetch(&numUnchanged, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        __atomic_add_fetch(&numFailed, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if (WavFile::probe(fd, &info) == 0)
+    {
+        index->add(path, &st, &info);
+        __atomic_add_fetch(&numScanned, 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        fprintf(stderr, "%s: not a playable WAV file\n", path);
+        __atomic_add_fetch(&numFailed, 1, __ATOMIC_RELAXED);
+    }
+
+    close(fd);
+}
@@ -0,0 +1,49 @@
+#ifndef _WAV_SCANNER_H_
+#define _WAV_SCANNER_H_
+
+#include <pthread.h>
+
+#include <list>
+using namespace std;
+
+#include "wav_index.h"
+
+/*
+ * Walks directory trees with a pool of worker threads and adds the header
+ * of every new or modified .wav file to a WavIndex.
+ */
+class WavScanner
+{
+public:
+    /* threads - 0 to use one worker per online CPU */
+    WavScanner(WavIndex *index, int threads = 0);
+    virtual ~WavScanner();
+
+    int scan(const char *root);
+
+    uint32_t scanned() { return numScanned; }
+    uint32_t unchanged() { return numUnchanged; }
+    uint32_t failed() { return numFailed; }
+
+    static void* workerThreadFunc(void *data);
+    void * workerTask();
+
+private:
+    void scanDir(char *dir);
+    void scanFile(const char *path);
+    void pushDir(char *dir);
+
+    WavIndex *index;
+    int numThreads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    list<char *> dirList;
+    int busyWorkers;
+
+    uint32_t numScanned;
+    uint32_t numUnchanged;
+    uint32_t numFailed;
+};
+
+#endif
@@ -0,0 +1,267 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "wav_writer.h"
+#include "wav_file.h"
+#include "channel_mixer.h"
+
+#define DS64_BODY   28      /* riff, data and sample count as 64 bits, table length */
+
+/* KSDATAFORMAT_SUBTYPE_* after the format tag */
+static const uint8_t guidTag[14] = {
+    0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
+
+static void putId(uint8_t *p, const char *id)
+{
+    memcpy(p, id, 4);
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static int writeAll(int fd, const void *buf, size_t bytes, off_t offset)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < bytes)
+    {
+        ret = pwrite(fd, (const char *)buf + done, bytes - done, offset + done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+
+    return 0;
+}
+
+WavWriter::WavWriter()
+    : fd(-1)
+    , directFd(-1)
+    , dataBytes(0)
+    , dataHeader(0)
+    , blockAlign(0)
+    , rf64(false)
+{
+}
+
+WavWriter::~WavWriter()
+{
+    close();
+}
+
+int WavWriter::open(const char *filename, snd_pcm_format_t format, int channels, uint32_t rate,
+                    uint32_t channelMask, bool direct)
+{
+    close();
+
+    fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    dataBytes = 0;
+    rf64 = false;
+    if (writeHeader(format, channels, rate, channelMask) < 0)
+    {
+        ::close(fd);
+        fd = -1;
+        unlink(filename);
+        return -1;
+    }
+
+    /* tmpfs and some network file systems refuse, the page cache will do */
+    if (direct)
+        directFd = ::open(filename, O_WRONLY | O_DIRECT);
+
+    return 0;
+}
+
+int WavWriter::writeHeader(snd_pcm_format_t format, int channels, uint32_t rate, uint32_t channelMask)
+{
+    uint8_t hdr[WAV_WRITER_ALIGN];
+    int width, physical, tag;
+    bool extensible;
+    uint32_t pos;
+
+    switch (format)
+    {
+    case SND_PCM_FORMAT_U8:
+    case SND_PCM_FORMAT_S16_LE:
+    case SND_PCM_FORMAT_S24_3LE:
+    case SND_PCM_FORMAT_S24_LE:
+    case SND_PCM_FORMAT_S32_LE:
+        tag = WAV_FMT_PCM;
+        break;
+    case SND_PCM_FORMAT_FLOAT_LE:
+        tag = WAV_FMT_IEEE_FLOAT;
+        break;
+    default:
+        fprintf(stderr, "can't write %s to a WAV file\n", snd_pcm_format_name(format));
+        return -1;
+    }
+
+    width = snd_pcm_format_width(format);
+    physical = snd_pcm_format_physical_width(format);
+    blockAlign = physical / 8 * channels;
+    extensible = channels > 2 || physical > 16 || width != physical;
+    if (channelMask == 0)
+        channelMask = ChannelMixer::defaultMask(channels);
+
+    memset(hdr, 0, sizeof(hdr));
+    putId(hdr, "RIFF");
+    putId(hdr + 8, "WAVE");
+
+    /* becomes 'ds64' when the file outgrows 32-bit sizes */
+    putId(hdr + 12, "JUNK");
+    put32(hdr + 16, DS64_BODY);
+    pos = 20 + DS64_BODY;
+
+    putId(hdr + pos, "fmt ");
+    put32(hdr + pos + 4, extensible ? 40 : 16);
+    put16(hdr + pos + 8, extensible ? WAV_FMT_EXTENSIBLE : tag);
+    put16(hdr + pos + 10, channels);
+    put32(hdr + pos + 12, rate);
+    put32(hdr + pos + 16, rate * blockAlign);
+    put16(hdr + pos + 20, blockAlign);
+    put16(hdr + pos + 22, physical);
+    pos += 24;
+    if (extensible)
+    {
+        put16(hdr + pos, 22);
+        put16(hdr + pos + 2, width);
+        put32(hdr + pos + 4, channelMask);
+        put16(hdr + pos + 8, tag);
+        memcpy(hdr + pos + 10, guidTag, sizeof(guidTag));
+        pos += 24;
+    }
+
+    /* pad so that the samples start on an aligned offset */
+    dataHeader = WAV_WRITER_ALIGN - 8;
+    putId(hdr + pos, "JUNK");
+    put32(hdr + pos + 4, dataHeader - pos - 8);
+
+    putId(hdr + dataHeader, "data");
+    put32(hdr + 4, dataHeader);
+
+    return writeAll(fd, hdr, sizeof(hdr), 0);
+}
+
+int WavWriter::writeAligned(const void *buf, size_t bytes)
+{
+    off_t offset = WAV_WRITER_ALIGN + dataBytes;
+
+    if (directFd >= 0 && offset % WAV_WRITER_ALIGN == 0)
+    {
+        if (writeAll(directFd, buf, bytes, offset) == 0)
+        {
+            dataBytes += bytes;
+            return 0;
+        }
+        if (errno != EINVAL)
+            return -1;
+
+        /* the file system takes O_DIRECT opens but not the writes */
+        ::close(directFd);
+        directFd = -1;
+    }
+
+    return write(buf, bytes);
+}
+
+int WavWriter::write(const void *buf, size_t bytes)
+{
+    if (writeAll(fd, buf, bytes, WAV_WRITER_ALIGN + dataBytes) < 0)
+        return -1;
+
+    dataBytes += bytes;
+    return 0;
+}
+
+int WavWriter::writeAt(uint64_t offset, const void *buf, size_t bytes)
+{
+    return writeAll(fd, buf, bytes, WAV_WRITER_ALIGN + offset);
+}
+
+int WavWriter::updateHeader(bool sync)
+{
+    uint8_t hdr[20 + DS64_BODY];
+    uint64_t riffBytes;
+
+    if (fd < 0)
+        return -1;
+
+    riffBytes = WAV_WRITER_ALIGN - 8 + dataBytes + (dataBytes & 1);
+    if (!rf64 && riffBytes >= WAV_SIZE_IN_DS64)
+        rf64 = true;
+
+    if (rf64)
+    {
+        putId(hdr, "RF64");
+        put32(hdr + 4, WAV_SIZE_IN_DS64);
+        putId(hdr + 8, "WAVE");
+        putId(hdr + 12, "ds64");
+        put32(hdr + 16, DS64_BODY);
+        put32(hdr + 20, riffBytes);
+        put32(hdr + 24, riffBytes >> 32);
+        put32(hdr + 28, dataBytes);
+        put32(hdr + 32, dataBytes >> 32);
+        put32(hdr + 36, dataBytes / blockAlign);
+        put32(hdr + 40, (uint64_t)(dataBytes / blockAlign) >> 32);
+        put32(hdr + 44, 0);
+        if (writeAll(fd, hdr, sizeof(hdr), 0) < 0)
+            return -1;
+        put32(hdr, WAV_SIZE_IN_DS64);
+    }
+    else
+    {
+        put32(hdr, riffBytes);
+        if (writeAll(fd, hdr, 4, 4) < 0)
+            return -1;
+        put32(hdr, dataBytes);
+    }
+
+    if (writeAll(fd, hdr, 4, dataHeader + 4) < 0)
+        return -1;
+
+    return sync ? fdatasync(fd) : 0;
+}
+
+int WavWriter::close()
+{
+    uint8_t pad = 0;
+    int ret = 0;
+
+    if (fd < 0)
+        return 0;
+
+    if ((dataBytes & 1) && writeAll(fd, &pad, 1, WAV_WRITER_ALIGN + dataBytes) < 0)
+        ret = -1;
+    if (updateHeader(true) < 0)
+        ret = -1;
+
+    if (directFd >= 0)
+        ::close(directFd);
+    if (::close(fd) < 0)
+        ret = -1;
+    fd = directFd = -1;
+
+    return ret;
+}
@@ -0,0 +1,57 @@
+#ifndef _WAV_WRITER_H_
+#define _WAV_WRITER_H_
+
+#include <stdint.h>
+#include <alsa/asoundlib.h>
+
+/* O_DIRECT granularity, the header is padded so samples start here */
+#define WAV_WRITER_ALIGN    4096
+
+/*
+ * Streaming WAV writer. The header takes the first WAV_WRITER_ALIGN bytes
+ * with a JUNK chunk reserved for 'ds64', so a recording that grows past
+ * 4 GiB turns into RF64 in place. Sizes are patched by updateHeader(),
+ * which the caller runs now and then so a crash loses little; WavFile
+ * also reads a file whose sizes were never patched.
+ */
+class WavWriter
+{
+public:
+    WavWriter();
+    virtual ~WavWriter();
+
+    /* direct - write samples with O_DIRECT where the file system allows it */
+    int  open(const char *filename, snd_pcm_format_t format, int channels, uint32_t rate,
+              uint32_t channelMask = 0, bool direct = false);
+
+    /* buf aligned to and bytes a multiple of WAV_WRITER_ALIGN */
+    int  writeAligned(const void *buf, size_t bytes);
+    /* any size, through the page cache; the tail of a recording */
+    int  write(const void *buf, size_t bytes);
+
+    /*
+     * Any thread, at a byte offset into the samples. For writers that know
+     * the final size up front and say so with setLength().
+     */
+    int  writeAt(uint64_t offset, const void *buf, size_t bytes);
+    void setLength(uint64_t bytes) { dataBytes = bytes; }
+
+    int  updateHeader(bool sync);
+    int  close();
+
+    bool isOpen() { return fd >= 0; }
+    bool isDirect() { return directFd >= 0; }
+    uint64_t length() { return dataBytes; }
+
+private:
+    int  writeHeader(snd_pcm_format_t format, int channels, uint32_t rate, uint32_t channelMask);
+
+    int      fd;
+    int      directFd;      /* second descriptor with O_DIRECT, -1 without */
+    uint64_t dataBytes;
+    uint32_t dataHeader;    /* file offset of the 'data' chunk header */
+    uint16_t blockAlign;
+    bool     rf64;
+};
+
+#endif
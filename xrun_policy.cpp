@@ -0,0 +1,99 @@
+#include <string.h>
+
+#include "xrun_policy.h"
+
+XrunPolicy::XrunPolicy()
+    : period(0)
+    , buffer(0)
+    , baseReadAhead(1)
+    , lvl(0)
+    , next(0)
+    , filled(0)
+    , count(0)
+    , lastChange(0)
+{
+    memset(history, 0, sizeof(history));
+}
+
+void XrunPolicy::setup(size_t periodFrames, size_t bufferFrames, int readAhead)
+{
+    period = periodFrames;
+    buffer = bufferFrames;
+    baseReadAhead = readAhead;
+    lvl = 0;
+    next = filled = 0;
+    count = 0;
+    lastChange = 0;
+}
+
+uint32_t XrunPolicy::recent(uint64_t now)
+{
+    uint32_t i, n = 0;
+
+    for (i = 0; i < filled; i++)
+        if (now - history[i] < XRUN_WINDOW_MS)
+            n++;
+
+    return n;
+}
+
+void XrunPolicy::underrun(uint64_t now)
+{
+    history[next] = now;
+    next = (next + 1) % XRUN_HISTORY;
+    if (filled < XRUN_HISTORY)
+        filled++;
+    count++;
+    lastChange = now;
+}
+
+bool XrunPolicy::raise(uint64_t now)
+{
+    if (lvl >= XRUN_MAX_LEVEL || recent(now) < XRUN_RAISE_COUNT)
+        return false;
+
+    /* the next step needs underruns of its own */
+    lvl++;
+    next = filled = 0;
+
+    return true;
+}
+
+bool XrunPolicy::tick(uint64_t now)
+{
+    if (lvl == 0 || now - lastChange < XRUN_CALM_MS)
+        return false;
+
+    lvl--;
+    lastChange = now;
+
+    return true;
+}
+
+size_t XrunPolicy::startThreshold()
+{
+    size_t frames = period * (XRUN_BASE_PERIODS + lvl);
+
+    return frames < buffer ? frames : buffer;
+}
+
+void XrunPolicy::event(xrun_event_type_t type, uint64_t now, xrun_event_t *event)
+{
+    event->type = type;
+    event->level = lvl;
+    event->recent = recent(now);
+    event->total = count;
+    event->startFrames = startThreshold();
+    event->readAhead = readAhead();
+}
+
+const char *XrunPolicy::eventName(xrun_event_type_t type)
+{
+    switch (type)
+    {
+    case XRUN_EVENT_UNDERRUN:   return "underrun";
+    case XRUN_EVENT_RAISE:      return "latency up";
+    case XRUN_EVENT_DECAY:      return "latency down";
+    default:                    return "unknown";
+    }
+}
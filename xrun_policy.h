@@ -0,0 +1,73 @@
+#ifndef _XRUN_POLICY_H_
+#define _XRUN_POLICY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define XRUN_WINDOW_MS      10000   /* underruns counted over this long */
+#define XRUN_RAISE_COUNT    2       /* underruns in the window that raise the level */
+#define XRUN_CALM_MS        30000   /* quiet time before stepping back down */
+#define XRUN_MAX_LEVEL      3
+#define XRUN_BASE_PERIODS   2       /* start threshold at level 0 */
+#define XRUN_HISTORY        8
+
+typedef enum {
+    XRUN_EVENT_UNDERRUN = 0,
+    XRUN_EVENT_RAISE,       /* more prefill and read-ahead */
+    XRUN_EVENT_DECAY,       /* back one step toward the latency target */
+} xrun_event_type_t;
+
+typedef struct {
+    xrun_event_type_t type;
+    int      level;
+    uint32_t recent;        /* underruns in the window */
+    uint64_t total;
+    size_t   startFrames;   /* start threshold now in use */
+    int      readAhead;     /* buffers queued per stream */
+} xrun_event_t;
+
+/*
+ * Decides how much latency the output needs. Level 0 starts the device
+ * after XRUN_BASE_PERIODS periods with the usual read-ahead; every step up
+ * prefills one period more, up to the whole buffer, and doubles the
+ * read-ahead. Steps go up after XRUN_RAISE_COUNT underruns inside the
+ * window and come down one at a time after a quiet XRUN_CALM_MS. Times are
+ * milliseconds on any monotonic clock.
+ */
+class XrunPolicy
+{
+public:
+    XrunPolicy();
+
+    /* back to level 0 for a freshly configured device */
+    void setup(size_t periodFrames, size_t bufferFrames, int readAhead);
+
+    /* an underrun at now */
+    void underrun(uint64_t now);
+    /* true when the underruns in the window took the level up */
+    bool raise(uint64_t now);
+    /* true when a quiet spell took the level down */
+    bool tick(uint64_t now);
+
+    int      level() { return lvl; }
+    uint32_t recent(uint64_t now);
+    uint64_t total() { return count; }
+    size_t   startThreshold();
+    int      readAhead() { return baseReadAhead << lvl; }
+
+    void event(xrun_event_type_t type, uint64_t now, xrun_event_t *event);
+    static const char *eventName(xrun_event_type_t type);
+
+private:
+    size_t   period;
+    size_t   buffer;
+    int      baseReadAhead;
+    int      lvl;
+    uint64_t history[XRUN_HISTORY];     /* latest underruns, ring */
+    uint32_t next;
+    uint32_t filled;
+    uint64_t count;
+    uint64_t lastChange;    /* last underrun or level change */
+};
+
+#endif